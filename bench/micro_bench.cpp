@@ -0,0 +1,562 @@
+// Microbenchmarks of the service's building blocks, run in-process.
+//
+// Each benchmark first runs in growing batches until the warmup time is
+// spent, which also estimates its cost. Then it takes a number of samples,
+// each a batch sized to last about the sample time, and reports the median
+// time per operation with the spread around it. Large fixtures (streams of
+// a million entries, PELs of up to ten million) are built only for the
+// benchmarks selected, outside the timed part, and freed after them.
+//
+// Output is a table by default, or one CSV row or JSON object per
+// benchmark, for comparing runs with scripts.
+
+#include "consumer_group.h"
+#include "redis_protocol.h"
+#include "reply_buffer.h"
+#include "resp_parser.h"
+#include "stream.h"
+#include "stream_entry.h"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+
+namespace {
+
+// Keeps the compiler from dropping a computation whose result is unused
+template <typename T>
+inline void keep(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct MicroConfig {
+    std::string filter;
+    double warmup_seconds = 0.2;
+    double sample_seconds = 0.02;
+    int samples = 15;
+    int cpu = -1;               // core to pin to, -1 = leave to the scheduler
+    enum class Format { Text, Csv, Json };
+    Format format = Format::Text;
+    bool list = false;
+    std::vector<uint64_t> pel_sizes = {1000, 10000, 100000, 1000000};
+
+    static MicroConfig from_args(int argc, char* argv[]);
+    static std::string usage();
+};
+
+double parse_seconds(const std::string& name, const std::string& value) {
+    size_t consumed = 0;
+    double result = 0;
+    try {
+        result = std::stod(value, &consumed);
+    } catch (const std::exception&) {
+        consumed = 0;
+    }
+    if (consumed != value.size() || !(result > 0)) {
+        throw std::invalid_argument("Invalid value for " + name + ": " + value);
+    }
+    return result;
+}
+
+uint64_t parse_count(const std::string& name, const std::string& value, uint64_t min_value) {
+    uint64_t result = 0;
+    auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), result);
+    if (error != std::errc() || end != value.data() + value.size() || result < min_value) {
+        throw std::invalid_argument("Invalid value for " + name + ": " + value);
+    }
+    return result;
+}
+
+MicroConfig MicroConfig::from_args(int argc, char* argv[]) {
+    MicroConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--list") {
+            config.list = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            throw std::invalid_argument("Missing value for " + arg);
+        }
+        std::string value = argv[++i];
+
+        if (arg == "--filter") {
+            config.filter = value;
+        } else if (arg == "--warmup") {
+            config.warmup_seconds = parse_seconds(arg, value);
+        } else if (arg == "--sample-time") {
+            config.sample_seconds = parse_seconds(arg, value);
+        } else if (arg == "--samples") {
+            config.samples = static_cast<int>(std::min<uint64_t>(parse_count(arg, value, 1), 100000));
+        } else if (arg == "--cpu") {
+            config.cpu = static_cast<int>(std::min<uint64_t>(parse_count(arg, value, 0), CPU_SETSIZE - 1));
+        } else if (arg == "--format") {
+            if (value == "text") {
+                config.format = Format::Text;
+            } else if (value == "csv") {
+                config.format = Format::Csv;
+            } else if (value == "json") {
+                config.format = Format::Json;
+            } else {
+                throw std::invalid_argument("Invalid value for " + arg + ": " + value);
+            }
+        } else if (arg == "--pel-sizes") {
+            config.pel_sizes.clear();
+            size_t start = 0;
+            while (start <= value.size()) {
+                size_t end = value.find(',', start);
+                config.pel_sizes.push_back(parse_count(arg, value.substr(start, end - start), 1));
+                if (end == std::string::npos) {
+                    break;
+                }
+                start = end + 1;
+            }
+        } else {
+            throw std::invalid_argument("Unknown option " + arg);
+        }
+    }
+    return config;
+}
+
+std::string MicroConfig::usage() {
+    return "Usage: redis_streams_microbench [options]\n"
+           "  --filter <text>          run only benchmarks whose name contains this\n"
+           "  --list                   print the benchmark names and exit\n"
+           "  --warmup <seconds>       untimed run before sampling (default 0.2)\n"
+           "  --sample-time <seconds>  length each sample aims for (default 0.02)\n"
+           "  --samples <n>            samples per benchmark (default 15)\n"
+           "  --cpu <n>                pin to this core (default: not pinned)\n"
+           "  --format <text|csv|json> output format (default text)\n"
+           "  --pel-sizes <n,...>      PEL sizes of the consumer group benchmarks\n"
+           "                           (default 1000,10000,100000,1000000; 10000000 needs a few GB)\n";
+}
+
+// A benchmark once its fixture is built: `run` performs the operation
+// `iterations` times, `prepare` restores the fixture before a sample
+// without being timed, and no sample is longer than `max_batch`
+struct Runner {
+    Runner() = default;
+    Runner(std::function<void(uint64_t iterations)> body) : run(std::move(body)) {}
+
+    std::function<void(uint64_t iterations)> run;
+    std::function<void(uint64_t iterations)> prepare;
+    uint64_t max_batch = UINT64_MAX;
+};
+
+struct Benchmark {
+    std::string name;
+    std::function<Runner()> make;
+};
+
+struct Result {
+    std::string name;
+    uint64_t batch;
+    std::vector<double> ns_per_op;      // one per sample, sorted
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+Result measure(const MicroConfig& config, const Benchmark& benchmark) {
+    Runner runner = benchmark.make();
+
+    // Warm up in doubling batches; the last one gives the cost estimate
+    double estimate_ns = 0;
+    uint64_t batch = 1;
+    auto warmup_start = std::chrono::steady_clock::now();
+    while (true) {
+        if (runner.prepare) {
+            runner.prepare(batch);
+        }
+        auto start = std::chrono::steady_clock::now();
+        runner.run(batch);
+        double elapsed = seconds_since(start);
+        estimate_ns = elapsed * 1e9 / batch;
+        if (seconds_since(warmup_start) >= config.warmup_seconds) {
+            break;
+        }
+        batch = std::min(batch * 2, runner.max_batch);
+    }
+
+    Result result;
+    result.name = benchmark.name;
+    double wanted = config.sample_seconds * 1e9 / std::max(estimate_ns, 1.0);
+    result.batch = std::max<uint64_t>(1, std::min<uint64_t>(static_cast<uint64_t>(wanted), runner.max_batch));
+    for (int i = 0; i < config.samples; i++) {
+        if (runner.prepare) {
+            runner.prepare(result.batch);
+        }
+        auto start = std::chrono::steady_clock::now();
+        runner.run(result.batch);
+        double elapsed = seconds_since(start);
+        result.ns_per_op.push_back(elapsed * 1e9 / result.batch);
+    }
+    std::sort(result.ns_per_op.begin(), result.ns_per_op.end());
+    return result;
+}
+
+double median(const std::vector<double>& sorted) {
+    size_t n = sorted.size();
+    return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+// Median absolute deviation as a fraction of the median: how far a typical
+// sample strays from it
+double relative_spread(const std::vector<double>& sorted) {
+    double middle = median(sorted);
+    std::vector<double> deviations;
+    for (double value : sorted) {
+        deviations.push_back(std::fabs(value - middle));
+    }
+    std::sort(deviations.begin(), deviations.end());
+    return middle > 0 ? median(deviations) / middle : 0;
+}
+
+void print_result(const MicroConfig& config, const Result& result) {
+    double middle = median(result.ns_per_op);
+    double spread = relative_spread(result.ns_per_op) * 100;
+    switch (config.format) {
+    case MicroConfig::Format::Text:
+        std::printf("%-44s %12.1f %12.1f %12.1f %7.1f%% %14.0f\n", result.name.c_str(), middle,
+                    result.ns_per_op.front(), result.ns_per_op.back(), spread, middle > 0 ? 1e9 / middle : 0);
+        break;
+    case MicroConfig::Format::Csv:
+        std::printf("%s,%llu,%zu,%.2f,%.2f,%.2f,%.2f\n", result.name.c_str(),
+                    static_cast<unsigned long long>(result.batch), result.ns_per_op.size(), middle,
+                    result.ns_per_op.front(), result.ns_per_op.back(), spread);
+        break;
+    case MicroConfig::Format::Json:
+        std::printf("{\"name\":\"%s\",\"batch\":%llu,\"samples\":%zu,\"ns_median\":%.2f,\"ns_min\":%.2f,"
+                    "\"ns_max\":%.2f,\"spread_pct\":%.2f}\n",
+                    result.name.c_str(), static_cast<unsigned long long>(result.batch), result.ns_per_op.size(),
+                    middle, result.ns_per_op.front(), result.ns_per_op.back(), spread);
+        break;
+    }
+    std::fflush(stdout);
+}
+
+// Fixtures
+
+constexpr int kReadCount = 10;
+constexpr uint64_t kStreamLength = 1000000;
+constexpr size_t kBatchSize = 100;
+const StreamID kEndOfStream(UINT64_MAX, UINT64_MAX);
+
+std::string xadd_request() {
+    ReplyBuffer out;
+    out.append_array_header(11);
+    for (std::string_view arg : {"XADD", "sensor:1042", "*", "temperature", "21.5", "humidity", "48",
+                                 "location", "warehouse-7/aisle-12", "status", "ok"}) {
+        out.append_bulk_string(arg);
+    }
+    return out.str();
+}
+
+FieldViews sample_fields() {
+    return {{"temperature", "21.5"}, {"humidity", "48"}, {"location", "warehouse-7/aisle-12"}, {"status", "ok"}};
+}
+
+std::vector<StreamEntry> sample_entries() {
+    std::vector<StreamEntry> entries;
+    for (int i = 0; i < kReadCount; i++) {
+        std::vector<std::pair<std::string, std::string>> fields;
+        for (const auto& field : sample_fields()) {
+            fields.emplace_back(std::string(field.first), std::string(field.second));
+        }
+        entries.emplace_back(StreamID(1700000000000 + i, 0), fields);
+    }
+    return entries;
+}
+
+// A stream of `length` entries with IDs 1-0, 2-0, ...
+std::shared_ptr<Stream> filled_stream(uint64_t length) {
+    auto stream = std::make_shared<Stream>();
+    FieldViews fields = sample_fields();
+    for (uint64_t i = 1; i <= length; i++) {
+        stream->add_entry(StreamID(i, 0), fields, StreamTrim(), true);
+    }
+    return stream;
+}
+
+// A group whose one consumer holds IDs 1-0 ... `size`-0 pending
+std::shared_ptr<ConsumerGroup> pending_group(uint64_t size) {
+    auto group = std::make_shared<ConsumerGroup>("group", StreamID(size, 0));
+    for (uint64_t i = 1; i <= size; i++) {
+        group->restore_pending("consumer", StreamID(i, 0), 0, 1);
+    }
+    return group;
+}
+
+std::vector<Benchmark> benchmarks(const MicroConfig& config) {
+    std::vector<Benchmark> list;
+
+    list.push_back({"resp/parse_command", [] {
+        auto request = std::make_shared<std::string>(xadd_request());
+        return Runner{[request](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; i++) {
+                keep(RedisProtocol::parse_command(*request));
+            }
+        }};
+    }});
+
+    // What the server actually parses requests with
+    list.push_back({"resp/resp_parser", [] {
+        auto request = std::make_shared<std::string>(xadd_request());
+        auto parser = std::make_shared<RespParser>();
+        return Runner{[request, parser](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; i++) {
+                parser->parse(*request);
+                keep(parser->args());
+                // As if the command were dropped and the same one arrived again
+                parser->discard(parser->consumed());
+            }
+        }};
+    }});
+
+    list.push_back({"protocol/format_stream_entries", [] {
+        auto entries = std::make_shared<std::vector<StreamEntry>>(sample_entries());
+        return Runner{[entries](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; i++) {
+                keep(RedisProtocol::format_stream_entries(*entries));
+            }
+        }};
+    }});
+
+    list.push_back({"protocol/write_stream_entries", [] {
+        auto entries = std::make_shared<std::vector<StreamEntry>>(sample_entries());
+        auto out = std::make_shared<ReplyBuffer>();
+        return Runner{[entries, out](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; i++) {
+                out->clear();
+                RedisProtocol::write_stream_entries(*out, *entries);
+                keep(*out);
+            }
+        }};
+    }});
+
+    // XRANGE as the server encodes it, straight from storage
+    list.push_back({"protocol/write_stream_range", [] {
+        auto stream = filled_stream(kStreamLength);
+        auto out = std::make_shared<ReplyBuffer>();
+        auto random = std::make_shared<std::mt19937_64>(1);
+        return Runner{[stream, out, random](uint64_t iterations) {
+            std::uniform_int_distribution<uint64_t> start(1, kStreamLength);
+            for (uint64_t i = 0; i < iterations; i++) {
+                out->clear();
+                Stream::ReadGuard guard = stream->read();
+                RedisProtocol::write_stream_range(*out, guard.entries(), StreamID(start(*random), 0),
+                                                  kEndOfStream, kReadCount);
+                keep(*out);
+            }
+        }};
+    }});
+
+    list.push_back({"stream_id/from_string", [] {
+        auto texts = std::make_shared<std::vector<std::string>>();
+        for (uint64_t i = 0; i < 1024; i++) {
+            texts->push_back(std::to_string(1700000000000 + i * 7919) + "-" + std::to_string(i % 13));
+        }
+        return Runner{[texts](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; i++) {
+                keep(StreamID::from_string((*texts)[i & 1023]));
+            }
+        }};
+    }});
+
+    list.push_back({"stream_id/to_string", [] {
+        return Runner{[](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; i++) {
+                keep(StreamID(1700000000000 + i, i & 15).to_string());
+            }
+        }};
+    }});
+
+    // Appends with generated IDs to a stream capped like XADD MAXLEN ~ 100000
+    list.push_back({"stream/add_entry", [] {
+        auto stream = std::make_shared<Stream>();
+        auto fields = std::make_shared<FieldViews>(sample_fields());
+        StreamTrim trim;
+        trim.strategy = StreamTrim::Strategy::MaxLen;
+        trim.approximate = true;
+        trim.max_len = 100000;
+        return Runner{[stream, fields, trim](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; i++) {
+                keep(stream->add_entry(StreamID(), *fields, trim));
+            }
+        }};
+    }});
+
+    // XADDBATCH: one operation is a batch of kBatchSize entries, capped the same way
+    list.push_back({"stream/add_entries/" + std::to_string(kBatchSize), [] {
+        auto stream = std::make_shared<Stream>();
+        auto entries = std::make_shared<std::vector<FieldViews>>(kBatchSize, sample_fields());
+        StreamTrim trim;
+        trim.strategy = StreamTrim::Strategy::MaxLen;
+        trim.approximate = true;
+        trim.max_len = 100000;
+        return Runner{[stream, entries, trim](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; i++) {
+                keep(stream->add_entries(StreamID(), *entries, trim));
+            }
+        }};
+    }});
+
+    list.push_back({"stream/get_range", [] {
+        auto stream = filled_stream(kStreamLength);
+        auto random = std::make_shared<std::mt19937_64>(1);
+        return Runner{[stream, random](uint64_t iterations) {
+            std::uniform_int_distribution<uint64_t> start(1, kStreamLength);
+            for (uint64_t i = 0; i < iterations; i++) {
+                keep(stream->get_range(StreamID(start(*random), 0), kEndOfStream, kReadCount));
+            }
+        }};
+    }});
+
+    list.push_back({"stream/get_entries_after", [] {
+        auto stream = filled_stream(kStreamLength);
+        auto random = std::make_shared<std::mt19937_64>(1);
+        return Runner{[stream, random](uint64_t iterations) {
+            std::uniform_int_distribution<uint64_t> start(1, kStreamLength);
+            for (uint64_t i = 0; i < iterations; i++) {
+                keep(stream->get_entries_after(StreamID(start(*random), 0), kReadCount));
+            }
+        }};
+    }});
+
+    // XREADGROUP ">": each sample starts a fresh group at the stream's start,
+    // so its PEL grows from empty over the sample; entries are encoded into
+    // a reply as they are delivered, as the server does
+    list.push_back({"group/deliver_new_messages", [] {
+        auto stream = filled_stream(kStreamLength);
+        auto group = std::make_shared<std::shared_ptr<ConsumerGroup>>();
+        Runner runner;
+        runner.prepare = [group](uint64_t) {
+            *group = std::make_shared<ConsumerGroup>("group", StreamID());
+        };
+        runner.run = [stream, group](uint64_t iterations) {
+            ReplyBuffer out;
+            for (uint64_t i = 0; i < iterations; i++) {
+                out.clear();
+                Stream::ReadGuard guard = stream->read();
+                keep((*group)->deliver_new_messages("consumer", guard.entries(), kReadCount,
+                                                    [&out](const StreamEntryView& entry) {
+                                                        RedisProtocol::write_stream_entry(out, entry);
+                                                    }));
+            }
+            keep(out.size());
+        };
+        runner.max_batch = kStreamLength / kReadCount;
+        return runner;
+    }});
+
+    for (uint64_t size : config.pel_sizes) {
+        // XREADGROUP with an ID: the consumer's own pending entries from a
+        // random point of its PEL
+        list.push_back({"group/get_pending_ids/" + std::to_string(size), [size] {
+            auto group = pending_group(size);
+            auto random = std::make_shared<std::mt19937_64>(1);
+            return Runner{[group, random, size](uint64_t iterations) {
+                std::uniform_int_distribution<uint64_t> after(0, size);
+                for (uint64_t i = 0; i < iterations; i++) {
+                    keep(group->get_pending_ids("consumer", StreamID(after(*random), 0), kReadCount));
+                }
+            }};
+        }});
+
+        // XACK of one ID; the IDs acknowledged are put back before the next
+        // sample, and a sample acknowledges at most a tenth of the PEL
+        list.push_back({"group/acknowledge_messages/" + std::to_string(size), [size] {
+            auto group = pending_group(size);
+            auto acked = std::make_shared<std::vector<StreamID>>();
+            auto random = std::make_shared<std::mt19937_64>(1);
+            Runner runner;
+            runner.prepare = [group, acked, random, size](uint64_t iterations) {
+                for (const StreamID& id : *acked) {
+                    group->restore_pending("consumer", id, 0, 1);
+                }
+                // Distinct IDs spread over the whole PEL
+                acked->clear();
+                uint64_t stride = size / iterations;
+                uint64_t offset = std::uniform_int_distribution<uint64_t>(1, stride)(*random);
+                for (uint64_t i = 0; i < iterations; i++) {
+                    acked->push_back(StreamID(offset + i * stride, 0));
+                }
+                std::shuffle(acked->begin(), acked->end(), *random);
+            };
+            runner.run = [group, acked](uint64_t iterations) {
+                std::vector<StreamID> ids(1);
+                for (uint64_t i = 0; i < iterations; i++) {
+                    ids[0] = (*acked)[i];
+                    keep(group->acknowledge_messages(ids));
+                }
+            };
+            runner.max_batch = std::max<uint64_t>(1, size / 10);
+            return runner;
+        }});
+    }
+
+    return list;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    MicroConfig config;
+    try {
+        config = MicroConfig::from_args(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl << MicroConfig::usage();
+        return 1;
+    }
+
+    std::vector<Benchmark> selected;
+    for (Benchmark& benchmark : benchmarks(config)) {
+        if (benchmark.name.find(config.filter) != std::string::npos) {
+            selected.push_back(std::move(benchmark));
+        }
+    }
+    if (config.list) {
+        for (const Benchmark& benchmark : selected) {
+            std::printf("%s\n", benchmark.name.c_str());
+        }
+        return 0;
+    }
+
+    if (config.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(config.cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            std::cerr << "Cannot pin to core " << config.cpu << std::endl;
+            return 1;
+        }
+    }
+
+    switch (config.format) {
+    case MicroConfig::Format::Text:
+        std::printf("%-44s %12s %12s %12s %8s %14s\n", "benchmark", "ns/op", "min", "max", "spread", "ops/s");
+        break;
+    case MicroConfig::Format::Csv:
+        std::printf("name,batch,samples,ns_median,ns_min,ns_max,spread_pct\n");
+        break;
+    case MicroConfig::Format::Json:
+        break;
+    }
+    for (const Benchmark& benchmark : selected) {
+        print_result(config, measure(config, benchmark));
+    }
+    return 0;
+}
@@ -0,0 +1,735 @@
+// Load generator for redis_streams_service.
+//
+// Opens many connections, spread over a few threads, and keeps a pipeline
+// of XADD/XREAD/XREADGROUP/XACK requests in flight on each, picked at
+// random in the proportions asked for. Every reply is timed from the moment
+// its request was written, and the run ends with the throughput and the
+// p50/p99/p99.9 latency of each kind of request.
+//
+// XREAD follows the tail of a stream from where the connection last read.
+// Connections spread over the consumer groups, so every group sees every
+// entry. XACK acknowledges what the connection's XREADGROUPs got, and turns
+// into another XREADGROUP while there is nothing to acknowledge.
+
+#include "command_stats.h"
+#include "event_loop.h"
+#include "reply_buffer.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+enum Op : size_t { kXAdd, kXRead, kXReadGroup, kXAck, kOpCount };
+const char* const kOpNames[kOpCount] = {"xadd", "xread", "xreadgroup", "xack"};
+
+constexpr size_t kReadChunkSize = 64 * 1024;
+// Acknowledgements a connection holds on to; older ones are dropped and
+// stay pending in their group
+constexpr size_t kMaxHeldAcks = 1024;
+
+struct BenchConfig {
+    std::string host = "127.0.0.1";
+    int port = 6379;
+    int connections = 50;
+    int threads = 0;            // 0 = one per core, at most one per connection
+    int pipeline = 1;           // requests in flight per connection
+    int duration = 10;          // seconds, when requests is 0
+    int64_t requests = 0;       // total to send, 0 = run for duration
+    int payload = 64;           // bytes of the one field XADD writes
+    int streams = 1;
+    int groups = 1;             // consumer groups per stream
+    int count = 10;             // COUNT of XREAD/XREADGROUP
+    int64_t maxlen = 0;         // XADD MAXLEN ~, 0 = uncapped
+    uint64_t mix[kOpCount] = {50, 20, 20, 10};
+
+    static BenchConfig from_args(int argc, char* argv[]);
+    static std::string usage();
+};
+
+int64_t parse_number(const std::string& name, const std::string& value, int64_t min_value) {
+    int64_t result = 0;
+    auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), result);
+    if (error != std::errc() || end != value.data() + value.size() || result < min_value) {
+        throw std::invalid_argument("Invalid value for " + name + ": " + value);
+    }
+    return result;
+}
+
+int parse_int(const std::string& name, const std::string& value, int min_value) {
+    int64_t result = parse_number(name, value, min_value);
+    if (result > INT32_MAX) {
+        throw std::invalid_argument("Invalid value for " + name + ": " + value);
+    }
+    return static_cast<int>(result);
+}
+
+// "xadd=50,xread=20,...": relative weights, missing kinds get none
+void parse_mix(const std::string& value, uint64_t (&mix)[kOpCount]) {
+    std::fill(std::begin(mix), std::end(mix), 0);
+    uint64_t total = 0;
+    size_t start = 0;
+    while (start <= value.size()) {
+        size_t end = value.find(',', start);
+        std::string part = value.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        size_t equals = part.find('=');
+        size_t op = 0;
+        while (op < kOpCount && part.compare(0, equals, kOpNames[op]) != 0) {
+            op++;
+        }
+        if (equals == std::string::npos || op == kOpCount) {
+            throw std::invalid_argument("Invalid value for --mix: " + value);
+        }
+        mix[op] = static_cast<uint64_t>(parse_number("--mix", part.substr(equals + 1), 0));
+        total += mix[op];
+        if (end == std::string::npos) {
+            break;
+        }
+        start = end + 1;
+    }
+    if (total == 0) {
+        throw std::invalid_argument("Invalid value for --mix: " + value);
+    }
+}
+
+BenchConfig BenchConfig::from_args(int argc, char* argv[]) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            throw std::invalid_argument("Missing value for " + arg);
+        }
+        std::string value = argv[++i];
+
+        if (arg == "--host") {
+            config.host = value;
+        } else if (arg == "--port") {
+            config.port = parse_int(arg, value, 1);
+        } else if (arg == "--connections") {
+            config.connections = parse_int(arg, value, 1);
+        } else if (arg == "--threads") {
+            config.threads = parse_int(arg, value, 0);
+        } else if (arg == "--pipeline") {
+            config.pipeline = parse_int(arg, value, 1);
+        } else if (arg == "--duration") {
+            config.duration = parse_int(arg, value, 1);
+        } else if (arg == "--requests") {
+            config.requests = parse_number(arg, value, 0);
+        } else if (arg == "--payload") {
+            config.payload = parse_int(arg, value, 0);
+        } else if (arg == "--streams") {
+            config.streams = parse_int(arg, value, 1);
+        } else if (arg == "--groups") {
+            config.groups = parse_int(arg, value, 1);
+        } else if (arg == "--count") {
+            config.count = parse_int(arg, value, 1);
+        } else if (arg == "--maxlen") {
+            config.maxlen = parse_number(arg, value, 0);
+        } else if (arg == "--mix") {
+            parse_mix(value, config.mix);
+        } else {
+            throw std::invalid_argument("Unknown option " + arg);
+        }
+    }
+    return config;
+}
+
+std::string BenchConfig::usage() {
+    return "Usage: redis_streams_bench [options]\n"
+           "  --host <host>          server address (default 127.0.0.1)\n"
+           "  --port <n>             server port (default 6379)\n"
+           "  --connections <n>      client connections (default 50)\n"
+           "  --threads <n>          client threads, 0 = one per core (default 0)\n"
+           "  --pipeline <n>         requests in flight per connection (default 1)\n"
+           "  --duration <seconds>   how long to run (default 10)\n"
+           "  --requests <n>         stop after this many instead, 0 = use --duration (default 0)\n"
+           "  --payload <bytes>      size of the value XADD writes (default 64)\n"
+           "  --streams <n>          streams, picked at random per request (default 1)\n"
+           "  --groups <n>           consumer groups per stream, each reading every entry (default 1)\n"
+           "  --count <n>            COUNT of XREAD and XREADGROUP (default 10)\n"
+           "  --maxlen <n>           cap streams with XADD MAXLEN ~ n, 0 = uncapped (default 0)\n"
+           "  --mix <kind=weight,...>\n"
+           "                         request mix over xadd, xread, xreadgroup and xack\n"
+           "                         (default xadd=50,xread=20,xreadgroup=20,xack=10)\n";
+}
+
+std::string stream_key(size_t stream) {
+    return "bench:" + std::to_string(stream);
+}
+
+std::string group_name(size_t group) {
+    return "group:" + std::to_string(group);
+}
+
+int connect_to(const std::string& host, int port) {
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) {
+        throw std::runtime_error("Cannot resolve " + host);
+    }
+
+    int fd = -1;
+    int error = 0;
+    for (addrinfo* address = addresses; address && fd < 0; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            error = errno;
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot connect to " + host + ":" + std::to_string(port) + ": " +
+                                 std::strerror(error));
+    }
+
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return fd;
+}
+
+// Walks RESP replies in a buffer; every read returns false when the reply
+// has not fully arrived yet
+class ReplyReader {
+public:
+    explicit ReplyReader(std::string_view data) : data_(data), pos_(0) {}
+
+    size_t position() const { return pos_; }
+
+    // Type byte and the rest of the line; `number` is set for lengths and integers
+    bool line(char& type, int64_t& number, std::string_view& text) {
+        size_t end = data_.find("\r\n", pos_);
+        if (end == std::string_view::npos || end == pos_) {
+            return false;
+        }
+        type = data_[pos_];
+        text = data_.substr(pos_ + 1, end - pos_ - 1);
+        number = 0;
+        if (type == '*' || type == '$' || type == ':') {
+            std::from_chars(text.data(), text.data() + text.size(), number);
+        }
+        pos_ = end + 2;
+        return true;
+    }
+
+    // One whole value, nested ones included
+    bool skip() {
+        char type;
+        int64_t number;
+        std::string_view text;
+        if (!line(type, number, text)) {
+            return false;
+        }
+        if (type == '$' && number >= 0) {
+            if (data_.size() < pos_ + number + 2) {
+                return false;
+            }
+            pos_ += number + 2;
+        } else if (type == '*') {
+            for (int64_t i = 0; i < number; i++) {
+                if (!skip()) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool bulk(std::string_view& value) {
+        char type;
+        int64_t number;
+        std::string_view text;
+        if (!line(type, number, text) || type != '$' || number < 0 || data_.size() < pos_ + number + 2) {
+            return false;
+        }
+        value = data_.substr(pos_, number);
+        pos_ += number + 2;
+        return true;
+    }
+
+    // Array length; -1 for a null array
+    bool array(int64_t& length) {
+        char type;
+        std::string_view text;
+        return line(type, length, text) && type == '*';
+    }
+
+private:
+    std::string_view data_;
+    size_t pos_;
+};
+
+// IDs of the entries in a complete XREAD/XREADGROUP reply for one stream
+void read_entry_ids(std::string_view reply, std::vector<std::string>& ids) {
+    ReplyReader reader(reply);
+    int64_t streams;
+    int64_t pair;
+    std::string_view key;
+    int64_t entries;
+    if (!reader.array(streams) || streams < 1 || !reader.array(pair) || !reader.bulk(key) ||
+        !reader.array(entries)) {
+        return;
+    }
+    for (int64_t i = 0; i < entries; i++) {
+        int64_t entry;
+        std::string_view id;
+        if (!reader.array(entry) || !reader.bulk(id) || !reader.skip()) {
+            return;
+        }
+        ids.emplace_back(id);
+    }
+}
+
+// One thread's connections, driven by an event loop of their own
+class Worker {
+public:
+    Worker(const BenchConfig& config, size_t index, std::atomic<int64_t>& budget)
+        : config_(config), index_(index), budget_(budget), random_(index + 1), issuing_(true), outstanding_(0),
+          completed_{}, errors_{} {
+        for (size_t op = 0; op < kOpCount; op++) {
+            mix_total_ += config.mix[op];
+        }
+        payload_.resize(config.payload);
+        for (size_t i = 0; i < payload_.size(); i++) {
+            payload_[i] = static_cast<char>('a' + i % 26);
+        }
+    }
+
+    // Called before run(), from the thread that starts the workers
+    void add_client(size_t id) {
+        auto client = std::make_unique<Client>();
+        client->id = id;
+        client->fd = connect_to(config_.host, config_.port);
+        fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK);
+        client->group = id % config_.groups;
+        client->consumer = "consumer:" + std::to_string(id);
+        client->last_read.assign(config_.streams, "0-0");
+        clients_.push_back(std::move(client));
+    }
+
+    void run() {
+        for (auto& owned : clients_) {
+            Client* client = owned.get();
+            loop_.add_fd(client->fd, EPOLLIN, [this, client](uint32_t events) {
+                on_event(*client, events);
+            });
+            for (int i = 0; i < config_.pipeline; i++) {
+                issue(*client);
+            }
+            flush(*client);
+        }
+        if (config_.requests == 0) {
+            loop_.add_timer(static_cast<uint64_t>(config_.duration) * 1000, [this] {
+                issuing_ = false;
+                finish_if_idle();
+            });
+        }
+        finish_if_idle();
+        loop_.run();
+        for (auto& client : clients_) {
+            close(client->fd);
+        }
+    }
+
+    uint64_t completed(size_t op) const { return completed_[op]; }
+    uint64_t errors(size_t op) const { return errors_[op]; }
+    const std::string& first_error(size_t op) const { return first_errors_[op]; }
+
+private:
+    struct Request {
+        Op op;
+        size_t stream;
+        uint64_t sent;
+    };
+
+    struct Ack {
+        size_t stream;
+        std::vector<std::string> ids;
+    };
+
+    struct Client {
+        size_t id = 0;
+        int fd = -1;
+        size_t group = 0;
+        std::string consumer;
+        std::string input;
+        ReplyBuffer output;
+        size_t output_offset = 0;
+        bool writing = false;
+        std::deque<Request> in_flight;
+        std::vector<std::string> last_read;     // XREAD position per stream
+        std::deque<Ack> acks;
+    };
+
+    Op pick_op(const Client& client) {
+        uint64_t roll = std::uniform_int_distribution<uint64_t>(0, mix_total_ - 1)(random_);
+        size_t op = 0;
+        while (roll >= config_.mix[op]) {
+            roll -= config_.mix[op++];
+        }
+        if (op == kXAck && client.acks.empty()) {
+            return kXReadGroup;
+        }
+        return static_cast<Op>(op);
+    }
+
+    void issue(Client& client) {
+        if (!issuing_ || (config_.requests > 0 && budget_.fetch_sub(1, std::memory_order_relaxed) <= 0)) {
+            issuing_ = false;
+            return;
+        }
+
+        Op op = pick_op(client);
+        size_t stream = std::uniform_int_distribution<size_t>(0, config_.streams - 1)(random_);
+        ReplyBuffer& out = client.output;
+        std::string key = stream_key(stream);
+        switch (op) {
+        case kXAdd:
+            out.append_array_header(config_.maxlen > 0 ? 8 : 5);
+            out.append_bulk_string("XADD");
+            out.append_bulk_string(key);
+            if (config_.maxlen > 0) {
+                out.append_bulk_string("MAXLEN");
+                out.append_bulk_string("~");
+                out.append_bulk_string(std::to_string(config_.maxlen));
+            }
+            out.append_bulk_string("*");
+            out.append_bulk_string("data");
+            out.append_bulk_string(payload_);
+            break;
+        case kXRead:
+            out.append_array_header(6);
+            out.append_bulk_string("XREAD");
+            out.append_bulk_string("COUNT");
+            out.append_bulk_string(std::to_string(config_.count));
+            out.append_bulk_string("STREAMS");
+            out.append_bulk_string(key);
+            out.append_bulk_string(client.last_read[stream]);
+            break;
+        case kXReadGroup:
+            out.append_array_header(9);
+            out.append_bulk_string("XREADGROUP");
+            out.append_bulk_string("GROUP");
+            out.append_bulk_string(group_name(client.group));
+            out.append_bulk_string(client.consumer);
+            out.append_bulk_string("COUNT");
+            out.append_bulk_string(std::to_string(config_.count));
+            out.append_bulk_string("STREAMS");
+            out.append_bulk_string(key);
+            out.append_bulk_string(">");
+            break;
+        case kXAck: {
+            Ack ack = std::move(client.acks.front());
+            client.acks.pop_front();
+            stream = ack.stream;
+            out.append_array_header(3 + ack.ids.size());
+            out.append_bulk_string("XACK");
+            out.append_bulk_string(stream_key(stream));
+            out.append_bulk_string(group_name(client.group));
+            for (const std::string& id : ack.ids) {
+                out.append_bulk_string(id);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        client.in_flight.push_back(Request{op, stream, CommandStats::now()});
+        outstanding_++;
+    }
+
+    void flush(Client& client) {
+        while (client.output_offset < client.output.size()) {
+            ssize_t sent = send(client.fd, client.output.data() + client.output_offset,
+                                client.output.size() - client.output_offset, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                fail("write failed: " + std::string(std::strerror(errno)));
+            }
+            client.output_offset += static_cast<size_t>(sent);
+        }
+
+        bool writing = client.output_offset < client.output.size();
+        if (!writing) {
+            client.output.clear();
+            client.output_offset = 0;
+        }
+        if (writing != client.writing) {
+            client.writing = writing;
+            loop_.modify_fd(client.fd, writing ? EPOLLIN | EPOLLOUT : EPOLLIN);
+        }
+    }
+
+    void on_event(Client& client, uint32_t events) {
+        if (events & EPOLLOUT) {
+            flush(client);
+        }
+        if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            return;
+        }
+
+        while (true) {
+            size_t old_size = client.input.size();
+            client.input.resize(old_size + kReadChunkSize);
+            ssize_t bytes = recv(client.fd, &client.input[old_size], kReadChunkSize, 0);
+            client.input.resize(old_size + (bytes > 0 ? bytes : 0));
+            if (bytes > 0) {
+                continue;
+            }
+            if (bytes == 0) {
+                fail("server closed the connection");
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fail("read failed: " + std::string(std::strerror(errno)));
+            }
+            break;
+        }
+
+        // Replies that arrived together are timed together
+        uint64_t received = CommandStats::now();
+        std::string_view input = client.input;
+        size_t consumed = 0;
+        while (!client.in_flight.empty()) {
+            ReplyReader reader(input.substr(consumed));
+            if (!reader.skip()) {
+                break;
+            }
+            Request request = client.in_flight.front();
+            client.in_flight.pop_front();
+            outstanding_--;
+            complete(client, request, input.substr(consumed, reader.position()), received);
+            consumed += reader.position();
+            issue(client);
+        }
+        client.input.erase(0, consumed);
+        flush(client);
+        finish_if_idle();
+    }
+
+    void complete(Client& client, const Request& request, std::string_view reply, uint64_t received) {
+        bool failed = reply[0] == '-';
+        CommandStats::record(request.op, CommandStats::elapsed_ns(request.sent, received),
+                             failed ? CommandStats::Outcome::Failed : CommandStats::Outcome::Ok);
+        completed_[request.op]++;
+        if (failed) {
+            if (errors_[request.op]++ == 0) {
+                first_errors_[request.op] = std::string(reply.substr(1, reply.size() - 3));
+            }
+            return;
+        }
+
+        if (request.op == kXRead || request.op == kXReadGroup) {
+            std::vector<std::string> ids;
+            read_entry_ids(reply, ids);
+            if (ids.empty()) {
+                return;
+            }
+            if (request.op == kXRead) {
+                client.last_read[request.stream] = ids.back();
+            } else {
+                client.acks.push_back(Ack{request.stream, std::move(ids)});
+                if (client.acks.size() > kMaxHeldAcks) {
+                    client.acks.pop_front();
+                }
+            }
+        }
+    }
+
+    void finish_if_idle() {
+        if (!issuing_ && outstanding_ == 0) {
+            loop_.stop();
+        }
+    }
+
+    [[noreturn]] void fail(const std::string& message) {
+        std::cerr << "redis_streams_bench: thread " << index_ << ": " << message << std::endl;
+        std::exit(1);
+    }
+
+    const BenchConfig& config_;
+    size_t index_;
+    std::atomic<int64_t>& budget_;
+    std::mt19937_64 random_;
+    uint64_t mix_total_ = 0;
+    std::string payload_;
+
+    EventLoop loop_;
+    std::vector<std::unique_ptr<Client>> clients_;
+    bool issuing_;
+    uint64_t outstanding_;
+    uint64_t completed_[kOpCount];
+    uint64_t errors_[kOpCount];
+    std::string first_errors_[kOpCount];
+};
+
+// Consumer groups the XREADGROUPs read through, created at the end of each
+// stream so a run only reads what it added; existing ones are kept
+void create_groups(const BenchConfig& config) {
+    int fd = connect_to(config.host, config.port);
+    ReplyBuffer out;
+    for (int stream = 0; stream < config.streams; stream++) {
+        for (int group = 0; group < config.groups; group++) {
+            out.append_array_header(5);
+            out.append_bulk_string("XGROUP");
+            out.append_bulk_string("CREATE");
+            out.append_bulk_string(stream_key(stream));
+            out.append_bulk_string(group_name(group));
+            out.append_bulk_string("$");
+        }
+    }
+    if (send(fd, out.data(), out.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(out.size())) {
+        close(fd);
+        throw std::runtime_error("Cannot send XGROUP CREATE");
+    }
+
+    std::string input;
+    size_t replies = 0;
+    size_t expected = static_cast<size_t>(config.streams) * config.groups;
+    char buffer[16 * 1024];
+    while (replies < expected) {
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received <= 0) {
+            close(fd);
+            throw std::runtime_error("Connection lost while creating consumer groups");
+        }
+        input.append(buffer, received);
+        size_t consumed = 0;
+        while (true) {
+            ReplyReader reader(std::string_view(input).substr(consumed));
+            if (!reader.skip()) {
+                break;
+            }
+            std::string_view reply = std::string_view(input).substr(consumed, reader.position());
+            if (reply[0] == '-' && reply.substr(1, 9) != "BUSYGROUP") {
+                close(fd);
+                throw std::runtime_error("XGROUP CREATE failed: " + std::string(reply.substr(1, reply.size() - 3)));
+            }
+            consumed += reader.position();
+            replies++;
+        }
+        input.erase(0, consumed);
+    }
+    close(fd);
+}
+
+void print_row(const char* name, uint64_t requests, uint64_t errors, double seconds,
+               const CommandStats::Summary& latency) {
+    std::printf("%-12s %12llu %12.0f %8llu %10.1f %10.1f %10.1f\n", name, static_cast<unsigned long long>(requests),
+                requests / seconds, static_cast<unsigned long long>(errors), latency.percentile(0.5) / 1000.0,
+                latency.percentile(0.99) / 1000.0, latency.percentile(0.999) / 1000.0);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    try {
+        config = BenchConfig::from_args(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl << BenchConfig::usage();
+        return 1;
+    }
+
+    int threads = config.threads;
+    if (threads == 0) {
+        threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    }
+    threads = std::min(threads, config.connections);
+
+    std::atomic<int64_t> budget(config.requests);
+    std::vector<std::unique_ptr<Worker>> workers;
+    try {
+        create_groups(config);
+        for (int i = 0; i < threads; i++) {
+            workers.push_back(std::make_unique<Worker>(config, i, budget));
+        }
+        for (int i = 0; i < config.connections; i++) {
+            workers[i % threads]->add_client(i);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "redis_streams_bench: " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::printf("%d connections on %d threads, pipeline %d, %d streams with %d groups each, %d byte payload\n",
+                config.connections, threads, config.pipeline, config.streams, config.groups, config.payload);
+
+    auto started = std::chrono::steady_clock::now();
+    std::vector<std::thread> running;
+    for (auto& worker : workers) {
+        running.emplace_back([&worker] { worker->run(); });
+    }
+    for (std::thread& thread : running) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    std::printf("\n%-12s %12s %12s %8s %10s %10s %10s\n", "request", "count", "ops/s", "errors", "p50 usec",
+                "p99 usec", "p99.9 usec");
+    CommandStats::Summary total;
+    uint64_t total_requests = 0;
+    uint64_t total_errors = 0;
+    for (size_t op = 0; op < kOpCount; op++) {
+        uint64_t requests = 0;
+        uint64_t errors = 0;
+        for (const auto& worker : workers) {
+            requests += worker->completed(op);
+            errors += worker->errors(op);
+        }
+        if (requests == 0) {
+            continue;
+        }
+        CommandStats::Summary latency = CommandStats::summary(op);
+        print_row(kOpNames[op], requests, errors, seconds, latency);
+        for (size_t i = 0; i < CommandStats::kBuckets; i++) {
+            total.buckets[i] += latency.buckets[i];
+        }
+        total_requests += requests;
+        total_errors += errors;
+    }
+    print_row("total", total_requests, total_errors, seconds, total);
+    std::printf("\n%.2f seconds\n", seconds);
+
+    for (size_t op = 0; op < kOpCount; op++) {
+        for (const auto& worker : workers) {
+            if (!worker->first_error(op).empty()) {
+                std::printf("first %s error: %s\n", kOpNames[op], worker->first_error(op).c_str());
+                break;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "reply_buffer.h"
+
+// Append-only log of the commands that changed the data set, replayed on
+// startup.
+//
+// Commands add their records to an in-memory buffer and a dedicated writer
+// thread drains it, one write() per batch, syncing as the fsync policy asks;
+// appending never waits on the disk. Under `always` the caller waits in
+// wait_durable() before replying instead, and everyone waiting shares the
+// same fsync (group commit).
+//
+// Records are RESP commands in their effect form: IDs resolved, trims as the
+// exact MINID they reached, group deliveries as absolute XCLAIMs. Applying a
+// record twice leaves the same state, so a rewrite can dump the live data
+// set while writers carry on and then replay what arrived meanwhile on top.
+class AppendLog {
+public:
+    enum class FsyncPolicy { Always, EverySec, No };
+
+    struct Options {
+        std::string path;
+        FsyncPolicy fsync = FsyncPolicy::EverySec;
+        // Rewrite once the log has grown by this percentage since the last
+        // rewrite and is at least min size; 0 turns automatic rewrites off
+        unsigned rewrite_percentage = 100;
+        uint64_t rewrite_min_size = 64 * 1024 * 1024;
+    };
+
+    using Command = std::vector<std::string_view>;
+    using Emit = std::function<void(const Command& command)>;
+    // Writes the current data set as commands through `emit`
+    using Dump = std::function<void(const Emit& emit)>;
+
+    AppendLog(Options options, Dump dump);
+    ~AppendLog();
+
+    AppendLog(const AppendLog&) = delete;
+    AppendLog& operator=(const AppendLog&) = delete;
+
+    // Feed the commands already in the log to `apply`, before start().
+    // A partial last record, left by a crash mid-write, is cut off.
+    // Returns the number of commands replayed.
+    size_t load(const std::function<void(const Command& command)>& apply);
+
+    void start();
+    // Write out and sync what is buffered, then stop the writer
+    void stop();
+
+    // Records touching one key must be appended in the order their changes
+    // took effect; callers see to that
+    void append(const Command& command);
+    // Under `always`, block until everything this thread appended is synced
+    void wait_durable();
+
+    // Start a background rewrite; false if one is already running
+    bool rewrite();
+
+    struct Stats {
+        bool rewriting;
+        bool last_rewrite_ok;
+        uint64_t current_size;
+        uint64_t base_size;        // size right after the last rewrite or load
+        uint64_t buffered;         // appended but not written yet
+        uint64_t rewrites;
+    };
+    Stats stats() const;
+
+private:
+    void run_writer();
+    void run_rewrite();
+    bool finish_rewrite(int fd, const std::string& temp_path, uint64_t& size);
+    bool rewrite_due() const;
+
+    Options options_;
+    Dump dump_;
+    int fd_;
+
+    // Guards the buffers and offsets below. Lock order: io_mutex_, mutex_.
+    mutable std::mutex mutex_;
+    std::condition_variable writer_cv_;
+    std::condition_variable durable_cv_;
+    ReplyBuffer pending_;
+    uint64_t appended_;          // bytes ever appended
+    uint64_t synced_;            // of which known to be on disk
+    uint64_t generation_;        // bumped when a rewrite replaces the file
+    bool stopping_;
+    // Records appended while a rewrite runs, for the new file
+    bool capturing_;
+    ReplyBuffer rewrite_tail_;
+
+    // Held while the file is written, synced or replaced
+    std::mutex io_mutex_;
+    uint64_t file_size_;
+    uint64_t base_size_;
+    std::atomic<bool> rewriting_;
+    bool last_rewrite_ok_;
+    uint64_t rewrites_;
+
+    std::thread writer_;
+    std::thread rewriter_;
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Memory for stream blocks, carved out of 1 MiB slabs mapped straight from
+// the kernel.
+//
+// A block with its entry slots and encoding is one allocation, rounded up to
+// a size class: four per power of two, from 256 bytes to 128 KiB. Each class
+// hands out chunks of its slabs and unmaps a slab once its last chunk is
+// freed, keeping at most one empty slab around. Blocks are allocated in ID
+// order and mostly freed that way too, by trimming, so slabs empty out whole
+// and resident memory follows the live blocks rather than staying at its
+// peak in a fragmented heap. Anything larger than the biggest class (a block
+// holding one huge entry) gets a mapping of its own.
+//
+// Classes lock separately, and a block costs one allocation when it starts
+// and one free when it goes, so the locks see little traffic.
+class BlockAllocator {
+public:
+    // Throws std::bad_alloc when the kernel has no memory to map
+    static void* allocate(size_t bytes);
+    static void deallocate(void* memory);
+    // Bytes an allocation of `bytes` actually takes
+    static size_t allocation_size(size_t bytes);
+
+    struct Stats {
+        uint64_t allocated;         // bytes in use, rounded up to their class
+        uint64_t mapped;            // bytes mapped from the kernel, headers included
+        uint64_t slabs;
+        uint64_t large;             // allocations with a mapping of their own
+        uint64_t allocations;       // since startup
+        uint64_t frees;
+    };
+    static Stats stats();
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "reply_buffer.h"
+#include "stream_entry.h"
+
+class Stream;
+
+// A client parked by XREAD/XREADGROUP BLOCK.
+//
+// The read is registered with every stream it covers and woken when one of
+// them gets an entry past the ID it waits for. The read then runs again on
+// its executor (the thread allowed to touch those streams) and, if it found
+// something, the reply goes to the client through `deliver`. Wakeups only
+// queue that retry, so a writer never pays for the readers it wakes. The
+// timeout is driven by the client's event loop and completes the read with
+// a null reply, whichever comes first.
+class BlockedRead : public std::enable_shared_from_this<BlockedRead> {
+public:
+    using Task = std::function<void()>;
+    using Executor = std::function<void(Task)>;
+    // Runs the read again; returns false, leaving `out` as it was, if there
+    // is still nothing to return
+    using Retry = std::function<bool(ReplyBuffer& out)>;
+    using Deliver = std::function<void(std::shared_ptr<ReplyBuffer> reply)>;
+
+    BlockedRead(Retry retry, uint64_t timeout_ms);
+
+    // 0 waits forever
+    uint64_t timeout_ms() const { return timeout_ms_; }
+
+    // Streams to wait on, each with the ID past which entries count
+    void watch(std::shared_ptr<Stream> stream, const StreamID& after);
+
+    // Register with the watched streams and check once more, so an entry
+    // added between the failed read and the registration is not missed
+    void arm(Executor executor, Deliver deliver);
+
+    // An entry arrived on a watched stream (any thread)
+    void wake();
+    // The timeout elapsed: reply with a null array
+    void expire();
+    // The client went away: complete without a reply
+    void cancel();
+
+private:
+    void serve();
+    void finish(std::shared_ptr<ReplyBuffer> reply);
+
+    Retry retry_;
+    uint64_t timeout_ms_;
+    Executor executor_;
+    Deliver deliver_;
+    std::vector<std::pair<std::shared_ptr<Stream>, StreamID>> watched_;
+
+    std::mutex mutex_;
+    bool done_;
+    bool queued_;       // a retry is queued or running
+    bool wake_again_;   // woken while the retry was running
+    bool expired_;      // timed out while the retry was running
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Call counts and latency histograms per command, for INFO commandstats,
+// INFO latencystats and LATENCY HISTOGRAM.
+//
+// Every thread that runs commands records into slots of its own, written
+// with plain relaxed stores since it is their only writer, so recording a
+// call takes no lock and shares no cache line. Readers add up all threads'
+// slots; a thread that exits leaves its counts behind in a retired total.
+//
+// Histograms are HDR-style: nanoseconds go into log-linear buckets, exact
+// below 16 and sixteen per power of two above, so a percentile read from
+// them is within 1/16 of the true latency anywhere from nanoseconds to
+// minutes, with a few kilobytes per command and thread.
+class CommandStats {
+public:
+    // Commands are numbered by the caller, below this
+    static constexpr size_t kMaxCommands = 64;
+    static constexpr int kSubBucketBits = 4;
+    // Latencies of 2^40 ns (about 18 minutes) or more share the last bucket
+    static constexpr int kMaxPower = 40;
+    static constexpr size_t kBuckets = size_t(kMaxPower - kSubBucketBits + 1) << kSubBucketBits;
+
+    enum class Outcome {
+        Ok,
+        Failed,         // ran and replied with an error
+        Rejected        // refused before running, e.g. for its arity
+    };
+    static void record(size_t command, uint64_t ns, Outcome outcome);
+
+    // Timestamps for timing a command, cheaper than steady_clock: the CPU's
+    // invariant TSC where there is one, calibrated once at startup, and
+    // steady_clock elsewhere. Only differences are meaningful.
+    static uint64_t now();
+    static uint64_t elapsed_ns(uint64_t start, uint64_t end);
+
+    struct Summary {
+        uint64_t calls = 0;         // ran, failed ones included
+        uint64_t failed = 0;
+        uint64_t rejected = 0;
+        uint64_t total_ns = 0;
+        std::array<uint64_t, kBuckets> buckets{};
+
+        // Latency within which `fraction` of the calls completed, in ns
+        uint64_t percentile(double fraction) const;
+    };
+    static Summary summary(size_t command);
+
+    static size_t bucket_for(uint64_t ns);
+    // Largest latency counted in a bucket
+    static uint64_t bucket_limit(size_t bucket);
+};
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Command dispatch helpers: name and keyword matching that neither copies
+// nor upper-cases its input, a command table found through a perfect hash,
+// and views over command arguments.
+
+constexpr char ascii_upper(char c) {
+    return c >= 'a' && c <= 'z' ? static_cast<char>(c - 'a' + 'A') : c;
+}
+
+// Case-insensitive match of an argument against an upper-case keyword
+constexpr bool equals_upper(std::string_view text, std::string_view upper) {
+    if (text.size() != upper.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < text.size(); i++) {
+        if (ascii_upper(text[i]) != upper[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Fixed set of entries, each with an upper-case `name`, found by name in
+// any case.
+//
+// Built at compile time: the constructor tries hash seeds until every name
+// lands in a slot of its own, so a lookup is one hash of the name, one slot
+// and one comparison with the only entry that can match.
+template <typename Entry, size_t N>
+class CommandTable {
+public:
+    constexpr explicit CommandTable(const Entry (&entries)[N])
+        : entries_(copy(entries, std::make_index_sequence<N>())), slots_(), seed_(0) {
+        for (uint32_t seed = 1; seed < kMaxSeeds; seed++) {
+            if (place(seed)) {
+                seed_ = seed;
+                return;
+            }
+        }
+        throw std::logic_error("no perfect hash for these names");
+    }
+
+    // Entry of that name, or null
+    const Entry* find(std::string_view name) const {
+        uint8_t slot = slots_[hash(name, seed_) & (kSlots - 1)];
+        if (slot == 0) {
+            return nullptr;
+        }
+        const Entry& entry = entries_[slot - 1];
+        return equals_upper(name, entry.name) ? &entry : nullptr;
+    }
+
+    const Entry* begin() const { return entries_.data(); }
+    const Entry* end() const { return entries_.data() + N; }
+    static constexpr size_t size() { return N; }
+    // Position of an entry in the table, for per-command arrays
+    size_t index_of(const Entry* entry) const { return entry - entries_.data(); }
+
+private:
+    static_assert(N > 0 && N < 255, "slots hold entry numbers in a byte");
+
+    // A power of two at least four times the entry count, so a seed turns up
+    // within a few dozen tries
+    static constexpr size_t slot_count() {
+        size_t slots = 1;
+        while (slots < 4 * N) {
+            slots *= 2;
+        }
+        return slots;
+    }
+    static constexpr size_t kSlots = slot_count();
+    static constexpr uint32_t kMaxSeeds = 100000;
+
+    template <size_t... I>
+    static constexpr std::array<Entry, N> copy(const Entry (&entries)[N], std::index_sequence<I...>) {
+        return {{entries[I]...}};
+    }
+
+    // FNV-1a over the upper-cased name
+    static constexpr uint32_t hash(std::string_view name, uint32_t seed) {
+        uint32_t h = 2166136261u ^ seed;
+        for (char c : name) {
+            h ^= static_cast<uint8_t>(ascii_upper(c));
+            h *= 16777619u;
+        }
+        return h ^ (h >> 16);
+    }
+
+    constexpr bool place(uint32_t seed) {
+        for (size_t i = 0; i < kSlots; i++) {
+            slots_[i] = 0;
+        }
+        for (size_t i = 0; i < N; i++) {
+            size_t slot = hash(entries_[i].name, seed) & (kSlots - 1);
+            if (slots_[slot] != 0) {
+                return false;
+            }
+            slots_[slot] = static_cast<uint8_t>(i + 1);
+        }
+        return true;
+    }
+
+    std::array<Entry, N> entries_;
+    std::array<uint8_t, kSlots> slots_;     // entry index + 1, 0 when free
+    uint32_t seed_;
+};
+
+template <typename Entry, size_t N>
+constexpr CommandTable<Entry, N> make_command_table(const Entry (&entries)[N]) {
+    return CommandTable<Entry, N>(entries);
+}
+
+// A run of consecutive arguments, viewed in place
+class ArgSpan {
+public:
+    ArgSpan() : data_(nullptr), size_(0) {}
+    ArgSpan(const std::vector<std::string_view>& args, size_t from, size_t count)
+        : data_(args.data() + from), size_(count) {}
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    std::string_view operator[](size_t i) const { return data_[i]; }
+    const std::string_view* begin() const { return data_; }
+    const std::string_view* end() const { return data_ + size_; }
+
+private:
+    const std::string_view* data_;
+    size_t size_;
+};
+
+// Arguments copied out of a connection's buffer into one string, for a
+// command that runs on another thread or again later, as a blocked read
+class OwnedArgs {
+public:
+    explicit OwnedArgs(const std::vector<std::string_view>& args);
+    OwnedArgs(const OwnedArgs& other);
+    OwnedArgs(OwnedArgs&& other) noexcept;
+    OwnedArgs& operator=(const OwnedArgs&) = delete;
+    OwnedArgs& operator=(OwnedArgs&&) = delete;
+
+    const std::vector<std::string_view>& args() const { return args_; }
+
+private:
+    // Point the views at this copy of the bytes
+    void rebase(const char* old_base);
+
+    std::string bytes_;
+    std::vector<std::string_view> args_;
+};
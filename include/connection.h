@@ -0,0 +1,95 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "reply_buffer.h"
+#include "resp_parser.h"
+
+// Per-client socket state owned by a single event loop thread.
+//
+// A connection is Reading while it has no unsent output; once the socket
+// stops accepting replies it switches to Writing and input is left in the
+// kernel until the backlog drains. Closing means the peer has gone away and
+// only the remaining output is flushed before the socket is closed.
+//
+// Independently of the I/O state, a connection may be awaiting the reply of
+// a command that executes on another thread; its remaining input is not
+// processed until that reply has been queued, which keeps replies in order.
+// A connection parked in a blocking read also remembers the read (one per
+// shard for a read spanning shards) and its timeout timer, so both can be
+// cancelled if the client disconnects first.
+class BlockedRead;
+
+class Connection {
+public:
+    enum class State {
+        Reading,
+        Writing,
+        Closing
+    };
+
+    explicit Connection(int fd);
+    ~Connection();
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    int fd() const { return fd_; }
+    // Hand the socket over; the connection no longer closes it
+    int release_fd() {
+        int fd = fd_;
+        fd_ = -1;
+        return fd;
+    }
+    // Client address as ip:port; fixed, so any thread may read it
+    const std::string& peer() const { return peer_; }
+    State state() const { return state_; }
+    void set_closing() { state_ = State::Closing; }
+
+    bool awaiting_reply() const { return awaiting_reply_; }
+    void set_awaiting_reply(bool awaiting) { awaiting_reply_ = awaiting; }
+
+    // Read everything the socket currently has. Returns false on EOF or error.
+    bool read_available();
+    std::string& input_buffer() { return input_; }
+    RespParser& parser() { return parser_; }
+
+    // Replies of a batch of pipelined commands are encoded into the output
+    // buffer and sent together by flush(). Returns false if the socket failed.
+    ReplyBuffer& output() { return output_; }
+    bool flush();
+    bool has_pending_output() const { return output_offset_ < output_.size(); }
+    size_t pending_bytes() const { return output_.size() - output_offset_; }
+
+    // Blocking read this connection is parked on; empty when not blocked
+    const std::vector<std::shared_ptr<BlockedRead>>& blocked_reads() const { return blocked_reads_; }
+    uint64_t block_timer() const { return block_timer_; }
+    bool blocked() const { return !blocked_reads_.empty(); }
+    void set_blocked(std::vector<std::shared_ptr<BlockedRead>> reads, uint64_t timer) {
+        blocked_reads_ = std::move(reads);
+        block_timer_ = timer;
+    }
+    void clear_blocked() { set_blocked({}, 0); }
+
+    // epoll interest currently registered for this socket
+    uint32_t interest() const { return interest_; }
+    void set_interest(uint32_t events) { interest_ = events; }
+
+private:
+    int fd_;
+    const std::string peer_;
+    State state_;
+    bool awaiting_reply_;
+    uint32_t interest_;
+
+    std::string input_;
+    RespParser parser_;
+    ReplyBuffer output_;
+    size_t output_offset_;   // bytes of output_ already sent
+
+    std::vector<std::shared_ptr<BlockedRead>> blocked_reads_;
+    uint64_t block_timer_;   // 0 when there is no timeout
+};
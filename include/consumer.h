@@ -1,11 +1,66 @@
 #pragma once
 
 #include <string>
-#include <vector>
-#include <unordered_set>
-#include <mutex>
+#include <atomic>
+#include <cstdint>
 #include "stream_entry.h"
 
+class Consumer;
+
+// A delivered entry awaiting XACK. Owned by the group's PEL; the consumer
+// it was delivered to indexes it through the links embedded here, so
+// moving it between consumers allocates nothing.
+struct PendingEntry {
+    StreamID id;
+    Consumer* consumer;
+    uint64_t delivery_time;
+    uint64_t delivery_count;
+    
+    // Treap links within the consumer's index, ordered by ID
+    PendingEntry* left = nullptr;
+    PendingEntry* right = nullptr;
+};
+
+// One consumer's pending entries in ID order: an intrusive treap over the
+// group's own PEL nodes. Priorities are a hash of the ID, so the shape is
+// balanced in expectation and no state is needed to draw them.
+class PendingIndex {
+public:
+    void insert(PendingEntry& entry);
+    void erase(PendingEntry& entry);
+    
+    // First entry with an ID >= / > `id`, null if there is none
+    PendingEntry* lower_bound(const StreamID& id) const;
+    PendingEntry* upper_bound(const StreamID& id) const;
+    PendingEntry* first() const { return lower_bound(StreamID()); }
+    size_t size() const { return size_; }
+    
+    // Calls visit(entry) in ID order on the entries from `from` on
+    // (`inclusive`) or after it, until it returns false
+    template <typename Visit>
+    void visit(const StreamID& from, bool inclusive, Visit visit) const {
+        walk(root_, from, inclusive, visit);
+    }
+    
+private:
+    template <typename Visit>
+    static bool walk(const PendingEntry* node, const StreamID& from, bool inclusive, Visit& visit) {
+        if (!node) {
+            return true;
+        }
+        // Nothing left of a node below the range is in it
+        if (inclusive ? node->id >= from : node->id > from) {
+            if (!walk(node->left, from, inclusive, visit) || !visit(*node)) {
+                return false;
+            }
+        }
+        return walk(node->right, from, inclusive, visit);
+    }
+    
+    PendingEntry* root_ = nullptr;
+    size_t size_ = 0;
+};
+
 class Consumer {
 public:
     explicit Consumer(const std::string& name);
@@ -13,22 +68,19 @@ public:
     
     const std::string& get_name() const { return name_; }
     
-    // Pending messages management
-    void add_pending_message(const StreamID& id);
-    bool remove_pending_message(const StreamID& id);
-    bool has_pending_message(const StreamID& id) const;
-    std::vector<StreamID> get_pending_messages() const;
-    size_t pending_count() const;
+    // This consumer's share of the group's PEL, in ID order. The index links
+    // the group's own PEL nodes and is guarded by the group's PEL lock.
+    PendingIndex& pending() { return pending_; }
+    const PendingIndex& pending() const { return pending_; }
+    size_t pending_count() const { return pending_.size(); }
     
     // Consumer info
-    uint64_t get_seen_time() const { return seen_time_; }
+    uint64_t get_seen_time() const { return seen_time_.load(std::memory_order_relaxed); }
     void update_seen_time();
+    void set_seen_time(uint64_t time) { seen_time_.store(time, std::memory_order_relaxed); }
     
 private:
     std::string name_;
-    uint64_t seen_time_;
-    mutable std::mutex pending_mutex_;
-    
-    // Set of pending message IDs for this consumer
-    std::unordered_set<std::string> pending_messages_; // stream_id as string
+    std::atomic<uint64_t> seen_time_;
+    PendingIndex pending_;
 };
@@ -1,11 +1,16 @@
 #pragma once
 
+#include <atomic>
+#include <functional>
 #include <string>
+#include <map>
+#include <set>
 #include <unordered_map>
 #include <memory>
 #include <mutex>
 #include <vector>
 #include "stream_entry.h"
+#include "stream_storage.h"
 #include "consumer.h"
 
 class ConsumerGroup {
@@ -14,40 +19,141 @@ public:
     ~ConsumerGroup();
     
     const std::string& get_name() const { return name_; }
-    const StreamID& get_last_delivered_id() const { return last_delivered_id_; }
+    StreamID get_last_delivered_id() const;
     
     // Consumer management
     std::shared_ptr<Consumer> get_or_create_consumer(const std::string& consumer_name);
     bool delete_consumer(const std::string& consumer_name);
     std::vector<std::string> get_consumer_names() const;
     
-    // Message delivery
-    std::vector<StreamEntry> read_pending_messages(const std::string& consumer_name, 
-                                                   const std::vector<StreamEntry>& available_entries,
-                                                   int count = -1);
+    // Message delivery: hands the entries after the last delivered ID to the
+    // consumer, at most `count` of them (no limit if <= 0). The cursor starts
+    // at the group's position in `entries` and walks only what it delivers,
+    // so the cost does not depend on how far the group lags behind. Each
+    // entry goes to `visit` straight out of storage, for the caller to encode
+    // without copying it; the IDs delivered are returned. Call under the
+    // stream's ReadGuard.
+    using EntryVisitor = std::function<void(const StreamEntryView& entry)>;
+    std::vector<StreamID> deliver_new_messages(const std::string& consumer_name, const StreamStorage& entries,
+                                               int count, const EntryVisitor& visit);
     
-    // Acknowledgment
-    int acknowledge_messages(const std::string& consumer_name, const std::vector<StreamID>& ids);
+    // Acknowledgment: one PEL lookup per ID, whichever consumer holds it.
+    // Returns how many were pending.
+    int acknowledge_messages(const std::vector<StreamID>& ids);
     
-    // Pending entries list (PEL)
-    std::vector<StreamEntry> get_pending_entries(const std::string& consumer_name = "") const;
+    // Pending entries list (PEL): IDs the consumer holds past `after`, in
+    // order, at most `count` of them (no limit if <= 0)
+    std::vector<StreamID> get_pending_ids(const std::string& consumer_name, const StreamID& after,
+                                          int count = -1) const;
+    size_t pending_count() const;
+    
+    // XPENDING: the summary form, and entries in [start, end] idle for at
+    // least `min_idle_ms`, optionally only those of one consumer
+    struct PendingSummary {
+        size_t count = 0;
+        StreamID first;
+        StreamID last;
+        std::vector<std::pair<std::string, size_t>> consumers;
+    };
+    struct PendingInfo {
+        StreamID id;
+        std::string consumer;
+        uint64_t idle_ms;
+        uint64_t delivery_time;
+        uint64_t delivery_count;
+    };
+    PendingSummary get_pending_summary() const;
+    std::vector<PendingInfo> get_pending_range(const StreamID& start, const StreamID& end, size_t count,
+                                               const std::string& consumer_name, uint64_t min_idle_ms) const;
+    // The listed entries that are pending, in the order given
+    std::vector<PendingInfo> get_pending_entries(const std::vector<StreamID>& ids) const;
+    
+    // XCLAIM: hand the listed entries idle for at least `min_idle_ms` to the
+    // consumer. Entries since deleted from the stream are dropped from the
+    // PEL instead. Returns the IDs claimed; call under the stream's ReadGuard.
+    struct ClaimOptions {
+        uint64_t min_idle_ms = 0;
+        int64_t idle_ms = -1;         // IDLE: backdate the delivery by this much
+        int64_t time_ms = -1;         // TIME: the new delivery time (unix ms)
+        int64_t retry_count = -1;     // RETRYCOUNT: the new delivery count
+        bool force = false;           // FORCE: claim IDs not yet pending
+        bool just_id = false;         // JUSTID: leave the delivery count alone
+        StreamID last_id;             // LASTID: raise the last delivered ID
+    };
+    std::vector<StreamID> claim(const std::string& consumer_name, const std::vector<StreamID>& ids,
+                                const ClaimOptions& options, const StreamStorage& entries);
+    
+    // XAUTOCLAIM: scan the PEL in ID order from `start` and claim the
+    // entries idle for at least `min_idle_ms`, up to `count` of them and
+    // looking at no more than 10 * `count`. `next` is the first ID not
+    // scanned, where the next call continues (0-0 at the end of the PEL);
+    // `deleted` lists stale entries dropped because the stream no longer
+    // has them, which count towards `count` as in Redis.
+    struct AutoClaimResult {
+        StreamID next;
+        std::vector<StreamID> claimed;
+        std::vector<StreamID> deleted;
+    };
+    AutoClaimResult auto_claim(const std::string& consumer_name, uint64_t min_idle_ms, const StreamID& start,
+                               size_t count, bool just_id, const StreamStorage& entries);
     
     void set_last_delivered_id(const StreamID& id);
     
+    // Snapshots: the group as of one instant, and loading it back into a
+    // new group before anyone else can see it
+    struct Snapshot {
+        struct Pending {
+            StreamID id;
+            size_t consumer;          // index into `consumers`
+            uint64_t delivery_time;
+            uint64_t delivery_count;
+        };
+        StreamID last_delivered_id;
+        std::vector<std::pair<std::string, uint64_t>> consumers;   // name, seen time
+        std::vector<Pending> pending;
+    };
+    Snapshot snapshot() const;
+    void restore_consumer(const std::string& consumer_name, uint64_t seen_time);
+    void restore_pending(const std::string& consumer_name, const StreamID& id, uint64_t delivery_time,
+                         uint64_t delivery_count);
+    
+    // Bytes held by the group, its consumers and its PEL; O(1)
+    size_t memory_usage() const { return memory_usage_.load(std::memory_order_relaxed); }
+    
 private:
+    // Record `id` as delivered to `consumer`, taking it over from whichever
+    // consumer held it before. Requires pending_mutex_.
+    void add_pending(Consumer& consumer, const StreamID& id, uint64_t now);
+    // Move a pending entry to `consumer` with a new delivery time, keeping
+    // the idle index in step. Requires pending_mutex_.
+    void transfer_pending(PendingEntry& pending, Consumer& consumer, uint64_t delivery_time);
+    void remove_pending(std::map<StreamID, PendingEntry>::iterator it);
+    
+    // PEL entries are charged once per command rather than one at a time:
+    // this settles the difference since the last call. Requires pending_mutex_.
+    void account_pending();
+    void charge(size_t bytes);
+    void release(size_t bytes);
+    
     std::string name_;
     StreamID last_delivered_id_;
+    // Serializes deliveries, so concurrent readers never hand out an entry twice
+    mutable std::mutex delivery_mutex_;
     mutable std::mutex consumers_mutex_;
+    // Guards the PEL and every consumer's index into it. Lock order:
+    // delivery_mutex_, pending_mutex_, consumers_mutex_.
     mutable std::mutex pending_mutex_;
     
     std::unordered_map<std::string, std::shared_ptr<Consumer>> consumers_;
     
-    // Pending Entry List (PEL) - messages delivered but not acknowledged
-    struct PendingEntry {
-        StreamID id;
-        std::string consumer_name;
-        uint64_t delivery_time;
-        int delivery_count;
-    };
-    std::unordered_map<std::string, PendingEntry> pending_entries_; // key: stream_id_string
+    // Pending Entry List (PEL) - messages delivered but not acknowledged,
+    // ordered by ID. Map nodes never move, so consumers index them directly.
+    std::map<StreamID, PendingEntry> pending_entries_;
+    // The same entries ordered by delivery time, oldest first, so stale
+    // entries are found without walking the whole PEL
+    std::set<std::pair<uint64_t, StreamID>> idle_index_;
+    
+    // PEL size memory_usage_ last accounted for, under pending_mutex_
+    size_t accounted_pending_;
+    std::atomic<size_t> memory_usage_;
 };
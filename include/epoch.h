@@ -0,0 +1,32 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+// Epoch-based reclamation for data that readers walk without taking locks.
+//
+// A reader holds an Epoch::Guard for as long as it may dereference shared
+// pointers. A writer that unlinks an object hands it to retire() instead of
+// freeing it; the object is freed once every guard that was active at the
+// time has been released. Guards nest and cost two atomic stores.
+class Epoch {
+public:
+    class Guard {
+    public:
+        Guard();
+        ~Guard();
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    // Run `deleter` once no reader can still see the object it frees
+    static void retire(std::function<void()> deleter);
+
+    // Free whatever is already safe to free
+    static void collect();
+
+    // Objects retired but not yet freed
+    static size_t pending();
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Level-triggered epoll reactor. Each loop is driven by exactly one thread;
+// file descriptors are registered and serviced only on that thread, and other
+// threads hand work over through post(). Timers share the same thread: the
+// earliest deadline bounds the epoll_wait timeout.
+class EventLoop {
+public:
+    using Handler = std::function<void(uint32_t events)>;
+    using Task = std::function<void()>;
+    using TimerId = uint64_t;
+
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    void run();
+    void stop();
+
+    // File descriptor registration (loop thread only, or before run())
+    bool add_fd(int fd, uint32_t events, Handler handler);
+    bool modify_fd(int fd, uint32_t events);
+    void remove_fd(int fd);
+
+    // Queue a task to run on the loop thread. Safe to call from any thread.
+    void post(Task task);
+
+    // One-shot timers (loop thread only). Cancelling a timer that already
+    // fired is a no-op.
+    TimerId add_timer(uint64_t delay_ms, Task task);
+    void cancel_timer(TimerId id);
+
+private:
+    void wake();
+    void run_posted_tasks();
+    // Fire due timers; returns the epoll_wait timeout until the next one
+    int run_timers();
+
+    int epoll_fd_;
+    int wake_fd_;
+    std::atomic<bool> running_;
+
+    // Handlers are shared so one can safely unregister itself while running
+    std::unordered_map<int, std::shared_ptr<Handler>> handlers_;
+
+    std::mutex tasks_mutex_;
+    std::vector<Task> tasks_;
+
+    // Min-heap of (deadline, id); cancelled timers are dropped from timers_
+    // and skipped when they reach the top
+    using TimerEntry = std::pair<uint64_t, TimerId>;
+    std::priority_queue<TimerEntry, std::vector<TimerEntry>, std::greater<TimerEntry>> timer_queue_;
+    std::unordered_map<TimerId, Task> timers_;
+    TimerId next_timer_id_;
+};
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Process-wide count of the bytes held by stream data: blocks, block
+// indexes, consumer groups and their PELs.
+//
+// Owners report what they allocate and free at a coarse grain (a block at a
+// time, or once per command for PEL entries), so the shared counter sees a
+// few updates per block of appends rather than one per entry. maxmemory is
+// enforced against this figure.
+class MemoryTracker {
+public:
+    static void allocated(size_t bytes) { used_.fetch_add(bytes, std::memory_order_relaxed); }
+    static void released(size_t bytes) { used_.fetch_sub(bytes, std::memory_order_relaxed); }
+    static size_t used() { return used_.load(std::memory_order_relaxed); }
+
+private:
+    static std::atomic<size_t> used_;
+};
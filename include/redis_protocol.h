@@ -3,6 +3,12 @@
 #include <string>
 #include <vector>
 #include <sstream>
+#include "reply_buffer.h"
+
+class StreamEntry;
+struct StreamID;
+struct StreamEntryView;
+class StreamStorage;
 
 class RedisProtocol {
 public:
@@ -19,11 +25,30 @@ public:
     static std::string format_null_array();
     
     // Stream-specific formatting
-    static std::string format_stream_entries(const std::vector<class StreamEntry>& entries);
-    static std::string format_stream_read_response(const std::vector<std::pair<std::string, std::vector<class StreamEntry>>>& stream_entries);
+    static std::string format_stream_entries(const std::vector<StreamEntry>& entries);
+    static std::string format_stream_read_response(const std::vector<std::pair<std::string, std::vector<StreamEntry>>>& stream_entries);
+    
+    // Encoders appending straight to a reply buffer; the format_* helpers
+    // above are thin wrappers around these
+    static void write_stream_id(ReplyBuffer& out, const StreamID& id);
+    static void write_stream_entries(ReplyBuffer& out, const std::vector<StreamEntry>& entries);
+    static void write_stream_read_response(ReplyBuffer& out,
+                                           const std::vector<std::pair<std::string, std::vector<StreamEntry>>>& stream_entries);
+    
+    // Encode entries straight out of stream storage, without materializing
+    // them: up to `count` (negative for all) live entries from `from` through
+    // `end`. Returns how many were written; none gives a null array. The
+    // caller must hold an Epoch::Guard (e.g. a Stream::ReadGuard).
+    static void write_stream_entry(ReplyBuffer& out, const StreamEntryView& entry);
+    static size_t write_stream_range(ReplyBuffer& out, const StreamStorage& storage,
+                                     const StreamID& from, const StreamID& end, int count);
+    
+    // Pending entries replayed by XREADGROUP with an explicit ID, looked up
+    // in storage by ID; entries deleted since delivery come back with null
+    // fields, as in Redis. Same Epoch::Guard requirement as above.
+    static void write_pending_entries(ReplyBuffer& out, const StreamStorage& storage,
+                                      const std::vector<StreamID>& ids);
     
-private:
-    static std::string parse_bulk_string(const std::string& input, size_t& pos);
-    static int64_t parse_integer(const std::string& input, size_t& pos);
-    static std::vector<std::string> parse_array(const std::string& input, size_t& pos);
+    // Combine single-stream XREAD/XREADGROUP replies into one, preserving order
+    static void merge_stream_read_responses(ReplyBuffer& out, const std::vector<ReplyBuffer>& responses);
 };
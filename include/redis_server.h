@@ -1,55 +1,265 @@
 #pragma once
 
 #include <string>
+#include <array>
 #include <unordered_map>
 #include <memory>
 #include <thread>
 #include <atomic>
 #include <mutex>
-#include "stream.h"
+#include <string_view>
+#include <vector>
+#include "blocked_read.h"
+#include "command_table.h"
+#include "stream_directory.h"
+#include "server_config.h"
+#include "reply_buffer.h"
+#include "append_log.h"
+#include "snapshot_file.h"
+#include "tiered_storage.h"
+#include "replication_backlog.h"
+#include "replica_link.h"
+#include "slow_log.h"
+
+class Connection;
+class Shard;
 
 class RedisServer {
 public:
     explicit RedisServer(int port = 6379);
+    explicit RedisServer(const ServerConfig& config);
     ~RedisServer();
     
     void start();
     void stop();
     
-    // Stream operations
-    std::string xadd(const std::string& stream_name, const std::string& id, 
-                     const std::vector<std::pair<std::string, std::string>>& fields);
-    std::string xread(const std::vector<std::string>& streams, 
-                      const std::vector<std::string>& ids, 
-                      int count = -1, int block = -1);
-    std::string xrange(const std::string& stream_name, 
-                       const std::string& start, const std::string& end, 
-                       int count = -1);
-    std::string xlen(const std::string& stream_name);
-    std::string xdel(const std::string& stream_name, const std::vector<std::string>& ids);
+    // Stream operations; each appends its RESP reply to `out`. Given `park`,
+    // a blocking read that finds nothing leaves `out` untouched and returns
+    // the read to park the client on there instead.
+    void xadd(ReplyBuffer& out, std::string_view stream_name, std::string_view id, const FieldViews& fields,
+              const StreamTrim& trim = StreamTrim(), bool no_mkstream = false);
+    // Replies with the first and last ID the entries got
+    void xaddbatch(ReplyBuffer& out, std::string_view stream_name, std::string_view id,
+                   const std::vector<FieldViews>& entries, const StreamTrim& trim = StreamTrim(),
+                   bool no_mkstream = false);
+    void xread(ReplyBuffer& out, ArgSpan streams, ArgSpan ids, int count = -1, int block = -1,
+               std::shared_ptr<BlockedRead>* park = nullptr);
+    void xrange(ReplyBuffer& out, std::string_view stream_name, std::string_view start, std::string_view end,
+                int count = -1);
+    void xlen(ReplyBuffer& out, std::string_view stream_name);
+    void xdel(ReplyBuffer& out, std::string_view stream_name, ArgSpan ids);
+    void xtrim(ReplyBuffer& out, std::string_view stream_name, const StreamTrim& trim);
+    void xsetid(ReplyBuffer& out, std::string_view stream_name, std::string_view id);
     
     // Consumer group operations
-    std::string xgroup_create(const std::string& stream_name, 
-                              const std::string& group_name, 
-                              const std::string& start_id);
-    std::string xreadgroup(const std::string& group_name, const std::string& consumer_name,
-                           const std::vector<std::string>& streams,
-                           const std::vector<std::string>& ids,
-                           int count = -1, int block = -1);
-    std::string xack(const std::string& stream_name, const std::string& group_name,
-                     const std::vector<std::string>& ids);
-
+    void xgroup_create(ReplyBuffer& out, std::string_view stream_name, std::string_view group_name,
+                       std::string_view start_id);
+    void xreadgroup(ReplyBuffer& out, std::string_view group_name, std::string_view consumer_name,
+                    ArgSpan streams, ArgSpan ids, int count = -1, int block = -1,
+                    std::shared_ptr<BlockedRead>* park = nullptr);
+    void xack(ReplyBuffer& out, std::string_view stream_name, std::string_view group_name, ArgSpan ids);
+    
+    // Pending entries inspection and recovery
+    void xpending(ReplyBuffer& out, std::string_view stream_name, std::string_view group_name);
+    void xpending_range(ReplyBuffer& out, std::string_view stream_name, std::string_view group_name,
+                        std::string_view start, std::string_view end, size_t count,
+                        std::string_view consumer_name, uint64_t min_idle_ms);
+    void xclaim(ReplyBuffer& out, std::string_view stream_name, std::string_view group_name,
+                std::string_view consumer_name, ArgSpan ids, const ConsumerGroup::ClaimOptions& options);
+    void xautoclaim(ReplyBuffer& out, std::string_view stream_name, std::string_view group_name,
+                    std::string_view consumer_name, uint64_t min_idle_ms, std::string_view start,
+                    size_t count, bool just_id);
+    
+    // Introspection
+    void memory_usage(ReplyBuffer& out, std::string_view stream_name);
+    void info(ReplyBuffer& out, const std::string& section);
+    
+    // Persistence
+    void bgrewriteaof(ReplyBuffer& out);
+    void save(ReplyBuffer& out);
+    void bgsave(ReplyBuffer& out);
+    
 private:
+    struct IoWorker;
+    
+    // Networking (runs on the event loop threads)
     void accept_connections();
-    void handle_client(int client_socket);
-    std::string process_command(const std::string& command);
+    void register_connection(IoWorker& worker, int client_socket);
+    void handle_connection_event(IoWorker& worker, int client_socket, uint32_t events);
+    void update_connection_interest(IoWorker& worker, Connection& conn);
+    void close_connection(IoWorker& worker, int client_socket);
+    bool serve_input(IoWorker& worker, const std::shared_ptr<Connection>& conn);
+    bool process_input(IoWorker& worker, const std::shared_ptr<Connection>& conn);
+    
+    // Command dispatch. Every command has an entry in a table built at
+    // compile time, found by name without copying or case-folding it; the
+    // arity is checked there and the handler gets the arguments as views.
+    using CommandArgs = std::vector<std::string_view>;
+    using CommandHandler = void (RedisServer::*)(ReplyBuffer& out, const CommandArgs& args,
+                                                 std::shared_ptr<BlockedRead>* park);
+    enum CommandFlags : uint32_t {
+        kWrite = 1 << 0,            // refused on replicas
+        kStreamKeys = 1 << 1,       // keys follow STREAMS, searched for from `key` on
+        kTakeover = 1 << 2,         // hands the connection over (PSYNC); no handler
+    };
+    struct Command {
+        std::string_view name;      // upper case
+        int arity;                  // argument count with the name; -N for N or more
+        uint32_t flags;
+        size_t key;                 // position of the key, 0 for keyless commands
+        CommandHandler handler;
+    };
+    // Every command; entries are numbered by their place in it
+    static const auto& command_table();
+    // nullptr for an unknown command
+    static const Command* find_command(std::string_view name);
+    void execute_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park = nullptr);
+    // `command` is what find_command() returned for args[0]. Times the
+    // handler into CommandStats and the slow log; `client` is who sent it,
+    // null for replayed and replicated commands.
+    void execute(ReplyBuffer& out, const Command* command, const CommandArgs& args,
+                 std::shared_ptr<BlockedRead>* park = nullptr, const Connection* client = nullptr);
+    
+    // Handlers: options and numbers are parsed here, then the operation above runs
+    void xadd_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void xaddbatch_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void xtrim_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void xread_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void xrange_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void xlen_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void xdel_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void xgroup_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void xreadgroup_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void xack_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void xpending_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void xclaim_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void xautoclaim_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void xsetid_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void memory_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void info_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void bgrewriteaof_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void save_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void bgsave_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void ping_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void replconf_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void slowlog_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    void latency_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park);
+    
+    // Sharded execution: run a command on the shard(s) owning its keys and
+    // deliver the reply back on the connection's event loop
+    struct KeyRange {
+        size_t first = 0;
+        size_t count = 0;       // 0 for keyless or malformed commands
+        bool blocking = false;  // a read given BLOCK
+    };
+    KeyRange command_keys(const Command* command, const CommandArgs& args) const;
+    bool route_to_shards(IoWorker& worker, const std::shared_ptr<Connection>& conn, const Command* command,
+                         const CommandArgs& args);
+    void complete_deferred(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                           const ReplyBuffer& reply);
+    void resume_input(IoWorker& worker, const std::shared_ptr<Connection>& conn);
     
-    int port_;
+    // Pipelined commands that each touch a single shard are sent in one
+    // task per shard; the replies go out together, in request order
+    struct PipelinedCommand {
+        size_t slot;            // position in the batch
+        const Command* command;
+        OwnedArgs args;
+    };
+    using ShardBatches = std::vector<std::vector<PipelinedCommand>>;
+    struct Pipeline;
+    Shard* pipeline_shard(const Command* command, const CommandArgs& args) const;
+    void run_pipeline(IoWorker& worker, const std::shared_ptr<Connection>& conn, ShardBatches& batches,
+                      size_t commands);
+    void complete_pipeline(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                           const std::shared_ptr<Pipeline>& pipeline);
+    
+    // Blocking reads. block_connection() arms a parked read from the thread
+    // that ran it; the rest runs on the connection's event loop.
+    struct FanOut;
+    void block_connection(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                          const std::shared_ptr<BlockedRead>& read, BlockedRead::Executor executor);
+    void park_connection(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                         const std::shared_ptr<BlockedRead>& read);
+    void complete_blocked(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                          const ReplyBuffer& reply);
+    void collect_fan_out(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                         const std::shared_ptr<FanOut>& fan_out);
+    void settle_fan_out(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                        const std::shared_ptr<FanOut>& fan_out);
+    void complete_fan_out(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                          const std::shared_ptr<FanOut>& fan_out, const ReplyBuffer& reply);
+    Shard& shard_for(std::string_view key) const;
+    
+    // Keyspace access: the calling shard's directory in sharded mode,
+    // otherwise the one shared by all I/O threads
+    StreamDirectory& directory();
+    
+    // maxmemory: whether writes that grow stream data by about `incoming`
+    // bytes must be refused
+    bool over_memory_limit(size_t incoming = 0) const;
+    // The stream XADD or XADDBATCH appends `incoming` bytes of fields to,
+    // evicting or creating it as needed; null once the reply (an OOM error,
+    // or nil under NOMKSTREAM) is written. Call under log_lock() on the key.
+    std::shared_ptr<Stream> append_target(ReplyBuffer& out, std::string_view stream_name, bool no_mkstream,
+                                          size_t incoming);
+    
+    // Write records, for the append-only log and replicas. Write commands
+    // hold log_lock() on their key from the change until its records are
+    // logged, so records of one key go out in the order they took effect.
+    // All of these do nothing while neither wants records, which is also
+    // the case while the log is being replayed.
+    bool logging() const { return aof_ || backlog_; }
+    std::unique_lock<std::mutex> log_lock(std::string_view key);
+    void log_command(const AppendLog::Command& command);
+    // XTRIM MINID down to the stream's first entry, however it got trimmed
+    void log_trim(std::string_view stream_name, Stream& stream);
+    // Absolute XCLAIMs restoring the listed PEL entries as they are now
+    void log_claims(std::string_view stream_name, std::string_view group_name, ConsumerGroup& group,
+                    const std::vector<StreamID>& ids);
+    // Under appendfsync always, wait until this thread's records are synced;
+    // called before replies leave
+    void wait_for_log();
+    void load_append_log(AppendLog& log);
+    void load_snapshot();
+    // Where a stream of that name lives or would be created
+    StreamDirectory& directory_for(std::string_view name);
+    // Shard of the key a logged record touches
+    Shard& shard_for_record(const AppendLog::Command& command);
+    // Wait until the shards ran everything queued so far
+    void drain_shards();
+    
+    // Replication. attach_replica() hands a connection that sent PSYNC to
+    // the backlog; false if it was refused and stays a client.
+    bool attach_replica(IoWorker& worker, const std::shared_ptr<Connection>& conn,
+                        const std::vector<std::string_view>& parts);
+    // On a replica: a record from the primary, and a full resync's snapshot
+    void apply_replicated(const AppendLog::Command& command);
+    void load_replica_snapshot(const std::string& path);
+    // Every stream, in all shards
+    void for_each_stream(const SnapshotFile::StreamVisitor& visit);
+    // The whole data set as commands, for log rewrites
+    void dump_streams(const AppendLog::Emit& emit);
+    
+    
+    ServerConfig config_;
     int server_socket_;
     std::atomic<bool> running_;
-    std::thread accept_thread_;
+    std::vector<std::unique_ptr<IoWorker>> workers_;
+    size_t next_worker_;
     
     // Storage
-    std::unordered_map<std::string, std::shared_ptr<Stream>> streams_;
-    mutable std::mutex streams_mutex_;
+    StreamDirectory streams_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    
+    std::unique_ptr<AppendLog> aof_;
+    std::unique_ptr<SnapshotFile> snapshots_;
+    std::unique_ptr<TieredStorage> tiering_;
+    std::unique_ptr<ReplicationBacklog> backlog_;
+    std::unique_ptr<ReplicaLink> primary_link_;
+    std::atomic<bool> loading_;
+    SlowLog slowlog_;
+    
+    static constexpr size_t kLogKeyStripes = 256;
+    std::array<std::mutex, kLogKeyStripes> log_key_mutexes_;
 };
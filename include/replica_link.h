@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "append_log.h"
+
+// Replica side of replication: follows a primary's write stream (see
+// ReplicationBacklog).
+//
+// A thread connects to the primary and asks to carry on from the
+// replication ID and offset it got to (PSYNC). On a full resync it saves
+// the primary's snapshot to a file and has `load` replace every stream with
+// its contents. Either way, it then parses the records that follow, hands
+// each to `apply` and acknowledges its offset once a second. After a
+// disconnect it reconnects and tries to carry on again.
+class ReplicaLink {
+public:
+    struct Options {
+        std::string host;
+        int port = 0;
+        // Where a full resync's snapshot is received
+        std::string snapshot_path;
+    };
+
+    using Apply = std::function<void(const AppendLog::Command& command)>;
+    // Replace the data set with the snapshot at the given path
+    using Load = std::function<void(const std::string& path)>;
+
+    ReplicaLink(Options options, Apply apply, Load load);
+    ~ReplicaLink();
+
+    ReplicaLink(const ReplicaLink&) = delete;
+    ReplicaLink& operator=(const ReplicaLink&) = delete;
+
+    void start();
+    void stop();
+
+    struct Status {
+        bool link_up;
+        bool syncing;
+        std::string replid;
+        uint64_t offset;            // applied
+        std::time_t last_io;
+        uint64_t full_syncs;
+        uint64_t partial_syncs;
+    };
+    Status status() const;
+
+private:
+    void run();
+    int connect_primary();
+    // One connection, from PSYNC until it breaks
+    void follow(int fd);
+    bool receive_snapshot(int fd, std::string& input, const std::string& header);
+    // Read more into `input`; false once the connection broke or stop() was called
+    bool read_more(int fd, std::string& input);
+    void send_ack(int fd);
+
+    Options options_;
+    Apply apply_;
+    Load load_;
+    std::thread thread_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_;
+    int fd_;                        // current connection, for stop()
+    bool link_up_;
+    bool syncing_;
+    std::string replid_;
+    uint64_t offset_;
+    std::time_t last_io_;
+    std::time_t last_ack_;
+    uint64_t full_syncs_;
+    uint64_t partial_syncs_;
+};
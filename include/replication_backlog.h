@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "append_log.h"
+#include "snapshot_file.h"
+
+// Primary side of replication: the stream of write records replicas follow,
+// and a thread per attached replica sending it.
+//
+// Every record the append-only file would get (see AppendLog) is appended
+// here too, numbered by its byte offset in the stream since startup under a
+// replication ID picked at startup. At least the last `size` bytes stay in
+// memory, so a replica that reconnects with an ID and offset still covered
+// carries on from there (PSYNC -> +CONTINUE). Any other gets a full resync:
+// a snapshot of every stream (SnapshotFile), then the records from the
+// offset the snapshot started at. As with log rewrites, the snapshot may
+// already hold some of those records; applying them again changes nothing.
+//
+// Replicas report the offset they applied with REPLCONF ACK once a second.
+// One that falls further behind than the backlog holds is dropped and has
+// to resync.
+class ReplicationBacklog {
+public:
+    struct Options {
+        uint64_t size = 1024 * 1024;
+        // Full resyncs write their snapshot next to this path
+        std::string snapshot_path;
+    };
+
+    ReplicationBacklog(Options options, SnapshotFile::ForEachStream for_each);
+    // Drops every replica
+    ~ReplicationBacklog();
+
+    ReplicationBacklog(const ReplicationBacklog&) = delete;
+    ReplicationBacklog& operator=(const ReplicationBacklog&) = delete;
+
+    void append(const AppendLog::Command& command);
+
+    // Answer PSYNC <replid> <offset> on `fd`, which the backlog owns from
+    // now on, and keep the replica fed. `pending` is output still owed to
+    // the client and goes first.
+    void attach(int fd, std::string_view replid, std::string_view offset, std::string pending);
+    void stop();
+
+    struct ReplicaInfo {
+        std::string address;
+        const char* state;          // "wait_bgsave", "send_bulk" or "online"
+        uint64_t offset;            // acknowledged
+        std::time_t last_ack;
+    };
+    struct Stats {
+        std::string replid;
+        uint64_t offset;            // end of the stream
+        uint64_t first_offset;      // oldest byte still held
+        uint64_t size;
+        uint64_t full_syncs;
+        uint64_t partial_syncs;
+        uint64_t partial_sync_errors;
+        std::vector<ReplicaInfo> replicas;
+    };
+    Stats stats() const;
+
+private:
+    enum class ReplicaState { WaitSnapshot, SendSnapshot, Online, Done };
+
+    struct Replica {
+        int fd;
+        std::string address;
+        std::thread thread;
+        std::atomic<ReplicaState> state;
+        std::atomic<uint64_t> acked;
+        std::atomic<std::time_t> last_ack;
+    };
+
+    void serve(Replica& replica, bool full, uint64_t offset, std::string pending);
+    // Send a snapshot taken now; returns the offset it started at
+    bool send_snapshot(Replica& replica, uint64_t& offset);
+    bool read_acks(Replica& replica, std::string& input);
+    void reap();
+
+    Options options_;
+    SnapshotFile::ForEachStream for_each_;
+    std::string replid_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::string buffer_;            // stream bytes from first_offset_ on
+    uint64_t first_offset_;
+    bool stopping_;
+    uint64_t full_syncs_;
+    uint64_t partial_syncs_;
+    uint64_t partial_sync_errors_;
+    uint64_t next_snapshot_;
+    std::list<std::unique_ptr<Replica>> replicas_;
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Growable output buffer that RESP replies are encoded straight into.
+//
+// Each connection keeps one and reuses it across batches, so encoding a
+// reply normally costs no allocation at all; a large reply grows the buffer
+// geometrically. Integers and lengths are formatted in place.
+class ReplyBuffer {
+public:
+    ReplyBuffer();
+
+    ReplyBuffer(ReplyBuffer&& other) noexcept;
+    ReplyBuffer& operator=(ReplyBuffer&& other) noexcept;
+    ReplyBuffer(const ReplyBuffer&) = delete;
+    ReplyBuffer& operator=(const ReplyBuffer&) = delete;
+
+    // RESP primitives
+    void append_simple_string(std::string_view str);
+    void append_error(std::string_view error);
+    void append_integer(int64_t value);
+    void append_bulk_string(std::string_view str);
+    void append_null_bulk_string() { append_raw("$-1\r\n"); }
+    void append_array_header(size_t count) { append_header('*', count); }
+    void append_null_array() { append_raw("*-1\r\n"); }
+
+    // "$<len>\r\n" or "*<len>\r\n"-style header without payload
+    void append_header(char type, uint64_t length);
+    void append_raw(std::string_view bytes);
+    // Same header placed at `position`, moving what follows; for aggregates
+    // whose length is only known once their elements are encoded
+    void insert_header(size_t position, char type, uint64_t length);
+
+    // Make room for `bytes` more and return where they go; commit() them after
+    char* reserve(size_t bytes);
+    void commit(size_t bytes) { size_ += bytes; }
+
+    const char* data() const { return data_.get(); }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    size_t capacity() const { return capacity_; }
+    std::string_view view() const { return std::string_view(data_.get(), size_); }
+    std::string str() const { return std::string(data_.get(), size_); }
+
+    // Drop content beyond `size`, keeping the allocation for reuse
+    void truncate(size_t size) { size_ = size < size_ ? size : size_; }
+    void clear() { size_ = 0; }
+    // Give back memory after an unusually large reply
+    void release();
+
+    // Decimal digits, written to `out` (at least 20 bytes); returns the count
+    static size_t format_uint(uint64_t value, char* out);
+
+private:
+    void grow(size_t min_capacity);
+
+    std::unique_ptr<char[]> data_;
+    size_t size_;
+    size_t capacity_;
+};
+
+inline char* ReplyBuffer::reserve(size_t bytes) {
+    if (size_ + bytes > capacity_) {
+        grow(size_ + bytes);
+    }
+    return data_.get() + size_;
+}
+
+inline void ReplyBuffer::append_raw(std::string_view bytes) {
+    char* out = reserve(bytes.size());
+    std::memcpy(out, bytes.data(), bytes.size());
+    size_ += bytes.size();
+}
+
+inline void ReplyBuffer::append_header(char type, uint64_t length) {
+    char* out = reserve(24);
+    out[0] = type;
+    size_t n = 1 + format_uint(length, out + 1);
+    out[n++] = '\r';
+    out[n++] = '\n';
+    size_ += n;
+}
+
+inline void ReplyBuffer::append_bulk_string(std::string_view str) {
+    char* out = reserve(str.size() + 26);
+    out[0] = '$';
+    size_t n = 1 + format_uint(str.size(), out + 1);
+    out[n++] = '\r';
+    out[n++] = '\n';
+    std::memcpy(out + n, str.data(), str.size());
+    n += str.size();
+    out[n++] = '\r';
+    out[n++] = '\n';
+    size_ += n;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Incremental RESP request parser.
+//
+// Parsing state survives across reads, so a command split over many TCP
+// segments is scanned once rather than re-parsed from the start on every
+// recv(). Completed arguments are string_views into the caller's buffer and
+// lengths are decoded in place. Running out of bytes is a normal result,
+// not an exception.
+class RespParser {
+public:
+    enum class Result {
+        Complete,    // args() holds the next command
+        Incomplete,  // need more bytes
+        Error        // protocol violation, see error()
+    };
+
+    RespParser();
+
+    // Continue scanning `buffer` where the previous call stopped. The views
+    // in args() stay valid until the buffer is modified.
+    Result parse(std::string_view buffer);
+
+    const std::vector<std::string_view>& args() const { return args_; }
+    const std::string& error() const { return error_; }
+
+    // Bytes at the front of the buffer that belong to completed commands
+    size_t consumed() const { return command_start_; }
+
+    // The caller dropped `bytes` (at most consumed()) from the buffer front
+    void discard(size_t bytes);
+
+    // Give back the command parse() just completed; the next call returns
+    // it again. Only valid before the buffer is modified.
+    void unparse();
+
+    // Optionally signed decimal integer; false if malformed or out of range
+    static bool parse_int64(std::string_view text, int64_t& value);
+
+private:
+    enum class State {
+        CommandStart,
+        BulkHeader,
+        BulkData
+    };
+
+    Result parse_inline(std::string_view buffer);
+    Result complete(std::string_view buffer);
+    Result fail(std::string message);
+
+    State state_;
+    size_t command_start_;
+    size_t last_start_;      // where the command last completed began
+    size_t pos_;
+    int64_t args_expected_;
+    int64_t bulk_length_;
+
+    // (offset, length) of each argument, turned into views once complete
+    std::vector<std::pair<size_t, size_t>> spans_;
+    std::vector<std::string_view> args_;
+    std::string error_;
+};
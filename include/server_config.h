@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "append_log.h"
+
+// Runtime options, filled from the command line:
+//   redis_streams_service [port] [--option value ...]
+struct ServerConfig {
+    int port = 6379;
+    int tcp_backlog = 511;      // listen() backlog
+    int io_threads = 0;         // event loop threads, 0 = one per core
+    int shards = 0;             // keyspace shard workers, 0 = unsharded
+
+    // What writes do once stream data reaches maxmemory: fail with an OOM
+    // error, or first evict the oldest entries of streams capped by XADD
+    enum class MaxMemoryPolicy { NoEviction, TrimCapped };
+    uint64_t maxmemory = 0;     // bytes, 0 = no limit
+    MaxMemoryPolicy maxmemory_policy = MaxMemoryPolicy::NoEviction;
+
+    // Append-only log; see AppendLog
+    bool appendonly = false;
+    std::string appendfilename = "appendonly.aof";
+    AppendLog::FsyncPolicy appendfsync = AppendLog::FsyncPolicy::EverySec;
+    int auto_aof_rewrite_percentage = 100;        // 0 = no automatic rewrites
+    uint64_t auto_aof_rewrite_min_size = 64 * 1024 * 1024;
+
+    // Binary snapshot written by SAVE/BGSAVE and loaded on startup when the
+    // append-only log is off; see SnapshotFile
+    std::string dbfilename = "dump.snap";
+
+    // Tiering: heap a stream's blocks may hold before the oldest move to
+    // memory-mapped segment files in tier_dir; see TieredStorage
+    uint64_t stream_hot_memory = 0;     // bytes, 0 = all in memory
+    std::string tier_dir = ".";
+
+    // Replication. A replica follows the primary at replicaof_host:port and
+    // refuses writes from its clients; a primary accepts replicas only with
+    // a backlog. See ReplicationBacklog and ReplicaLink.
+    std::string replicaof_host;
+    int replicaof_port = 0;
+    uint64_t repl_backlog_size = 0;     // bytes, 0 = no replicas
+
+    // SLOWLOG: commands running at least this long are logged, keeping the
+    // newest slowlog_max_len; see SlowLog
+    int64_t slowlog_log_slower_than = 10000;    // microseconds, negative = never
+    int slowlog_max_len = 128;
+
+    static ServerConfig from_args(int argc, char* argv[]);
+    static std::string usage();
+};
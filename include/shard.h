@@ -0,0 +1,67 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "stream_directory.h"
+
+// A shard worker owns a disjoint slice of the keyspace: every command on its
+// keys runs on the shard's thread, handed over by the I/O threads through
+// submit(). Commands therefore never race each other, but background work
+// still reaches the shard's streams from other threads, so the directory's
+// stripe locks and the stream's own locks stay in force:
+//
+// - The tiering thread spills cold blocks (Stream::spill). It writes them
+//   out under an epoch guard alone and takes the writer lock for the swap.
+// - BGSAVE, AOF rewrites and the snapshots of replica full resyncs walk
+//   every shard's directory from their own threads, each stripe under its
+//   lock. SAVE does the same from an I/O thread. Snapshots take the stream's
+//   writer and group locks (Stream::snapshot), while log rewrites read
+//   entries under a ReadGuard and groups under the group's own locks.
+// - A replica's load_replica_snapshot() runs on the replication link thread.
+//   Once the records queued before the resync have drained, it erases and
+//   refills the directories under their stripe locks while the shards go on
+//   serving reads.
+//
+// A shard thread only waits on these, and only on the streams they touch.
+class Shard {
+public:
+    using Task = std::function<void()>;
+
+    Shard(size_t index, int cpu);
+    ~Shard();
+
+    Shard(const Shard&) = delete;
+    Shard& operator=(const Shard&) = delete;
+
+    void start();
+    void stop();
+
+    // Queue a task for the shard thread. Safe to call from any thread.
+    void submit(Task task);
+
+    size_t index() const { return index_; }
+    StreamDirectory& streams() { return streams_; }
+
+    // Shard owning the calling thread, or nullptr outside shard workers
+    static Shard* current();
+
+private:
+    void run();
+
+    size_t index_;
+    int cpu_;
+    std::thread thread_;
+
+    std::mutex queue_mutex_;
+    std::condition_variable queue_cv_;
+    std::vector<Task> queue_;
+    bool stopping_;
+
+    StreamDirectory streams_;
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Commands that took at least a threshold to run, newest first, keeping at
+// most max_len of them (SLOWLOG).
+//
+// Arguments are stored truncated as Redis does: at most 32 of them, each
+// at most 128 bytes, with a note of what was left out. Only commands over
+// the threshold ever take the lock.
+class SlowLog {
+public:
+    struct Entry {
+        uint64_t id;
+        int64_t time;               // unix seconds when it was logged
+        uint64_t duration_us;
+        std::vector<std::string> args;
+        std::string client;         // peer address, empty for replayed commands
+    };
+
+    // A negative threshold logs nothing, zero logs every command
+    SlowLog(int64_t threshold_us, size_t max_len);
+
+    bool slow(uint64_t duration_us) const {
+        return threshold_us_ >= 0 && duration_us >= static_cast<uint64_t>(threshold_us_);
+    }
+    void add(const std::vector<std::string_view>& args, uint64_t duration_us, std::string_view client);
+
+    // The `count` newest entries
+    std::vector<Entry> get(size_t count) const;
+    size_t length() const;
+    void reset();
+
+private:
+    const int64_t threshold_us_;
+    const size_t max_len_;
+
+    mutable std::mutex mutex_;
+    std::deque<Entry> entries_;     // newest first
+    uint64_t next_id_;
+};
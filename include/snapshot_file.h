@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "stream.h"
+
+// Binary point-in-time snapshots of every stream (SAVE/BGSAVE), loaded on
+// startup.
+//
+// Each stream is saved as of one instant without stopping writers for
+// longer than it takes to note its block list: blocks only ever grow at the
+// tail, so the snapshot shares them and copies just their entry counts and
+// delete flags, while an Epoch::Guard keeps blocks trimmed meanwhile alive.
+// Streams are captured one after the other, not all at the same instant.
+//
+// Layout, integers in host byte order:
+//   "RSSNAP01"
+//   one section per stream (see snapshot_file.cpp), each ending in a checksum
+//   table: (offset, length) per section
+//   section count | table offset | "RSSNAPTB"
+// Blocks are written in their in-memory encoding, so loading copies them
+// back instead of re-encoding entries, and the table at the end lets the
+// loader map the file and rebuild streams on every core at once.
+class SnapshotFile {
+public:
+    using StreamVisitor = std::function<void(const std::string& name, const std::shared_ptr<Stream>& stream)>;
+    // Calls its argument on every stream
+    using ForEachStream = std::function<void(const StreamVisitor& visit)>;
+    // Returns the empty stream a saved one is loaded into
+    using CreateStream = std::function<std::shared_ptr<Stream>(const std::string& name)>;
+
+    struct SaveStats {
+        uint64_t streams = 0;
+        uint64_t entries = 0;
+        uint64_t bytes = 0;
+        uint64_t ms = 0;
+    };
+    struct LoadStats {
+        uint64_t streams = 0;
+        uint64_t entries = 0;
+        uint64_t bytes = 0;
+        uint64_t ms = 0;
+        unsigned threads = 0;
+    };
+
+    SnapshotFile(std::string path, ForEachStream for_each);
+    // Waits for a background save to finish
+    ~SnapshotFile();
+
+    SnapshotFile(const SnapshotFile&) = delete;
+    SnapshotFile& operator=(const SnapshotFile&) = delete;
+
+    // SAVE: write the snapshot on the calling thread. Throws if that fails
+    // or a save is already running.
+    SaveStats save();
+    // BGSAVE: false if a save is already running
+    bool background_save();
+    // Wait for a background save to end
+    void wait();
+
+    // Load the file into streams made by `create`, on all cores. Returns
+    // false if there is no file; throws if it is damaged.
+    bool load(const CreateStream& create);
+
+    struct Status {
+        bool saving;
+        bool last_save_ok;
+        uint64_t saves;
+        std::time_t last_save_time;
+        SaveStats last_save;
+        LoadStats last_load;
+    };
+    Status status() const;
+
+private:
+    SaveStats write_file();
+    void finish_save(bool ok, const SaveStats& stats);
+
+    std::string path_;
+    ForEachStream for_each_;
+    std::atomic<bool> saving_;
+    std::mutex saver_mutex_;
+    std::thread saver_;
+
+    mutable std::mutex mutex_;
+    bool last_save_ok_;
+    uint64_t saves_;
+    std::time_t last_save_time_;
+    SaveStats last_save_;
+    LoadStats last_load_;
+};
@@ -1,55 +1,154 @@
 #pragma once
 
-#include <map>
 #include <vector>
+#include <atomic>
+#include <functional>
 #include <memory>
 #include <mutex>
-#include <condition_variable>
 #include <unordered_map>
+#include "epoch.h"
 #include "stream_entry.h"
+#include "stream_storage.h"
 #include "consumer_group.h"
 
+class BlockedRead;
+
+// Trimming requested by XADD or XTRIM: MAXLEN keeps at most `max_len`
+// entries, MINID drops those below `min_id`. Approximate (`~`) trims stop
+// at block boundaries and evict at most `limit` entries (0: no limit).
+struct StreamTrim {
+    enum class Strategy { None, MaxLen, MinId };
+    
+    Strategy strategy = Strategy::None;
+    bool approximate = false;
+    uint64_t max_len = 0;
+    StreamID min_id;
+    size_t limit = 0;
+};
+
 class Stream {
 public:
     Stream();
     ~Stream();
     
-    // Basic stream operations
-    StreamID add_entry(const StreamID& id, const std::vector<std::pair<std::string, std::string>>& fields);
+    // Basic stream operations. Unless `exact_id` is set, a 0-0 ID takes the
+    // current time and an ID with sequence 0 the next sequence free for its
+    // millisecond, which is how XADD's "*" and "<ms>-*" arrive.
+    StreamID add_entry(const StreamID& id, const FieldViews& fields, const StreamTrim& trim = StreamTrim(),
+                       bool exact_id = false);
+    // XADDBATCH: appends every entry under one lock, with IDs from `id` (as
+    // resolved above) on up in consecutive sequence numbers, then trims and
+    // wakes blocked readers once. Returns the first ID; a bad ID adds none.
+    StreamID add_entries(const StreamID& id, const std::vector<FieldViews>& entries,
+                         const StreamTrim& trim = StreamTrim(), bool exact_id = false);
     std::vector<StreamEntry> get_range(const StreamID& start, const StreamID& end, int count = -1) const;
     std::vector<StreamEntry> get_entries_after(const StreamID& id, int count = -1) const;
     bool delete_entries(const std::vector<StreamID>& ids);
+    // Returns the number of entries evicted
+    size_t trim(const StreamTrim& trim);
     size_t length() const;
     
+    // Memory: bytes held by the stream, its entries and its consumer
+    // groups, from counters kept up to date as they change
+    size_t memory_usage() const;
+    // Whether XADD has ever capped the stream with MAXLEN/MINID, which opts
+    // it in to losing its oldest entries under maxmemory
+    bool capped() const { return capped_.load(std::memory_order_relaxed); }
+    // Evict the oldest block of entries to make room; returns the count
+    size_t evict_oldest();
+    
+    // Direct access to the packed entries, e.g. to encode replies without
+    // copying them out first. Reads take no lock: the guard pins the current
+    // epoch so blocks the writer unlinks meanwhile stay valid until it ends.
+    class ReadGuard {
+    public:
+        const StreamStorage& entries() const { return *entries_; }
+        
+    private:
+        friend class Stream;
+        explicit ReadGuard(const StreamStorage& entries) : entries_(&entries) {}
+        
+        Epoch::Guard epoch_;
+        const StreamStorage* entries_;
+    };
+    ReadGuard read() const;
+    
     // Consumer group operations
     bool create_consumer_group(const std::string& group_name, const StreamID& start_id);
     std::shared_ptr<ConsumerGroup> get_consumer_group(const std::string& group_name);
     bool delete_consumer_group(const std::string& group_name);
+    std::vector<std::pair<std::string, std::shared_ptr<ConsumerGroup>>> get_consumer_groups() const;
     
     // Get last entry ID
     StreamID get_last_id() const;
+    // XSETID: raise the last ID, so later entries must be above it; false
+    // if `id` is below the current one
+    bool advance_last_id(const StreamID& id);
     
-    // Blocking operations
-    void add_blocked_client(int client_socket, const StreamID& last_id);
-    void notify_blocked_clients();
+    // Snapshots (SAVE/BGSAVE): the stream and its groups as of one instant,
+    // taken under their locks. Entries are shared rather than copied, so use
+    // the result under an Epoch::Guard entered before the call.
+    struct Snapshot {
+        StreamID last_id;
+        bool capped;
+        StreamStorage::Snapshot entries;
+        std::vector<std::pair<std::string, ConsumerGroup::Snapshot>> groups;
+    };
+    Snapshot snapshot() const;
+    // Loading a snapshot into a stream no one else uses yet
+    void restore_block(StreamBlock::Ptr block);
+    void restore_state(const StreamID& last_id, bool capped);
+    
+    // Tiering: move the oldest blocks out of the heap until the hot ones
+    // hold about `hot_limit` bytes, writing at most about `max_bytes` of
+    // them per call. `write` stores the blocks somewhere readable, fills in
+    // where each one went and returns what keeps that memory alive, or null
+    // on failure. It runs without the writer lock; only the swap takes it.
+    // Returns the number of blocks moved.
+    using SpillWriter = std::function<std::shared_ptr<const void>(const std::vector<const StreamBlock*>& blocks,
+                                                                  std::vector<const uint8_t*>& bytes)>;
+    size_t spill(size_t hot_limit, size_t max_bytes, const SpillWriter& write);
+    size_t hot_memory() const { return entries_.hot_memory(); }
+    
+    // Blocking operations: readers parked until an entry past `after` arrives
+    void add_waiter(const std::shared_ptr<BlockedRead>& waiter, const StreamID& after);
+    void remove_waiter(const BlockedRead* waiter);
     
 private:
-    mutable std::mutex entries_mutex_;
+    // Serializes writers (XADD/XDEL); readers never take it
+    mutable std::mutex write_mutex_;
     mutable std::mutex groups_mutex_;
-    mutable std::mutex blocked_clients_mutex_;
+    mutable std::mutex waiters_mutex_;
     
-    // Entries stored in chronological order
-    std::map<StreamID, StreamEntry> entries_;
+    // Entries stored in chronological order, packed into blocks
+    StreamStorage entries_;
     
     // Consumer groups
     std::unordered_map<std::string, std::shared_ptr<ConsumerGroup>> consumer_groups_;
     
-    // Blocked clients waiting for new entries
-    struct BlockedClient {
-        int socket;
-        StreamID last_id;
+    // Requires write_mutex_
+    size_t apply_trim(const StreamTrim& trim);
+    // The ID an entry added as `id` gets (see add_entry); requires write_mutex_
+    StreamID next_id(const StreamID& id, bool exact_id) const;
+    
+    // Wake the waiters an entry with this ID satisfies
+    void notify_waiters(const StreamID& id);
+    
+    // Blocked readers waiting for new entries, in arrival order. The count
+    // lets XADD skip the lock when nobody is waiting.
+    struct Waiter {
+        std::shared_ptr<BlockedRead> read;
+        StreamID after;
     };
-    std::vector<BlockedClient> blocked_clients_;
+    std::vector<Waiter> waiters_;
+    std::atomic<size_t> waiter_count_;
+    
+    std::atomic<bool> capped_;
     
-    StreamID last_id_;
+    // Last ID ever added, readable without the writer lock. A seqlock: the
+    // version is odd while the writer is updating the two halves.
+    void set_last_id(const StreamID& id);
+    std::atomic<uint64_t> last_id_version_;
+    std::atomic<uint64_t> last_id_ms_;
+    std::atomic<uint64_t> last_id_seq_;
 };
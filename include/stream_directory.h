@@ -0,0 +1,50 @@
+#pragma once
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "stream.h"
+
+// Name -> stream map shared by all command handlers.
+//
+// The map is split into stripes by key hash, each behind its own
+// reader/writer lock, and a lock is only held for the lookup itself.
+// Handlers get a shared_ptr back and work on the stream under the
+// stream's own locks, so a long read of one stream never holds up
+// commands on another.
+class StreamDirectory {
+public:
+    StreamDirectory() = default;
+
+    StreamDirectory(const StreamDirectory&) = delete;
+    StreamDirectory& operator=(const StreamDirectory&) = delete;
+
+    // nullptr when no such stream exists
+    std::shared_ptr<Stream> find(std::string_view name) const;
+    std::shared_ptr<Stream> find_or_create(std::string_view name);
+    bool erase(std::string_view name);
+
+    size_t size() const;
+
+    // Call `visit` on every stream. Each stripe is copied under its lock and
+    // visited after, so `visit` may take as long as it likes.
+    void for_each(const std::function<void(const std::string& name, const std::shared_ptr<Stream>& stream)>& visit) const;
+
+private:
+    static constexpr size_t kStripes = 64;
+
+    // Stripes sit on separate cache lines so their locks don't false-share
+    struct alignas(64) Stripe {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<Stream>> streams;
+    };
+
+    Stripe& stripe_for(std::string_view name);
+    const Stripe& stripe_for(std::string_view name) const;
+
+    std::array<Stripe, kStripes> stripes_;
+};
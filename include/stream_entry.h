@@ -1,9 +1,11 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
-#include <unordered_map>
+#include <utility>
 #include <cstdint>
+#include "reply_buffer.h"
 
 struct StreamID {
     uint64_t timestamp_ms;
@@ -12,8 +14,14 @@ struct StreamID {
     StreamID() : timestamp_ms(0), sequence(0) {}
     StreamID(uint64_t ts, uint64_t seq) : timestamp_ms(ts), sequence(seq) {}
     
+    // Longest "<ms>-<seq>" text, both parts being 20-digit numbers
+    static constexpr size_t kMaxStringLength = 41;
+    
     std::string to_string() const;
-    static StreamID from_string(const std::string& id_str);
+    // Writes "<ms>-<seq>" into `out` (kMaxStringLength bytes), returns the length
+    size_t format(char* out) const;
+    // "<ms>-<seq>", "<ms>-*" or "*"; throws std::invalid_argument otherwise
+    static StreamID from_string(std::string_view id_str);
     static StreamID generate_auto();
     
     bool operator<(const StreamID& other) const;
@@ -24,16 +32,21 @@ struct StreamID {
     bool operator!=(const StreamID& other) const;
 };
 
+// Field-value pairs viewed in place, as XADD hands them to storage
+using FieldViews = std::vector<std::pair<std::string_view, std::string_view>>;
+
 class StreamEntry {
 public:
     StreamEntry(const StreamID& id, const std::vector<std::pair<std::string, std::string>>& fields);
     
     const StreamID& get_id() const { return id_; }
-    const std::unordered_map<std::string, std::string>& get_fields() const { return fields_; }
+    // Field-value pairs in the order they were added
+    const std::vector<std::pair<std::string, std::string>>& get_fields() const { return fields_; }
     
     std::string to_resp_format() const;
+    void write_resp(ReplyBuffer& out) const;
     
 private:
     StreamID id_;
-    std::unordered_map<std::string, std::string> fields_;
+    std::vector<std::pair<std::string, std::string>> fields_;
 };
@@ -0,0 +1,274 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "stream_entry.h"
+
+// One decoded entry. The views point into block memory and stay valid while
+// the storage is not modified.
+struct StreamEntryView {
+    StreamID id;
+    std::vector<std::pair<std::string_view, std::string_view>> fields;
+
+    StreamEntry to_entry() const;
+};
+
+// A run of consecutive entries packed into one contiguous buffer.
+//
+// The buffer starts with the master field names, taken from the block's
+// first entry:
+//   name count | (name len, name)*
+// followed by the entries, each encoded as
+//   flags | ms delta | seq | field count | (name len, name, value len, value)*
+// or, when an entry has exactly the master field names in the same order
+// (the same-fields flag),
+//   flags | ms delta | seq | (value len, value)*
+// with all numbers as varints. Streams mostly carry one schema, so most
+// entries store values only. The ms delta is relative to the block's
+// master (first) ID; the sequence is relative to the master sequence when
+// both share a millisecond and absolute otherwise. Deleted entries keep
+// their bytes and only get a flag set, as in Redis.
+//
+// Blocks support one writer and any number of concurrent readers without
+// locks: the writer fills in an entry and then publishes the new count with
+// release semantics, so a reader that loads the count with acquire sees
+// every entry below it fully written. Delete flags live in a separate
+// array of atomics since the writer flips them after publication.
+class StreamBlock {
+public:
+    // A block closes once it holds this many bytes or entries
+    static constexpr size_t kTargetBytes = 4096;
+    static constexpr size_t kMaxEntries = 128;
+
+    // A block shares one allocation from BlockAllocator with its entry
+    // slots and, while hot, its encoding, so blocks are made by these and
+    // freed with destroy() (or Ptr) rather than new and delete.
+    struct Deleter {
+        void operator()(const StreamBlock* block) const { destroy(block); }
+    };
+    using Ptr = std::unique_ptr<StreamBlock, Deleter>;
+
+    // Empty block with room for `capacity` bytes of encoding
+    static Ptr create(const StreamID& master_id, const FieldViews& master_fields, size_t capacity);
+    // Rebuild a block from the parts a snapshot saved: `count` entries
+    // encoded in `data` at `offsets`. Throws std::invalid_argument if the
+    // parts do not describe a well-formed block.
+    static Ptr restore(const StreamID& master_id, const uint8_t* data, size_t size, const uint32_t* offsets,
+                       const uint8_t* deleted, size_t count);
+    // Cold copy of a closed block whose encoding now lives at `bytes`, in
+    // memory that `backing` keeps alive (a mapped segment file). Only the
+    // entry offsets and delete flags stay on the heap. Writer side.
+    static Ptr make_cold(const StreamBlock& hot, const uint8_t* bytes, std::shared_ptr<const void> backing);
+    static void destroy(const StreamBlock* block);
+
+    StreamBlock(const StreamBlock&) = delete;
+    StreamBlock& operator=(const StreamBlock&) = delete;
+
+    const StreamID& master_id() const { return master_id_; }
+    size_t entry_count() const { return count_.load(std::memory_order_acquire); }
+    size_t live_count() const { return live_count_.load(std::memory_order_relaxed); }
+    // Bytes of its allocation; for a cold block that leaves out the encoding
+    size_t memory_usage() const { return allocation_; }
+    bool cold() const { return !data_; }
+
+    // Bytes a new block needs for its master field names plus the first entry
+    static size_t initial_size(const FieldViews& master_fields);
+    // Bytes the entry would take when appended to this block
+    size_t encoded_size(const StreamID& id, const FieldViews& fields) const;
+    bool has_room(size_t bytes) const;
+    void append(const StreamID& id, const FieldViews& fields);
+
+    // Readers: `index` must be below a count returned by entry_count()
+    StreamID id_at(size_t index) const;
+    bool is_deleted(size_t index) const { return deleted_[index].load(std::memory_order_acquire) != 0; }
+    void decode(size_t index, StreamEntryView& view) const;
+
+    // Writer only
+    bool mark_deleted(size_t index);
+
+    // The encoding itself, for snapshots. raw_size() covers the entries
+    // written so far; read it under the writer's lock.
+    const uint8_t* raw_data() const { return bytes_; }
+    size_t raw_size() const { return size_; }
+    const uint32_t* raw_offsets() const { return offsets_; }
+
+    // Index of the first entry (deleted or not) with an ID >= id
+    size_t lower_bound(const StreamID& id) const;
+
+private:
+    // Lays out the parts after the object itself, in `allocation` bytes
+    StreamBlock(const StreamID& master_id, size_t names, size_t slots, size_t capacity, size_t allocation);
+    ~StreamBlock() = default;
+    static Ptr allocate(const StreamID& master_id, size_t names, size_t slots, size_t capacity);
+
+    bool has_master_fields(const FieldViews& fields) const;
+
+    StreamID master_id_;
+    size_t allocation_;
+    // The encoding: in the allocation while the block is hot, elsewhere
+    // once spilled
+    uint8_t* data_;
+    const uint8_t* bytes_;
+    std::shared_ptr<const void> backing_;
+    size_t capacity_;
+    size_t size_;
+    // Entry slots: kMaxEntries, or just the count once cold
+    size_t slots_;
+    uint32_t* offsets_;
+    std::atomic<uint8_t>* deleted_;
+    std::atomic<uint32_t> count_;
+    std::atomic<uint32_t> live_count_;
+    // Views of the names stored at the start of the encoding
+    size_t master_count_;
+    std::string_view* master_fields_;
+};
+
+// Entry storage for one stream: packed blocks kept in ID order.
+//
+// IDs only ever grow, so blocks are appended at the back and the block list
+// is itself sorted by master ID. Binary search over it is the lookup a
+// B+-tree would do, without inner nodes to maintain.
+//
+// One writer at a time (the caller serializes append/remove/trim) runs
+// concurrently with any number of lock-free readers. Readers must hold an
+// Epoch::Guard while they use iterators: the block list is an immutable
+// snapshot that the writer replaces, retiring the old one through Epoch,
+// when it grows or loses a block in the middle; appends into the current
+// snapshot are published by its atomic count, and blocks trimmed off the
+// front by its atomic start.
+class StreamStorage {
+    struct BlockIndex;
+
+public:
+    // Forward cursor over live entries
+    class Iterator {
+    public:
+        bool valid() const { return index_ && block_ < count_; }
+        StreamID id() const { return block().id_at(entry_); }
+        void decode(StreamEntryView& view) const { block().decode(entry_, view); }
+        void next();
+
+    private:
+        friend class StreamStorage;
+        Iterator(const BlockIndex* index, size_t block, size_t entry);
+        const StreamBlock& block() const;
+        void skip_deleted();
+
+        const BlockIndex* index_;
+        size_t count_;
+        size_t block_;
+        size_t entry_;
+        size_t block_entries_;
+    };
+
+    StreamStorage();
+    ~StreamStorage();
+
+    StreamStorage(const StreamStorage&) = delete;
+    StreamStorage& operator=(const StreamStorage&) = delete;
+
+    // Writer side. `id` must be greater than every ID already stored;
+    // append() throws std::invalid_argument otherwise.
+    void append(const StreamID& id, const FieldViews& fields);
+    bool remove(const StreamID& id);
+
+    // Front trimming: evict the oldest entries until at most `max_len` are
+    // left, or until none is below `min_id`, evicting no more than `limit`
+    // (0 for no limit). Approximate trims only drop whole blocks, which is
+    // O(1) per block and may leave a few extra entries; exact ones then
+    // delete single entries from the new first block. Returns the count.
+    size_t trim_to_length(size_t max_len, bool approximate, size_t limit = 0);
+    size_t trim_before(const StreamID& min_id, bool approximate, size_t limit = 0);
+    // Evict the oldest block whole, unless it is the only one; returns the
+    // live entries it held
+    size_t trim_front_block();
+
+    // Point-in-time view for snapshots. Blocks are shared, not copied: what
+    // the writer may still change in them (entry count, encoded size and
+    // delete flags) is copied instead. Take it under the writer's lock and
+    // read it under an Epoch::Guard entered before, so trimmed blocks stay.
+    struct Snapshot {
+        struct Block {
+            const StreamBlock* block;
+            size_t count;
+            size_t size;
+            std::vector<uint8_t> deleted;
+        };
+        std::vector<Block> blocks;
+    };
+    Snapshot snapshot() const;
+    // Loading: add a block rebuilt from a snapshot after the others. Its
+    // IDs must be above every ID already stored.
+    void append_block(StreamBlock::Ptr block);
+
+    // Tiering. Reader side, under an Epoch::Guard: the oldest hot blocks to
+    // spill for the heap held by hot blocks to drop to `hot_limit`, with at
+    // most about `max_bytes` of encoding between them. The tail block is
+    // never picked.
+    std::vector<const StreamBlock*> spill_candidates(size_t hot_limit, size_t max_bytes) const;
+    // Writer side: swap in cold copies of `blocks`, whose encodings now sit
+    // at `bytes` inside `backing`, skipping blocks gone since they were
+    // picked. Returns the number swapped.
+    size_t make_cold(const std::vector<const StreamBlock*>& blocks, const std::vector<const uint8_t*>& bytes,
+                     const std::shared_ptr<const void>& backing);
+
+    // Reader side, under an Epoch::Guard
+    Iterator begin() const;
+    Iterator lower_bound(const StreamID& id) const;   // first live entry >= id
+    Iterator upper_bound(const StreamID& id) const;   // first live entry > id
+
+    size_t size() const { return live_entries_.load(std::memory_order_relaxed); }
+    bool empty() const { return size() == 0; }
+    size_t block_count() const;
+    // Bytes held by the blocks and the block list, kept up to date as
+    // blocks come and go, so this is O(1)
+    size_t memory_usage() const { return memory_usage_.load(std::memory_order_relaxed); }
+    // The part of it held by hot blocks and the block list
+    size_t hot_memory() const;
+
+private:
+    // Snapshot of the block list. The writer fills slot `count` and then
+    // bumps it. Trimming bumps `first`; the slots below it hold retired
+    // blocks that only readers which loaded an older `first` may still be
+    // walking. Load `first` before `count`. Slots in [first, count) only
+    // change when tiering swaps a block for its cold copy, which reads the
+    // same either way.
+    struct BlockIndex {
+        explicit BlockIndex(size_t capacity);
+
+        StreamBlock* at(size_t i) const { return blocks[i].load(std::memory_order_acquire); }
+        void set(size_t i, StreamBlock* block) { blocks[i].store(block, std::memory_order_release); }
+        // Slots [begin, end) of `from` into this index from slot `to` on
+        void copy(const BlockIndex& from, size_t begin, size_t end, size_t to);
+
+        size_t capacity;
+        std::atomic<size_t> first;
+        std::atomic<size_t> count;
+        std::unique_ptr<std::atomic<StreamBlock*>[]> blocks;
+    };
+
+    // Block that would hold `id`: the last one in [first, count) whose
+    // master ID is <= id, or `first`
+    static size_t find_block(const BlockIndex& index, size_t first, size_t count, const StreamID& id);
+    // Retire the oldest block along with its entries
+    void drop_front_block();
+    // Publish `next` in place of the current index and retire the old one
+    void replace_index(BlockIndex* next);
+
+    // Memory accounting, mirrored into MemoryTracker
+    static size_t index_bytes(size_t capacity);
+    void charge(size_t bytes);
+    void release(size_t bytes);
+    void release_block(const StreamBlock& block);
+
+    std::atomic<BlockIndex*> index_;
+    std::atomic<size_t> live_entries_;
+    std::atomic<size_t> memory_usage_;
+    // Heap bytes of cold blocks, part of memory_usage_
+    std::atomic<size_t> cold_memory_;
+};
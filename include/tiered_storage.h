@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "stream.h"
+
+// Moves the old end of streams out of the heap into memory-mapped segment
+// files, keeping the hot tail in memory.
+//
+// A background thread looks over the streams a few times a second. For each
+// one whose hot blocks hold more than the per-stream limit, it writes the
+// oldest of them into a new segment file, maps the file and swaps each block
+// for a cold copy reading from the mapping (see Stream::spill). Appends only
+// wait for the swap, not for the file. Reads of cold ranges take no lock;
+// they are memory reads that may have to fault pages in from disk.
+//
+// Segment files are unlinked as soon as they are mapped: nothing in them is
+// needed after a restart, so they go away with the last block using them or
+// with the process.
+class TieredStorage {
+public:
+    struct Options {
+        std::string dir = ".";
+        uint64_t hot_bytes = 0;     // heap per stream held by its hot blocks
+    };
+
+    using StreamVisitor = std::function<void(const std::string& name, const std::shared_ptr<Stream>& stream)>;
+    using ForEachStream = std::function<void(const StreamVisitor& visit)>;
+
+    TieredStorage(Options options, ForEachStream for_each);
+    ~TieredStorage();
+
+    TieredStorage(const TieredStorage&) = delete;
+    TieredStorage& operator=(const TieredStorage&) = delete;
+
+    void start();
+    void stop();
+
+    struct Stats {
+        uint64_t segments;          // mapped now
+        uint64_t segment_bytes;
+        uint64_t spills;            // segments ever written
+        uint64_t spilled_blocks;
+        uint64_t spilled_bytes;
+    };
+    Stats stats() const;
+
+private:
+    void run();
+    // Write `blocks` into a new segment; null if that failed
+    std::shared_ptr<const void> write_segment(const std::vector<const StreamBlock*>& blocks,
+                                              std::vector<const uint8_t*>& bytes);
+
+    Options options_;
+    ForEachStream for_each_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_;
+    uint64_t next_segment_;
+
+    std::atomic<uint64_t> spills_;
+    std::atomic<uint64_t> spilled_blocks_;
+    std::atomic<uint64_t> spilled_bytes_;
+};
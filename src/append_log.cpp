@@ -0,0 +1,389 @@
+#include "append_log.h"
+#include "resp_parser.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t kReadChunk = 1024 * 1024;
+// The rewrite writes its dump out in pieces of about this size
+constexpr size_t kRewriteFlushBytes = 4 * 1024 * 1024;
+// It stops catching up with the tail outside the locks once a round
+// leaves less than this, or after this many rounds
+constexpr size_t kCatchUpBytes = 64 * 1024;
+constexpr int kCatchUpRounds = 8;
+
+// End offset of the last record the calling thread appended
+thread_local uint64_t last_appended = 0;
+
+void encode(ReplyBuffer& out, const AppendLog::Command& command) {
+    out.append_array_header(command.size());
+    for (const auto& arg : command) {
+        out.append_bulk_string(arg);
+    }
+}
+
+bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Make a rename within the file's directory durable
+void sync_directory(const std::string& path) {
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+} // namespace
+
+AppendLog::AppendLog(Options options, Dump dump)
+    : options_(std::move(options)), dump_(std::move(dump)), fd_(-1),
+      appended_(0), synced_(0), generation_(0), stopping_(false), capturing_(false),
+      file_size_(0), base_size_(0), rewriting_(false), last_rewrite_ok_(true), rewrites_(0) {
+}
+
+AppendLog::~AppendLog() {
+    stop();
+}
+
+size_t AppendLog::load(const std::function<void(const Command& command)>& apply) {
+    int fd = open(options_.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0; // Nothing logged yet
+        }
+        throw std::runtime_error("Cannot open append-only file " + options_.path + ": " + std::strerror(errno));
+    }
+
+    std::unique_ptr<char[]> chunk(new char[kReadChunk]);
+    std::string buffer;
+    RespParser parser;
+    uint64_t offset = 0; // of buffer[0] in the file
+    size_t commands = 0;
+
+    while (true) {
+        ssize_t n = read(fd, chunk.get(), kReadChunk);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int error = errno;
+            close(fd);
+            throw std::runtime_error("Error reading append-only file " + options_.path + ": " +
+                                     std::strerror(error));
+        }
+        if (n == 0) {
+            break;
+        }
+        buffer.append(chunk.get(), static_cast<size_t>(n));
+
+        RespParser::Result result = RespParser::Result::Incomplete;
+        // Records are always arrays; the parser would also take inline text
+        while (parser.consumed() < buffer.size() && buffer[parser.consumed()] == '*' &&
+               (result = parser.parse(buffer)) == RespParser::Result::Complete) {
+            apply(parser.args());
+            commands++;
+        }
+        if (result == RespParser::Result::Error ||
+            (parser.consumed() < buffer.size() && buffer[parser.consumed()] != '*')) {
+            close(fd);
+            throw std::runtime_error("Bad record in append-only file " + options_.path + " at offset " +
+                                     std::to_string(offset + parser.consumed()) +
+                                     (result == RespParser::Result::Error ? ": " + parser.error() : ""));
+        }
+
+        size_t consumed = parser.consumed();
+        buffer.erase(0, consumed);
+        parser.discard(consumed);
+        offset += consumed;
+    }
+    close(fd);
+
+    if (!buffer.empty()) {
+        std::cerr << "Append-only file " << options_.path << " ends in a partial record; truncating it to "
+                  << offset << " bytes" << std::endl;
+        if (truncate(options_.path.c_str(), static_cast<off_t>(offset)) != 0) {
+            throw std::runtime_error("Cannot truncate append-only file " + options_.path + ": " +
+                                     std::strerror(errno));
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    file_size_ = offset;
+    base_size_ = offset;
+    return commands;
+}
+
+void AppendLog::start() {
+    fd_ = open(options_.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        throw std::runtime_error("Cannot open append-only file " + options_.path + ": " + std::strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd_, &st) == 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        file_size_ = static_cast<uint64_t>(st.st_size);
+        base_size_ = file_size_;
+    }
+    writer_ = std::thread([this] { run_writer(); });
+}
+
+void AppendLog::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    writer_cv_.notify_one();
+    if (writer_.joinable()) {
+        writer_.join();
+    }
+    if (rewriter_.joinable()) {
+        rewriter_.join();
+    }
+    if (fd_ >= 0) {
+        fdatasync(fd_);
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+void AppendLog::append(const Command& command) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t start = pending_.size();
+    encode(pending_, command);
+    if (capturing_) {
+        rewrite_tail_.append_raw(pending_.view().substr(start));
+    }
+    appended_ += pending_.size() - start;
+    last_appended = appended_;
+
+    // The writer only sleeps once it has drained the buffer
+    if (start == 0) {
+        writer_cv_.notify_one();
+    }
+}
+
+void AppendLog::wait_durable() {
+    uint64_t target = last_appended;
+    if (options_.fsync != FsyncPolicy::Always || target == 0) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    durable_cv_.wait(lock, [this, target] { return synced_ >= target || stopping_; });
+}
+
+bool AppendLog::rewrite() {
+    bool expected = false;
+    if (!rewriting_.compare_exchange_strong(expected, true)) {
+        return false;
+    }
+    if (rewriter_.joinable()) {
+        rewriter_.join(); // The previous rewrite, already done
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+            rewriting_ = false;
+            return false;
+        }
+        capturing_ = true;
+        rewrite_tail_.clear();
+    }
+    rewriter_ = std::thread([this] { run_rewrite(); });
+    return true;
+}
+
+AppendLog::Stats AppendLog::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Stats{rewriting_.load(), last_rewrite_ok_, file_size_, base_size_, pending_.size(), rewrites_};
+}
+
+void AppendLog::run_writer() {
+    using Clock = std::chrono::steady_clock;
+    ReplyBuffer batch;
+    Clock::time_point last_sync = Clock::now();
+    bool unsynced = false;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        // Wake at least once a second so everysec syncs an idle log too
+        writer_cv_.wait_for(lock, std::chrono::seconds(1), [this] { return stopping_ || !pending_.empty(); });
+        bool last_round = stopping_ && pending_.empty();
+        std::swap(batch, pending_);
+        uint64_t end = appended_;
+        uint64_t generation = generation_;
+        lock.unlock();
+
+        bool synced = false;
+        {
+            std::lock_guard<std::mutex> io(io_mutex_);
+            if (generation != generation_) {
+                batch.clear(); // A rewrite already put these in the new file
+                unsynced = false;
+            }
+            while (!batch.empty() && !write_all(fd_, batch.data(), batch.size())) {
+                // Keep the records and try again; under `always` writers
+                // wait meanwhile, as they should
+                std::cerr << "Error writing append-only file " << options_.path << ": " << std::strerror(errno)
+                          << std::endl;
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
+            unsynced = unsynced || !batch.empty();
+
+            bool sync_due = options_.fsync == FsyncPolicy::Always ||
+                            (options_.fsync == FsyncPolicy::EverySec && Clock::now() - last_sync >= std::chrono::seconds(1)) ||
+                            last_round;
+            if (unsynced && sync_due) {
+                fdatasync(fd_);
+                last_sync = Clock::now();
+                unsynced = false;
+                synced = true;
+            }
+        }
+
+        lock.lock();
+        if (generation == generation_) {
+            file_size_ += batch.size();
+            if (synced) {
+                synced_ = end;
+                durable_cv_.notify_all();
+            }
+        }
+        batch.clear();
+        batch.release();
+
+        if (last_round) {
+            break;
+        }
+        if (rewrite_due()) {
+            lock.unlock();
+            rewrite();
+            lock.lock();
+        }
+    }
+}
+
+bool AppendLog::rewrite_due() const {
+    if (options_.rewrite_percentage == 0 || rewriting_.load() || stopping_ || file_size_ < options_.rewrite_min_size) {
+        return false;
+    }
+    uint64_t base = base_size_ > 0 ? base_size_ : 1;
+    return (file_size_ - std::min(file_size_, base)) * 100 / base >= options_.rewrite_percentage;
+}
+
+void AppendLog::run_rewrite() {
+    std::string temp_path = options_.path + ".rewrite";
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd >= 0;
+    uint64_t size = 0;
+
+    if (ok) {
+        ReplyBuffer out;
+        try {
+            dump_([&](const Command& command) {
+                encode(out, command);
+                if (out.size() >= kRewriteFlushBytes) {
+                    ok = ok && write_all(fd, out.data(), out.size());
+                    size += out.size();
+                    out.clear();
+                }
+            });
+        } catch (const std::exception& e) {
+            std::cerr << "Append-only file rewrite failed: " << e.what() << std::endl;
+            ok = false;
+        }
+        ok = ok && write_all(fd, out.data(), out.size());
+        size += out.size();
+        ok = ok && finish_rewrite(fd, temp_path, size);
+    }
+
+    if (!ok) {
+        std::cerr << "Append-only file rewrite failed; keeping " << options_.path << std::endl;
+        if (fd >= 0) {
+            close(fd);
+            unlink(temp_path.c_str());
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!ok) {
+        capturing_ = false;
+        rewrite_tail_.clear();
+        rewrite_tail_.release();
+    } else {
+        rewrites_++;
+    }
+    last_rewrite_ok_ = ok;
+    rewriting_ = false;
+}
+
+bool AppendLog::finish_rewrite(int fd, const std::string& temp_path, uint64_t& size) {
+    // Catch up with the records that arrived during the dump while the log
+    // stays open for appends, so little is left for the final step
+    for (int round = 0; round < kCatchUpRounds; round++) {
+        ReplyBuffer chunk;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::swap(chunk, rewrite_tail_);
+        }
+        if (!write_all(fd, chunk.data(), chunk.size())) {
+            return false;
+        }
+        size += chunk.size();
+        if (chunk.size() < kCatchUpBytes) {
+            break;
+        }
+    }
+    if (fdatasync(fd) != 0) {
+        return false;
+    }
+
+    // Appends pause from here until the new file takes over
+    std::lock_guard<std::mutex> io(io_mutex_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!write_all(fd, rewrite_tail_.data(), rewrite_tail_.size()) || fdatasync(fd) != 0 ||
+        rename(temp_path.c_str(), options_.path.c_str()) != 0) {
+        return false;
+    }
+    size += rewrite_tail_.size();
+    sync_directory(options_.path);
+
+    close(fd_);
+    fd_ = fd;
+    // Everything appended so far is in the new file and synced
+    pending_.clear();
+    generation_++;
+    synced_ = appended_;
+    file_size_ = size;
+    base_size_ = size;
+    capturing_ = false;
+    rewrite_tail_.clear();
+    rewrite_tail_.release();
+    durable_cv_.notify_all();
+    return true;
+}
@@ -0,0 +1,225 @@
+#include "block_allocator.h"
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t kSlabSize = 1024 * 1024;
+constexpr size_t kMinClass = 256;
+constexpr size_t kMaxClass = 128 * 1024;
+// 256 bytes, then four classes per power of two up to 128 KiB
+constexpr size_t kClassCount = 37;
+// Chunks start this far into a mapping, past its header
+constexpr size_t kHeaderSize = 128;
+
+struct SizeClass;
+
+// Header at the start of every mapping. Mappings are aligned to the slab
+// size, so masking a chunk's address finds it.
+struct Slab {
+    SizeClass* size_class;          // null for a large allocation
+    size_t mapped;
+    size_t chunk;
+    size_t capacity;                // chunks
+    size_t used;
+    // Chunks from here on were never handed out, so their pages may still
+    // be untouched; freed ones are chained through their first word
+    size_t untouched;
+    void* free_list;
+    // Within the class's list of slabs with a free chunk
+    Slab* prev;
+    Slab* next;
+};
+static_assert(sizeof(Slab) <= kHeaderSize, "slab header too large");
+
+struct SizeClass {
+    std::mutex mutex;
+    Slab* available = nullptr;
+    // Slabs in `available` with no chunk in use
+    size_t empty = 0;
+};
+
+SizeClass classes[kClassCount];
+
+std::atomic<uint64_t> allocated_bytes{0};
+std::atomic<uint64_t> mapped_bytes{0};
+std::atomic<uint64_t> slab_count{0};
+std::atomic<uint64_t> large_count{0};
+std::atomic<uint64_t> allocation_count{0};
+std::atomic<uint64_t> free_count{0};
+
+size_t class_size(size_t index) {
+    if (index == 0) {
+        return kMinClass;
+    }
+    size_t power = size_t(1) << (8 + (index - 1) / 4);
+    return power + ((index - 1) % 4 + 1) * (power / 4);
+}
+
+size_t class_index(size_t bytes) {
+    if (bytes <= kMinClass) {
+        return 0;
+    }
+    // The power of two at or below bytes - 1, then the quarter step above it
+    size_t log = 63 - __builtin_clzll(bytes - 1);
+    size_t power = size_t(1) << log;
+    return (log - 8) * 4 + (bytes - 1 - power) / (power / 4) + 1;
+}
+
+size_t large_size(size_t bytes) {
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return (kHeaderSize + bytes + page - 1) / page * page;
+}
+
+// `bytes` of fresh memory aligned to the slab size
+Slab* map_aligned(size_t bytes) {
+    size_t length = bytes + kSlabSize;
+    void* raw = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+    uintptr_t aligned = (start + kSlabSize - 1) & ~(kSlabSize - 1);
+    if (aligned > start) {
+        munmap(raw, aligned - start);
+    }
+    size_t tail = length - (aligned - start) - bytes;
+    if (tail > 0) {
+        munmap(reinterpret_cast<void*>(aligned + bytes), tail);
+    }
+    mapped_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    return reinterpret_cast<Slab*>(aligned);
+}
+
+void unmap(Slab* slab) {
+    mapped_bytes.fetch_sub(slab->mapped, std::memory_order_relaxed);
+    munmap(slab, slab->mapped);
+}
+
+void link(SizeClass& size_class, Slab* slab) {
+    slab->prev = nullptr;
+    slab->next = size_class.available;
+    if (slab->next) {
+        slab->next->prev = slab;
+    }
+    size_class.available = slab;
+}
+
+void unlink(SizeClass& size_class, Slab* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        size_class.available = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+} // namespace
+
+void* BlockAllocator::allocate(size_t bytes) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+
+    if (bytes > kMaxClass) {
+        size_t mapped = large_size(bytes);
+        Slab* slab = map_aligned(mapped);
+        slab->size_class = nullptr;
+        slab->mapped = mapped;
+        large_count.fetch_add(1, std::memory_order_relaxed);
+        allocated_bytes.fetch_add(mapped, std::memory_order_relaxed);
+        return reinterpret_cast<char*>(slab) + kHeaderSize;
+    }
+
+    size_t index = class_index(bytes);
+    SizeClass& size_class = classes[index];
+    std::lock_guard<std::mutex> lock(size_class.mutex);
+    Slab* slab = size_class.available;
+    if (!slab) {
+        slab = map_aligned(kSlabSize);
+        slab->size_class = &size_class;
+        slab->mapped = kSlabSize;
+        slab->chunk = class_size(index);
+        slab->capacity = (kSlabSize - kHeaderSize) / slab->chunk;
+        slab->used = 0;
+        slab->untouched = 0;
+        slab->free_list = nullptr;
+        link(size_class, slab);
+        size_class.empty++;
+        slab_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void* chunk = slab->free_list;
+    if (chunk) {
+        slab->free_list = *static_cast<void**>(chunk);
+    } else {
+        chunk = reinterpret_cast<char*>(slab) + kHeaderSize + slab->untouched++ * slab->chunk;
+    }
+    if (slab->used++ == 0) {
+        size_class.empty--;
+    }
+    if (slab->used == slab->capacity) {
+        unlink(size_class, slab);
+    }
+    allocated_bytes.fetch_add(slab->chunk, std::memory_order_relaxed);
+    return chunk;
+}
+
+void BlockAllocator::deallocate(void* memory) {
+    if (!memory) {
+        return;
+    }
+    free_count.fetch_add(1, std::memory_order_relaxed);
+    Slab* slab = reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(memory) & ~(kSlabSize - 1));
+
+    if (!slab->size_class) {
+        large_count.fetch_sub(1, std::memory_order_relaxed);
+        allocated_bytes.fetch_sub(slab->mapped, std::memory_order_relaxed);
+        unmap(slab);
+        return;
+    }
+
+    SizeClass& size_class = *slab->size_class;
+    allocated_bytes.fetch_sub(slab->chunk, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(size_class.mutex);
+        *static_cast<void**>(memory) = slab->free_list;
+        slab->free_list = memory;
+        if (slab->used-- == slab->capacity) {
+            link(size_class, slab);
+        }
+        if (slab->used > 0) {
+            return;
+        }
+        // Keep one empty slab so a stream hovering at a slab boundary does
+        // not map and unmap on every block, but give back its pages
+        if (size_class.empty == 0) {
+            size_t touched = kHeaderSize + slab->untouched * slab->chunk;
+            size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            size_t from = (kHeaderSize + page - 1) / page * page;
+            if (touched > from) {
+                madvise(reinterpret_cast<char*>(slab) + from, touched - from, MADV_DONTNEED);
+            }
+            slab->untouched = 0;
+            slab->free_list = nullptr;
+            size_class.empty++;
+            return;
+        }
+        unlink(size_class, slab);
+    }
+    slab_count.fetch_sub(1, std::memory_order_relaxed);
+    unmap(slab);
+}
+
+size_t BlockAllocator::allocation_size(size_t bytes) {
+    return bytes > kMaxClass ? large_size(bytes) : class_size(class_index(bytes));
+}
+
+BlockAllocator::Stats BlockAllocator::stats() {
+    return Stats{allocated_bytes.load(std::memory_order_relaxed), mapped_bytes.load(std::memory_order_relaxed),
+                 slab_count.load(std::memory_order_relaxed), large_count.load(std::memory_order_relaxed),
+                 allocation_count.load(std::memory_order_relaxed), free_count.load(std::memory_order_relaxed)};
+}
@@ -0,0 +1,112 @@
+#include "blocked_read.h"
+#include "stream.h"
+
+BlockedRead::BlockedRead(Retry retry, uint64_t timeout_ms)
+    : retry_(std::move(retry)), timeout_ms_(timeout_ms),
+      done_(false), queued_(false), wake_again_(false), expired_(false) {
+}
+
+void BlockedRead::watch(std::shared_ptr<Stream> stream, const StreamID& after) {
+    watched_.emplace_back(std::move(stream), after);
+}
+
+void BlockedRead::arm(Executor executor, Deliver deliver) {
+    executor_ = std::move(executor);
+    deliver_ = std::move(deliver);
+
+    auto self = shared_from_this();
+    for (const auto& watched : watched_) {
+        watched.first->add_waiter(self, watched.second);
+    }
+    wake();
+}
+
+void BlockedRead::wake() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (done_) {
+            return;
+        }
+        if (queued_) {
+            wake_again_ = true;
+            return;
+        }
+        queued_ = true;
+    }
+    executor_([self = shared_from_this()] { self->serve(); });
+}
+
+void BlockedRead::expire() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (done_) {
+            return;
+        }
+        if (queued_) {
+            expired_ = true; // The running retry replies for us
+            return;
+        }
+        done_ = true;
+    }
+    auto reply = std::make_shared<ReplyBuffer>();
+    reply->append_null_array();
+    finish(std::move(reply));
+}
+
+void BlockedRead::cancel() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (done_) {
+            return;
+        }
+        done_ = true;
+    }
+    finish(nullptr);
+}
+
+void BlockedRead::serve() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (done_) {
+            return;
+        }
+        wake_again_ = false;
+    }
+
+    auto reply = std::make_shared<ReplyBuffer>();
+    bool served = retry_(*reply);
+
+    bool complete;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (done_) {
+            return; // Cancelled meanwhile
+        }
+        complete = served || expired_;
+        if (complete) {
+            if (!served) {
+                reply->append_null_array();
+            }
+            done_ = true;
+        } else if (!wake_again_) {
+            queued_ = false;
+            return; // Keep waiting
+        }
+    }
+
+    if (!complete) {
+        // An entry arrived while we were reading; look again
+        executor_([self = shared_from_this()] { self->serve(); });
+        return;
+    }
+    finish(std::move(reply));
+}
+
+void BlockedRead::finish(std::shared_ptr<ReplyBuffer> reply) {
+    for (const auto& watched : watched_) {
+        watched.first->remove_waiter(this);
+    }
+    if (reply) {
+        deliver_(std::move(reply));
+    }
+}
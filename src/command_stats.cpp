@@ -0,0 +1,208 @@
+#include "command_stats.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <vector>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+namespace {
+
+struct CycleClock {
+    bool tsc = false;
+    double ns_per_tick = 1.0;
+
+    CycleClock() {
+#if defined(__x86_64__)
+        // Invariant TSC: ticks at a constant rate in every power state
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8))) {
+            return;
+        }
+        auto wall_start = std::chrono::steady_clock::now();
+        uint64_t ticks_start = __rdtsc();
+        while (std::chrono::steady_clock::now() - wall_start < std::chrono::milliseconds(2)) {
+        }
+        uint64_t ticks = __rdtsc() - ticks_start;
+        auto wall = std::chrono::steady_clock::now() - wall_start;
+        if (ticks > 0) {
+            tsc = true;
+            ns_per_tick = std::chrono::duration<double, std::nano>(wall).count() / static_cast<double>(ticks);
+        }
+#endif
+    }
+};
+
+const CycleClock cycle_clock;
+
+struct Slot {
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> failed;
+    std::atomic<uint64_t> rejected;
+    std::atomic<uint64_t> total_ns;
+    std::atomic<uint64_t> buckets[CommandStats::kBuckets];
+};
+
+// One thread's slots, each allocated the first time the thread runs that
+// command; value-initialised, so everything starts at zero
+struct ThreadSlots {
+    std::atomic<Slot*> slots[CommandStats::kMaxCommands];
+};
+
+std::mutex registry_mutex;
+std::vector<ThreadSlots*> registry;
+// Counts of threads that have exited
+CommandStats::Summary retired[CommandStats::kMaxCommands];
+
+void add(CommandStats::Summary& into, const Slot& slot) {
+    into.calls += slot.calls.load(std::memory_order_relaxed);
+    into.failed += slot.failed.load(std::memory_order_relaxed);
+    into.rejected += slot.rejected.load(std::memory_order_relaxed);
+    into.total_ns += slot.total_ns.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < CommandStats::kBuckets; i++) {
+        into.buckets[i] += slot.buckets[i].load(std::memory_order_relaxed);
+    }
+}
+
+struct ThreadHandle {
+    ThreadSlots* slots = nullptr;
+
+    ~ThreadHandle() {
+        if (!slots) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (size_t i = 0; i < CommandStats::kMaxCommands; i++) {
+            if (Slot* slot = slots->slots[i].load(std::memory_order_relaxed)) {
+                add(retired[i], *slot);
+                delete slot;
+            }
+        }
+        registry.erase(std::find(registry.begin(), registry.end(), slots));
+        delete slots;
+    }
+};
+
+thread_local ThreadHandle handle;
+
+Slot& local_slot(size_t command) {
+    ThreadSlots* slots = handle.slots;
+    if (!slots) {
+        slots = new ThreadSlots();
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.push_back(slots);
+        handle.slots = slots;
+    }
+    Slot* slot = slots->slots[command].load(std::memory_order_relaxed);
+    if (!slot) {
+        slot = new Slot();
+        slots->slots[command].store(slot, std::memory_order_release);
+    }
+    return *slot;
+}
+
+// Only the owning thread writes a slot, so no read-modify-write is needed
+void bump(std::atomic<uint64_t>& counter, uint64_t amount) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+} // namespace
+
+void CommandStats::record(size_t command, uint64_t ns, Outcome outcome) {
+    if (command >= kMaxCommands) {
+        return;
+    }
+    Slot& slot = local_slot(command);
+    if (outcome == Outcome::Rejected) {
+        bump(slot.rejected, 1);
+        return;
+    }
+    bump(slot.calls, 1);
+    bump(slot.total_ns, ns);
+    bump(slot.buckets[bucket_for(ns)], 1);
+    if (outcome == Outcome::Failed) {
+        bump(slot.failed, 1);
+    }
+}
+
+uint64_t CommandStats::now() {
+#if defined(__x86_64__)
+    if (cycle_clock.tsc) {
+        return __rdtsc();
+    }
+#endif
+    return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+}
+
+uint64_t CommandStats::elapsed_ns(uint64_t start, uint64_t end) {
+    if (end <= start) {
+        return 0;
+    }
+    if (cycle_clock.tsc) {
+        return static_cast<uint64_t>(static_cast<double>(end - start) * cycle_clock.ns_per_tick);
+    }
+    // steady_clock counts nanoseconds with libstdc++ and libc++
+    auto elapsed = std::chrono::steady_clock::duration(end - start);
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+CommandStats::Summary CommandStats::summary(size_t command) {
+    Summary summary;
+    if (command >= kMaxCommands) {
+        return summary;
+    }
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    summary = retired[command];
+    for (ThreadSlots* slots : registry) {
+        if (const Slot* slot = slots->slots[command].load(std::memory_order_acquire)) {
+            add(summary, *slot);
+        }
+    }
+    return summary;
+}
+
+uint64_t CommandStats::Summary::percentile(double fraction) const {
+    uint64_t total = 0;
+    for (uint64_t count : buckets) {
+        total += count;
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(fraction * total)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; i++) {
+        seen += buckets[i];
+        if (seen >= target) {
+            return bucket_limit(i);
+        }
+    }
+    return bucket_limit(kBuckets - 1);
+}
+
+size_t CommandStats::bucket_for(uint64_t ns) {
+    if (ns < (uint64_t(1) << kSubBucketBits)) {
+        return static_cast<size_t>(ns);
+    }
+    int power = 63 - __builtin_clzll(ns);
+    if (power >= kMaxPower) {
+        return kBuckets - 1;
+    }
+    // The bits just below the leading one pick the sub-bucket
+    size_t sub = (ns >> (power - kSubBucketBits)) & ((size_t(1) << kSubBucketBits) - 1);
+    return (size_t(power - kSubBucketBits + 1) << kSubBucketBits) + sub;
+}
+
+uint64_t CommandStats::bucket_limit(size_t bucket) {
+    if (bucket < (size_t(1) << kSubBucketBits)) {
+        return bucket;
+    }
+    int power = static_cast<int>(bucket >> kSubBucketBits) + kSubBucketBits - 1;
+    uint64_t sub = bucket & ((size_t(1) << kSubBucketBits) - 1);
+    uint64_t width = uint64_t(1) << (power - kSubBucketBits);
+    return ((uint64_t(1) << kSubBucketBits) + sub) * width + width - 1;
+}
@@ -0,0 +1,32 @@
+#include "command_table.h"
+
+OwnedArgs::OwnedArgs(const std::vector<std::string_view>& args) {
+    size_t total = 0;
+    for (std::string_view arg : args) {
+        total += arg.size();
+    }
+    // Reserved up front, so the bytes stay put while the views are taken
+    bytes_.reserve(total);
+    args_.reserve(args.size());
+    for (std::string_view arg : args) {
+        args_.emplace_back(bytes_.data() + bytes_.size(), arg.size());
+        bytes_.append(arg);
+    }
+}
+
+OwnedArgs::OwnedArgs(const OwnedArgs& other) : bytes_(other.bytes_), args_(other.args_) {
+    rebase(other.bytes_.data());
+}
+
+OwnedArgs::OwnedArgs(OwnedArgs&& other) noexcept : args_(std::move(other.args_)) {
+    // A short string moves by copy, so its views have to follow
+    const char* old_base = other.bytes_.data();
+    bytes_ = std::move(other.bytes_);
+    rebase(old_base);
+}
+
+void OwnedArgs::rebase(const char* old_base) {
+    for (std::string_view& arg : args_) {
+        arg = std::string_view(bytes_.data() + (arg.data() - old_base), arg.size());
+    }
+}
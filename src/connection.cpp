@@ -0,0 +1,89 @@
+#include "connection.h"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+constexpr size_t kReadChunkSize = 16 * 1024;
+
+std::string peer_address(int fd) {
+    sockaddr_in address{};
+    socklen_t length = sizeof(address);
+    if (getpeername(fd, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+        return "?";
+    }
+    char text[INET_ADDRSTRLEN] = "?";
+    inet_ntop(AF_INET, &address.sin_addr, text, sizeof(text));
+    return std::string(text) + ":" + std::to_string(ntohs(address.sin_port));
+}
+}
+
+Connection::Connection(int fd)
+    : fd_(fd), peer_(peer_address(fd)), state_(State::Reading), awaiting_reply_(false), interest_(0),
+      output_offset_(0), block_timer_(0) {
+}
+
+Connection::~Connection() {
+    if (fd_ != -1) {
+        close(fd_);
+    }
+}
+
+bool Connection::read_available() {
+    while (true) {
+        size_t old_size = input_.size();
+        input_.resize(old_size + kReadChunkSize);
+
+        ssize_t bytes_received = recv(fd_, &input_[old_size], kReadChunkSize, 0);
+        if (bytes_received > 0) {
+            input_.resize(old_size + bytes_received);
+            if (static_cast<size_t>(bytes_received) < kReadChunkSize) {
+                return true; // Socket drained
+            }
+            continue;
+        }
+
+        input_.resize(old_size);
+
+        if (bytes_received == 0) {
+            return false; // Peer closed
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+}
+
+bool Connection::flush() {
+    while (output_offset_ < output_.size()) {
+        ssize_t sent = send(fd_, output_.data() + output_offset_,
+                            output_.size() - output_offset_, MSG_NOSIGNAL);
+        if (sent > 0) {
+            output_offset_ += sent;
+            continue;
+        }
+
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (state_ == State::Reading) {
+                state_ = State::Writing;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Everything is out: keep the buffer for the next batch
+    output_.clear();
+    output_.release();
+    output_offset_ = 0;
+    if (state_ == State::Writing) {
+        state_ = State::Reading;
+    }
+    return true;
+}
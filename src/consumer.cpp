@@ -1,50 +1,122 @@
 #include "consumer.h"
 #include <chrono>
-#include <algorithm>
 
-Consumer::Consumer(const std::string& name) 
-    : name_(name) {
-    update_seen_time();
+namespace {
+
+uint64_t priority(const StreamID& id) {
+    // splitmix64 finalizer
+    uint64_t x = id.timestamp_ms * 0x9e3779b97f4a7c15ULL ^ id.sequence;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
 }
 
-Consumer::~Consumer() = default;
+// Splits `tree` into the entries below `id` and the rest
+void split(PendingEntry* tree, const StreamID& id, PendingEntry*& below, PendingEntry*& rest) {
+    if (!tree) {
+        below = rest = nullptr;
+    } else if (tree->id < id) {
+        split(tree->right, id, tree->right, rest);
+        below = tree;
+    } else {
+        split(tree->left, id, below, tree->left);
+        rest = tree;
+    }
+}
 
-void Consumer::add_pending_message(const StreamID& id) {
-    std::lock_guard<std::mutex> lock(pending_mutex_);
-    pending_messages_.insert(id.to_string());
+// Joins two treaps, every ID in `low` being below every ID in `high`
+PendingEntry* merge(PendingEntry* low, PendingEntry* high) {
+    if (!low || !high) {
+        return low ? low : high;
+    }
+    if (priority(low->id) > priority(high->id)) {
+        low->right = merge(low->right, high);
+        return low;
+    }
+    high->left = merge(low, high->left);
+    return high;
 }
 
-bool Consumer::remove_pending_message(const StreamID& id) {
-    std::lock_guard<std::mutex> lock(pending_mutex_);
-    return pending_messages_.erase(id.to_string()) > 0;
+PendingEntry* insert(PendingEntry* tree, PendingEntry* entry) {
+    if (!tree) {
+        return entry;
+    }
+    if (priority(entry->id) > priority(tree->id)) {
+        split(tree, entry->id, entry->left, entry->right);
+        return entry;
+    }
+    if (entry->id < tree->id) {
+        tree->left = insert(tree->left, entry);
+    } else {
+        tree->right = insert(tree->right, entry);
+    }
+    return tree;
 }
 
-bool Consumer::has_pending_message(const StreamID& id) const {
-    std::lock_guard<std::mutex> lock(pending_mutex_);
-    return pending_messages_.count(id.to_string()) > 0;
+PendingEntry* erase(PendingEntry* tree, const StreamID& id) {
+    if (!tree) {
+        return nullptr;
+    }
+    if (tree->id == id) {
+        PendingEntry* rest = merge(tree->left, tree->right);
+        tree->left = tree->right = nullptr;
+        return rest;
+    }
+    if (id < tree->id) {
+        tree->left = erase(tree->left, id);
+    } else {
+        tree->right = erase(tree->right, id);
+    }
+    return tree;
 }
 
-std::vector<StreamID> Consumer::get_pending_messages() const {
-    std::lock_guard<std::mutex> lock(pending_mutex_);
-    std::vector<StreamID> result;
-    
-    for (const std::string& id_str : pending_messages_) {
-        try {
-            result.push_back(StreamID::from_string(id_str));
-        } catch (const std::exception&) {
-            // Skip invalid IDs
+} // namespace
+
+void PendingIndex::insert(PendingEntry& entry) {
+    entry.left = entry.right = nullptr;
+    root_ = ::insert(root_, &entry);
+    size_++;
+}
+
+void PendingIndex::erase(PendingEntry& entry) {
+    root_ = ::erase(root_, entry.id);
+    size_--;
+}
+
+PendingEntry* PendingIndex::lower_bound(const StreamID& id) const {
+    PendingEntry* found = nullptr;
+    for (PendingEntry* node = root_; node;) {
+        if (node->id < id) {
+            node = node->right;
+        } else {
+            found = node;
+            node = node->left;
         }
     }
-    
-    return result;
+    return found;
 }
 
-size_t Consumer::pending_count() const {
-    std::lock_guard<std::mutex> lock(pending_mutex_);
-    return pending_messages_.size();
+PendingEntry* PendingIndex::upper_bound(const StreamID& id) const {
+    PendingEntry* found = nullptr;
+    for (PendingEntry* node = root_; node;) {
+        if (node->id <= id) {
+            node = node->right;
+        } else {
+            found = node;
+            node = node->left;
+        }
+    }
+    return found;
 }
 
+Consumer::Consumer(const std::string& name) 
+    : name_(name), seen_time_(0) {
+    update_seen_time();
+}
+
+Consumer::~Consumer() = default;
+
 void Consumer::update_seen_time() {
-    seen_time_ = std::chrono::duration_cast<std::chrono::milliseconds>(
-        std::chrono::system_clock::now().time_since_epoch()).count();
+    seen_time_.store(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
 }
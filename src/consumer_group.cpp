@@ -1,12 +1,50 @@
 #include "consumer_group.h"
-#include <chrono>
+#include "memory_tracker.h"
 #include <algorithm>
+#include <chrono>
+
+namespace {
+
+// XAUTOCLAIM looks at up to this many PEL entries per entry it may claim
+constexpr size_t kAutoClaimAttemptsPerEntry = 10;
+
+// Red-black tree node header: color and three links
+constexpr size_t kTreeNodeOverhead = 4 * sizeof(void*);
+
+// A pending entry is a node in the PEL and in the idle index; its
+// consumer's index links the PEL node itself
+constexpr size_t kPendingEntryBytes =
+    kTreeNodeOverhead + sizeof(std::pair<const StreamID, PendingEntry>) +
+    kTreeNodeOverhead + sizeof(std::pair<uint64_t, StreamID>);
+
+// The consumer, its shared_ptr control block and its hash map node, which
+// holds a second copy of the name
+size_t consumer_bytes(const std::string& name) {
+    return sizeof(Consumer) + 2 * sizeof(long) +
+           2 * sizeof(void*) + sizeof(std::pair<const std::string, std::shared_ptr<Consumer>>) +
+           2 * name.size();
+}
+
+uint64_t now_ms() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+bool in_stream(const StreamStorage& entries, const StreamID& id) {
+    auto it = entries.lower_bound(id);
+    return it.valid() && it.id() == id;
+}
+
+} // namespace
 
 ConsumerGroup::ConsumerGroup(const std::string& name, const StreamID& start_id)
-    : name_(name), last_delivered_id_(start_id) {
+    : name_(name), last_delivered_id_(start_id), accounted_pending_(0), memory_usage_(0) {
+    charge(sizeof(ConsumerGroup) + name_.size());
 }
 
-ConsumerGroup::~ConsumerGroup() = default;
+ConsumerGroup::~ConsumerGroup() {
+    MemoryTracker::released(memory_usage_.load(std::memory_order_relaxed));
+}
 
 std::shared_ptr<Consumer> ConsumerGroup::get_or_create_consumer(const std::string& consumer_name) {
     std::lock_guard<std::mutex> lock(consumers_mutex_);
@@ -18,12 +56,30 @@ std::shared_ptr<Consumer> ConsumerGroup::get_or_create_consumer(const std::strin
     
     auto consumer = std::make_shared<Consumer>(consumer_name);
     consumers_[consumer_name] = consumer;
+    charge(consumer_bytes(consumer_name));
     return consumer;
 }
 
 bool ConsumerGroup::delete_consumer(const std::string& consumer_name) {
+    std::lock_guard<std::mutex> pending_lock(pending_mutex_);
     std::lock_guard<std::mutex> lock(consumers_mutex_);
-    return consumers_.erase(consumer_name) > 0;
+    
+    auto it = consumers_.find(consumer_name);
+    if (it == consumers_.end()) {
+        return false;
+    }
+    
+    // Its pending entries go with it
+    PendingIndex& index = it->second->pending();
+    while (PendingEntry* pending = index.first()) {
+        index.erase(*pending);
+        idle_index_.erase({pending->delivery_time, pending->id});
+        pending_entries_.erase(pending->id);
+    }
+    consumers_.erase(it);
+    release(consumer_bytes(consumer_name));
+    account_pending();
+    return true;
 }
 
 std::vector<std::string> ConsumerGroup::get_consumer_names() const {
@@ -39,87 +95,373 @@ std::vector<std::string> ConsumerGroup::get_consumer_names() const {
     return names;
 }
 
-std::vector<StreamEntry> ConsumerGroup::read_pending_messages(
+std::vector<StreamID> ConsumerGroup::deliver_new_messages(
     const std::string& consumer_name,
-    const std::vector<StreamEntry>& available_entries,
-    int count) {
+    const StreamStorage& entries,
+    int count,
+    const EntryVisitor& visit) {
+    
+    std::lock_guard<std::mutex> delivery_lock(delivery_mutex_);
+    // Held while the consumer is looked up, so it cannot be deleted before
+    // the entries are recorded against it
+    std::lock_guard<std::mutex> pending_lock(pending_mutex_);
     
     auto consumer = get_or_create_consumer(consumer_name);
     consumer->update_seen_time();
     
-    std::vector<StreamEntry> result;
-    int delivered = 0;
+    std::vector<StreamID> result;
+    if (count > 0) {
+        result.reserve(count);
+    }
+    
+    uint64_t now = now_ms();
+    StreamEntryView view;
+    
+    for (auto it = entries.upper_bound(last_delivered_id_);
+         it.valid() && (count <= 0 || static_cast<int>(result.size()) < count); it.next()) {
+        it.decode(view);
+        visit(view);
+        result.push_back(view.id);
+        
+        add_pending(*consumer, view.id, now);
+        last_delivered_id_ = view.id;
+    }
+    account_pending();
+    
+    return result;
+}
+
+void ConsumerGroup::add_pending(Consumer& consumer, const StreamID& id, uint64_t now) {
+    auto inserted = pending_entries_.try_emplace(id, PendingEntry{id, &consumer, now, 0});
+    PendingEntry& pending = inserted.first->second;
+    
+    if (inserted.second) {
+        consumer.pending().insert(pending);
+        idle_index_.emplace(now, id);
+    } else {
+        transfer_pending(pending, consumer, now); // Delivered again
+    }
+    pending.delivery_count++;
+}
+
+void ConsumerGroup::transfer_pending(PendingEntry& pending, Consumer& consumer, uint64_t delivery_time) {
+    if (pending.consumer != &consumer) {
+        pending.consumer->pending().erase(pending);
+        pending.consumer = &consumer;
+        consumer.pending().insert(pending);
+    }
+    if (pending.delivery_time != delivery_time) {
+        idle_index_.erase({pending.delivery_time, pending.id});
+        pending.delivery_time = delivery_time;
+        idle_index_.emplace(delivery_time, pending.id);
+    }
+}
+
+void ConsumerGroup::remove_pending(std::map<StreamID, PendingEntry>::iterator it) {
+    it->second.consumer->pending().erase(it->second);
+    idle_index_.erase({it->second.delivery_time, it->first});
+    pending_entries_.erase(it);
+}
+
+void ConsumerGroup::account_pending() {
+    size_t pending = pending_entries_.size();
+    if (pending > accounted_pending_) {
+        charge((pending - accounted_pending_) * kPendingEntryBytes);
+    } else if (pending < accounted_pending_) {
+        release((accounted_pending_ - pending) * kPendingEntryBytes);
+    }
+    accounted_pending_ = pending;
+}
+
+void ConsumerGroup::charge(size_t bytes) {
+    memory_usage_.fetch_add(bytes, std::memory_order_relaxed);
+    MemoryTracker::allocated(bytes);
+}
+
+void ConsumerGroup::release(size_t bytes) {
+    memory_usage_.fetch_sub(bytes, std::memory_order_relaxed);
+    MemoryTracker::released(bytes);
+}
+
+int ConsumerGroup::acknowledge_messages(const std::vector<StreamID>& ids) {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    int acknowledged = 0;
     
-    for (const auto& entry : available_entries) {
-        if (count > 0 && delivered >= count) {
-            break;
+    for (const auto& id : ids) {
+        auto it = pending_entries_.find(id);
+        if (it == pending_entries_.end()) {
+            continue;
         }
         
-        if (entry.get_id() > last_delivered_id_) {
-            result.push_back(entry);
-            
-            // Add to pending list
-            {
-                std::lock_guard<std::mutex> lock(pending_mutex_);
-                PendingEntry pending{
-                    entry.get_id(),
-                    consumer_name,
-                    static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
-                        std::chrono::system_clock::now().time_since_epoch()).count()),
-                    1
-                };
-                pending_entries_[entry.get_id().to_string()] = pending;
-            }
-            
-            consumer->add_pending_message(entry.get_id());
-            last_delivered_id_ = entry.get_id();
-            delivered++;
+        remove_pending(it);
+        acknowledged++;
+    }
+    account_pending();
+    
+    return acknowledged;
+}
+
+std::vector<StreamID> ConsumerGroup::get_pending_ids(const std::string& consumer_name, const StreamID& after,
+                                                     int count) const {
+    std::lock_guard<std::mutex> pending_lock(pending_mutex_);
+    
+    const Consumer* consumer;
+    {
+        std::lock_guard<std::mutex> lock(consumers_mutex_);
+        auto it = consumers_.find(consumer_name);
+        if (it == consumers_.end()) {
+            return {};
         }
+        consumer = it->second.get();
     }
     
+    std::vector<StreamID> result;
+    consumer->pending().visit(after, false, [&](const PendingEntry& pending) {
+        result.push_back(pending.id);
+        return count <= 0 || static_cast<int>(result.size()) < count;
+    });
+    
     return result;
 }
 
-int ConsumerGroup::acknowledge_messages(const std::string& consumer_name, const std::vector<StreamID>& ids) {
+size_t ConsumerGroup::pending_count() const {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    return pending_entries_.size();
+}
+
+ConsumerGroup::PendingSummary ConsumerGroup::get_pending_summary() const {
+    std::lock_guard<std::mutex> pending_lock(pending_mutex_);
+    
+    PendingSummary summary;
+    summary.count = pending_entries_.size();
+    if (summary.count == 0) {
+        return summary;
+    }
+    summary.first = pending_entries_.begin()->first;
+    summary.last = pending_entries_.rbegin()->first;
+    
+    std::lock_guard<std::mutex> lock(consumers_mutex_);
+    for (const auto& pair : consumers_) {
+        if (pair.second->pending_count() > 0) {
+            summary.consumers.emplace_back(pair.first, pair.second->pending_count());
+        }
+    }
+    std::sort(summary.consumers.begin(), summary.consumers.end());
+    return summary;
+}
+
+std::vector<ConsumerGroup::PendingInfo> ConsumerGroup::get_pending_range(
+    const StreamID& start, const StreamID& end, size_t count,
+    const std::string& consumer_name, uint64_t min_idle_ms) const {
+    
+    std::lock_guard<std::mutex> pending_lock(pending_mutex_);
+    uint64_t now = now_ms();
+    std::vector<PendingInfo> result;
+    
+    auto visit = [&](const PendingEntry& pending) {
+        uint64_t idle = now > pending.delivery_time ? now - pending.delivery_time : 0;
+        if (idle >= min_idle_ms) {
+            result.push_back({pending.id, pending.consumer->get_name(), idle, pending.delivery_time,
+                              pending.delivery_count});
+        }
+    };
+    
+    if (consumer_name.empty()) {
+        for (auto it = pending_entries_.lower_bound(start);
+             it != pending_entries_.end() && it->first <= end && result.size() < count; ++it) {
+            visit(it->second);
+        }
+        return result;
+    }
+    
+    const Consumer* consumer;
+    {
+        std::lock_guard<std::mutex> lock(consumers_mutex_);
+        auto it = consumers_.find(consumer_name);
+        if (it == consumers_.end()) {
+            return result;
+        }
+        consumer = it->second.get();
+    }
+    consumer->pending().visit(start, true, [&](const PendingEntry& pending) {
+        if (pending.id > end || result.size() >= count) {
+            return false;
+        }
+        visit(pending);
+        return true;
+    });
+    return result;
+}
+
+std::vector<ConsumerGroup::PendingInfo> ConsumerGroup::get_pending_entries(const std::vector<StreamID>& ids) const {
+    std::lock_guard<std::mutex> pending_lock(pending_mutex_);
+    uint64_t now = now_ms();
+    std::vector<PendingInfo> result;
+    
+    for (const auto& id : ids) {
+        auto it = pending_entries_.find(id);
+        if (it == pending_entries_.end()) {
+            continue;
+        }
+        const PendingEntry& pending = it->second;
+        uint64_t idle = now > pending.delivery_time ? now - pending.delivery_time : 0;
+        result.push_back({pending.id, pending.consumer->get_name(), idle, pending.delivery_time,
+                          pending.delivery_count});
+    }
+    return result;
+}
+
+std::vector<StreamID> ConsumerGroup::claim(const std::string& consumer_name, const std::vector<StreamID>& ids,
+                                           const ClaimOptions& options, const StreamStorage& entries) {
+    std::lock_guard<std::mutex> delivery_lock(delivery_mutex_);
+    std::lock_guard<std::mutex> pending_lock(pending_mutex_);
+    
     auto consumer = get_or_create_consumer(consumer_name);
-    int acknowledged = 0;
+    consumer->update_seen_time();
+    
+    if (options.last_id > last_delivered_id_) {
+        last_delivered_id_ = options.last_id;
+    }
+    
+    uint64_t now = now_ms();
+    uint64_t delivery_time = now;
+    if (options.time_ms >= 0) {
+        delivery_time = static_cast<uint64_t>(options.time_ms);
+    } else if (options.idle_ms >= 0) {
+        delivery_time = now - std::min<uint64_t>(now, options.idle_ms);
+    }
     
+    std::vector<StreamID> claimed;
     for (const auto& id : ids) {
-        std::string id_str = id.to_string();
+        bool exists = in_stream(entries, id);
+        auto it = pending_entries_.find(id);
         
-        {
-            std::lock_guard<std::mutex> lock(pending_mutex_);
-            auto it = pending_entries_.find(id_str);
-            if (it != pending_entries_.end() && it->second.consumer_name == consumer_name) {
-                pending_entries_.erase(it);
-                acknowledged++;
+        if (it == pending_entries_.end()) {
+            if (!options.force || !exists) {
+                continue;
+            }
+            // Never delivered, so there is no idle time to check
+            it = pending_entries_.emplace(id, PendingEntry{id, consumer.get(), now, 1}).first;
+            consumer->pending().insert(it->second);
+            idle_index_.emplace(now, id);
+        } else if (!exists) {
+            remove_pending(it); // Deleted from the stream meanwhile
+            continue;
+        } else {
+            uint64_t idle = now > it->second.delivery_time ? now - it->second.delivery_time : 0;
+            if (idle < options.min_idle_ms) {
+                continue;
             }
         }
         
-        consumer->remove_pending_message(id);
+        PendingEntry& pending = it->second;
+        transfer_pending(pending, *consumer, delivery_time);
+        if (options.retry_count >= 0) {
+            pending.delivery_count = static_cast<uint64_t>(options.retry_count);
+        } else if (!options.just_id) {
+            pending.delivery_count++;
+        }
+        claimed.push_back(id);
     }
+    account_pending();
     
-    return acknowledged;
+    return claimed;
 }
 
-std::vector<StreamEntry> ConsumerGroup::get_pending_entries(const std::string& consumer_name) const {
-    std::lock_guard<std::mutex> lock(pending_mutex_);
+ConsumerGroup::AutoClaimResult ConsumerGroup::auto_claim(const std::string& consumer_name, uint64_t min_idle_ms,
+                                                         const StreamID& start, size_t count, bool just_id,
+                                                         const StreamStorage& entries) {
+    std::lock_guard<std::mutex> pending_lock(pending_mutex_);
     
-    std::vector<StreamEntry> result;
+    auto consumer = get_or_create_consumer(consumer_name);
+    consumer->update_seen_time();
     
-    for (const auto& pair : pending_entries_) {
-        if (consumer_name.empty() || pair.second.consumer_name == consumer_name) {
-            // Note: We can't fully reconstruct StreamEntry from just the ID
-            // In a real implementation, we'd store more information or reference back to the stream
-            // For now, create empty entries with just the ID
-            std::vector<std::pair<std::string, std::string>> empty_fields;
-            result.emplace_back(pair.second.id, empty_fields);
+    AutoClaimResult result;
+    uint64_t now = now_ms();
+    // The idle index says at once whether anything at all is stale enough
+    if (min_idle_ms > now || idle_index_.empty() || idle_index_.begin()->first > now - min_idle_ms) {
+        return result;
+    }
+    
+    // Scan in ID order from the cursor, as Redis does, so a client looping
+    // on the returned cursor visits every stale entry once per sweep. Fresh
+    // entries cost an attempt each, bounding the work of one call.
+    size_t attempts = count * kAutoClaimAttemptsPerEntry;
+    auto it = pending_entries_.lower_bound(start);
+    while (it != pending_entries_.end() && attempts > 0 && count > 0) {
+        attempts--;
+        PendingEntry& pending = it->second;
+        uint64_t idle = now > pending.delivery_time ? now - pending.delivery_time : 0;
+        if (idle < min_idle_ms) {
+            ++it;
+            continue;
+        }
+        
+        count--;
+        StreamID id = it->first;
+        if (!in_stream(entries, id)) {
+            remove_pending(it++);
+            result.deleted.push_back(id);
+            continue;
+        }
+        
+        transfer_pending(pending, *consumer, now);
+        if (!just_id) {
+            pending.delivery_count++;
         }
+        result.claimed.push_back(id);
+        ++it;
     }
     
+    // Where the next call picks up; 0-0 once the scan reached the end
+    if (it != pending_entries_.end()) {
+        result.next = it->first;
+    }
+    account_pending();
     return result;
 }
 
+StreamID ConsumerGroup::get_last_delivered_id() const {
+    std::lock_guard<std::mutex> lock(delivery_mutex_);
+    return last_delivered_id_;
+}
+
 void ConsumerGroup::set_last_delivered_id(const StreamID& id) {
+    std::lock_guard<std::mutex> lock(delivery_mutex_);
     last_delivered_id_ = id;
 }
+
+ConsumerGroup::Snapshot ConsumerGroup::snapshot() const {
+    std::lock_guard<std::mutex> delivery_lock(delivery_mutex_);
+    std::lock_guard<std::mutex> pending_lock(pending_mutex_);
+    std::lock_guard<std::mutex> lock(consumers_mutex_);
+    
+    Snapshot snapshot;
+    snapshot.last_delivered_id = last_delivered_id_;
+    std::unordered_map<const Consumer*, size_t> consumer_index;
+    for (const auto& pair : consumers_) {
+        consumer_index.emplace(pair.second.get(), snapshot.consumers.size());
+        snapshot.consumers.emplace_back(pair.first, pair.second->get_seen_time());
+    }
+    snapshot.pending.reserve(pending_entries_.size());
+    for (const auto& pair : pending_entries_) {
+        const PendingEntry& pending = pair.second;
+        snapshot.pending.push_back(Snapshot::Pending{pending.id, consumer_index.at(pending.consumer),
+                                                     pending.delivery_time, pending.delivery_count});
+    }
+    return snapshot;
+}
+
+void ConsumerGroup::restore_consumer(const std::string& consumer_name, uint64_t seen_time) {
+    get_or_create_consumer(consumer_name)->set_seen_time(seen_time);
+}
+
+void ConsumerGroup::restore_pending(const std::string& consumer_name, const StreamID& id, uint64_t delivery_time,
+                                    uint64_t delivery_count) {
+    auto consumer = get_or_create_consumer(consumer_name);
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    
+    add_pending(*consumer, id, delivery_time);
+    pending_entries_.at(id).delivery_count = delivery_count;
+    account_pending();
+}
@@ -0,0 +1,132 @@
+#include "epoch.h"
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Upper bound on threads holding guards at the same time
+constexpr size_t kMaxThreads = 512;
+// Retired objects accumulated before retire() tries to free some
+constexpr size_t kCollectThreshold = 64;
+
+// A thread's published epoch; 0 while it holds no guard
+struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<bool> in_use{false};
+};
+
+struct Retired {
+    uint64_t epoch;
+    std::function<void()> deleter;
+};
+
+std::atomic<uint64_t> global_epoch{1};
+Slot slots[kMaxThreads];
+
+std::mutex retired_mutex;
+std::vector<Retired> retired;
+
+// Slot claimed by the calling thread on its first guard, released on exit
+struct ThreadState {
+    Slot* slot = nullptr;
+    int depth = 0;
+
+    ~ThreadState() {
+        if (slot) {
+            slot->epoch.store(0, std::memory_order_release);
+            slot->in_use.store(false, std::memory_order_release);
+        }
+    }
+
+    Slot& claim() {
+        if (!slot) {
+            for (auto& candidate : slots) {
+                bool expected = false;
+                if (candidate.in_use.compare_exchange_strong(expected, true)) {
+                    slot = &candidate;
+                    break;
+                }
+            }
+            if (!slot) {
+                throw std::runtime_error("Too many threads for epoch reclamation");
+            }
+        }
+        return *slot;
+    }
+};
+
+thread_local ThreadState thread_state;
+
+// Frees everything retired before the oldest epoch still pinned. Called
+// with retired_mutex held; returns the deleters to run after unlocking.
+std::vector<Retired> take_reclaimable() {
+    uint64_t oldest = global_epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+    for (const auto& slot : slots) {
+        uint64_t pinned = slot.epoch.load(std::memory_order_seq_cst);
+        if (pinned != 0 && pinned < oldest) {
+            oldest = pinned;
+        }
+    }
+
+    std::vector<Retired> reclaimable;
+    size_t kept = 0;
+    for (auto& item : retired) {
+        if (item.epoch < oldest) {
+            reclaimable.push_back(std::move(item));
+        } else {
+            retired[kept++] = std::move(item);
+        }
+    }
+    retired.resize(kept);
+    return reclaimable;
+}
+
+} // namespace
+
+Epoch::Guard::Guard() {
+    ThreadState& state = thread_state;
+    if (state.depth++ == 0) {
+        Slot& slot = state.claim();
+        // seq_cst orders the publication before any read of shared pointers
+        slot.epoch.store(global_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+    }
+}
+
+Epoch::Guard::~Guard() {
+    ThreadState& state = thread_state;
+    if (--state.depth == 0) {
+        state.slot->epoch.store(0, std::memory_order_release);
+    }
+}
+
+void Epoch::retire(std::function<void()> deleter) {
+    std::vector<Retired> reclaimable;
+    {
+        std::lock_guard<std::mutex> lock(retired_mutex);
+        retired.push_back({global_epoch.load(std::memory_order_seq_cst), std::move(deleter)});
+        if (retired.size() >= kCollectThreshold) {
+            reclaimable = take_reclaimable();
+        }
+    }
+    for (auto& item : reclaimable) {
+        item.deleter();
+    }
+}
+
+void Epoch::collect() {
+    std::vector<Retired> reclaimable;
+    {
+        std::lock_guard<std::mutex> lock(retired_mutex);
+        reclaimable = take_reclaimable();
+    }
+    for (auto& item : reclaimable) {
+        item.deleter();
+    }
+}
+
+size_t Epoch::pending() {
+    std::lock_guard<std::mutex> lock(retired_mutex);
+    return retired.size();
+}
@@ -0,0 +1,185 @@
+#include "event_loop.h"
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr int kMaxEventsPerWait = 256;
+
+uint64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+EventLoop::EventLoop() : epoll_fd_(-1), wake_fd_(-1), running_(false), next_timer_id_(1) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ == -1) {
+        throw std::runtime_error("Failed to create epoll instance");
+    }
+
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd_ == -1) {
+        close(epoll_fd_);
+        throw std::runtime_error("Failed to create eventfd");
+    }
+
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = wake_fd_;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev) == -1) {
+        close(wake_fd_);
+        close(epoll_fd_);
+        throw std::runtime_error("Failed to register eventfd");
+    }
+}
+
+EventLoop::~EventLoop() {
+    close(wake_fd_);
+    close(epoll_fd_);
+}
+
+void EventLoop::run() {
+    running_ = true;
+    struct epoll_event events[kMaxEventsPerWait];
+
+    while (running_) {
+        int ready = epoll_wait(epoll_fd_, events, kMaxEventsPerWait, run_timers());
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == wake_fd_) {
+                uint64_t value;
+                while (read(wake_fd_, &value, sizeof(value)) > 0) {
+                }
+                continue;
+            }
+
+            auto it = handlers_.find(fd);
+            if (it == handlers_.end()) {
+                continue; // Unregistered earlier in this batch
+            }
+
+            std::shared_ptr<Handler> handler = it->second;
+            (*handler)(events[i].events);
+        }
+
+        run_posted_tasks();
+    }
+
+    run_posted_tasks();
+}
+
+void EventLoop::stop() {
+    running_ = false;
+    wake();
+}
+
+bool EventLoop::add_fd(int fd, uint32_t events, Handler handler) {
+    struct epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        return false;
+    }
+
+    handlers_[fd] = std::make_shared<Handler>(std::move(handler));
+    return true;
+}
+
+bool EventLoop::modify_fd(int fd, uint32_t events) {
+    struct epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void EventLoop::remove_fd(int fd) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    handlers_.erase(fd);
+}
+
+void EventLoop::post(Task task) {
+    {
+        std::lock_guard<std::mutex> lock(tasks_mutex_);
+        tasks_.push_back(std::move(task));
+    }
+    wake();
+}
+
+EventLoop::TimerId EventLoop::add_timer(uint64_t delay_ms, Task task) {
+    TimerId id = next_timer_id_++;
+    timers_.emplace(id, std::move(task));
+    timer_queue_.emplace(now_ms() + delay_ms, id);
+    return id;
+}
+
+void EventLoop::cancel_timer(TimerId id) {
+    timers_.erase(id);
+
+    // Long timeouts cancelled early would otherwise pile up in the heap
+    if (timer_queue_.size() > 2 * timers_.size() + 64) {
+        decltype(timer_queue_) live;
+        while (!timer_queue_.empty()) {
+            if (timers_.count(timer_queue_.top().second)) {
+                live.push(timer_queue_.top());
+            }
+            timer_queue_.pop();
+        }
+        timer_queue_.swap(live);
+    }
+}
+
+int EventLoop::run_timers() {
+    while (!timer_queue_.empty()) {
+        auto [deadline, id] = timer_queue_.top();
+        auto it = timers_.find(id);
+        if (it == timers_.end()) {
+            timer_queue_.pop(); // Cancelled
+            continue;
+        }
+
+        uint64_t now = now_ms();
+        if (deadline > now) {
+            return static_cast<int>(std::min<uint64_t>(deadline - now, INT32_MAX));
+        }
+
+        Task task = std::move(it->second);
+        timers_.erase(it);
+        timer_queue_.pop();
+        task();
+    }
+    return -1;
+}
+
+void EventLoop::wake() {
+    uint64_t one = 1;
+    ssize_t written = write(wake_fd_, &one, sizeof(one));
+    (void)written; // EAGAIN means a wakeup is already pending
+}
+
+void EventLoop::run_posted_tasks() {
+    std::vector<Task> tasks;
+    {
+        std::lock_guard<std::mutex> lock(tasks_mutex_);
+        tasks.swap(tasks_);
+    }
+
+    for (auto& task : tasks) {
+        task();
+    }
+}
@@ -1,4 +1,5 @@
 #include "redis_server.h"
+#include "server_config.h"
 #include <iostream>
 #include <signal.h>
 #include <memory>
@@ -17,26 +18,26 @@ void signal_handler(int signal) {
 
 int main(int argc, char* argv[]) {
     // Handle command line arguments
-    int port = 6379; // Default Redis port
+    ServerConfig config;
     
-    if (argc > 1) {
-        try {
-            port = std::stoi(argv[1]);
-        } catch (const std::exception& e) {
-            std::cerr << "Invalid port number: " << argv[1] << std::endl;
-            return 1;
-        }
+    try {
+        config = ServerConfig::from_args(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl << ServerConfig::usage();
+        return 1;
     }
     
     // Set up signal handling
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    // A peer hanging up surfaces as EPIPE; sendfile() has no MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
     
     try {
         std::cout << "Starting Redis Streams Service..." << std::endl;
         
         // Create and start the server
-        server = std::make_unique<RedisServer>(port);
+        server = std::make_unique<RedisServer>(config);
         server->start();
         
         std::cout << "Server started successfully. Press Ctrl+C to stop." << std::endl;
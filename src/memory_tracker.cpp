@@ -0,0 +1,3 @@
+#include "memory_tracker.h"
+
+std::atomic<size_t> MemoryTracker::used_{0};
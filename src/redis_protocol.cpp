@@ -1,5 +1,7 @@
 #include "redis_protocol.h"
 #include "stream_entry.h"
+#include "stream_storage.h"
+#include "resp_parser.h"
 #include <sstream>
 #include <stdexcept>
 
@@ -8,10 +10,17 @@ std::vector<std::string> RedisProtocol::parse_command(const std::string& input)
         return {};
     }
     
-    size_t pos = 0;
-    
     if (input[0] == '*') {
-        return parse_array(input, pos);
+        RespParser parser;
+        switch (parser.parse(input)) {
+        case RespParser::Result::Complete:
+            return std::vector<std::string>(parser.args().begin(), parser.args().end());
+        case RespParser::Result::Incomplete:
+            throw std::invalid_argument("Incomplete command");
+        case RespParser::Result::Error:
+            break;
+        }
+        throw std::invalid_argument("Protocol error: " + parser.error());
     } else {
         // Handle inline commands (simple space-separated)
         std::vector<std::string> parts;
@@ -27,30 +36,38 @@ std::vector<std::string> RedisProtocol::parse_command(const std::string& input)
 }
 
 std::string RedisProtocol::format_simple_string(const std::string& str) {
-    return "+" + str + "\r\n";
+    ReplyBuffer out;
+    out.append_simple_string(str);
+    return out.str();
 }
 
 std::string RedisProtocol::format_error(const std::string& error) {
-    return "-" + error + "\r\n";
+    ReplyBuffer out;
+    out.append_error(error);
+    return out.str();
 }
 
 std::string RedisProtocol::format_integer(int64_t value) {
-    return ":" + std::to_string(value) + "\r\n";
+    ReplyBuffer out;
+    out.append_integer(value);
+    return out.str();
 }
 
 std::string RedisProtocol::format_bulk_string(const std::string& str) {
-    return "$" + std::to_string(str.length()) + "\r\n" + str + "\r\n";
+    ReplyBuffer out;
+    out.append_bulk_string(str);
+    return out.str();
 }
 
 std::string RedisProtocol::format_array(const std::vector<std::string>& elements) {
-    std::ostringstream oss;
-    oss << "*" << elements.size() << "\r\n";
+    ReplyBuffer out;
+    out.append_array_header(elements.size());
     
     for (const auto& element : elements) {
-        oss << format_bulk_string(element);
+        out.append_bulk_string(element);
     }
     
-    return oss.str();
+    return out.str();
 }
 
 std::string RedisProtocol::format_null_bulk_string() {
@@ -62,138 +79,132 @@ std::string RedisProtocol::format_null_array() {
 }
 
 std::string RedisProtocol::format_stream_entries(const std::vector<StreamEntry>& entries) {
+    ReplyBuffer out;
+    write_stream_entries(out, entries);
+    return out.str();
+}
+
+std::string RedisProtocol::format_stream_read_response(
+    const std::vector<std::pair<std::string, std::vector<StreamEntry>>>& stream_entries) {
+    ReplyBuffer out;
+    write_stream_read_response(out, stream_entries);
+    return out.str();
+}
+
+void RedisProtocol::write_stream_id(ReplyBuffer& out, const StreamID& id) {
+    char text[StreamID::kMaxStringLength];
+    out.append_bulk_string(std::string_view(text, id.format(text)));
+}
+
+void RedisProtocol::write_stream_entries(ReplyBuffer& out, const std::vector<StreamEntry>& entries) {
     if (entries.empty()) {
-        return format_null_array();
+        out.append_null_array();
+        return;
     }
     
-    std::ostringstream oss;
-    oss << "*" << entries.size() << "\r\n";
-    
+    out.append_array_header(entries.size());
     for (const auto& entry : entries) {
-        oss << entry.to_resp_format();
+        entry.write_resp(out);
     }
-    
-    return oss.str();
 }
 
-std::string RedisProtocol::format_stream_read_response(
+void RedisProtocol::write_stream_read_response(
+    ReplyBuffer& out,
     const std::vector<std::pair<std::string, std::vector<StreamEntry>>>& stream_entries) {
     
     if (stream_entries.empty()) {
-        return format_null_array();
+        out.append_null_array();
+        return;
     }
     
-    std::ostringstream oss;
-    oss << "*" << stream_entries.size() << "\r\n";
+    out.append_array_header(stream_entries.size());
     
     for (const auto& stream_pair : stream_entries) {
-        const std::string& stream_name = stream_pair.first;
-        const std::vector<StreamEntry>& entries = stream_pair.second;
-        
         // Each stream response is an array of [stream_name, entries_array]
-        oss << "*2\r\n";
-        oss << format_bulk_string(stream_name);
-        oss << format_stream_entries(entries);
+        out.append_array_header(2);
+        out.append_bulk_string(stream_pair.first);
+        write_stream_entries(out, stream_pair.second);
     }
-    
-    return oss.str();
 }
 
-// Private helper methods
-
-std::string RedisProtocol::parse_bulk_string(const std::string& input, size_t& pos) {
-    if (pos >= input.length() || input[pos] != '$') {
-        throw std::invalid_argument("Expected bulk string");
+void RedisProtocol::write_stream_entry(ReplyBuffer& out, const StreamEntryView& entry) {
+    out.append_array_header(2);
+    write_stream_id(out, entry.id);
+    out.append_array_header(entry.fields.size() * 2);
+    for (const auto& field : entry.fields) {
+        out.append_bulk_string(field.first);
+        out.append_bulk_string(field.second);
     }
-    
-    pos++; // Skip '$'
-    
-    // Find the length
-    size_t length_end = input.find("\r\n", pos);
-    if (length_end == std::string::npos) {
-        throw std::invalid_argument("Invalid bulk string format");
-    }
-    
-    int length = std::stoi(input.substr(pos, length_end - pos));
-    pos = length_end + 2; // Skip "\r\n"
-    
-    if (length == -1) {
-        return ""; // Null bulk string
-    }
-    
-    if (pos + length > input.length()) {
-        throw std::invalid_argument("Bulk string length exceeds input");
-    }
-    
-    std::string result = input.substr(pos, length);
-    pos += length + 2; // Skip the string and trailing "\r\n"
-    
-    return result;
 }
 
-int64_t RedisProtocol::parse_integer(const std::string& input, size_t& pos) {
-    if (pos >= input.length() || input[pos] != ':') {
-        throw std::invalid_argument("Expected integer");
+size_t RedisProtocol::write_stream_range(ReplyBuffer& out, const StreamStorage& storage,
+                                         const StreamID& from, const StreamID& end, int count) {
+    // The writer may append or delete while we walk, so the entries are
+    // encoded in a single pass and the array header goes in front after
+    size_t start = out.size();
+    size_t total = 0;
+    StreamEntryView view;
+    
+    for (auto it = storage.lower_bound(from); it.valid() && (count < 0 || total < static_cast<size_t>(count)); it.next()) {
+        it.decode(view);
+        if (view.id > end) {
+            break;
+        }
+        write_stream_entry(out, view);
+        total++;
     }
     
-    pos++; // Skip ':'
-    
-    size_t end = input.find("\r\n", pos);
-    if (end == std::string::npos) {
-        throw std::invalid_argument("Invalid integer format");
+    if (total == 0) {
+        out.append_null_array();
+    } else {
+        out.insert_header(start, '*', total);
     }
-    
-    int64_t result = std::stoll(input.substr(pos, end - pos));
-    pos = end + 2; // Skip "\r\n"
-    
-    return result;
+    return total;
 }
 
-std::vector<std::string> RedisProtocol::parse_array(const std::string& input, size_t& pos) {
-    if (pos >= input.length() || input[pos] != '*') {
-        throw std::invalid_argument("Expected array");
+void RedisProtocol::write_pending_entries(ReplyBuffer& out, const StreamStorage& storage,
+                                          const std::vector<StreamID>& ids) {
+    out.append_array_header(ids.size());
+    StreamEntryView view;
+    
+    for (const auto& id : ids) {
+        auto it = storage.lower_bound(id);
+        if (it.valid() && it.id() == id) {
+            it.decode(view);
+            write_stream_entry(out, view);
+        } else {
+            out.append_array_header(2);
+            write_stream_id(out, id);
+            out.append_null_array();
+        }
     }
-    
-    pos++; // Skip '*'
-    
-    // Find the array length
-    size_t length_end = input.find("\r\n", pos);
-    if (length_end == std::string::npos) {
-        throw std::invalid_argument("Invalid array format");
+}
+
+void RedisProtocol::merge_stream_read_responses(ReplyBuffer& out, const std::vector<ReplyBuffer>& responses) {
+    uint64_t total = 0;
+    for (const auto& response : responses) {
+        std::string_view text = response.view();
+        if (!text.empty() && text[0] == '-') {
+            out.append_raw(text); // First error wins
+            return;
+        }
+        if (text.size() >= 4 && text[0] == '*' && text[1] != '-') {
+            int64_t count = 0;
+            RespParser::parse_int64(text.substr(1, text.find("\r\n") - 1), count);
+            total += count;
+        }
     }
     
-    int length = std::stoi(input.substr(pos, length_end - pos));
-    pos = length_end + 2; // Skip "\r\n"
-    
-    if (length == -1) {
-        return {}; // Null array
+    if (total == 0) {
+        out.append_null_array();
+        return;
     }
     
-    std::vector<std::string> result;
-    result.reserve(length);
-    
-    for (int i = 0; i < length; i++) {
-        if (pos >= input.length()) {
-            throw std::invalid_argument("Array length exceeds input");
-        }
-        
-        if (input[pos] == '$') {
-            result.push_back(parse_bulk_string(input, pos));
-        } else if (input[pos] == ':') {
-            result.push_back(std::to_string(parse_integer(input, pos)));
-        } else if (input[pos] == '+') {
-            // Simple string
-            pos++; // Skip '+'
-            size_t end = input.find("\r\n", pos);
-            if (end == std::string::npos) {
-                throw std::invalid_argument("Invalid simple string format");
-            }
-            result.push_back(input.substr(pos, end - pos));
-            pos = end + 2; // Skip "\r\n"
-        } else {
-            throw std::invalid_argument("Unsupported array element type");
+    out.append_array_header(total);
+    for (const auto& response : responses) {
+        std::string_view text = response.view();
+        if (text.size() >= 4 && text[0] == '*' && text[1] != '-') {
+            out.append_raw(text.substr(text.find("\r\n") + 2));
         }
     }
-    
-    return result;
 }
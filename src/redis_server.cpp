@@ -1,16 +1,325 @@
 #include "redis_server.h"
 #include "redis_protocol.h"
+#include "connection.h"
+#include "event_loop.h"
+#include "shard.h"
+#include "resp_parser.h"
+#include "memory_tracker.h"
+#include "epoch.h"
+#include "block_allocator.h"
+#include "command_stats.h"
 #include <iostream>
 #include <sstream>
+#include <iomanip>
 #include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <climits>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <chrono>
+#include <future>
+#include <pthread.h>
+
+namespace {
+// Stop executing pipelined commands once this much reply data is unsent
+constexpr size_t kMaxPendingOutput = 4 * 1024 * 1024;
+
+constexpr const char* kOomError = "OOM command not allowed when used memory > 'maxmemory'.";
+
+// Commands sent to each shard per task while the append-only log is replayed
+constexpr size_t kReplayBatch = 256;
+
+// Pipelined commands a connection hands its shards per round trip
+constexpr size_t kPipelineBatch = 1024;
+
+// Smallest ID above `id`
+StreamID id_after(const StreamID& id) {
+    if (id.sequence != UINT64_MAX) {
+        return StreamID(id.timestamp_ms, id.sequence + 1);
+    }
+    return id.timestamp_ms != UINT64_MAX ? StreamID(id.timestamp_ms + 1, 0) : id;
+}
+
+// "1.50M"-style sizes for INFO
+std::string bytes_to_human(uint64_t bytes) {
+    static const char kUnits[] = "BKMGTP";
+    double value = static_cast<double>(bytes);
+    size_t unit = 0;
+    while (value >= 1024 && unit + 1 < sizeof(kUnits) - 1) {
+        value /= 1024;
+        unit++;
+    }
+    char text[32];
+    if (unit == 0) {
+        snprintf(text, sizeof(text), "%lluB", static_cast<unsigned long long>(bytes));
+    } else {
+        snprintf(text, sizeof(text), "%.2f%c", value, kUnits[unit]);
+    }
+    return text;
+}
+
+// Command names as INFO and error messages spell them
+std::string lower_case(std::string_view name) {
+    std::string lower(name);
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    return lower;
+}
+
+// Resident set size as the kernel sees it, allocator slack included
+uint64_t resident_memory() {
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (!statm) {
+        return 0;
+    }
+    unsigned long long pages_total = 0;
+    unsigned long long pages_resident = 0;
+    if (fscanf(statm, "%llu %llu", &pages_total, &pages_resident) != 2) {
+        pages_resident = 0;
+    }
+    fclose(statm);
+    return pages_resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+}
+
+// Integer argument, strictly decimal
+int64_t parse_integer(std::string_view text) {
+    int64_t value;
+    if (!RespParser::parse_int64(text, value)) {
+        throw std::invalid_argument("value is not an integer or out of range");
+    }
+    return value;
+}
+
+// COUNT of a read; negative means no limit
+int parse_count(std::string_view text) {
+    return static_cast<int>(std::clamp<int64_t>(parse_integer(text), -1, INT_MAX));
+}
+
+// BLOCK milliseconds, 0 waiting forever
+int parse_timeout(std::string_view text) {
+    int64_t value;
+    if (!RespParser::parse_int64(text, value)) {
+        throw std::invalid_argument("timeout is not an integer or out of range");
+    }
+    if (value < 0) {
+        throw std::invalid_argument("timeout is negative");
+    }
+    return static_cast<int>(std::min<int64_t>(value, INT_MAX));
+}
+
+// An idle time; negative ones count as 0, as in Redis
+uint64_t parse_ms(std::string_view text) {
+    return static_cast<uint64_t>(std::max<int64_t>(parse_integer(text), 0));
+}
+
+// "<ms>-<seq>", or a bare "<ms>" standing for `sequence` within that millisecond
+StreamID parse_id_or_ms(std::string_view text, uint64_t sequence) {
+    if (text.find('-') != std::string_view::npos) {
+        return StreamID::from_string(text);
+    }
+    uint64_t ms = 0;
+    auto result = std::from_chars(text.data(), text.data() + text.size(), ms);
+    if (text.empty() || result.ec != std::errc() || result.ptr != text.data() + text.size()) {
+        throw std::invalid_argument("Invalid stream ID specified as stream command argument");
+    }
+    return StreamID(ms, sequence);
+}
+
+// Bound of an ID range: "-" and "+" for the extremes, a bare millisecond
+// time, and a leading "(" for an exclusive bound
+StreamID parse_range_id(std::string_view text, bool is_end) {
+    if (text == "-") {
+        return StreamID(0, 0);
+    }
+    if (text == "+") {
+        return StreamID(UINT64_MAX, UINT64_MAX);
+    }
+    
+    bool exclusive = !text.empty() && text[0] == '(';
+    StreamID id = parse_id_or_ms(exclusive ? text.substr(1) : text, is_end ? UINT64_MAX : 0);
+    
+    if (exclusive) {
+        if (is_end) {
+            if (id == StreamID(0, 0)) {
+                throw std::invalid_argument("invalid end ID for the interval");
+            }
+            return id.sequence > 0 ? StreamID(id.timestamp_ms, id.sequence - 1)
+                                   : StreamID(id.timestamp_ms - 1, UINT64_MAX);
+        }
+        if (id == StreamID(UINT64_MAX, UINT64_MAX)) {
+            throw std::invalid_argument("invalid start ID for the interval");
+        }
+        return id.sequence < UINT64_MAX ? StreamID(id.timestamp_ms, id.sequence + 1)
+                                        : StreamID(id.timestamp_ms + 1, 0);
+    }
+    return id;
+}
+
+// MAXLEN|MINID [=|~] threshold [LIMIT count], starting at parts[pos];
+// returns the position after it
+size_t parse_trim(const std::vector<std::string_view>& parts, size_t pos, StreamTrim& trim) {
+    bool max_len = equals_upper(parts[pos++], "MAXLEN");
+    
+    if (pos < parts.size() && (parts[pos] == "~" || parts[pos] == "=")) {
+        trim.approximate = parts[pos++] == "~";
+    }
+    if (pos >= parts.size()) {
+        throw std::invalid_argument("syntax error");
+    }
+    
+    std::string_view threshold = parts[pos++];
+    if (max_len) {
+        int64_t value = parse_integer(threshold);
+        if (value < 0) {
+            throw std::invalid_argument("The MAXLEN argument must be >= 0.");
+        }
+        trim.strategy = StreamTrim::Strategy::MaxLen;
+        trim.max_len = static_cast<uint64_t>(value);
+    } else {
+        trim.strategy = StreamTrim::Strategy::MinId;
+        trim.min_id = parse_id_or_ms(threshold, 0);
+    }
+    
+    // Approximate trims are capped like in Redis, so one call never evicts
+    // more than a bounded batch
+    trim.limit = trim.approximate ? 100 * StreamBlock::kMaxEntries : 0;
+    if (pos + 1 < parts.size() && equals_upper(parts[pos], "LIMIT")) {
+        if (!trim.approximate) {
+            throw std::invalid_argument("syntax error, LIMIT cannot be used without the special ~ option");
+        }
+        int64_t limit = parse_integer(parts[pos + 1]);
+        if (limit < 0) {
+            throw std::invalid_argument("The LIMIT argument must be >= 0.");
+        }
+        trim.limit = static_cast<size_t>(limit);
+        pos += 2;
+    }
+    return pos;
+}
+
+// XADD's options after the key, [NOMKSTREAM] [MAXLEN|MINID ...] in any
+// order; returns the position of the ID
+size_t parse_add_options(const std::vector<std::string_view>& parts, StreamTrim& trim, bool& no_mkstream) {
+    size_t pos = 2;
+    while (pos < parts.size()) {
+        if (equals_upper(parts[pos], "NOMKSTREAM")) {
+            no_mkstream = true;
+            pos++;
+        } else if (equals_upper(parts[pos], "MAXLEN") || equals_upper(parts[pos], "MINID")) {
+            pos = parse_trim(parts, pos, trim);
+        } else {
+            break;
+        }
+    }
+    return pos;
+}
+
+// The ID of XADD or XADDBATCH, with the checks that do not need the
+// stream, so a rejected ID never creates the key. An exact ID gives its
+// sequence number to the first of `count` entries.
+StreamID parse_add_id(std::string_view id, size_t count) {
+    // "*" goes to the stream as 0-0, which picks the time and moves past
+    // the last ID however the clock stands
+    if (id == "*") {
+        return StreamID();
+    }
+    StreamID stream_id = StreamID::from_string(id);
+    if (id.find('*') == std::string_view::npos) {
+        if (stream_id == StreamID(0, 0)) {
+            throw std::invalid_argument("Stream ID must be greater than 0-0");
+        }
+        if (UINT64_MAX - stream_id.sequence < count - 1) {
+            throw std::invalid_argument("Stream ID sequence exhausted for this batch");
+        }
+    }
+    return stream_id;
+}
+
+// Raw size of an entry's fields and values, about what it takes encoded
+size_t field_bytes(const FieldViews& fields) {
+    size_t bytes = 0;
+    for (const auto& field : fields) {
+        bytes += field.first.size() + field.second.size();
+    }
+    return bytes;
+}
+
+// [COUNT count] [BLOCK milliseconds] up to STREAMS, from parts[pos] on;
+// returns the position after STREAMS, or 0 when it is missing
+size_t parse_read_options(const std::vector<std::string_view>& parts, size_t pos, int& count, int& block) {
+    for (size_t i = pos; i < parts.size(); i++) {
+        bool has_value = i + 1 < parts.size();
+        if (equals_upper(parts[i], "STREAMS")) {
+            return i + 1;
+        } else if (equals_upper(parts[i], "COUNT") && has_value) {
+            count = parse_count(parts[++i]);
+        } else if (equals_upper(parts[i], "BLOCK") && has_value) {
+            block = parse_timeout(parts[++i]);
+        }
+    }
+    return 0;
+}
+
+// Keywords ending the ID list of XCLAIM
+bool is_claim_option(std::string_view arg) {
+    static constexpr std::string_view kOptions[] = {"IDLE", "TIME", "RETRYCOUNT", "FORCE", "JUSTID", "LASTID"};
+    return std::any_of(std::begin(kOptions), std::end(kOptions), [arg](std::string_view option) {
+        return equals_upper(arg, option);
+    });
+}
+
+void append_no_group(ReplyBuffer& out, std::string_view stream_name, std::string_view group_name) {
+    out.append_error("NOGROUP No such key '" + std::string(stream_name) + "' or consumer group '" +
+                     std::string(group_name) + "'");
+}
+}
+
+struct RedisServer::IoWorker {
+    EventLoop loop;
+    std::thread thread;
+    std::unordered_map<int, std::shared_ptr<Connection>> connections;
+};
+
+// A read spanning shards, touched only on the connection's event loop
+struct RedisServer::FanOut {
+    std::vector<ReplyBuffer> replies;
+    std::vector<std::shared_ptr<BlockedRead>> parked;   // sub-reads waiting on their shard
+    std::vector<Shard*> shards;                          // where each sub-read runs
+    size_t remaining = 0;                                // shards yet to answer once
+    size_t unsettled = 0;                                // parked sub-reads not yet cancelled
+    bool settling = false;
+    bool done = false;
+    EventLoop::TimerId timer = 0;
+};
+
+// Replies of a pipelined batch; each shard fills in the slots of its own
+// commands, read on the connection's loop once every shard has answered
+struct RedisServer::Pipeline {
+    std::vector<ReplyBuffer> replies;
+    size_t remaining = 0;   // shards yet to answer
+};
 
 RedisServer::RedisServer(int port) 
-    : port_(port), server_socket_(-1), running_(false) {
+    : RedisServer([port] {
+          ServerConfig config;
+          config.port = port;
+          return config;
+      }()) {
+}
+
+RedisServer::RedisServer(const ServerConfig& config)
+    : config_(config), server_socket_(-1), running_(false), next_worker_(0),
+      snapshots_(std::make_unique<SnapshotFile>(config.dbfilename, [this](const SnapshotFile::StreamVisitor& visit) {
+          for_each_stream(visit);
+      })),
+      loading_(false), slowlog_(config.slowlog_log_slower_than, static_cast<size_t>(config.slowlog_max_len)) {
 }
 
 RedisServer::~RedisServer() {
@@ -19,7 +328,7 @@ RedisServer::~RedisServer() {
 
 void RedisServer::start() {
     // Create socket
-    server_socket_ = socket(AF_INET, SOCK_STREAM, 0);
+    server_socket_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (server_socket_ == -1) {
         throw std::runtime_error("Failed to create socket");
     }
@@ -35,7 +344,7 @@ void RedisServer::start() {
     struct sockaddr_in address;
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port_);
+    address.sin_port = htons(config_.port);
     
     if (bind(server_socket_, (struct sockaddr*)&address, sizeof(address)) < 0) {
         close(server_socket_);
@@ -43,29 +352,147 @@ void RedisServer::start() {
     }
     
     // Listen
-    if (listen(server_socket_, 3) < 0) {
+    if (listen(server_socket_, config_.tcp_backlog) < 0) {
         close(server_socket_);
         throw std::runtime_error("Failed to listen on socket");
     }
     
+    // Server threads inherit this mask, so shutdown signals only ever reach
+    // the main thread and never a worker that stop() would have to join
+    sigset_t shutdown_signals, previous_mask;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, &previous_mask);
+    
+    // Shard workers own the keyspace in sharded mode, one pinned to each core in turn
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < config_.shards; i++) {
+        shards_.push_back(std::make_unique<Shard>(i, static_cast<int>(i % cores)));
+        shards_.back()->start();
+    }
+    
+    // Replay the log before any client is served
+    if (config_.appendonly) {
+        AppendLog::Options options;
+        options.path = config_.appendfilename;
+        options.fsync = config_.appendfsync;
+        options.rewrite_percentage = static_cast<unsigned>(config_.auto_aof_rewrite_percentage);
+        options.rewrite_min_size = config_.auto_aof_rewrite_min_size;
+        auto log = std::make_unique<AppendLog>(options, [this](const AppendLog::Emit& emit) {
+            dump_streams(emit);
+        });
+        load_append_log(*log);
+        log->start();
+        aof_ = std::move(log);
+    } else {
+        load_snapshot();
+    }
+    
+    // Spill only once loading is done, so a restart does not write segments
+    // for data it is about to trim
+    if (config_.stream_hot_memory > 0) {
+        TieredStorage::Options options;
+        options.dir = config_.tier_dir;
+        options.hot_bytes = config_.stream_hot_memory;
+        tiering_ = std::make_unique<TieredStorage>(options, [this](const TieredStorage::StreamVisitor& visit) {
+            for_each_stream(visit);
+        });
+        tiering_->start();
+    }
+    
+    if (config_.replicaof_port == 0 && config_.repl_backlog_size > 0) {
+        ReplicationBacklog::Options options;
+        options.size = config_.repl_backlog_size;
+        options.snapshot_path = config_.dbfilename;
+        backlog_ = std::make_unique<ReplicationBacklog>(options, [this](const SnapshotFile::StreamVisitor& visit) {
+            for_each_stream(visit);
+        });
+    }
+    
+    // One event loop per I/O thread; the listener lives on the first one
+    size_t num_workers = config_.io_threads > 0 ? static_cast<size_t>(config_.io_threads) : cores;
+    for (size_t i = 0; i < num_workers; i++) {
+        workers_.push_back(std::make_unique<IoWorker>());
+    }
+    
+    workers_[0]->loop.add_fd(server_socket_, EPOLLIN, [this](uint32_t) {
+        accept_connections();
+    });
+    
     running_ = true;
-    std::cout << "Redis Streams Server listening on port " << port_ << std::endl;
+    std::cout << "Redis Streams Server listening on port " << config_.port
+              << " (" << num_workers << " I/O threads";
+    if (!shards_.empty()) {
+        std::cout << ", " << shards_.size() << " shards";
+    }
+    std::cout << ")" << std::endl;
+    
+    for (auto& worker : workers_) {
+        IoWorker* w = worker.get();
+        w->thread = std::thread([w] { w->loop.run(); });
+    }
+    
+    // Replicated writes may wake blocked readers, so the loops run first
+    if (config_.replicaof_port != 0) {
+        ReplicaLink::Options options;
+        options.host = config_.replicaof_host;
+        options.port = config_.replicaof_port;
+        options.snapshot_path = config_.dbfilename + ".sync";
+        primary_link_ = std::make_unique<ReplicaLink>(
+            options, [this](const AppendLog::Command& command) { apply_replicated(command); },
+            [this](const std::string& path) { load_replica_snapshot(path); });
+        primary_link_->start();
+    }
     
-    // Start accepting connections in a separate thread
-    accept_thread_ = std::thread(&RedisServer::accept_connections, this);
+    pthread_sigmask(SIG_SETMASK, &previous_mask, nullptr);
 }
 
 void RedisServer::stop() {
-    running_ = false;
+    if (!running_.exchange(false)) {
+        return;
+    }
+    
+    for (auto& worker : workers_) {
+        worker->loop.stop();
+    }
+    for (auto& worker : workers_) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+    
+    // Replicated records run on the shards, so the link ends before them
+    if (primary_link_) {
+        primary_link_->stop();
+    }
+    
+    // Shards may still post replies to the loops, so they go before the workers
+    for (auto& shard : shards_) {
+        shard->stop();
+    }
+    
+    // Nothing appends any more; write out and sync the rest. Rewrites,
+    // background saves, spills and replica resyncs still walk the shards,
+    // so they end first.
+    if (aof_) {
+        aof_->stop();
+    }
+    if (backlog_) {
+        backlog_->stop();
+    }
+    snapshots_->wait();
+    if (tiering_) {
+        tiering_->stop();
+    }
+    
+    shards_.clear();
+    workers_.clear(); // Closes all client sockets
     
     if (server_socket_ != -1) {
         close(server_socket_);
         server_socket_ = -1;
     }
-    
-    if (accept_thread_.joinable()) {
-        accept_thread_.join();
-    }
 }
 
 void RedisServer::accept_connections() {
@@ -73,427 +500,1475 @@ void RedisServer::accept_connections() {
         struct sockaddr_in client_address;
         socklen_t client_len = sizeof(client_address);
         
-        int client_socket = accept(server_socket_, (struct sockaddr*)&client_address, &client_len);
+        int client_socket = accept4(server_socket_, (struct sockaddr*)&client_address, &client_len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
         
         if (client_socket < 0) {
-            if (running_) {
-                std::cerr << "Failed to accept client connection" << std::endl;
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
             }
-            continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "Failed to accept client connection: " << std::strerror(errno) << std::endl;
+            }
+            break;
         }
         
-        // Handle client in a separate thread
-        std::thread client_thread(&RedisServer::handle_client, this, client_socket);
-        client_thread.detach();
+        int nodelay = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        
+        // Hand the socket to the next event loop in round-robin order
+        IoWorker* worker = workers_[next_worker_++ % workers_.size()].get();
+        worker->loop.post([this, worker, client_socket] {
+            register_connection(*worker, client_socket);
+        });
     }
 }
 
-void RedisServer::handle_client(int client_socket) {
-    char buffer[4096];
-    std::string accumulated_data;
+void RedisServer::register_connection(IoWorker& worker, int client_socket) {
+    auto conn = std::make_shared<Connection>(client_socket);
+    conn->set_interest(EPOLLIN);
     
-    while (running_) {
-        ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-        
-        if (bytes_received <= 0) {
-            break; // Client disconnected or error
-        }
-        
-        buffer[bytes_received] = '\0';
-        accumulated_data += buffer;
-        
-        // Process complete commands
-        size_t pos = 0;
-        while (pos < accumulated_data.length()) {
-            size_t command_end = accumulated_data.find("\r\n", pos);
-            if (command_end == std::string::npos) {
-                // Need more data for RESP parsing
-                if (accumulated_data[pos] == '*') {
-                    // Try to parse as array command
-                    try {
-                        std::string command_data = accumulated_data.substr(pos);
-                        std::string response = process_command(command_data);
-                        
-                        send(client_socket, response.c_str(), response.length(), 0);
-                        accumulated_data.clear();
-                        break;
-                    } catch (const std::exception&) {
-                        // Not enough data yet, continue reading
-                        break;
-                    }
-                } else {
-                    break; // Wait for more data
-                }
-            } else {
-                // Simple inline command
-                std::string command = accumulated_data.substr(pos, command_end - pos);
-                std::string response = process_command(command);
-                
-                send(client_socket, response.c_str(), response.length(), 0);
-                pos = command_end + 2;
-            }
+    bool added = worker.loop.add_fd(client_socket, EPOLLIN, [this, &worker, client_socket](uint32_t events) {
+        handle_connection_event(worker, client_socket, events);
+    });
+    if (added) {
+        worker.connections[client_socket] = conn;
+    }
+}
+
+void RedisServer::handle_connection_event(IoWorker& worker, int client_socket, uint32_t events) {
+    auto it = worker.connections.find(client_socket);
+    if (it == worker.connections.end()) {
+        return;
+    }
+    std::shared_ptr<Connection> conn = it->second;
+    
+    // A hung-up peer cannot receive a reply that is still being computed;
+    // parked clients are watched for EPOLLRDHUP so they don't wait forever
+    if ((events & EPOLLERR) || ((events & (EPOLLHUP | EPOLLRDHUP)) && conn->awaiting_reply())) {
+        close_connection(worker, client_socket);
+        return;
+    }
+    
+    if (events & EPOLLOUT) {
+        if (!conn->flush()) {
+            close_connection(worker, client_socket);
+            return;
         }
-        
-        if (pos > 0) {
-            accumulated_data = accumulated_data.substr(pos);
+        // Pick up pipelined commands that were held back by the output limit
+        if (!conn->has_pending_output() && conn->state() == Connection::State::Reading &&
+            !serve_input(worker, conn)) {
+            return;
+        }
+    }
+    
+    if ((events & (EPOLLIN | EPOLLHUP)) && conn->state() == Connection::State::Reading &&
+        !conn->awaiting_reply()) {
+        bool open = conn->read_available();
+        if (!serve_input(worker, conn)) {
+            return;
+        }
+        if (!open) {
+            conn->set_closing();
         }
     }
     
-    close(client_socket);
+    update_connection_interest(worker, *conn);
 }
 
-std::string RedisServer::process_command(const std::string& command) {
-    try {
-        auto parts = RedisProtocol::parse_command(command);
+bool RedisServer::serve_input(IoWorker& worker, const std::shared_ptr<Connection>& conn) {
+    // Run the whole pipelined batch, then send all its replies at once
+    while (true) {
+        bool held_back = process_input(worker, conn);
         
-        if (parts.empty()) {
-            return RedisProtocol::format_error("ERR empty command");
+        wait_for_log();
+        if (!conn->flush()) {
+            close_connection(worker, conn->fd());
+            return false;
         }
-        
-        // Convert command to uppercase
-        std::string cmd = parts[0];
-        std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
-        
-        if (cmd == "XADD") {
-            if (parts.size() < 4 || (parts.size() - 3) % 2 != 0) {
-                return RedisProtocol::format_error("ERR wrong number of arguments for 'xadd' command");
-            }
-            
-            std::string stream_name = parts[1];
-            std::string id = parts[2];
-            
-            std::vector<std::pair<std::string, std::string>> fields;
-            for (size_t i = 3; i < parts.size(); i += 2) {
-                fields.emplace_back(parts[i], parts[i + 1]);
-            }
-            
-            return xadd(stream_name, id, fields);
-            
-        } else if (cmd == "XREAD") {
-            // XREAD [COUNT count] [BLOCK milliseconds] STREAMS key [key ...] id [id ...]
-            size_t streams_pos = 0;
-            int count = -1;
-            int block = -1;
-            
-            for (size_t i = 1; i < parts.size(); i++) {
-                std::string arg = parts[i];
-                std::transform(arg.begin(), arg.end(), arg.begin(), ::toupper);
-                
-                if (arg == "STREAMS") {
-                    streams_pos = i + 1;
-                    break;
-                } else if (arg == "COUNT" && i + 1 < parts.size()) {
-                    count = std::stoi(parts[++i]);
-                } else if (arg == "BLOCK" && i + 1 < parts.size()) {
-                    block = std::stoi(parts[++i]);
-                }
-            }
-            
-            if (streams_pos == 0 || streams_pos >= parts.size()) {
-                return RedisProtocol::format_error("ERR wrong number of arguments for 'xread' command");
-            }
-            
-            size_t num_streams = (parts.size() - streams_pos) / 2;
-            if (num_streams == 0 || (parts.size() - streams_pos) % 2 != 0) {
-                return RedisProtocol::format_error("ERR Unbalanced XREAD list of streams: for each stream key an ID or $ must be specified");
-            }
-            
-            std::vector<std::string> streams(parts.begin() + streams_pos, parts.begin() + streams_pos + num_streams);
-            std::vector<std::string> ids(parts.begin() + streams_pos + num_streams, parts.end());
-            
-            return xread(streams, ids, count, block);
-            
-        } else if (cmd == "XRANGE") {
-            if (parts.size() < 4 || parts.size() > 6) {
-                return RedisProtocol::format_error("ERR wrong number of arguments for 'xrange' command");
-            }
-            
-            std::string stream_name = parts[1];
-            std::string start = parts[2];
-            std::string end = parts[3];
-            int count = -1;
-            
-            if (parts.size() >= 6 && parts[4] == "COUNT") {
-                count = std::stoi(parts[5]);
-            }
-            
-            return xrange(stream_name, start, end, count);
-            
-        } else if (cmd == "XLEN") {
-            if (parts.size() != 2) {
-                return RedisProtocol::format_error("ERR wrong number of arguments for 'xlen' command");
-            }
-            
-            return xlen(parts[1]);
-            
-        } else if (cmd == "XDEL") {
-            if (parts.size() < 3) {
-                return RedisProtocol::format_error("ERR wrong number of arguments for 'xdel' command");
-            }
-            
-            std::string stream_name = parts[1];
-            std::vector<std::string> ids(parts.begin() + 2, parts.end());
-            
-            return xdel(stream_name, ids);
-            
-        } else if (cmd == "XGROUP") {
-            if (parts.size() < 2) {
-                return RedisProtocol::format_error("ERR wrong number of arguments for 'xgroup' command");
-            }
-            
-            std::string subcommand = parts[1];
-            std::transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
-            
-            if (subcommand == "CREATE" && parts.size() == 5) {
-                return xgroup_create(parts[2], parts[3], parts[4]);
-            } else {
-                return RedisProtocol::format_error("ERR Unknown XGROUP subcommand or wrong number of arguments");
-            }
-            
-        } else if (cmd == "XREADGROUP") {
-            // XREADGROUP GROUP group consumer [COUNT count] [BLOCK milliseconds] STREAMS key [key ...] ID [ID ...]
-            if (parts.size() < 6) {
-                return RedisProtocol::format_error("ERR wrong number of arguments for 'xreadgroup' command");
-            }
-            
-            std::string group_name = parts[2];
-            std::string consumer_name = parts[3];
-            
-            size_t streams_pos = 0;
-            int count = -1;
-            int block = -1;
-            
-            for (size_t i = 4; i < parts.size(); i++) {
-                std::string arg = parts[i];
-                std::transform(arg.begin(), arg.end(), arg.begin(), ::toupper);
-                
-                if (arg == "STREAMS") {
-                    streams_pos = i + 1;
-                    break;
-                } else if (arg == "COUNT" && i + 1 < parts.size()) {
-                    count = std::stoi(parts[++i]);
-                } else if (arg == "BLOCK" && i + 1 < parts.size()) {
-                    block = std::stoi(parts[++i]);
-                }
-            }
-            
-            if (streams_pos == 0 || streams_pos >= parts.size()) {
-                return RedisProtocol::format_error("ERR wrong number of arguments for 'xreadgroup' command");
-            }
-            
-            size_t num_streams = (parts.size() - streams_pos) / 2;
-            if (num_streams == 0) {
-                return RedisProtocol::format_error("ERR Unbalanced XREADGROUP list of streams");
-            }
-            
-            std::vector<std::string> streams(parts.begin() + streams_pos, parts.begin() + streams_pos + num_streams);
-            std::vector<std::string> ids(parts.begin() + streams_pos + num_streams, parts.end());
-            
-            return xreadgroup(group_name, consumer_name, streams, ids, count, block);
-            
-        } else if (cmd == "XACK") {
-            if (parts.size() < 4) {
-                return RedisProtocol::format_error("ERR wrong number of arguments for 'xack' command");
-            }
-            
-            std::string stream_name = parts[1];
-            std::string group_name = parts[2];
-            std::vector<std::string> ids(parts.begin() + 3, parts.end());
-            
-            return xack(stream_name, group_name, ids);
-            
-        } else if (cmd == "PING") {
-            return RedisProtocol::format_simple_string("PONG");
-            
-        } else {
-            return RedisProtocol::format_error("ERR unknown command '" + parts[0] + "'");
+        if (!held_back || conn->has_pending_output()) {
+            return true;
         }
-        
-    } catch (const std::exception& e) {
-        return RedisProtocol::format_error("ERR " + std::string(e.what()));
     }
 }
 
-// Stream command implementations will be in separate files
-// For now, let's implement them here directly
-
-std::string RedisServer::xadd(const std::string& stream_name, const std::string& id, 
-                              const std::vector<std::pair<std::string, std::string>>& fields) {
-    std::lock_guard<std::mutex> lock(streams_mutex_);
-    
-    auto& stream = streams_[stream_name];
-    if (!stream) {
-        stream = std::make_shared<Stream>();
+void RedisServer::update_connection_interest(IoWorker& worker, Connection& conn) {
+    if (conn.state() == Connection::State::Closing && !conn.has_pending_output()) {
+        close_connection(worker, conn.fd());
+        return;
     }
     
-    try {
-        StreamID stream_id = StreamID::from_string(id);
-        StreamID actual_id = stream->add_entry(stream_id, fields);
-        return RedisProtocol::format_bulk_string(actual_id.to_string());
-    } catch (const std::exception& e) {
-        return RedisProtocol::format_error("ERR " + std::string(e.what()));
+    // Stop reading while replies are backed up or a reply is outstanding
+    uint32_t wanted = 0;
+    if (conn.has_pending_output()) {
+        wanted = EPOLLOUT;
+    } else if (conn.blocked()) {
+        wanted = EPOLLRDHUP;
+    } else if (!conn.awaiting_reply()) {
+        wanted = EPOLLIN;
+    }
+    if (wanted != conn.interest()) {
+        worker.loop.modify_fd(conn.fd(), wanted);
+        conn.set_interest(wanted);
     }
 }
 
-std::string RedisServer::xread(const std::vector<std::string>& streams, 
-                               const std::vector<std::string>& ids, 
-                               int count, int /* block */) {
-    std::vector<std::pair<std::string, std::vector<StreamEntry>>> results;
+void RedisServer::close_connection(IoWorker& worker, int client_socket) {
+    auto it = worker.connections.find(client_socket);
+    if (it != worker.connections.end() && it->second->blocked()) {
+        for (const auto& read : it->second->blocked_reads()) {
+            read->cancel();
+        }
+        worker.loop.cancel_timer(it->second->block_timer());
+    }
     
-    std::lock_guard<std::mutex> lock(streams_mutex_);
+    worker.loop.remove_fd(client_socket);
+    worker.connections.erase(client_socket);
+}
+
+bool RedisServer::process_input(IoWorker& worker, const std::shared_ptr<Connection>& conn) {
+    std::string& input = conn->input_buffer();
+    RespParser& parser = conn->parser();
+    bool held_back = false;
+    ShardBatches batches;
+    size_t batched = 0;
     
-    for (size_t i = 0; i < streams.size(); i++) {
-        const std::string& stream_name = streams[i];
-        const std::string& id_str = ids[i];
+    // Execute every complete command in order; a partial one stays buffered
+    // and the parser resumes it on the next read
+    while (!conn->awaiting_reply()) {
+        if (conn->pending_bytes() >= kMaxPendingOutput) {
+            held_back = true; // Let the client drain replies first
+            break;
+        }
+        if (batched == kPipelineBatch) {
+            break; // The rest follows once these are answered
+        }
         
-        auto it = streams_.find(stream_name);
-        if (it == streams_.end()) {
-            continue; // Stream doesn't exist
+        RespParser::Result result = parser.parse(input);
+        if (result == RespParser::Result::Incomplete) {
+            break;
+        }
+        if (result == RespParser::Result::Error) {
+            if (batched > 0) {
+                break; // Reported after the replies ahead of it
+            }
+            conn->output().append_error("ERR Protocol error: " + parser.error());
+            conn->set_closing();
+            break;
         }
         
-        try {
-            StreamID start_id = StreamID::from_string(id_str);
-            auto entries = it->second->get_entries_after(start_id, count);
-            
-            if (!entries.empty()) {
-                results.emplace_back(stream_name, entries);
+        const auto& args = parser.args();
+        const Command* command = args.empty() ? nullptr : find_command(args[0]);
+        
+        // Queue commands for their shard as long as each touches just one;
+        // anything else waits until the queued ones have been answered
+        if (!shards_.empty()) {
+            bool read_only = command && (command->flags & kWrite) && primary_link_;
+            Shard* owner = read_only ? nullptr : pipeline_shard(command, args);
+            if (owner) {
+                if (batches.empty()) {
+                    batches.resize(shards_.size());
+                }
+                batches[owner->index()].push_back({batched++, command, OwnedArgs(args)});
+                continue;
             }
-        } catch (const std::exception&) {
-            continue; // Skip invalid ID
+            if (batched > 0) {
+                parser.unparse();
+                break;
+            }
+        }
+        
+        if (command && (command->flags & kTakeover)) {
+            if (attach_replica(worker, conn, args)) {
+                break;
+            }
+            continue;
+        }
+        if (command && (command->flags & kWrite) && primary_link_) {
+            // A replica's data only changes through its primary
+            conn->output().append_error("READONLY You can't write against a read only replica.");
+            continue;
+        }
+        
+        if (shards_.empty()) {
+            std::shared_ptr<BlockedRead> park;
+            execute(conn->output(), command, args, &park, conn.get());
+            if (park) {
+                // Retries run on this loop, which can see every stream
+                conn->set_awaiting_reply(true);
+                block_connection(worker, conn, park, [&worker](BlockedRead::Task task) {
+                    worker.loop.post(std::move(task));
+                });
+            }
+        } else if (route_to_shards(worker, conn, command, args)) {
+            conn->set_awaiting_reply(true);
         }
     }
     
-    return RedisProtocol::format_stream_read_response(results);
-}
-
-std::string RedisServer::xrange(const std::string& stream_name, 
-                                const std::string& start, const std::string& end, 
-                                int count) {
-    std::lock_guard<std::mutex> lock(streams_mutex_);
-    
-    auto it = streams_.find(stream_name);
-    if (it == streams_.end()) {
-        return RedisProtocol::format_null_array();
+    if (batched > 0) {
+        run_pipeline(worker, conn, batches, batched);
     }
     
-    try {
-        StreamID start_id = (start == "-") ? StreamID(0, 0) : StreamID::from_string(start);
-        StreamID end_id = (end == "+") ? StreamID(UINT64_MAX, UINT64_MAX) : StreamID::from_string(end);
-        
-        auto entries = it->second->get_range(start_id, end_id, count);
-        return RedisProtocol::format_stream_entries(entries);
-    } catch (const std::exception& e) {
-        return RedisProtocol::format_error("ERR " + std::string(e.what()));
+    size_t consumed = parser.consumed();
+    if (consumed > 0) {
+        input.erase(0, consumed);
+        parser.discard(consumed);
     }
+    return held_back;
 }
 
-std::string RedisServer::xlen(const std::string& stream_name) {
-    std::lock_guard<std::mutex> lock(streams_mutex_);
-    
-    auto it = streams_.find(stream_name);
-    if (it == streams_.end()) {
-        return RedisProtocol::format_integer(0);
+Shard& RedisServer::shard_for(std::string_view key) const {
+    return *shards_[std::hash<std::string_view>()(key) % shards_.size()];
+}
+
+RedisServer::KeyRange RedisServer::command_keys(const Command* command, const CommandArgs& parts) const {
+    // The keys a command touches are always consecutive
+    KeyRange keys;
+    if (command && (command->flags & kStreamKeys)) {
+        size_t streams_pos = 0;
+        for (size_t i = command->key; i < parts.size(); i++) {
+            if (equals_upper(parts[i], "STREAMS")) {
+                streams_pos = i + 1;
+                break;
+            }
+            keys.blocking = keys.blocking || equals_upper(parts[i], "BLOCK");
+        }
+        
+        size_t remaining = streams_pos > 0 ? parts.size() - streams_pos : 0;
+        if (remaining > 0 && remaining % 2 == 0) {
+            keys.first = streams_pos;
+            keys.count = remaining / 2;
+        }
+    } else if (command && command->key > 0 && command->key < parts.size()) {
+        keys.first = command->key;
+        keys.count = 1;
     }
-    
-    return RedisProtocol::format_integer(static_cast<int64_t>(it->second->length()));
+    return keys;
 }
 
-std::string RedisServer::xdel(const std::string& stream_name, const std::vector<std::string>& ids) {
-    std::lock_guard<std::mutex> lock(streams_mutex_);
-    
-    auto it = streams_.find(stream_name);
-    if (it == streams_.end()) {
-        return RedisProtocol::format_integer(0);
+Shard* RedisServer::pipeline_shard(const Command* command, const CommandArgs& parts) const {
+    // A blocking read may park the client, which holds back what follows
+    KeyRange keys = command_keys(command, parts);
+    if (keys.count == 0 || keys.blocking) {
+        return nullptr;
     }
-    
-    std::vector<StreamID> stream_ids;
-    for (const std::string& id_str : ids) {
-        try {
-            stream_ids.push_back(StreamID::from_string(id_str));
-        } catch (const std::exception&) {
-            // Skip invalid IDs
+    Shard& owner = shard_for(parts[keys.first]);
+    for (size_t i = 1; i < keys.count; i++) {
+        if (&shard_for(parts[keys.first + i]) != &owner) {
+            return nullptr;
         }
     }
-    
-    bool deleted = it->second->delete_entries(stream_ids);
-    return RedisProtocol::format_integer(deleted ? stream_ids.size() : 0);
+    return &owner;
 }
 
-std::string RedisServer::xgroup_create(const std::string& stream_name, 
-                                       const std::string& group_name, 
-                                       const std::string& start_id) {
-    std::lock_guard<std::mutex> lock(streams_mutex_);
+void RedisServer::run_pipeline(IoWorker& worker, const std::shared_ptr<Connection>& conn, ShardBatches& batches,
+                               size_t commands) {
+    auto pipeline = std::make_shared<Pipeline>();
+    pipeline->replies.resize(commands);
+    for (const auto& batch : batches) {
+        pipeline->remaining += batch.empty() ? 0 : 1;
+    }
     
-    auto& stream = streams_[stream_name];
+    std::weak_ptr<Connection> weak_conn = conn;
+    for (size_t i = 0; i < batches.size(); i++) {
+        if (batches[i].empty()) {
+            continue;
+        }
+        shards_[i]->submit([this, &worker, weak_conn, pipeline, batch = std::move(batches[i])] {
+            // Shards write disjoint slots; the loop reads them after the post
+            std::shared_ptr<Connection> client = weak_conn.lock();
+            for (const auto& queued : batch) {
+                execute(pipeline->replies[queued.slot], queued.command, queued.args.args(), nullptr, client.get());
+            }
+            wait_for_log(); // One log sync covers the whole batch
+            
+            worker.loop.post([this, &worker, weak_conn, pipeline] {
+                if (--pipeline->remaining == 0) {
+                    complete_pipeline(worker, weak_conn, pipeline);
+                }
+            });
+        });
+    }
+    conn->set_awaiting_reply(true);
+}
+
+void RedisServer::complete_pipeline(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                                    const std::shared_ptr<Pipeline>& pipeline) {
+    std::shared_ptr<Connection> conn = weak_conn.lock();
+    if (!conn) {
+        return;
+    }
+    for (const auto& reply : pipeline->replies) {
+        conn->output().append_raw(reply.view());
+    }
+    resume_input(worker, conn);
+}
+
+bool RedisServer::route_to_shards(IoWorker& worker, const std::shared_ptr<Connection>& conn, const Command* command,
+                                  const CommandArgs& parts) {
+    KeyRange keys = command_keys(command, parts);
+    size_t first_key = keys.first;
+    size_t num_keys = keys.count;
+    
+    // Keyless or malformed commands are answered right here
+    if (num_keys == 0) {
+        execute(conn->output(), command, parts, nullptr, conn.get());
+        return false;
+    }
+    
+    std::weak_ptr<Connection> weak_conn = conn;
+    Shard& owner = shard_for(parts[first_key]);
+    bool single_shard = true;
+    for (size_t i = 1; i < num_keys && single_shard; i++) {
+        single_shard = &shard_for(parts[first_key + i]) == &owner;
+    }
+    
+    if (single_shard) {
+        // Arguments point into the connection buffer, so the shard gets a copy
+        owner.submit([this, &worker, &owner, weak_conn, command, owned = OwnedArgs(parts)] {
+            auto reply = std::make_shared<ReplyBuffer>();
+            std::shared_ptr<BlockedRead> park;
+            execute(*reply, command, owned.args(), &park, weak_conn.lock().get());
+            wait_for_log();
+            if (park) {
+                block_connection(worker, weak_conn, park, [&owner](BlockedRead::Task task) {
+                    owner.submit(std::move(task));
+                });
+                return;
+            }
+            worker.loop.post([this, &worker, weak_conn, reply] {
+                complete_deferred(worker, weak_conn, *reply);
+            });
+        });
+        return true;
+    }
+    
+    // Multi-key read spanning shards: one sub-read per stream, merged in
+    // request order on the connection's loop once every shard has answered
+    auto fan_out = std::make_shared<FanOut>();
+    fan_out->replies.resize(num_keys);
+    fan_out->parked.resize(num_keys);
+    fan_out->shards.resize(num_keys);
+    fan_out->remaining = num_keys;
+    
+    for (size_t i = 0; i < num_keys; i++) {
+        CommandArgs sub_command(parts.begin(), parts.begin() + first_key);
+        sub_command.push_back(parts[first_key + i]);
+        sub_command.push_back(parts[first_key + num_keys + i]);
+        
+        Shard& shard = shard_for(parts[first_key + i]);
+        fan_out->shards[i] = &shard;
+        shard.submit([this, &worker, &shard, weak_conn, fan_out, i, command, owned = OwnedArgs(sub_command)] {
+            auto reply = std::make_shared<ReplyBuffer>();
+            std::shared_ptr<BlockedRead> park;
+            execute(*reply, command, owned.args(), &park, weak_conn.lock().get());
+            wait_for_log();
+            
+            worker.loop.post([this, &worker, weak_conn, fan_out, i, reply, park] {
+                if (park) {
+                    fan_out->parked[i] = park;
+                } else {
+                    fan_out->replies[i] = std::move(*reply);
+                }
+                fan_out->remaining--;
+                collect_fan_out(worker, weak_conn, fan_out);
+            });
+            
+            if (park) {
+                // The first stream to get an entry ends the read. Siblings
+                // woken meanwhile have already delivered to the group, so
+                // their entries are kept and go out in the same reply.
+                park->arm([&shard](BlockedRead::Task task) { shard.submit(std::move(task)); },
+                          [this, &worker, weak_conn, fan_out, i](std::shared_ptr<ReplyBuffer> woken) {
+                              worker.loop.post([this, &worker, weak_conn, fan_out, i, woken] {
+                                  if (fan_out->done) {
+                                      return;
+                                  }
+                                  fan_out->replies[i] = std::move(*woken);
+                                  if (fan_out->remaining == 0) {
+                                      settle_fan_out(worker, weak_conn, fan_out);
+                                  }
+                              });
+                          });
+            }
+        });
+    }
+    return true;
+}
+
+void RedisServer::complete_deferred(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                                    const ReplyBuffer& reply) {
+    std::shared_ptr<Connection> conn = weak_conn.lock();
+    if (!conn) {
+        return; // Client went away while the command was running
+    }
+    
+    conn->output().append_raw(reply.view());
+    resume_input(worker, conn);
+}
+
+void RedisServer::resume_input(IoWorker& worker, const std::shared_ptr<Connection>& conn) {
+    conn->set_awaiting_reply(false);
+    
+    // Resume any pipelined commands that arrived behind the deferred ones
+    if (conn->state() == Connection::State::Closing) {
+        if (!conn->flush()) {
+            close_connection(worker, conn->fd());
+            return;
+        }
+    } else if (!serve_input(worker, conn)) {
+        return;
+    }
+    update_connection_interest(worker, *conn);
+}
+
+void RedisServer::block_connection(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                                   const std::shared_ptr<BlockedRead>& read, BlockedRead::Executor executor) {
+    // Posted before arming, so the loop has set up the timeout by the time
+    // any reply of the read reaches it
+    worker.loop.post([this, &worker, weak_conn, read] {
+        park_connection(worker, weak_conn, read);
+    });
+    read->arm(std::move(executor), [this, &worker, weak_conn](std::shared_ptr<ReplyBuffer> reply) {
+        worker.loop.post([this, &worker, weak_conn, reply] {
+            complete_blocked(worker, weak_conn, *reply);
+        });
+    });
+}
+
+void RedisServer::park_connection(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                                  const std::shared_ptr<BlockedRead>& read) {
+    std::shared_ptr<Connection> conn = weak_conn.lock();
+    if (!conn) {
+        read->cancel();
+        return;
+    }
+    
+    EventLoop::TimerId timer = 0;
+    if (read->timeout_ms() > 0) {
+        timer = worker.loop.add_timer(read->timeout_ms(), [read] { read->expire(); });
+    }
+    conn->set_blocked({read}, timer);
+    update_connection_interest(worker, *conn);
+}
+
+void RedisServer::complete_blocked(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                                   const ReplyBuffer& reply) {
+    if (std::shared_ptr<Connection> conn = weak_conn.lock()) {
+        worker.loop.cancel_timer(conn->block_timer());
+        conn->clear_blocked();
+    }
+    complete_deferred(worker, weak_conn, reply);
+}
+
+void RedisServer::collect_fan_out(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                                  const std::shared_ptr<FanOut>& fan_out) {
+    if (fan_out->done || fan_out->remaining > 0) {
+        return;
+    }
+    
+    ReplyBuffer reply;
+    RedisProtocol::merge_stream_read_responses(reply, fan_out->replies);
+    
+    std::vector<std::shared_ptr<BlockedRead>> parked;
+    for (const auto& read : fan_out->parked) {
+        if (read) {
+            parked.push_back(read);
+        }
+    }
+    if (parked.empty()) {
+        complete_fan_out(worker, weak_conn, fan_out, reply);
+        return;
+    }
+    if (reply.view() != "*-1\r\n") {
+        settle_fan_out(worker, weak_conn, fan_out);
+        return;
+    }
+    
+    // Nothing on any shard yet: wait for the first one to wake
+    std::shared_ptr<Connection> conn = weak_conn.lock();
+    if (!conn) {
+        fan_out->done = true;
+        for (const auto& read : parked) {
+            read->cancel();
+        }
+        return;
+    }
+    
+    uint64_t timeout_ms = parked.front()->timeout_ms();
+    if (timeout_ms > 0) {
+        fan_out->timer = worker.loop.add_timer(timeout_ms, [this, &worker, weak_conn, fan_out] {
+            fan_out->timer = 0;
+            settle_fan_out(worker, weak_conn, fan_out); // Null unless a stream woke just now
+        });
+    }
+    conn->set_blocked(std::move(parked), fan_out->timer);
+    update_connection_interest(worker, *conn);
+}
+
+void RedisServer::settle_fan_out(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                                 const std::shared_ptr<FanOut>& fan_out) {
+    if (fan_out->done || fan_out->settling) {
+        return;
+    }
+    fan_out->settling = true;
+    if (fan_out->timer) {
+        worker.loop.cancel_timer(fan_out->timer);
+        fan_out->timer = 0;
+    }
+    
+    // A sub-read retries on its shard's thread, so a cancel queued there
+    // runs either before the retry (which then never reads) or after it, in
+    // which case its reply was posted here ahead of the acknowledgement.
+    // Once every shard acknowledged, all replies are in.
+    for (size_t i = 0; i < fan_out->parked.size(); i++) {
+        const std::shared_ptr<BlockedRead>& read = fan_out->parked[i];
+        if (!read) {
+            continue;
+        }
+        fan_out->unsettled++;
+        fan_out->shards[i]->submit([this, &worker, weak_conn, fan_out, read] {
+            read->cancel();
+            worker.loop.post([this, &worker, weak_conn, fan_out] {
+                if (--fan_out->unsettled > 0 || fan_out->done) {
+                    return;
+                }
+                ReplyBuffer reply;
+                RedisProtocol::merge_stream_read_responses(reply, fan_out->replies);
+                complete_fan_out(worker, weak_conn, fan_out, reply);
+            });
+        });
+    }
+}
+
+void RedisServer::complete_fan_out(IoWorker& worker, const std::weak_ptr<Connection>& weak_conn,
+                                   const std::shared_ptr<FanOut>& fan_out, const ReplyBuffer& reply) {
+    fan_out->done = true;
+    for (const auto& read : fan_out->parked) {
+        if (read) {
+            read->cancel();
+        }
+    }
+    if (fan_out->timer) {
+        worker.loop.cancel_timer(fan_out->timer);
+    }
+    if (std::shared_ptr<Connection> conn = weak_conn.lock()) {
+        conn->clear_blocked();
+    }
+    complete_deferred(worker, weak_conn, reply);
+}
+
+StreamDirectory& RedisServer::directory() {
+    Shard* shard = Shard::current();
+    return shard ? shard->streams() : streams_;
+}
+
+const auto& RedisServer::command_table() {
+    static constexpr Command kCommands[] = {
+        {"XADD", -5, kWrite, 1, &RedisServer::xadd_command},
+        {"XADDBATCH", -6, kWrite, 1, &RedisServer::xaddbatch_command},
+        {"XTRIM", -4, kWrite, 1, &RedisServer::xtrim_command},
+        {"XREAD", -4, kStreamKeys, 1, &RedisServer::xread_command},
+        {"XRANGE", -4, 0, 1, &RedisServer::xrange_command},
+        {"XLEN", 2, 0, 1, &RedisServer::xlen_command},
+        {"XDEL", -3, kWrite, 1, &RedisServer::xdel_command},
+        {"XGROUP", -2, kWrite, 2, &RedisServer::xgroup_command},
+        {"XREADGROUP", -7, kWrite | kStreamKeys, 4, &RedisServer::xreadgroup_command},
+        {"XACK", -4, kWrite, 1, &RedisServer::xack_command},
+        {"XPENDING", -3, 0, 1, &RedisServer::xpending_command},
+        {"XCLAIM", -6, kWrite, 1, &RedisServer::xclaim_command},
+        {"XAUTOCLAIM", -6, kWrite, 1, &RedisServer::xautoclaim_command},
+        {"XSETID", 3, kWrite, 1, &RedisServer::xsetid_command},
+        {"MEMORY", -2, 0, 2, &RedisServer::memory_command},
+        {"INFO", -1, 0, 0, &RedisServer::info_command},
+        {"BGREWRITEAOF", 1, 0, 0, &RedisServer::bgrewriteaof_command},
+        {"SAVE", 1, 0, 0, &RedisServer::save_command},
+        {"BGSAVE", -1, 0, 0, &RedisServer::bgsave_command},
+        {"PING", -1, 0, 0, &RedisServer::ping_command},
+        {"REPLCONF", -1, 0, 0, &RedisServer::replconf_command},
+        {"SLOWLOG", -2, 0, 0, &RedisServer::slowlog_command},
+        {"LATENCY", -2, 0, 0, &RedisServer::latency_command},
+        {"PSYNC", -3, kTakeover, 0, nullptr},
+    };
+    static constexpr auto kTable = make_command_table(kCommands);
+    static_assert(kTable.size() <= CommandStats::kMaxCommands, "CommandStats numbers fewer commands");
+    return kTable;
+}
+
+const RedisServer::Command* RedisServer::find_command(std::string_view name) {
+    return command_table().find(name);
+}
+
+void RedisServer::execute_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park) {
+    execute(out, args.empty() ? nullptr : find_command(args[0]), args, park);
+}
+
+void RedisServer::execute(ReplyBuffer& out, const Command* command, const CommandArgs& args,
+                          std::shared_ptr<BlockedRead>* park, const Connection* client) {
+    if (args.empty()) {
+        out.append_error("ERR empty command");
+        return;
+    }
+    if (!command || !command->handler) {
+        out.append_error("ERR unknown command '" + std::string(args[0]) + "'");
+        return;
+    }
+    
+    size_t index = command_table().index_of(command);
+    size_t arity = static_cast<size_t>(command->arity < 0 ? -command->arity : command->arity);
+    if (command->arity < 0 ? args.size() < arity : args.size() != arity) {
+        CommandStats::record(index, 0, CommandStats::Outcome::Rejected);
+        out.append_error("ERR wrong number of arguments for '" + lower_case(command->name) + "' command");
+        return;
+    }
+    
+    size_t reply_start = out.size();
+    uint64_t started = CommandStats::now();
+    try {
+        (this->*command->handler)(out, args, park);
+    } catch (const std::exception& e) {
+        out.truncate(reply_start); // Drop any partial reply
+        out.append_error("ERR " + std::string(e.what()));
+    }
+    uint64_t ns = CommandStats::elapsed_ns(started, CommandStats::now());
+    
+    bool failed = out.size() > reply_start && out.view()[reply_start] == '-';
+    CommandStats::record(index, ns, failed ? CommandStats::Outcome::Failed : CommandStats::Outcome::Ok);
+    if (slowlog_.slow(ns / 1000)) {
+        slowlog_.add(args, ns / 1000, client ? std::string_view(client->peer()) : std::string_view());
+    }
+}
+
+void RedisServer::xadd_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    // XADD key [NOMKSTREAM] [MAXLEN|MINID [=|~] threshold [LIMIT count]] id field value [...]
+    StreamTrim trim;
+    bool no_mkstream = false;
+    size_t pos = parse_add_options(args, trim, no_mkstream);
+    
+    if (args.size() < pos + 3 || (args.size() - pos - 1) % 2 != 0) {
+        out.append_error("ERR wrong number of arguments for 'xadd' command");
+        return;
+    }
+    
+    // Fields reach storage as views into the request; the vector is reused
+    thread_local FieldViews fields;
+    fields.clear();
+    for (size_t i = pos + 1; i < args.size(); i += 2) {
+        fields.emplace_back(args[i], args[i + 1]);
+    }
+    
+    xadd(out, args[1], args[pos], fields, trim, no_mkstream);
+}
+
+void RedisServer::xaddbatch_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    // XADDBATCH key [NOMKSTREAM] [MAXLEN|MINID [=|~] threshold [LIMIT count]] id
+    //           numfields field value [...] [numfields field value [...] ...]
+    StreamTrim trim;
+    bool no_mkstream = false;
+    size_t pos = parse_add_options(args, trim, no_mkstream);
+    
+    // One group of views per entry; the vectors are reused
+    thread_local std::vector<FieldViews> entries;
+    size_t count = 0;
+    for (size_t i = pos + 1; i < args.size(); count++) {
+        int64_t num_fields = parse_integer(args[i++]);
+        if (num_fields <= 0 || static_cast<uint64_t>(num_fields) > (args.size() - i) / 2) {
+            out.append_error("ERR wrong number of arguments for 'xaddbatch' command");
+            return;
+        }
+        if (count == entries.size()) {
+            entries.emplace_back();
+        }
+        FieldViews& fields = entries[count];
+        fields.clear();
+        for (int64_t field = 0; field < num_fields; field++, i += 2) {
+            fields.emplace_back(args[i], args[i + 1]);
+        }
+    }
+    if (count == 0) {
+        out.append_error("ERR wrong number of arguments for 'xaddbatch' command");
+        return;
+    }
+    entries.resize(count);
+    
+    xaddbatch(out, args[1], args[pos], entries, trim, no_mkstream);
+}
+
+void RedisServer::xtrim_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    // XTRIM key MAXLEN|MINID [=|~] threshold [LIMIT count]
+    StreamTrim trim;
+    if ((!equals_upper(args[2], "MAXLEN") && !equals_upper(args[2], "MINID")) ||
+        parse_trim(args, 2, trim) != args.size()) {
+        out.append_error("ERR syntax error");
+        return;
+    }
+    
+    xtrim(out, args[1], trim);
+}
+
+void RedisServer::xread_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>* park) {
+    // XREAD [COUNT count] [BLOCK milliseconds] STREAMS key [key ...] id [id ...]
+    int count = -1;
+    int block = -1;
+    size_t streams_pos = parse_read_options(args, 1, count, block);
+    if (streams_pos == 0 || streams_pos >= args.size()) {
+        out.append_error("ERR wrong number of arguments for 'xread' command");
+        return;
+    }
+    
+    size_t num_streams = (args.size() - streams_pos) / 2;
+    if (num_streams == 0 || (args.size() - streams_pos) % 2 != 0) {
+        out.append_error("ERR Unbalanced XREAD list of streams: for each stream key an ID or $ must be specified");
+        return;
+    }
+    
+    xread(out, ArgSpan(args, streams_pos, num_streams), ArgSpan(args, streams_pos + num_streams, num_streams),
+          count, block, park);
+}
+
+void RedisServer::xrange_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    // XRANGE key start end [COUNT count]
+    int count = -1;
+    if (args.size() == 6 && equals_upper(args[4], "COUNT")) {
+        count = parse_count(args[5]);
+    } else if (args.size() != 4) {
+        out.append_error("ERR syntax error");
+        return;
+    }
+    
+    xrange(out, args[1], args[2], args[3], count);
+}
+
+void RedisServer::xlen_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    xlen(out, args[1]);
+}
+
+void RedisServer::xdel_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    xdel(out, args[1], ArgSpan(args, 2, args.size() - 2));
+}
+
+void RedisServer::xgroup_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    if (equals_upper(args[1], "CREATE") && args.size() == 5) {
+        xgroup_create(out, args[2], args[3], args[4]);
+    } else {
+        out.append_error("ERR Unknown XGROUP subcommand or wrong number of arguments");
+    }
+}
+
+void RedisServer::xreadgroup_command(ReplyBuffer& out, const CommandArgs& args,
+                                     std::shared_ptr<BlockedRead>* park) {
+    // XREADGROUP GROUP group consumer [COUNT count] [BLOCK milliseconds] STREAMS key [key ...] ID [ID ...]
+    if (!equals_upper(args[1], "GROUP")) {
+        out.append_error("ERR syntax error");
+        return;
+    }
+    
+    int count = -1;
+    int block = -1;
+    size_t streams_pos = parse_read_options(args, 4, count, block);
+    if (streams_pos == 0 || streams_pos >= args.size()) {
+        out.append_error("ERR wrong number of arguments for 'xreadgroup' command");
+        return;
+    }
+    
+    size_t num_streams = (args.size() - streams_pos) / 2;
+    if (num_streams == 0 || (args.size() - streams_pos) % 2 != 0) {
+        out.append_error("ERR Unbalanced XREADGROUP list of streams: "
+                         "for each stream key an ID or '>' must be specified");
+        return;
+    }
+    
+    xreadgroup(out, args[2], args[3], ArgSpan(args, streams_pos, num_streams),
+               ArgSpan(args, streams_pos + num_streams, num_streams), count, block, park);
+}
+
+void RedisServer::xack_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    xack(out, args[1], args[2], ArgSpan(args, 3, args.size() - 3));
+}
+
+void RedisServer::xpending_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    // XPENDING key group [[IDLE min-idle-time] start end count [consumer]]
+    if (args.size() == 3) {
+        xpending(out, args[1], args[2]);
+        return;
+    }
+    
+    size_t pos = 3;
+    uint64_t min_idle = 0;
+    if (equals_upper(args[3], "IDLE") && args.size() > 4) {
+        min_idle = parse_ms(args[4]);
+        pos = 5;
+    }
+    if (args.size() < pos + 3 || args.size() > pos + 4) {
+        out.append_error("ERR syntax error");
+        return;
+    }
+    
+    int64_t count = parse_integer(args[pos + 2]);
+    std::string_view consumer_name = args.size() == pos + 4 ? args[pos + 3] : std::string_view();
+    xpending_range(out, args[1], args[2], args[pos], args[pos + 1], count < 0 ? 0 : static_cast<size_t>(count),
+                   consumer_name, min_idle);
+}
+
+void RedisServer::xclaim_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    // XCLAIM key group consumer min-idle-time id [id ...] [IDLE ms] [TIME unix-ms]
+    //        [RETRYCOUNT count] [FORCE] [JUSTID] [LASTID id]
+    ConsumerGroup::ClaimOptions options;
+    options.min_idle_ms = parse_ms(args[4]);
+    
+    // IDs run up to the first option keyword
+    size_t i = 5;
+    while (i < args.size() && !is_claim_option(args[i])) {
+        i++;
+    }
+    ArgSpan ids(args, 5, i - 5);
+    
+    for (; i < args.size(); i++) {
+        bool has_value = i + 1 < args.size();
+        if (equals_upper(args[i], "FORCE")) {
+            options.force = true;
+        } else if (equals_upper(args[i], "JUSTID")) {
+            options.just_id = true;
+        } else if (equals_upper(args[i], "IDLE") && has_value) {
+            options.idle_ms = parse_integer(args[++i]);
+        } else if (equals_upper(args[i], "TIME") && has_value) {
+            options.time_ms = parse_integer(args[++i]);
+        } else if (equals_upper(args[i], "RETRYCOUNT") && has_value) {
+            options.retry_count = parse_integer(args[++i]);
+        } else if (equals_upper(args[i], "LASTID") && has_value) {
+            options.last_id = StreamID::from_string(args[++i]);
+        } else {
+            out.append_error("ERR syntax error");
+            return;
+        }
+    }
+    
+    xclaim(out, args[1], args[2], args[3], ids, options);
+}
+
+void RedisServer::xautoclaim_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    // XAUTOCLAIM key group consumer min-idle-time start [COUNT count] [JUSTID]
+    size_t count = 100;
+    bool just_id = false;
+    for (size_t i = 6; i < args.size(); i++) {
+        if (equals_upper(args[i], "COUNT") && i + 1 < args.size()) {
+            int64_t value = parse_integer(args[++i]);
+            // Redis refuses counts whose scan budget (10 per entry) overflows
+            if (value < 1 || value > INT64_MAX / 10) {
+                out.append_error("ERR COUNT must be > 0");
+                return;
+            }
+            count = static_cast<size_t>(value);
+        } else if (equals_upper(args[i], "JUSTID")) {
+            just_id = true;
+        } else {
+            out.append_error("ERR syntax error");
+            return;
+        }
+    }
+    
+    xautoclaim(out, args[1], args[2], args[3], parse_ms(args[4]), args[5], count, just_id);
+}
+
+void RedisServer::xsetid_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    xsetid(out, args[1], args[2]);
+}
+
+void RedisServer::memory_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    // MEMORY USAGE key [SAMPLES count]; the figure is exact, so SAMPLES is ignored
+    if (equals_upper(args[1], "USAGE") && (args.size() == 3 || args.size() == 5)) {
+        memory_usage(out, args[2]);
+    } else {
+        out.append_error("ERR Unknown MEMORY subcommand or wrong number of arguments");
+    }
+}
+
+void RedisServer::info_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    if (args.size() > 2) {
+        out.append_error("ERR syntax error");
+        return;
+    }
+    
+    std::string section(args.size() > 1 ? args[1] : "default");
+    std::transform(section.begin(), section.end(), section.begin(), ::tolower);
+    info(out, section);
+}
+
+void RedisServer::bgrewriteaof_command(ReplyBuffer& out, const CommandArgs&, std::shared_ptr<BlockedRead>*) {
+    bgrewriteaof(out);
+}
+
+void RedisServer::save_command(ReplyBuffer& out, const CommandArgs&, std::shared_ptr<BlockedRead>*) {
+    save(out);
+}
+
+void RedisServer::bgsave_command(ReplyBuffer& out, const CommandArgs&, std::shared_ptr<BlockedRead>*) {
+    bgsave(out);
+}
+
+void RedisServer::ping_command(ReplyBuffer& out, const CommandArgs&, std::shared_ptr<BlockedRead>*) {
+    out.append_simple_string("PONG");
+}
+
+void RedisServer::replconf_command(ReplyBuffer& out, const CommandArgs&, std::shared_ptr<BlockedRead>*) {
+    // Handshake options; acknowledgements only arrive once replicas are attached
+    out.append_simple_string("OK");
+}
+
+void RedisServer::slowlog_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    // SLOWLOG GET [count] | LEN | RESET
+    if (equals_upper(args[1], "GET") && args.size() <= 3) {
+        int64_t count = args.size() == 3 ? parse_integer(args[2]) : 10;
+        if (count < -1) {
+            out.append_error("ERR count should be greater than or equal to -1");
+            return;
+        }
+        std::vector<SlowLog::Entry> entries = slowlog_.get(count == -1 ? SIZE_MAX : static_cast<size_t>(count));
+        out.append_array_header(entries.size());
+        for (const SlowLog::Entry& entry : entries) {
+            out.append_array_header(6);
+            out.append_integer(static_cast<int64_t>(entry.id));
+            out.append_integer(entry.time);
+            out.append_integer(static_cast<int64_t>(entry.duration_us));
+            out.append_array_header(entry.args.size());
+            for (const std::string& arg : entry.args) {
+                out.append_bulk_string(arg);
+            }
+            out.append_bulk_string(entry.client);
+            out.append_bulk_string("");     // client name; connections have none
+        }
+    } else if (equals_upper(args[1], "LEN") && args.size() == 2) {
+        out.append_integer(static_cast<int64_t>(slowlog_.length()));
+    } else if (equals_upper(args[1], "RESET") && args.size() == 2) {
+        slowlog_.reset();
+        out.append_simple_string("OK");
+    } else {
+        out.append_error("ERR Unknown SLOWLOG subcommand or wrong number of arguments");
+    }
+}
+
+void RedisServer::latency_command(ReplyBuffer& out, const CommandArgs& args, std::shared_ptr<BlockedRead>*) {
+    // LATENCY HISTOGRAM [command ...]: cumulative call counts at power-of-two
+    // microsecond bounds, for every command run so far or those named
+    if (!equals_upper(args[1], "HISTOGRAM")) {
+        out.append_error("ERR Unknown LATENCY subcommand or wrong number of arguments");
+        return;
+    }
+    
+    std::vector<const Command*> selected;
+    for (const Command& command : command_table()) {
+        bool named = args.size() == 2;
+        for (size_t i = 2; i < args.size() && !named; i++) {
+            named = equals_upper(args[i], command.name);
+        }
+        if (named && command.handler) {
+            selected.push_back(&command);
+        }
+    }
+    
+    std::vector<std::pair<const Command*, CommandStats::Summary>> histograms;
+    for (const Command* command : selected) {
+        CommandStats::Summary summary = CommandStats::summary(command_table().index_of(command));
+        if (summary.calls > 0) {
+            histograms.emplace_back(command, summary);
+        }
+    }
+    
+    out.append_array_header(histograms.size() * 2);
+    for (const auto& [command, summary] : histograms) {
+        uint64_t recorded = 0;
+        for (uint64_t count : summary.buckets) {
+            recorded += count;
+        }
+        std::vector<std::pair<uint64_t, uint64_t>> points;
+        uint64_t cumulative = 0;
+        size_t bucket = 0;
+        for (uint64_t usec = 1; cumulative < recorded; usec *= 2) {
+            while (bucket < CommandStats::kBuckets && CommandStats::bucket_limit(bucket) <= usec * 1000) {
+                cumulative += summary.buckets[bucket++];
+            }
+            if (bucket == CommandStats::kBuckets) {
+                cumulative = recorded;
+            }
+            if (cumulative > 0 && (points.empty() || points.back().second != cumulative)) {
+                points.emplace_back(usec, cumulative);
+            }
+        }
+        
+        out.append_bulk_string(lower_case(command->name));
+        out.append_array_header(4);
+        out.append_bulk_string("calls");
+        out.append_integer(static_cast<int64_t>(summary.calls));
+        out.append_bulk_string("histogram_usec");
+        out.append_array_header(points.size() * 2);
+        for (const auto& [usec, count] : points) {
+            out.append_integer(static_cast<int64_t>(usec));
+            out.append_integer(static_cast<int64_t>(count));
+        }
+    }
+}
+
+// Stream command implementations will be in separate files
+// For now, let's implement them here directly
+
+void RedisServer::xadd(ReplyBuffer& out, std::string_view stream_name, std::string_view id, const FieldViews& fields,
+                       const StreamTrim& trim, bool no_mkstream) {
+    auto log = log_lock(stream_name);
+    try {
+        StreamID stream_id = parse_add_id(id, 1);
+        auto stream = append_target(out, stream_name, no_mkstream, field_bytes(fields));
+        if (!stream) {
+            return;
+        }
+        
+        size_t length = stream->length();
+        StreamID actual_id = stream->add_entry(stream_id, fields, trim, id.find('*') == std::string_view::npos);
+        RedisProtocol::write_stream_id(out, actual_id);
+        
+        if (logging()) {
+            // Logged with the ID it got, and any trim as a separate record
+            std::string id_text = actual_id.to_string();
+            AppendLog::Command command{"XADD", stream_name, id_text};
+            for (const auto& field : fields) {
+                command.emplace_back(field.first);
+                command.emplace_back(field.second);
+            }
+            log_command(command);
+            if (stream->length() <= length) {
+                log_trim(stream_name, *stream);
+            }
+        }
+    } catch (const std::exception& e) {
+        out.append_error("ERR " + std::string(e.what()));
+    }
+}
+
+void RedisServer::xaddbatch(ReplyBuffer& out, std::string_view stream_name, std::string_view id,
+                            const std::vector<FieldViews>& entries, const StreamTrim& trim, bool no_mkstream) {
+    auto log = log_lock(stream_name);
+    try {
+        StreamID stream_id = parse_add_id(id, entries.size());
+        size_t bytes = 0;
+        for (const FieldViews& fields : entries) {
+            bytes += field_bytes(fields);
+        }
+        auto stream = append_target(out, stream_name, no_mkstream, bytes);
+        if (!stream) {
+            return;
+        }
+        
+        size_t length = stream->length();
+        StreamID first_id = stream->add_entries(stream_id, entries, trim, id.find('*') == std::string_view::npos);
+        StreamID last_id(first_id.timestamp_ms, first_id.sequence + entries.size() - 1);
+        out.append_array_header(2);
+        RedisProtocol::write_stream_id(out, first_id);
+        RedisProtocol::write_stream_id(out, last_id);
+        
+        if (logging()) {
+            // One record for the batch; from its exact first ID, replay
+            // assigns the same IDs again
+            std::string id_text = first_id.to_string();
+            std::vector<std::string> field_counts;
+            field_counts.reserve(entries.size());
+            AppendLog::Command command{"XADDBATCH", stream_name, id_text};
+            for (const FieldViews& fields : entries) {
+                field_counts.push_back(std::to_string(fields.size()));
+                command.emplace_back(field_counts.back());
+                for (const auto& field : fields) {
+                    command.emplace_back(field.first);
+                    command.emplace_back(field.second);
+                }
+            }
+            log_command(command);
+            if (stream->length() < length + entries.size()) {
+                log_trim(stream_name, *stream);
+            }
+        }
+    } catch (const std::exception& e) {
+        out.append_error("ERR " + std::string(e.what()));
+    }
+}
+
+std::shared_ptr<Stream> RedisServer::append_target(ReplyBuffer& out, std::string_view stream_name, bool no_mkstream,
+                                                   size_t incoming) {
+    auto stream = directory().find(stream_name);
+    
+    // At the memory cap, capped streams may make room by giving up their
+    // oldest blocks until the new entries fit; every other append is refused
+    if (over_memory_limit(incoming)) {
+        if (config_.maxmemory_policy != ServerConfig::MaxMemoryPolicy::TrimCapped || !stream || !stream->capped()) {
+            out.append_error(kOomError);
+            return nullptr;
+        }
+        bool evicted = false;
+        while (over_memory_limit(incoming) && stream->evict_oldest() > 0) {
+            evicted = true;
+        }
+        if (evicted) {
+            log_trim(stream_name, *stream);
+        }
+        if (over_memory_limit(incoming)) {
+            out.append_error(kOomError);
+            return nullptr;
+        }
+    }
+    
+    if (!stream) {
+        if (no_mkstream) {
+            out.append_null_bulk_string();
+            return nullptr;
+        }
+        stream = directory().find_or_create(stream_name);
+    }
+    return stream;
+}
+
+void RedisServer::xread(ReplyBuffer& out, ArgSpan streams, ArgSpan ids, int count, int block,
+                        std::shared_ptr<BlockedRead>* park) {
+    // Streams are encoded straight from storage as they are visited; the
+    // ones with nothing new are dropped again and the outer header goes in
+    // once we know how many are left
+    const StreamID last_possible(UINT64_MAX, UINT64_MAX);
+    size_t reply_start = out.size();
+    size_t readable = 0;
+    
+    // IDs as resolved at call time ("$" becomes the current last ID), which
+    // is what a blocked read keeps waiting past
+    std::vector<std::pair<size_t, StreamID>> resolved;
+    
+    for (size_t i = 0; i < streams.size(); i++) {
+        auto stream = directory().find(streams[i]);
+        
+        StreamID start_id;
+        try {
+            if (ids[i] == "$") {
+                start_id = stream ? stream->get_last_id() : StreamID(0, 0);
+            } else {
+                start_id = StreamID::from_string(ids[i]);
+            }
+        } catch (const std::exception&) {
+            continue; // Skip invalid ID
+        }
+        resolved.emplace_back(i, start_id);
+        
+        if (!stream) {
+            continue; // Stream doesn't exist
+        }
+        
+        // Entries strictly after start_id
+        if (start_id.sequence == UINT64_MAX) {
+            if (start_id.timestamp_ms == UINT64_MAX) {
+                continue;
+            }
+            start_id = StreamID(start_id.timestamp_ms + 1, 0);
+        } else {
+            start_id.sequence++;
+        }
+        
+        // Each stream response is an array of [stream_name, entries_array]
+        size_t stream_start = out.size();
+        auto guard = stream->read();
+        out.append_array_header(2);
+        out.append_bulk_string(streams[i]);
+        if (RedisProtocol::write_stream_range(out, guard.entries(), start_id, last_possible, count) == 0) {
+            out.truncate(stream_start);
+            continue;
+        }
+        readable++;
+    }
+    
+    if (readable > 0) {
+        out.insert_header(reply_start, '*', readable);
+        return;
+    }
+    
+    if (block < 0 || !park || resolved.empty()) {
+        out.append_null_array();
+        return;
+    }
+    
+    // Nothing yet: park the client on every stream, waiting for an entry
+    // past the ID it gave. The retry is a plain non-blocking XREAD.
+    std::vector<std::string> id_texts;
+    std::vector<std::string_view> retry_args;
+    for (const auto& entry : resolved) {
+        retry_args.push_back(streams[entry.first]);
+        id_texts.push_back(entry.second.to_string());
+    }
+    retry_args.insert(retry_args.end(), id_texts.begin(), id_texts.end());
+    auto read = std::make_shared<BlockedRead>(
+        [this, retry = OwnedArgs(retry_args), num_streams = resolved.size(), count](ReplyBuffer& retry_out) {
+            size_t start = retry_out.size();
+            xread(retry_out, ArgSpan(retry.args(), 0, num_streams), ArgSpan(retry.args(), num_streams, num_streams),
+                  count);
+            if (retry_out.view().substr(start) == "*-1\r\n") {
+                retry_out.truncate(start);
+                return false;
+            }
+            return true;
+        },
+        static_cast<uint64_t>(block));
+    for (const auto& entry : resolved) {
+        read->watch(directory().find_or_create(streams[entry.first]), entry.second);
+    }
+    *park = read;
+}
+
+void RedisServer::xrange(ReplyBuffer& out, std::string_view stream_name, std::string_view start, std::string_view end,
+                         int count) {
+    auto stream = directory().find(stream_name);
+    if (!stream) {
+        out.append_null_array();
+        return;
+    }
+    
+    try {
+        StreamID start_id = (start == "-") ? StreamID(0, 0) : StreamID::from_string(start);
+        StreamID end_id = (end == "+") ? StreamID(UINT64_MAX, UINT64_MAX) : StreamID::from_string(end);
+        
+        auto guard = stream->read();
+        RedisProtocol::write_stream_range(out, guard.entries(), start_id, end_id, count);
+    } catch (const std::exception& e) {
+        out.append_error("ERR " + std::string(e.what()));
+    }
+}
+
+void RedisServer::xlen(ReplyBuffer& out, std::string_view stream_name) {
+    auto stream = directory().find(stream_name);
+    if (!stream) {
+        out.append_integer(0);
+        return;
+    }
+    
+    out.append_integer(static_cast<int64_t>(stream->length()));
+}
+
+void RedisServer::xtrim(ReplyBuffer& out, std::string_view stream_name, const StreamTrim& trim) {
+    auto log = log_lock(stream_name);
+    auto stream = directory().find(stream_name);
+    if (!stream) {
+        out.append_integer(0);
+        return;
+    }
+    
+    size_t removed = stream->trim(trim);
+    if (removed > 0) {
+        log_trim(stream_name, *stream);
+    }
+    out.append_integer(static_cast<int64_t>(removed));
+}
+
+void RedisServer::xsetid(ReplyBuffer& out, std::string_view stream_name, std::string_view id) {
+    auto log = log_lock(stream_name);
+    // A rewritten log records an empty stream as XSETID alone, so replay
+    // creates the key
+    auto stream = loading_ ? directory().find_or_create(stream_name) : directory().find(stream_name);
+    if (!stream) {
+        out.append_error("ERR no such key");
+        return;
+    }
+    
+    StreamID stream_id;
+    try {
+        stream_id = StreamID::from_string(id);
+    } catch (const std::exception&) {
+        out.append_error("ERR Invalid stream ID specified as stream command argument");
+        return;
+    }
+    if (!stream->advance_last_id(stream_id)) {
+        out.append_error("ERR The ID specified in XSETID is smaller than the target stream top item");
+        return;
+    }
+    
+    log_command({"XSETID", stream_name, id});
+    out.append_simple_string("OK");
+}
+
+void RedisServer::xdel(ReplyBuffer& out, std::string_view stream_name, ArgSpan ids) {
+    auto log = log_lock(stream_name);
+    auto stream = directory().find(stream_name);
     if (!stream) {
-        stream = std::make_shared<Stream>();
+        out.append_integer(0);
+        return;
     }
     
+    std::vector<StreamID> stream_ids;
+    for (std::string_view id_str : ids) {
+        try {
+            stream_ids.push_back(StreamID::from_string(id_str));
+        } catch (const std::exception&) {
+            // Skip invalid IDs
+        }
+    }
+    
+    bool deleted = stream->delete_entries(stream_ids);
+    out.append_integer(deleted ? stream_ids.size() : 0);
+    
+    if (deleted && logging()) {
+        std::vector<std::string> id_texts;
+        AppendLog::Command command{"XDEL", stream_name};
+        for (const auto& id : stream_ids) {
+            id_texts.push_back(id.to_string());
+        }
+        command.insert(command.end(), id_texts.begin(), id_texts.end());
+        log_command(command);
+    }
+}
+
+void RedisServer::xgroup_create(ReplyBuffer& out, std::string_view stream_name, std::string_view group_name,
+                                std::string_view start_id) {
+    if (over_memory_limit()) {
+        out.append_error(kOomError);
+        return;
+    }
+    auto log = log_lock(stream_name);
+    auto stream = directory().find_or_create(stream_name);
+    
     try {
+        std::string group(group_name);
         StreamID id = (start_id == "$") ? stream->get_last_id() : StreamID::from_string(start_id);
-        bool created = stream->create_consumer_group(group_name, id);
+        bool created = stream->create_consumer_group(group, id);
         
         if (created) {
-            return RedisProtocol::format_simple_string("OK");
+            if (logging()) {
+                std::string start = stream->get_consumer_group(group)->get_last_delivered_id().to_string();
+                log_command({"XGROUP", "CREATE", stream_name, group_name, start});
+            }
+            out.append_simple_string("OK");
         } else {
-            return RedisProtocol::format_error("BUSYGROUP Consumer Group name already exists");
+            out.append_error("BUSYGROUP Consumer Group name already exists");
         }
     } catch (const std::exception& e) {
-        return RedisProtocol::format_error("ERR " + std::string(e.what()));
+        out.append_error("ERR " + std::string(e.what()));
     }
 }
 
-std::string RedisServer::xreadgroup(const std::string& group_name, const std::string& consumer_name,
-                                    const std::vector<std::string>& streams,
-                                    const std::vector<std::string>& /* ids */,
-                                    int count, int /* block */) {
-    std::vector<std::pair<std::string, std::vector<StreamEntry>>> results;
-    
-    std::lock_guard<std::mutex> lock(streams_mutex_);
+void RedisServer::xreadgroup(ReplyBuffer& out, std::string_view group_name, std::string_view consumer_name,
+                             ArgSpan streams, ArgSpan ids, int count, int block,
+                             std::shared_ptr<BlockedRead>* park) {
+    // Streams are encoded as they are visited, like XREAD; those with
+    // nothing new are left out and the outer header goes in last
+    size_t reply_start = out.size();
+    size_t written = 0;
+    bool history = false;
+    std::vector<std::shared_ptr<Stream>> grouped;
     
     for (size_t i = 0; i < streams.size(); i++) {
-        const std::string& stream_name = streams[i];
+        std::string_view stream_name = streams[i];
         
-        auto it = streams_.find(stream_name);
-        if (it == streams_.end()) {
+        auto stream = directory().find(stream_name);
+        if (!stream) {
             continue;
         }
         
-        auto group = it->second->get_consumer_group(group_name);
+        auto group = stream->get_consumer_group(std::string(group_name));
         if (!group) {
             continue; // Group doesn't exist
         }
         
-        // Get available entries after the group's last delivered ID
-        auto available_entries = it->second->get_entries_after(group->get_last_delivered_id(), -1);
+        if (ids[i] == ">") {
+            grouped.push_back(stream);
+            
+            // Deliver straight off the group's position in the stream, each
+            // entry encoded from storage as it is handed out; the count goes
+            // in front after
+            size_t stream_start = out.size();
+            out.append_array_header(2);
+            out.append_bulk_string(stream_name);
+            size_t entries_start = out.size();
+            std::vector<StreamID> delivered;
+            {
+                auto log = log_lock(stream_name);
+                auto guard = stream->read();
+                delivered = group->deliver_new_messages(
+                    std::string(consumer_name), guard.entries(), count,
+                    [&out](const StreamEntryView& entry) { RedisProtocol::write_stream_entry(out, entry); });
+                
+                if (logging() && !delivered.empty()) {
+                    log_claims(stream_name, group_name, *group, delivered);
+                }
+            }
+            if (delivered.empty()) {
+                out.truncate(stream_start);
+                continue;
+            }
+            
+            out.insert_header(entries_start, '*', delivered.size());
+            written++;
+            continue;
+        }
         
-        // Read pending messages for this consumer
-        auto entries = group->read_pending_messages(consumer_name, available_entries, count);
+        // An explicit ID replays the consumer's own pending entries after it
+        StreamID after;
+        try {
+            after = parse_id_or_ms(ids[i], 0);
+        } catch (const std::exception&) {
+            continue; // Skip invalid ID
+        }
+        history = true;
         
-        if (!entries.empty()) {
-            results.emplace_back(stream_name, entries);
+        std::vector<StreamID> pending = group->get_pending_ids(std::string(consumer_name), after, count);
+        out.append_array_header(2);
+        out.append_bulk_string(stream_name);
+        {
+            auto guard = stream->read();
+            RedisProtocol::write_pending_entries(out, guard.entries(), pending);
         }
+        written++;
+    }
+    
+    if (written > 0) {
+        out.insert_header(reply_start, '*', written);
+        return;
+    }
+    
+    if (history || block < 0 || !park || grouped.empty()) {
+        out.append_null_array();
+        return;
     }
     
-    return RedisProtocol::format_stream_read_response(results);
+    // Nothing new for the group: wait for the next entry on any stream. Every
+    // consumer parked on a group is woken by an append; those that lose the
+    // race for the entry find nothing on retry and stay parked.
+    std::vector<std::string_view> retry_args{group_name, consumer_name};
+    retry_args.insert(retry_args.end(), streams.begin(), streams.end());
+    retry_args.insert(retry_args.end(), ids.begin(), ids.end());
+    auto read = std::make_shared<BlockedRead>(
+        [this, retry = OwnedArgs(retry_args), num_streams = streams.size(), count](ReplyBuffer& retry_out) {
+            const auto& args = retry.args();
+            size_t start = retry_out.size();
+            xreadgroup(retry_out, args[0], args[1], ArgSpan(args, 2, num_streams),
+                       ArgSpan(args, 2 + num_streams, num_streams), count);
+            if (retry_out.view().substr(start) == "*-1\r\n") {
+                retry_out.truncate(start);
+                return false;
+            }
+            wait_for_log();
+            return true;
+        },
+        static_cast<uint64_t>(block));
+    for (const auto& stream : grouped) {
+        read->watch(stream, stream->get_last_id());
+    }
+    *park = read;
 }
 
-std::string RedisServer::xack(const std::string& stream_name, const std::string& group_name,
-                              const std::vector<std::string>& ids) {
-    std::lock_guard<std::mutex> lock(streams_mutex_);
-    
-    auto it = streams_.find(stream_name);
-    if (it == streams_.end()) {
-        return RedisProtocol::format_integer(0);
+void RedisServer::xack(ReplyBuffer& out, std::string_view stream_name, std::string_view group_name, ArgSpan ids) {
+    auto log = log_lock(stream_name);
+    auto stream = directory().find(stream_name);
+    if (!stream) {
+        out.append_integer(0);
+        return;
     }
     
-    auto group = it->second->get_consumer_group(group_name);
+    auto group = stream->get_consumer_group(std::string(group_name));
     if (!group) {
-        return RedisProtocol::format_integer(0);
+        out.append_integer(0);
+        return;
     }
     
     std::vector<StreamID> stream_ids;
-    for (const std::string& id_str : ids) {
+    for (std::string_view id_str : ids) {
         try {
             stream_ids.push_back(StreamID::from_string(id_str));
         } catch (const std::exception&) {
@@ -501,13 +1976,638 @@ std::string RedisServer::xack(const std::string& stream_name, const std::string&
         }
     }
     
-    // For XACK, we need to know which consumer to acknowledge for
-    // In a real implementation, this would be tracked better
-    // For now, let's acknowledge for all consumers in the group
-    int acknowledged = 0;
-    for (const std::string& consumer_name : group->get_consumer_names()) {
-        acknowledged += group->acknowledge_messages(consumer_name, stream_ids);
+    int acknowledged = group->acknowledge_messages(stream_ids);
+    out.append_integer(acknowledged);
+    
+    if (acknowledged > 0 && logging()) {
+        std::vector<std::string> id_texts;
+        AppendLog::Command command{"XACK", stream_name, group_name};
+        for (const auto& id : stream_ids) {
+            id_texts.push_back(id.to_string());
+        }
+        command.insert(command.end(), id_texts.begin(), id_texts.end());
+        log_command(command);
+    }
+}
+
+void RedisServer::xpending(ReplyBuffer& out, std::string_view stream_name, std::string_view group_name) {
+    auto stream = directory().find(stream_name);
+    auto group = stream ? stream->get_consumer_group(std::string(group_name)) : nullptr;
+    if (!group) {
+        append_no_group(out, stream_name, group_name);
+        return;
+    }
+    
+    ConsumerGroup::PendingSummary summary = group->get_pending_summary();
+    out.append_array_header(4);
+    out.append_integer(static_cast<int64_t>(summary.count));
+    if (summary.count == 0) {
+        out.append_null_bulk_string();
+        out.append_null_bulk_string();
+        out.append_null_array();
+        return;
+    }
+    
+    RedisProtocol::write_stream_id(out, summary.first);
+    RedisProtocol::write_stream_id(out, summary.last);
+    out.append_array_header(summary.consumers.size());
+    for (const auto& consumer : summary.consumers) {
+        out.append_array_header(2);
+        out.append_bulk_string(consumer.first);
+        out.append_bulk_string(std::to_string(consumer.second));
+    }
+}
+
+void RedisServer::xpending_range(ReplyBuffer& out, std::string_view stream_name, std::string_view group_name,
+                                 std::string_view start, std::string_view end, size_t count,
+                                 std::string_view consumer_name, uint64_t min_idle_ms) {
+    auto stream = directory().find(stream_name);
+    auto group = stream ? stream->get_consumer_group(std::string(group_name)) : nullptr;
+    if (!group) {
+        append_no_group(out, stream_name, group_name);
+        return;
+    }
+    
+    try {
+        auto pending = group->get_pending_range(parse_range_id(start, false), parse_range_id(end, true),
+                                                count, std::string(consumer_name), min_idle_ms);
+        out.append_array_header(pending.size());
+        for (const auto& info : pending) {
+            out.append_array_header(4);
+            RedisProtocol::write_stream_id(out, info.id);
+            out.append_bulk_string(info.consumer);
+            out.append_integer(static_cast<int64_t>(info.idle_ms));
+            out.append_integer(static_cast<int64_t>(info.delivery_count));
+        }
+    } catch (const std::exception& e) {
+        out.append_error("ERR " + std::string(e.what()));
+    }
+}
+
+void RedisServer::xclaim(ReplyBuffer& out, std::string_view stream_name, std::string_view group_name,
+                         std::string_view consumer_name, ArgSpan ids, const ConsumerGroup::ClaimOptions& options) {
+    auto log = log_lock(stream_name);
+    auto stream = directory().find(stream_name);
+    auto group = stream ? stream->get_consumer_group(std::string(group_name)) : nullptr;
+    if (!group) {
+        append_no_group(out, stream_name, group_name);
+        return;
+    }
+    
+    std::vector<StreamID> stream_ids;
+    try {
+        for (std::string_view id_str : ids) {
+            stream_ids.push_back(StreamID::from_string(id_str));
+        }
+    } catch (const std::exception&) {
+        out.append_error("ERR Invalid stream ID specified as stream command argument");
+        return;
+    }
+    
+    auto guard = stream->read();
+    std::vector<StreamID> claimed = group->claim(std::string(consumer_name), stream_ids, options, guard.entries());
+    
+    if (logging()) {
+        log_claims(stream_name, group_name, *group, claimed);
+        
+        // Pending entries no longer in the stream were dropped; XACK does the same
+        std::vector<std::string> dropped;
+        for (const auto& id : stream_ids) {
+            auto it = guard.entries().lower_bound(id);
+            if (!(it.valid() && it.id() == id)) {
+                dropped.push_back(id.to_string());
+            }
+        }
+        if (!dropped.empty()) {
+            AppendLog::Command command{"XACK", stream_name, group_name};
+            command.insert(command.end(), dropped.begin(), dropped.end());
+            log_command(command);
+        }
+    }
+    if (options.just_id) {
+        out.append_array_header(claimed.size());
+        for (const auto& id : claimed) {
+            RedisProtocol::write_stream_id(out, id);
+        }
+    } else {
+        RedisProtocol::write_pending_entries(out, guard.entries(), claimed);
+    }
+}
+
+void RedisServer::xautoclaim(ReplyBuffer& out, std::string_view stream_name, std::string_view group_name,
+                             std::string_view consumer_name, uint64_t min_idle_ms, std::string_view start,
+                             size_t count, bool just_id) {
+    auto log = log_lock(stream_name);
+    auto stream = directory().find(stream_name);
+    auto group = stream ? stream->get_consumer_group(std::string(group_name)) : nullptr;
+    if (!group) {
+        append_no_group(out, stream_name, group_name);
+        return;
+    }
+    
+    StreamID start_id;
+    try {
+        start_id = parse_range_id(start, false);
+    } catch (const std::exception&) {
+        out.append_error("ERR Invalid stream ID specified as stream command argument");
+        return;
+    }
+    
+    auto guard = stream->read();
+    ConsumerGroup::AutoClaimResult result =
+        group->auto_claim(std::string(consumer_name), min_idle_ms, start_id, count, just_id, guard.entries());
+    
+    if (logging()) {
+        log_claims(stream_name, group_name, *group, result.claimed);
+        if (!result.deleted.empty()) {
+            std::vector<std::string> id_texts;
+            AppendLog::Command command{"XACK", stream_name, group_name};
+            for (const auto& id : result.deleted) {
+                id_texts.push_back(id.to_string());
+            }
+            command.insert(command.end(), id_texts.begin(), id_texts.end());
+            log_command(command);
+        }
+    }
+    
+    // [next cursor, claimed entries, IDs no longer in the stream]
+    out.append_array_header(3);
+    RedisProtocol::write_stream_id(out, result.next);
+    if (just_id) {
+        out.append_array_header(result.claimed.size());
+        for (const auto& id : result.claimed) {
+            RedisProtocol::write_stream_id(out, id);
+        }
+    } else {
+        RedisProtocol::write_pending_entries(out, guard.entries(), result.claimed);
+    }
+    out.append_array_header(result.deleted.size());
+    for (const auto& id : result.deleted) {
+        RedisProtocol::write_stream_id(out, id);
+    }
+}
+
+void RedisServer::memory_usage(ReplyBuffer& out, std::string_view stream_name) {
+    auto stream = directory().find(stream_name);
+    if (!stream) {
+        out.append_null_bulk_string();
+        return;
+    }
+    out.append_integer(static_cast<int64_t>(stream_name.size() + stream->memory_usage()));
+}
+
+void RedisServer::info(ReplyBuffer& out, const std::string& section) {
+    // Per-command sections only show up when asked for, as in Redis
+    bool everything = section == "all" || section == "everything";
+    bool all = everything || section == "default";
+    std::ostringstream text;
+    
+    if (all || section == "memory") {
+        uint64_t used = MemoryTracker::used();
+        uint64_t rss = resident_memory();
+        BlockAllocator::Stats blocks = BlockAllocator::stats();
+        const char* policy =
+            config_.maxmemory_policy == ServerConfig::MaxMemoryPolicy::TrimCapped ? "trim-capped" : "noeviction";
+        
+        text << "# Memory\r\n"
+             << "used_memory:" << used << "\r\n"
+             << "used_memory_human:" << bytes_to_human(used) << "\r\n"
+             << "used_memory_rss:" << rss << "\r\n"
+             << "used_memory_rss_human:" << bytes_to_human(rss) << "\r\n"
+             << "maxmemory:" << config_.maxmemory << "\r\n"
+             << "maxmemory_human:" << bytes_to_human(config_.maxmemory) << "\r\n"
+             << "maxmemory_policy:" << policy << "\r\n"
+             << "mem_retired_objects:" << Epoch::pending() << "\r\n"
+             << "allocator_allocated:" << blocks.allocated << "\r\n"
+             << "allocator_mapped:" << blocks.mapped << "\r\n"
+             << "allocator_frag_ratio:" << std::fixed << std::setprecision(2)
+             << (blocks.allocated ? static_cast<double>(blocks.mapped) / blocks.allocated : 1.0) << "\r\n"
+             << "allocator_slabs:" << blocks.slabs << "\r\n"
+             << "allocator_large_allocations:" << blocks.large << "\r\n"
+             << "allocator_allocations:" << blocks.allocations << "\r\n"
+             << "allocator_frees:" << blocks.frees << "\r\n";
+    }
+    
+    if (all || section == "persistence") {
+        if (!text.str().empty()) {
+            text << "\r\n";
+        }
+        text << "# Persistence\r\n"
+             << "loading:" << (loading_ ? 1 : 0) << "\r\n"
+             << "aof_enabled:" << (aof_ ? 1 : 0) << "\r\n";
+        if (aof_) {
+            AppendLog::Stats stats = aof_->stats();
+            text << "aof_rewrite_in_progress:" << (stats.rewriting ? 1 : 0) << "\r\n"
+                 << "aof_rewrites:" << stats.rewrites << "\r\n"
+                 << "aof_last_bgrewrite_status:" << (stats.last_rewrite_ok ? "ok" : "err") << "\r\n"
+                 << "aof_current_size:" << stats.current_size << "\r\n"
+                 << "aof_base_size:" << stats.base_size << "\r\n"
+                 << "aof_buffer_length:" << stats.buffered << "\r\n";
+        }
+        
+        SnapshotFile::Status snapshot = snapshots_->status();
+        text << "rdb_bgsave_in_progress:" << (snapshot.saving ? 1 : 0) << "\r\n"
+             << "rdb_saves:" << snapshot.saves << "\r\n"
+             << "rdb_last_save_time:" << snapshot.last_save_time << "\r\n"
+             << "rdb_last_bgsave_status:" << (snapshot.last_save_ok ? "ok" : "err") << "\r\n"
+             << "rdb_last_save_keys:" << snapshot.last_save.streams << "\r\n"
+             << "rdb_last_save_entries:" << snapshot.last_save.entries << "\r\n"
+             << "rdb_last_save_bytes:" << snapshot.last_save.bytes << "\r\n"
+             << "rdb_last_save_time_ms:" << snapshot.last_save.ms << "\r\n"
+             << "rdb_last_load_keys_loaded:" << snapshot.last_load.streams << "\r\n"
+             << "rdb_last_load_entries_loaded:" << snapshot.last_load.entries << "\r\n"
+             << "rdb_last_load_bytes:" << snapshot.last_load.bytes << "\r\n"
+             << "rdb_last_load_time_ms:" << snapshot.last_load.ms << "\r\n"
+             << "rdb_last_load_threads:" << snapshot.last_load.threads << "\r\n";
+    }
+    
+    if (all || section == "tiering") {
+        if (!text.str().empty()) {
+            text << "\r\n";
+        }
+        TieredStorage::Stats stats = tiering_ ? tiering_->stats() : TieredStorage::Stats{};
+        text << "# Tiering\r\n"
+             << "tiering_enabled:" << (tiering_ ? 1 : 0) << "\r\n"
+             << "tiering_stream_hot_memory:" << config_.stream_hot_memory << "\r\n"
+             << "tiering_segments:" << stats.segments << "\r\n"
+             << "tiering_segment_bytes:" << stats.segment_bytes << "\r\n"
+             << "tiering_spills:" << stats.spills << "\r\n"
+             << "tiering_spilled_blocks:" << stats.spilled_blocks << "\r\n"
+             << "tiering_spilled_bytes:" << stats.spilled_bytes << "\r\n";
+    }
+    
+    if (all || section == "replication") {
+        if (!text.str().empty()) {
+            text << "\r\n";
+        }
+        text << "# Replication\r\n";
+        if (primary_link_) {
+            ReplicaLink::Status status = primary_link_->status();
+            long long last_io = status.last_io == 0 ? -1 : static_cast<long long>(std::time(nullptr) - status.last_io);
+            text << "role:slave\r\n"
+                 << "master_host:" << config_.replicaof_host << "\r\n"
+                 << "master_port:" << config_.replicaof_port << "\r\n"
+                 << "master_link_status:" << (status.link_up ? "up" : "down") << "\r\n"
+                 << "master_last_io_seconds_ago:" << last_io << "\r\n"
+                 << "master_sync_in_progress:" << (status.syncing ? 1 : 0) << "\r\n"
+                 << "slave_repl_offset:" << status.offset << "\r\n"
+                 << "slave_full_syncs:" << status.full_syncs << "\r\n"
+                 << "slave_partial_syncs:" << status.partial_syncs << "\r\n"
+                 << "master_replid:" << status.replid << "\r\n"
+                 << "master_repl_offset:" << status.offset << "\r\n";
+        } else {
+            ReplicationBacklog::Stats stats = backlog_ ? backlog_->stats() : ReplicationBacklog::Stats{};
+            std::time_t now = std::time(nullptr);
+            text << "role:master\r\n"
+                 << "connected_slaves:" << stats.replicas.size() << "\r\n";
+            for (size_t i = 0; i < stats.replicas.size(); i++) {
+                const auto& replica = stats.replicas[i];
+                size_t colon = replica.address.rfind(':');
+                text << "slave" << i << ":ip=" << replica.address.substr(0, colon)
+                     << ",port=" << (colon == std::string::npos ? "" : replica.address.substr(colon + 1))
+                     << ",state=" << replica.state << ",offset=" << replica.offset
+                     << ",lag=" << (now - replica.last_ack) << "\r\n";
+            }
+            text << "master_replid:" << stats.replid << "\r\n"
+                 << "master_repl_offset:" << stats.offset << "\r\n"
+                 << "repl_backlog_active:" << (backlog_ ? 1 : 0) << "\r\n"
+                 << "repl_backlog_size:" << stats.size << "\r\n"
+                 << "repl_backlog_first_byte_offset:" << stats.first_offset << "\r\n"
+                 << "repl_backlog_histlen:" << (stats.offset - stats.first_offset) << "\r\n"
+                 << "sync_full:" << stats.full_syncs << "\r\n"
+                 << "sync_partial_ok:" << stats.partial_syncs << "\r\n"
+                 << "sync_partial_err:" << stats.partial_sync_errors << "\r\n";
+        }
+    }
+    
+    if (everything || section == "commandstats") {
+        if (!text.str().empty()) {
+            text << "\r\n";
+        }
+        text << "# Commandstats\r\n";
+        for (const Command& command : command_table()) {
+            CommandStats::Summary stats = CommandStats::summary(command_table().index_of(&command));
+            if (stats.calls == 0 && stats.rejected == 0) {
+                continue;
+            }
+            double usec = stats.total_ns / 1000.0;
+            text << "cmdstat_" << lower_case(command.name) << ":calls=" << stats.calls
+                 << ",usec=" << static_cast<uint64_t>(usec) << ",usec_per_call=" << std::fixed << std::setprecision(2)
+                 << (stats.calls ? usec / stats.calls : 0.0) << ",rejected_calls=" << stats.rejected
+                 << ",failed_calls=" << stats.failed << "\r\n";
+        }
+    }
+    
+    if (everything || section == "latencystats") {
+        if (!text.str().empty()) {
+            text << "\r\n";
+        }
+        text << "# Latencystats\r\n";
+        for (const Command& command : command_table()) {
+            CommandStats::Summary stats = CommandStats::summary(command_table().index_of(&command));
+            if (stats.calls == 0) {
+                continue;
+            }
+            text << "latency_percentiles_usec_" << lower_case(command.name) << ":" << std::fixed
+                 << std::setprecision(3) << "p50=" << stats.percentile(0.5) / 1000.0
+                 << ",p99=" << stats.percentile(0.99) / 1000.0 << ",p99.9=" << stats.percentile(0.999) / 1000.0
+                 << "\r\n";
+        }
+    }
+    
+    out.append_bulk_string(text.str());
+}
+
+bool RedisServer::over_memory_limit(size_t incoming) const {
+    // Replaying the log restores what was already admitted, and a replica
+    // takes whatever its primary did
+    return config_.maxmemory > 0 && !loading_ && !primary_link_ &&
+           MemoryTracker::used() + incoming >= config_.maxmemory;
+}
+
+void RedisServer::bgrewriteaof(ReplyBuffer& out) {
+    if (!aof_) {
+        out.append_error("ERR Append only file is disabled");
+    } else if (!aof_->rewrite()) {
+        out.append_error("ERR Background append only file rewriting already in progress");
+    } else {
+        out.append_simple_string("Background append only file rewriting started");
+    }
+}
+
+void RedisServer::save(ReplyBuffer& out) {
+    snapshots_->save();
+    out.append_simple_string("OK");
+}
+
+void RedisServer::bgsave(ReplyBuffer& out) {
+    if (!snapshots_->background_save()) {
+        out.append_error("ERR Background save already in progress");
+        return;
+    }
+    out.append_simple_string("Background saving started");
+}
+
+std::unique_lock<std::mutex> RedisServer::log_lock(std::string_view key) {
+    if (!logging()) {
+        return std::unique_lock<std::mutex>();
+    }
+    return std::unique_lock<std::mutex>(log_key_mutexes_[std::hash<std::string_view>()(key) % kLogKeyStripes]);
+}
+
+void RedisServer::log_command(const AppendLog::Command& command) {
+    if (aof_) {
+        aof_->append(command);
+    }
+    if (backlog_) {
+        backlog_->append(command);
+    }
+}
+
+void RedisServer::log_trim(std::string_view stream_name, Stream& stream) {
+    if (!logging()) {
+        return;
+    }
+    
+    // Every trim evicts a prefix of the live entries, so an exact MINID on
+    // the first one left evicts the same on replay
+    StreamID first;
+    {
+        auto guard = stream.read();
+        auto it = guard.entries().begin();
+        first = it.valid() ? it.id() : id_after(stream.get_last_id());
+    }
+    std::string first_text = first.to_string();
+    log_command({"XTRIM", stream_name, "MINID", "=", first_text});
+}
+
+void RedisServer::log_claims(std::string_view stream_name, std::string_view group_name,
+                             ConsumerGroup& group, const std::vector<StreamID>& ids) {
+    if (!logging() || ids.empty()) {
+        return;
+    }
+    
+    std::string last_id = group.get_last_delivered_id().to_string();
+    for (const auto& pending : group.get_pending_entries(ids)) {
+        std::string id = pending.id.to_string();
+        std::string time = std::to_string(pending.delivery_time);
+        std::string count = std::to_string(pending.delivery_count);
+        log_command({"XCLAIM", stream_name, group_name, pending.consumer, "0", id, "TIME", time,
+                     "RETRYCOUNT", count, "FORCE", "JUSTID", "LASTID", last_id});
+    }
+}
+
+void RedisServer::wait_for_log() {
+    if (aof_) {
+        aof_->wait_durable();
+    }
+}
+
+void RedisServer::load_append_log(AppendLog& log) {
+    auto started = std::chrono::steady_clock::now();
+    loading_ = true;
+    size_t commands;
+    
+    if (shards_.empty()) {
+        ReplyBuffer scratch;
+        commands = log.load([this, &scratch](const AppendLog::Command& command) {
+            execute_command(scratch, command);
+            scratch.clear();
+        });
+    } else {
+        // Every shard replays its own keys, in log order and alongside the others
+        std::vector<std::vector<OwnedArgs>> batches(shards_.size());
+        auto submit = [this, &batches](size_t index) {
+            shards_[index]->submit([this, batch = std::move(batches[index])] {
+                ReplyBuffer scratch;
+                for (const auto& command : batch) {
+                    execute_command(scratch, command.args());
+                    scratch.clear();
+                }
+            });
+            batches[index].clear();
+        };
+        
+        commands = log.load([this, &batches, &submit](const AppendLog::Command& command) {
+            size_t index = shard_for_record(command).index();
+            batches[index].emplace_back(command);
+            if (batches[index].size() >= kReplayBatch) {
+                submit(index);
+            }
+        });
+        
+        for (size_t i = 0; i < shards_.size(); i++) {
+            if (!batches[i].empty()) {
+                submit(i);
+            }
+        }
+        drain_shards();
+    }
+    
+    loading_ = false;
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+    std::cout << "Loaded " << commands << " commands from " << config_.appendfilename << " in "
+              << elapsed.count() << " ms" << std::endl;
+}
+
+void RedisServer::load_snapshot() {
+    loading_ = true;
+    bool loaded = snapshots_->load([this](const std::string& name) {
+        return directory_for(name).find_or_create(name);
+    });
+    loading_ = false;
+    
+    if (loaded) {
+        SnapshotFile::LoadStats stats = snapshots_->status().last_load;
+        std::cout << "Loaded " << stats.streams << " streams (" << stats.entries << " entries, "
+                  << bytes_to_human(stats.bytes) << ") from " << config_.dbfilename << " in " << stats.ms
+                  << " ms on " << stats.threads << " threads" << std::endl;
+    }
+}
+
+bool RedisServer::attach_replica(IoWorker& worker, const std::shared_ptr<Connection>& conn,
+                                const std::vector<std::string_view>& parts) {
+    if (!backlog_) {
+        conn->output().append_error(primary_link_ ? "ERR Replicas do not take replicas of their own"
+                                                  : "ERR Replication is off; start with --repl-backlog-size");
+        return false;
+    }
+    if (parts.size() != 3) {
+        conn->output().append_error("ERR wrong number of arguments for 'psync' command");
+        return false;
+    }
+    
+    // The socket, and replies it is still owed, go to the replica's thread
+    ReplyBuffer& output = conn->output();
+    std::string pending(output.view().substr(output.size() - conn->pending_bytes()));
+    output.clear();
+    int fd = conn->fd();
+    worker.loop.remove_fd(fd);
+    worker.connections.erase(fd);
+    conn->release_fd();
+    conn->set_closing();
+    backlog_->attach(fd, parts[1], parts[2], std::move(pending));
+    return true;
+}
+
+void RedisServer::apply_replicated(const AppendLog::Command& command) {
+    if (shards_.empty()) {
+        ReplyBuffer scratch;
+        execute_command(scratch, command);
+        return;
+    }
+    
+    // Queued behind earlier records of the same key, so they apply in order
+    shard_for_record(command).submit([this, record = OwnedArgs(command)] {
+        ReplyBuffer scratch;
+        execute_command(scratch, record.args());
+    });
+}
+
+void RedisServer::load_replica_snapshot(const std::string& path) {
+    // Records from before the resync must not land on the new data
+    drain_shards();
+    
+    loading_ = true;
+    for_each_stream([this](const std::string& name, const std::shared_ptr<Stream>&) {
+        directory_for(name).erase(name);
+    });
+    SnapshotFile snapshot(path, [this](const SnapshotFile::StreamVisitor& visit) {
+        for_each_stream(visit);
+    });
+    snapshot.load([this](const std::string& name) {
+        return directory_for(name).find_or_create(name);
+    });
+    loading_ = false;
+    
+    // The log still describes the old data set
+    if (aof_) {
+        aof_->rewrite();
+    }
+}
+
+StreamDirectory& RedisServer::directory_for(std::string_view name) {
+    return shards_.empty() ? streams_ : shard_for(name).streams();
+}
+
+Shard& RedisServer::shard_for_record(const AppendLog::Command& command) {
+    const Command* found = command.empty() ? nullptr : find_command(command[0]);
+    size_t key = found && found->key > 0 ? found->key : 1;
+    return shard_for(key < command.size() ? command[key] : std::string_view());
+}
+
+void RedisServer::drain_shards() {
+    std::vector<std::future<void>> done;
+    for (const auto& shard : shards_) {
+        auto finished = std::make_shared<std::promise<void>>();
+        done.push_back(finished->get_future());
+        shard->submit([finished] { finished->set_value(); });
+    }
+    for (auto& future : done) {
+        future.wait();
     }
+}
+
+void RedisServer::for_each_stream(const SnapshotFile::StreamVisitor& visit) {
+    if (shards_.empty()) {
+        streams_.for_each(visit);
+    } else {
+        for (const auto& shard : shards_) {
+            shard->streams().for_each(visit);
+        }
+    }
+}
+
+void RedisServer::dump_streams(const AppendLog::Emit& emit) {
+    auto dump = [&emit](const std::string& name, const std::shared_ptr<Stream>& stream) {
+        // The last ID is read first. Entries added after it are either
+        // dumped below or replayed from the records logged meanwhile.
+        StreamID last_id = stream->get_last_id();
+        std::string last_text = last_id.to_string();
+        
+        bool any = false;
+        StreamID last_dumped;
+        {
+            auto guard = stream->read();
+            StreamEntryView view;
+            char id_text[StreamID::kMaxStringLength];
+            AppendLog::Command command;
+            for (auto it = guard.entries().begin(); it.valid(); it.next()) {
+                it.decode(view);
+                command.assign({"XADD", name, std::string_view(id_text, view.id.format(id_text))});
+                for (const auto& field : view.fields) {
+                    command.push_back(field.first);
+                    command.push_back(field.second);
+                }
+                emit(command);
+                any = true;
+                last_dumped = view.id;
+            }
+        }
+        
+        // Keep IDs that were used from being handed out again. An empty
+        // stream is recreated by the XSETID alone.
+        if (!any || last_dumped < last_id) {
+            emit({"XSETID", name, last_text});
+        }
+        
+        // PEL entries whose stream entry is gone cannot be claimed back; the
+        // next claim would drop them anyway
+        for (const auto& pair : stream->get_consumer_groups()) {
+            const std::string& group_name = pair.first;
+            const ConsumerGroup& group = *pair.second;
+            emit({"XGROUP", "CREATE", name, group_name, group.get_last_delivered_id().to_string()});
+            
+            auto pending = group.get_pending_range(StreamID(0, 0), StreamID(UINT64_MAX, UINT64_MAX), SIZE_MAX, "", 0);
+            for (const auto& entry : pending) {
+                std::string id = entry.id.to_string();
+                std::string time = std::to_string(entry.delivery_time);
+                std::string count = std::to_string(entry.delivery_count);
+                emit({"XCLAIM", name, group_name, entry.consumer, "0", id, "TIME", time, "RETRYCOUNT", count,
+                      "FORCE", "JUSTID"});
+            }
+        }
+    };
     
-    return RedisProtocol::format_integer(acknowledged);
+    for_each_stream(dump);
 }
@@ -0,0 +1,330 @@
+#include "replica_link.h"
+#include "reply_buffer.h"
+#include "resp_parser.h"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr auto kRetryInterval = std::chrono::seconds(1);
+constexpr int kPollMs = 1000;
+constexpr size_t kReadChunk = 64 * 1024;
+
+bool send_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t sent = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data.remove_prefix(static_cast<size_t>(sent));
+    }
+    return true;
+}
+
+bool send_command(int fd, const AppendLog::Command& command) {
+    ReplyBuffer out;
+    out.append_array_header(command.size());
+    for (const auto& arg : command) {
+        out.append_bulk_string(arg);
+    }
+    return send_all(fd, out.view());
+}
+
+bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+ReplicaLink::ReplicaLink(Options options, Apply apply, Load load)
+    : options_(std::move(options)), apply_(std::move(apply)), load_(std::move(load)), stopping_(false), fd_(-1),
+      link_up_(false), syncing_(false), offset_(0), last_io_(0), last_ack_(0), full_syncs_(0), partial_syncs_(0) {
+}
+
+ReplicaLink::~ReplicaLink() {
+    stop();
+}
+
+void ReplicaLink::start() {
+    thread_ = std::thread([this] { run(); });
+}
+
+void ReplicaLink::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        if (fd_ >= 0) {
+            shutdown(fd_, SHUT_RDWR);
+        }
+    }
+    cv_.notify_one();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+ReplicaLink::Status ReplicaLink::status() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Status{link_up_, syncing_, replid_, offset_, last_io_, full_syncs_, partial_syncs_};
+}
+
+void ReplicaLink::run() {
+    bool reported = false;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        lock.unlock();
+        int fd = connect_primary();
+        lock.lock();
+
+        if (fd >= 0 && !stopping_) {
+            fd_ = fd;
+            lock.unlock();
+            reported = false;
+            follow(fd);
+            lock.lock();
+            fd_ = -1;
+            link_up_ = false;
+            syncing_ = false;
+            if (!stopping_) {
+                std::cerr << "Lost connection to primary " << options_.host << ":" << options_.port << std::endl;
+            }
+        } else if (fd < 0 && !reported) {
+            std::cerr << "Cannot connect to primary " << options_.host << ":" << options_.port << ": "
+                      << std::strerror(errno) << std::endl;
+            reported = true;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        cv_.wait_for(lock, kRetryInterval, [this] { return stopping_; });
+    }
+}
+
+int ReplicaLink::connect_primary() {
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(options_.host.c_str(), std::to_string(options_.port).c_str(), &hints, &addresses) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    int fd = -1;
+    for (addrinfo* address = addresses; address && fd < 0; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            int error = errno;
+            close(fd);
+            fd = -1;
+            errno = error;
+        }
+    }
+    freeaddrinfo(addresses);
+
+    if (fd >= 0) {
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+    return fd;
+}
+
+void ReplicaLink::follow(int fd) {
+    std::string replid;
+    std::string offset;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        replid = replid_.empty() ? "?" : replid_;
+        offset = replid_.empty() ? "-1" : std::to_string(offset_);
+    }
+    if (!send_command(fd, {"PSYNC", replid, offset})) {
+        return;
+    }
+
+    std::string input;
+    size_t line_end;
+    while ((line_end = input.find("\r\n")) == std::string::npos) {
+        if (!read_more(fd, input)) {
+            return;
+        }
+    }
+    std::string reply = input.substr(0, line_end);
+    input.erase(0, line_end + 2);
+
+    bool full = reply.compare(0, 12, "+FULLRESYNC ") == 0;
+    if (full) {
+        // +FULLRESYNC <replid> <offset>, then the snapshot
+        size_t space = reply.find(' ', 12);
+        int64_t start;
+        if (space == std::string::npos ||
+            !RespParser::parse_int64(std::string_view(reply).substr(space + 1), start) || start < 0) {
+            std::cerr << "Bad reply from primary: " << reply << std::endl;
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            syncing_ = true;
+        }
+        if (!receive_snapshot(fd, input, reply)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        replid_ = reply.substr(12, space - 12);
+        offset_ = static_cast<uint64_t>(start);
+        syncing_ = false;
+        full_syncs_++;
+    } else if (reply.compare(0, 9, "+CONTINUE") == 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        partial_syncs_++;
+    } else {
+        std::cerr << "Primary refused to sync: " << reply << std::endl;
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        link_up_ = true;
+        std::cout << (full ? "Full" : "Partial") << " resync with primary " << options_.host << ":"
+                  << options_.port << " done at offset " << offset_ << std::endl;
+    }
+
+    RespParser parser;
+    while (true) {
+        // Each record moves the offset by exactly its encoded size
+        RespParser::Result result;
+        size_t applied = 0;
+        while ((result = parser.parse(input)) == RespParser::Result::Complete) {
+            apply_(parser.args());
+            applied = parser.consumed();
+        }
+        if (result == RespParser::Result::Error) {
+            std::cerr << "Bad record from primary: " << parser.error() << std::endl;
+            return;
+        }
+        if (applied > 0) {
+            input.erase(0, applied);
+            parser.discard(applied);
+            std::lock_guard<std::mutex> lock(mutex_);
+            offset_ += applied;
+        }
+
+        send_ack(fd);
+        if (!read_more(fd, input)) {
+            return;
+        }
+    }
+}
+
+bool ReplicaLink::receive_snapshot(int fd, std::string& input, const std::string& header) {
+    size_t line_end;
+    while ((line_end = input.find("\r\n")) == std::string::npos) {
+        if (!read_more(fd, input)) {
+            return false;
+        }
+    }
+    int64_t length;
+    if (input[0] != '$' || !RespParser::parse_int64(std::string_view(input).substr(1, line_end - 1), length) ||
+        length < 0) {
+        std::cerr << "Bad snapshot header from primary after " << header << std::endl;
+        return false;
+    }
+    input.erase(0, line_end + 2);
+
+    const std::string& path = options_.snapshot_path;
+    int file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file < 0) {
+        std::cerr << "Cannot create " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    uint64_t remaining = static_cast<uint64_t>(length);
+    bool ok = true;
+    while (ok && remaining > 0) {
+        if (input.empty() && !read_more(fd, input)) {
+            ok = false;
+            break;
+        }
+        size_t take = static_cast<size_t>(std::min<uint64_t>(remaining, input.size()));
+        if (!write_all(file, input.data(), take)) {
+            std::cerr << "Error writing " << path << ": " << std::strerror(errno) << std::endl;
+            ok = false;
+        }
+        input.erase(0, take);
+        remaining -= take;
+    }
+    close(file);
+
+    if (ok) {
+        try {
+            load_(path);
+        } catch (const std::exception& e) {
+            std::cerr << "Cannot load the primary's snapshot: " << e.what() << std::endl;
+            ok = false;
+        }
+    }
+    unlink(path.c_str());
+    return ok;
+}
+
+bool ReplicaLink::read_more(int fd, std::string& input) {
+    pollfd watched{fd, POLLIN, 0};
+    int ready = poll(&watched, 1, kPollMs);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_) {
+        return false;
+    }
+    if (ready < 0) {
+        return errno == EINTR;
+    }
+    if (ready == 0) {
+        return true; // Nothing yet; the caller may have an ack due
+    }
+
+    size_t old_size = input.size();
+    input.resize(old_size + kReadChunk);
+    ssize_t n = recv(fd, &input[old_size], kReadChunk, 0);
+    input.resize(old_size + (n > 0 ? static_cast<size_t>(n) : 0));
+    if (n > 0) {
+        last_io_ = std::time(nullptr);
+        return true;
+    }
+    return n < 0 && (errno == EINTR || errno == EAGAIN);
+}
+
+void ReplicaLink::send_ack(int fd) {
+    std::string offset;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::time_t now = std::time(nullptr);
+        if (now == last_ack_) {
+            return;
+        }
+        last_ack_ = now;
+        offset = std::to_string(offset_);
+    }
+    send_command(fd, {"REPLCONF", "ACK", offset});
+}
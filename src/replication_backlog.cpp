@@ -0,0 +1,301 @@
+#include "replication_backlog.h"
+#include "reply_buffer.h"
+#include "resp_parser.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <random>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// How often a replica thread looks for acknowledgements when idle
+constexpr auto kPollInterval = std::chrono::seconds(1);
+// Records are copied out of the backlog and sent in pieces of this size
+constexpr size_t kSendChunk = 256 * 1024;
+constexpr size_t kReadChunk = 4096;
+
+std::string make_replid() {
+    std::random_device device;
+    std::mt19937_64 random((static_cast<uint64_t>(device()) << 32) ^ device());
+    static const char digits[] = "0123456789abcdef";
+    std::string id;
+    for (int i = 0; i < 40; i++) {
+        id += digits[random() % 16];
+    }
+    return id;
+}
+
+std::string peer_address(int fd) {
+    sockaddr_in address{};
+    socklen_t length = sizeof(address);
+    if (getpeername(fd, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+        return "?";
+    }
+    char text[INET_ADDRSTRLEN] = "?";
+    inet_ntop(AF_INET, &address.sin_addr, text, sizeof(text));
+    return std::string(text) + ":" + std::to_string(ntohs(address.sin_port));
+}
+
+bool send_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t sent = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data.remove_prefix(static_cast<size_t>(sent));
+    }
+    return true;
+}
+
+} // namespace
+
+ReplicationBacklog::ReplicationBacklog(Options options, SnapshotFile::ForEachStream for_each)
+    : options_(std::move(options)), for_each_(std::move(for_each)), replid_(make_replid()), first_offset_(0),
+      stopping_(false), full_syncs_(0), partial_syncs_(0), partial_sync_errors_(0), next_snapshot_(0) {
+}
+
+ReplicationBacklog::~ReplicationBacklog() {
+    stop();
+}
+
+void ReplicationBacklog::append(const AppendLog::Command& command) {
+    // Encoded before taking the lock, into a buffer each thread reuses
+    thread_local ReplyBuffer record;
+    record.clear();
+    record.append_array_header(command.size());
+    for (const auto& arg : command) {
+        record.append_bulk_string(arg);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        buffer_.append(record.data(), record.size());
+        // Drop the front in bulk, moving the rest once per `size` bytes appended
+        if (buffer_.size() >= 2 * options_.size) {
+            size_t excess = buffer_.size() - options_.size;
+            buffer_.erase(0, excess);
+            first_offset_ += excess;
+        }
+    }
+    cv_.notify_all();
+}
+
+void ReplicationBacklog::attach(int fd, std::string_view replid, std::string_view offset, std::string pending) {
+    reap();
+
+    // Blocking from here on; the replica's thread is the only one using it
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_) {
+        close(fd);
+        return;
+    }
+
+    int64_t from = -1;
+    bool partial = replid == replid_ && RespParser::parse_int64(offset, from) &&
+                   from >= static_cast<int64_t>(first_offset_) &&
+                   from <= static_cast<int64_t>(first_offset_ + buffer_.size());
+    if (partial) {
+        partial_syncs_++;
+    } else {
+        if (replid != "?") {
+            partial_sync_errors_++;
+        }
+        full_syncs_++;
+    }
+
+    auto replica = std::make_unique<Replica>();
+    replica->fd = fd;
+    replica->address = peer_address(fd);
+    replica->state = partial ? ReplicaState::Online : ReplicaState::WaitSnapshot;
+    replica->acked = partial ? static_cast<uint64_t>(from) : 0;
+    replica->last_ack = std::time(nullptr);
+    Replica* served = replica.get();
+    replicas_.push_back(std::move(replica));
+    served->thread = std::thread([this, served, partial, from, pending = std::move(pending)]() mutable {
+        serve(*served, !partial, partial ? static_cast<uint64_t>(from) : 0, std::move(pending));
+    });
+}
+
+void ReplicationBacklog::stop() {
+    std::list<std::unique_ptr<Replica>> replicas;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        // Wakes threads blocked sending to a replica that stopped reading
+        for (const auto& replica : replicas_) {
+            shutdown(replica->fd, SHUT_RDWR);
+        }
+        replicas.swap(replicas_);
+    }
+    cv_.notify_all();
+
+    for (const auto& replica : replicas) {
+        replica->thread.join();
+        close(replica->fd);
+    }
+}
+
+ReplicationBacklog::Stats ReplicationBacklog::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats{replid_, first_offset_ + buffer_.size(), first_offset_, options_.size,
+                full_syncs_, partial_syncs_, partial_sync_errors_, {}};
+    for (const auto& replica : replicas_) {
+        ReplicaState state = replica->state;
+        if (state == ReplicaState::Done) {
+            continue;
+        }
+        const char* name = state == ReplicaState::WaitSnapshot ? "wait_bgsave"
+                           : state == ReplicaState::SendSnapshot ? "send_bulk"
+                                                                 : "online";
+        stats.replicas.push_back(ReplicaInfo{replica->address, name, replica->acked, replica->last_ack});
+    }
+    return stats;
+}
+
+void ReplicationBacklog::serve(Replica& replica, bool full, uint64_t offset, std::string pending) {
+    bool ok = send_all(replica.fd, pending);
+    if (ok && full) {
+        ok = send_snapshot(replica, offset);
+    } else if (ok) {
+        ok = send_all(replica.fd, "+CONTINUE " + replid_ + "\r\n");
+    }
+    replica.state = ReplicaState::Online;
+
+    std::string chunk;
+    std::string input;
+    while (ok) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait_for(lock, kPollInterval, [this, offset] {
+                return stopping_ || first_offset_ + buffer_.size() > offset;
+            });
+            if (stopping_) {
+                break;
+            }
+            if (offset < first_offset_) {
+                std::cerr << "Replica " << replica.address << " fell behind the replication backlog; dropping it"
+                          << std::endl;
+                break;
+            }
+            size_t from = static_cast<size_t>(offset - first_offset_);
+            chunk.assign(buffer_, from, std::min(kSendChunk, buffer_.size() - from));
+        }
+
+        ok = send_all(replica.fd, chunk) && read_acks(replica, input);
+        offset += chunk.size();
+    }
+
+    // Closed by whoever joins this thread
+    shutdown(replica.fd, SHUT_RDWR);
+    replica.state = ReplicaState::Done;
+}
+
+bool ReplicationBacklog::send_snapshot(Replica& replica, uint64_t& offset) {
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        offset = first_offset_ + buffer_.size();
+        path = options_.snapshot_path + ".repl-" + std::to_string(next_snapshot_++);
+    }
+    if (!send_all(replica.fd, "+FULLRESYNC " + replid_ + " " + std::to_string(offset) + "\r\n")) {
+        return false;
+    }
+
+    // Records from `offset` on are kept only while the backlog holds them,
+    // so a snapshot taking longer than the backlog lasts ends in another
+    try {
+        SnapshotFile(path, for_each_).save();
+    } catch (const std::exception& e) {
+        std::cerr << "Snapshot for replica " << replica.address << " failed: " << e.what() << std::endl;
+        return false;
+    }
+
+    int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    unlink(path.c_str());
+    struct stat st;
+    if (file < 0 || fstat(file, &st) != 0) {
+        std::cerr << "Cannot read snapshot " << path << ": " << std::strerror(errno) << std::endl;
+        if (file >= 0) {
+            close(file);
+        }
+        return false;
+    }
+
+    replica.state = ReplicaState::SendSnapshot;
+    bool ok = send_all(replica.fd, "$" + std::to_string(st.st_size) + "\r\n");
+    off_t position = 0;
+    // Unlike send_all(), this relies on SIGPIPE being ignored (see main())
+    while (ok && position < st.st_size) {
+        ssize_t sent = sendfile(replica.fd, file, &position, static_cast<size_t>(st.st_size - position));
+        ok = sent > 0 || (sent < 0 && errno == EINTR);
+    }
+    close(file);
+    return ok;
+}
+
+bool ReplicationBacklog::read_acks(Replica& replica, std::string& input) {
+    char chunk[kReadChunk];
+    while (true) {
+        ssize_t n = recv(replica.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (n > 0) {
+            input.append(chunk, static_cast<size_t>(n));
+            continue;
+        }
+        if (n == 0) {
+            return false; // Replica hung up
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return false;
+        }
+        break;
+    }
+
+    // REPLCONF ACK <offset> is all a replica sends once synced
+    RespParser parser;
+    RespParser::Result result;
+    while ((result = parser.parse(input)) == RespParser::Result::Complete) {
+        const auto& args = parser.args();
+        int64_t acked;
+        if (args.size() == 3 && args[1] == "ACK" && RespParser::parse_int64(args[2], acked) && acked >= 0) {
+            replica.acked = static_cast<uint64_t>(acked);
+            replica.last_ack = std::time(nullptr);
+        }
+    }
+    input.erase(0, parser.consumed());
+    return result != RespParser::Result::Error;
+}
+
+void ReplicationBacklog::reap() {
+    std::list<std::unique_ptr<Replica>> finished;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = replicas_.begin(); it != replicas_.end();) {
+            auto next = std::next(it);
+            if ((*it)->state == ReplicaState::Done) {
+                finished.splice(finished.end(), replicas_, it);
+            }
+            it = next;
+        }
+    }
+    for (const auto& replica : finished) {
+        replica->thread.join();
+        close(replica->fd);
+    }
+}
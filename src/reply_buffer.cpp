@@ -0,0 +1,138 @@
+#include "reply_buffer.h"
+#include <algorithm>
+
+namespace {
+
+constexpr size_t kInitialCapacity = 4 * 1024;
+constexpr size_t kRetainedCapacity = 1024 * 1024;
+
+// "00" "01" ... "99", two digits per table lookup
+constexpr char kDigitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+size_t count_digits(uint64_t value) {
+    size_t digits = 1;
+    while (value >= 10000) {
+        value /= 10000;
+        digits += 4;
+    }
+    if (value >= 1000) return digits + 3;
+    if (value >= 100) return digits + 2;
+    if (value >= 10) return digits + 1;
+    return digits;
+}
+
+} // namespace
+
+ReplyBuffer::ReplyBuffer() : size_(0), capacity_(0) {
+}
+
+ReplyBuffer::ReplyBuffer(ReplyBuffer&& other) noexcept
+    : data_(std::move(other.data_)), size_(other.size_), capacity_(other.capacity_) {
+    other.size_ = 0;
+    other.capacity_ = 0;
+}
+
+ReplyBuffer& ReplyBuffer::operator=(ReplyBuffer&& other) noexcept {
+    if (this != &other) {
+        data_ = std::move(other.data_);
+        size_ = other.size_;
+        capacity_ = other.capacity_;
+        other.size_ = 0;
+        other.capacity_ = 0;
+    }
+    return *this;
+}
+
+void ReplyBuffer::append_simple_string(std::string_view str) {
+    char* out = reserve(str.size() + 3);
+    out[0] = '+';
+    std::memcpy(out + 1, str.data(), str.size());
+    out[str.size() + 1] = '\r';
+    out[str.size() + 2] = '\n';
+    size_ += str.size() + 3;
+}
+
+void ReplyBuffer::append_error(std::string_view error) {
+    char* out = reserve(error.size() + 3);
+    out[0] = '-';
+    std::memcpy(out + 1, error.data(), error.size());
+    out[error.size() + 1] = '\r';
+    out[error.size() + 2] = '\n';
+    size_ += error.size() + 3;
+}
+
+void ReplyBuffer::append_integer(int64_t value) {
+    char* out = reserve(24);
+    size_t n = 0;
+    out[n++] = ':';
+
+    uint64_t magnitude = static_cast<uint64_t>(value);
+    if (value < 0) {
+        out[n++] = '-';
+        magnitude = 0 - magnitude;
+    }
+    n += format_uint(magnitude, out + n);
+    out[n++] = '\r';
+    out[n++] = '\n';
+    size_ += n;
+}
+
+void ReplyBuffer::insert_header(size_t position, char type, uint64_t length) {
+    char header[24];
+    header[0] = type;
+    size_t n = 1 + format_uint(length, header + 1);
+    header[n++] = '\r';
+    header[n++] = '\n';
+
+    reserve(n);
+    std::memmove(data_.get() + position + n, data_.get() + position, size_ - position);
+    std::memcpy(data_.get() + position, header, n);
+    size_ += n;
+}
+
+void ReplyBuffer::release() {
+    if (capacity_ > kRetainedCapacity && size_ == 0) {
+        data_.reset();
+        capacity_ = 0;
+    }
+}
+
+size_t ReplyBuffer::format_uint(uint64_t value, char* out) {
+    size_t digits = count_digits(value);
+    char* p = out + digits;
+
+    while (value >= 100) {
+        size_t pair = (value % 100) * 2;
+        value /= 100;
+        *--p = kDigitPairs[pair + 1];
+        *--p = kDigitPairs[pair];
+    }
+    if (value >= 10) {
+        size_t pair = value * 2;
+        *--p = kDigitPairs[pair + 1];
+        *--p = kDigitPairs[pair];
+    } else {
+        *--p = static_cast<char>('0' + value);
+    }
+    return digits;
+}
+
+void ReplyBuffer::grow(size_t min_capacity) {
+    size_t new_capacity = std::max({min_capacity, capacity_ * 2, kInitialCapacity});
+    std::unique_ptr<char[]> new_data(new char[new_capacity]);
+    if (size_ > 0) {
+        std::memcpy(new_data.get(), data_.get(), size_);
+    }
+    data_ = std::move(new_data);
+    capacity_ = new_capacity;
+}
@@ -0,0 +1,232 @@
+#include "resp_parser.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// Limits match Redis: a request header line may not grow without bound
+constexpr size_t kMaxInlineLength = 64 * 1024;
+constexpr int64_t kMaxMultibulkLength = 1024 * 1024;
+constexpr int64_t kMaxBulkLength = 512LL * 1024 * 1024;
+// Argument slots reserved up front; the header is only the client's word
+// for the count, so larger commands grow the vector as arguments arrive
+constexpr size_t kReservedArgs = 64;
+
+// Position of the "\r\n" terminating the line that starts at `from`
+size_t find_crlf(std::string_view buffer, size_t from) {
+    while (from < buffer.size()) {
+        const void* found = std::memchr(buffer.data() + from, '\r', buffer.size() - from);
+        if (!found) {
+            return std::string_view::npos;
+        }
+        size_t cr = static_cast<const char*>(found) - buffer.data();
+        if (cr + 1 >= buffer.size()) {
+            return std::string_view::npos;
+        }
+        if (buffer[cr + 1] == '\n') {
+            return cr;
+        }
+        from = cr + 1;
+    }
+    return std::string_view::npos;
+}
+
+bool is_inline_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+} // namespace
+
+RespParser::RespParser()
+    : state_(State::CommandStart), command_start_(0), last_start_(0), pos_(0),
+      args_expected_(0), bulk_length_(0) {
+}
+
+RespParser::Result RespParser::parse(std::string_view buffer) {
+    if (!error_.empty()) {
+        return Result::Error;
+    }
+
+    while (true) {
+        switch (state_) {
+        case State::CommandStart: {
+            if (pos_ >= buffer.size()) {
+                return Result::Incomplete;
+            }
+            if (buffer[pos_] != '*') {
+                Result result = parse_inline(buffer);
+                if (result == Result::Complete && spans_.empty()) {
+                    command_start_ = pos_; // Blank line, keep going
+                    continue;
+                }
+                return result;
+            }
+
+            size_t line_end = find_crlf(buffer, pos_ + 1);
+            if (line_end == std::string_view::npos) {
+                if (buffer.size() - pos_ > kMaxInlineLength) {
+                    return fail("too big mbulk count string");
+                }
+                return Result::Incomplete;
+            }
+
+            int64_t length;
+            if (!parse_int64(buffer.substr(pos_ + 1, line_end - pos_ - 1), length) ||
+                length > kMaxMultibulkLength) {
+                return fail("invalid multibulk length");
+            }
+            pos_ = line_end + 2;
+
+            if (length <= 0) {
+                command_start_ = pos_; // Empty or null array carries no command
+                continue;
+            }
+
+            spans_.clear();
+            spans_.reserve(std::min<size_t>(static_cast<size_t>(length), kReservedArgs));
+            args_expected_ = length;
+            state_ = State::BulkHeader;
+            break;
+        }
+
+        case State::BulkHeader: {
+            if (pos_ >= buffer.size()) {
+                return Result::Incomplete;
+            }
+            if (buffer[pos_] != '$') {
+                return fail(std::string("expected '$', got '") + buffer[pos_] + "'");
+            }
+
+            size_t line_end = find_crlf(buffer, pos_ + 1);
+            if (line_end == std::string_view::npos) {
+                if (buffer.size() - pos_ > kMaxInlineLength) {
+                    return fail("too big bulk count string");
+                }
+                return Result::Incomplete;
+            }
+
+            if (!parse_int64(buffer.substr(pos_ + 1, line_end - pos_ - 1), bulk_length_) ||
+                bulk_length_ < 0 || bulk_length_ > kMaxBulkLength) {
+                return fail("invalid bulk length");
+            }
+            pos_ = line_end + 2;
+            state_ = State::BulkData;
+            break;
+        }
+
+        case State::BulkData: {
+            size_t length = static_cast<size_t>(bulk_length_);
+            if (buffer.size() - pos_ < length + 2) {
+                return Result::Incomplete;
+            }
+            if (buffer[pos_ + length] != '\r' || buffer[pos_ + length + 1] != '\n') {
+                return fail("bulk string not terminated by CRLF");
+            }
+
+            spans_.emplace_back(pos_, length);
+            pos_ += length + 2;
+
+            if (static_cast<int64_t>(spans_.size()) == args_expected_) {
+                return complete(buffer);
+            }
+            state_ = State::BulkHeader;
+            break;
+        }
+        }
+    }
+}
+
+void RespParser::discard(size_t bytes) {
+    command_start_ -= bytes;
+    pos_ -= bytes;
+    // Arguments already scanned of a command still in progress move too
+    for (auto& span : spans_) {
+        span.first -= bytes;
+    }
+    args_.clear();
+}
+
+void RespParser::unparse() {
+    command_start_ = last_start_;
+    pos_ = last_start_;
+    args_.clear();
+}
+
+bool RespParser::parse_int64(std::string_view text, int64_t& value) {
+    if (text.empty()) {
+        return false;
+    }
+
+    bool negative = text[0] == '-';
+    size_t i = negative ? 1 : 0;
+    if (i == text.size()) {
+        return false;
+    }
+
+    uint64_t result = 0;
+    const uint64_t limit = negative ? static_cast<uint64_t>(INT64_MAX) + 1 : INT64_MAX;
+    for (; i < text.size(); i++) {
+        char c = text[i];
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        uint64_t digit = c - '0';
+        if (result > (limit - digit) / 10) {
+            return false;
+        }
+        result = result * 10 + digit;
+    }
+
+    value = negative ? static_cast<int64_t>(0 - result) : static_cast<int64_t>(result);
+    return true;
+}
+
+RespParser::Result RespParser::parse_inline(std::string_view buffer) {
+    const void* found = std::memchr(buffer.data() + pos_, '\n', buffer.size() - pos_);
+    if (!found) {
+        if (buffer.size() - pos_ > kMaxInlineLength) {
+            return fail("too big inline request");
+        }
+        return Result::Incomplete;
+    }
+
+    size_t line_end = static_cast<const char*>(found) - buffer.data();
+    spans_.clear();
+
+    size_t i = pos_;
+    while (i < line_end) {
+        while (i < line_end && is_inline_space(buffer[i])) {
+            i++;
+        }
+        size_t start = i;
+        while (i < line_end && !is_inline_space(buffer[i])) {
+            i++;
+        }
+        if (i > start) {
+            spans_.emplace_back(start, i - start);
+        }
+    }
+
+    pos_ = line_end + 1;
+    if (spans_.empty()) {
+        return Result::Complete;
+    }
+    return complete(buffer);
+}
+
+RespParser::Result RespParser::complete(std::string_view buffer) {
+    args_.clear();
+    for (const auto& span : spans_) {
+        args_.emplace_back(buffer.data() + span.first, span.second);
+    }
+
+    last_start_ = command_start_;
+    command_start_ = pos_;
+    state_ = State::CommandStart;
+    return Result::Complete;
+}
+
+RespParser::Result RespParser::fail(std::string message) {
+    error_ = std::move(message);
+    return Result::Error;
+}
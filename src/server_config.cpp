@@ -0,0 +1,172 @@
+#include "server_config.h"
+#include <cstring>
+#include <stdexcept>
+#include <strings.h>
+
+namespace {
+
+int parse_int_option(const std::string& name, const std::string& value, int min_value) {
+    size_t consumed = 0;
+    int result;
+    try {
+        result = std::stoi(value, &consumed);
+    } catch (const std::exception&) {
+        throw std::invalid_argument("Invalid value for " + name + ": " + value);
+    }
+    if (consumed != value.size() || result < min_value) {
+        throw std::invalid_argument("Invalid value for " + name + ": " + value);
+    }
+    return result;
+}
+
+// Byte count with an optional unit, as in redis.conf: 1k = 1000, 1kb = 1024
+uint64_t parse_size_option(const std::string& name, const std::string& value) {
+    static const std::pair<const char*, uint64_t> kUnits[] = {
+        {"kb", 1024ULL}, {"mb", 1024ULL * 1024}, {"gb", 1024ULL * 1024 * 1024},
+        {"k", 1000ULL}, {"m", 1000ULL * 1000}, {"g", 1000ULL * 1000 * 1000}, {"b", 1ULL},
+    };
+
+    std::string number = value;
+    uint64_t multiplier = 1;
+    for (const auto& unit : kUnits) {
+        size_t length = std::strlen(unit.first);
+        if (number.size() > length &&
+            strcasecmp(number.c_str() + number.size() - length, unit.first) == 0) {
+            number.resize(number.size() - length);
+            multiplier = unit.second;
+            break;
+        }
+    }
+
+    size_t consumed = 0;
+    uint64_t result;
+    try {
+        result = std::stoull(number, &consumed);
+    } catch (const std::exception&) {
+        throw std::invalid_argument("Invalid value for " + name + ": " + value);
+    }
+    if (consumed != number.size() || number[0] == '-' || result > UINT64_MAX / multiplier) {
+        throw std::invalid_argument("Invalid value for " + name + ": " + value);
+    }
+    return result * multiplier;
+}
+
+bool parse_yes_no_option(const std::string& name, const std::string& value) {
+    if (value == "yes") {
+        return true;
+    }
+    if (value == "no") {
+        return false;
+    }
+    throw std::invalid_argument("Invalid value for " + name + ": " + value);
+}
+
+} // namespace
+
+ServerConfig ServerConfig::from_args(int argc, char* argv[]) {
+    ServerConfig config;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg.rfind("--", 0) != 0) {
+            // Bare argument is the port, as in earlier releases
+            config.port = parse_int_option("port", arg, 1);
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            throw std::invalid_argument("Missing value for " + arg);
+        }
+        std::string value = argv[++i];
+
+        if (arg == "--port") {
+            config.port = parse_int_option(arg, value, 1);
+        } else if (arg == "--tcp-backlog") {
+            config.tcp_backlog = parse_int_option(arg, value, 1);
+        } else if (arg == "--io-threads") {
+            config.io_threads = parse_int_option(arg, value, 0);
+        } else if (arg == "--shards") {
+            config.shards = parse_int_option(arg, value, 0);
+        } else if (arg == "--maxmemory") {
+            config.maxmemory = parse_size_option(arg, value);
+        } else if (arg == "--maxmemory-policy") {
+            if (value == "noeviction") {
+                config.maxmemory_policy = MaxMemoryPolicy::NoEviction;
+            } else if (value == "trim-capped") {
+                config.maxmemory_policy = MaxMemoryPolicy::TrimCapped;
+            } else {
+                throw std::invalid_argument("Invalid value for " + arg + ": " + value);
+            }
+        } else if (arg == "--appendonly") {
+            config.appendonly = parse_yes_no_option(arg, value);
+        } else if (arg == "--appendfilename") {
+            config.appendfilename = value;
+        } else if (arg == "--dbfilename") {
+            config.dbfilename = value;
+        } else if (arg == "--stream-hot-memory") {
+            config.stream_hot_memory = parse_size_option(arg, value);
+        } else if (arg == "--tier-dir") {
+            config.tier_dir = value;
+        } else if (arg == "--replicaof") {
+            size_t colon = value.rfind(':');
+            if (colon == std::string::npos || colon == 0) {
+                throw std::invalid_argument("Invalid value for " + arg + ": " + value + " (expected host:port)");
+            }
+            config.replicaof_host = value.substr(0, colon);
+            config.replicaof_port = parse_int_option(arg, value.substr(colon + 1), 1);
+        } else if (arg == "--repl-backlog-size") {
+            config.repl_backlog_size = parse_size_option(arg, value);
+        } else if (arg == "--slowlog-log-slower-than") {
+            config.slowlog_log_slower_than = parse_int_option(arg, value, -1);
+        } else if (arg == "--slowlog-max-len") {
+            config.slowlog_max_len = parse_int_option(arg, value, 0);
+        } else if (arg == "--appendfsync") {
+            if (value == "always") {
+                config.appendfsync = AppendLog::FsyncPolicy::Always;
+            } else if (value == "everysec") {
+                config.appendfsync = AppendLog::FsyncPolicy::EverySec;
+            } else if (value == "no") {
+                config.appendfsync = AppendLog::FsyncPolicy::No;
+            } else {
+                throw std::invalid_argument("Invalid value for " + arg + ": " + value);
+            }
+        } else if (arg == "--auto-aof-rewrite-percentage") {
+            config.auto_aof_rewrite_percentage = parse_int_option(arg, value, 0);
+        } else if (arg == "--auto-aof-rewrite-min-size") {
+            config.auto_aof_rewrite_min_size = parse_size_option(arg, value);
+        } else {
+            throw std::invalid_argument("Unknown option " + arg);
+        }
+    }
+
+    return config;
+}
+
+std::string ServerConfig::usage() {
+    return "Usage: redis_streams_service [port] [options]\n"
+           "  --port <n>           TCP port (default 6379)\n"
+           "  --tcp-backlog <n>    listen() backlog (default 511)\n"
+           "  --io-threads <n>     event loop threads, 0 = one per core (default 0)\n"
+           "  --shards <n>         keyspace shard workers pinned to cores, 0 = unsharded (default 0)\n"
+           "  --maxmemory <bytes>  cap on stream data, e.g. 512mb; 0 = no limit (default 0)\n"
+           "  --maxmemory-policy <noeviction|trim-capped>\n"
+           "                       at the cap, reject writes, or evict the oldest entries of\n"
+           "                       streams XADD capped with MAXLEN/MINID (default noeviction)\n"
+           "  --appendonly <yes|no>                log writes to an append-only file (default no)\n"
+           "  --appendfilename <path>              append-only file (default appendonly.aof)\n"
+           "  --appendfsync <always|everysec|no>   when the log is synced (default everysec)\n"
+           "  --auto-aof-rewrite-percentage <n>    rewrite once the log grew this much, 0 = never (default 100)\n"
+           "  --auto-aof-rewrite-min-size <bytes>  but not below this size (default 64mb)\n"
+           "  --dbfilename <path>                  snapshot for SAVE/BGSAVE, loaded when appendonly is off\n"
+           "                                       (default dump.snap)\n"
+           "  --stream-hot-memory <bytes>          heap per stream before its oldest blocks move to\n"
+           "                                       memory-mapped files, 0 = never (default 0)\n"
+           "  --tier-dir <path>                    directory for those files (default .)\n"
+           "  --replicaof <host:port>              run as a read-only replica of that primary\n"
+           "  --repl-backlog-size <bytes>          write history kept for replicas to resume from;\n"
+           "                                       0 = accept no replicas (default 0)\n"
+           "  --slowlog-log-slower-than <usec>     log commands taking at least this long to SLOWLOG;\n"
+           "                                       -1 = never, 0 = every command (default 10000)\n"
+           "  --slowlog-max-len <n>                slow commands kept (default 128)\n";
+}
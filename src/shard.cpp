@@ -0,0 +1,77 @@
+#include "shard.h"
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+
+namespace {
+thread_local Shard* current_shard = nullptr;
+}
+
+Shard::Shard(size_t index, int cpu)
+    : index_(index), cpu_(cpu), stopping_(false) {
+}
+
+Shard::~Shard() {
+    stop();
+}
+
+void Shard::start() {
+    thread_ = std::thread(&Shard::run, this);
+
+    if (cpu_ >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu_, &cpus);
+        if (pthread_setaffinity_np(thread_.native_handle(), sizeof(cpus), &cpus) != 0) {
+            std::cerr << "Failed to pin shard " << index_ << " to CPU " << cpu_ << std::endl;
+        }
+    }
+}
+
+void Shard::stop() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        stopping_ = true;
+    }
+    queue_cv_.notify_one();
+
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void Shard::submit(Task task) {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        queue_.push_back(std::move(task));
+    }
+    queue_cv_.notify_one();
+}
+
+Shard* Shard::current() {
+    return current_shard;
+}
+
+void Shard::run() {
+    current_shard = this;
+    std::vector<Task> batch;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            queue_cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                break; // Stopping and drained
+            }
+            batch.swap(queue_);
+        }
+
+        // Run everything that was queued in one go to amortise the wakeup
+        for (auto& task : batch) {
+            task();
+        }
+        batch.clear();
+    }
+
+    current_shard = nullptr;
+}
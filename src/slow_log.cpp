@@ -0,0 +1,61 @@
+#include "slow_log.h"
+#include <algorithm>
+#include <ctime>
+
+namespace {
+
+constexpr size_t kMaxArgs = 32;
+constexpr size_t kMaxArgBytes = 128;
+
+} // namespace
+
+SlowLog::SlowLog(int64_t threshold_us, size_t max_len)
+    : threshold_us_(threshold_us), max_len_(max_len), next_id_(0) {}
+
+void SlowLog::add(const std::vector<std::string_view>& args, uint64_t duration_us, std::string_view client) {
+    Entry entry;
+    entry.time = static_cast<int64_t>(std::time(nullptr));
+    entry.duration_us = duration_us;
+    entry.client = std::string(client);
+
+    // The last kept slot says how many arguments were dropped
+    size_t kept = args.size() > kMaxArgs ? kMaxArgs - 1 : args.size();
+    entry.args.reserve(kept + 1);
+    for (size_t i = 0; i < kept; i++) {
+        if (args[i].size() > kMaxArgBytes) {
+            entry.args.push_back(std::string(args[i].substr(0, kMaxArgBytes)) + "... (" +
+                                 std::to_string(args[i].size() - kMaxArgBytes) + " more bytes)");
+        } else {
+            entry.args.emplace_back(args[i]);
+        }
+    }
+    if (kept < args.size()) {
+        entry.args.push_back("... (" + std::to_string(args.size() - kept) + " more arguments)");
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    entry.id = next_id_++;
+    if (max_len_ == 0) {
+        return;
+    }
+    entries_.push_front(std::move(entry));
+    if (entries_.size() > max_len_) {
+        entries_.pop_back();
+    }
+}
+
+std::vector<SlowLog::Entry> SlowLog::get(size_t count) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    count = std::min(count, entries_.size());
+    return std::vector<Entry>(entries_.begin(), entries_.begin() + count);
+}
+
+size_t SlowLog::length() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
+
+void SlowLog::reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+}
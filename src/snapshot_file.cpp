@@ -0,0 +1,551 @@
+#include "snapshot_file.h"
+#include "epoch.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// A stream section:
+//   name len u32 | name | last id (ms u64, seq u64) | capped u8
+//   block count u64, then per block:
+//     master id (ms u64, seq u64) | entry count u32 | size u32 |
+//     offsets u32 * count | delete flags u8 * count | encoded bytes
+//   group count u32, then per group:
+//     name len u32 | name | last delivered id (ms u64, seq u64)
+//     consumer count u32 | (name len u32, name, seen time u64) * count
+//     pending count u64 | (id ms u64, id seq u64, consumer u32,
+//                          delivery time u64, delivery count u64) * count
+//   checksum u64 of everything before it in the section
+
+namespace {
+
+constexpr char kMagic[8] = {'R', 'S', 'S', 'N', 'A', 'P', '0', '1'};
+constexpr char kTableMagic[8] = {'R', 'S', 'S', 'N', 'A', 'P', 'T', 'B'};
+constexpr size_t kTrailerSize = 2 * sizeof(uint64_t) + sizeof(kTableMagic);
+constexpr size_t kWriteBuffer = 4 * 1024 * 1024;
+
+uint64_t now_ms() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// 64-bit checksum over 8-byte words, fed in pieces of any size
+class Checksum {
+public:
+    void update(const uint8_t* data, size_t size) {
+        length_ += size;
+        if (buffered_ > 0) {
+            size_t take = std::min(size, sizeof(buffer_) - buffered_);
+            std::memcpy(buffer_ + buffered_, data, take);
+            buffered_ += take;
+            data += take;
+            size -= take;
+            if (buffered_ < sizeof(buffer_)) {
+                return;
+            }
+            mix(word(buffer_));
+            buffered_ = 0;
+        }
+        for (; size >= sizeof(buffer_); data += sizeof(buffer_), size -= sizeof(buffer_)) {
+            mix(word(data));
+        }
+        std::memcpy(buffer_, data, size);
+        buffered_ = size;
+    }
+
+    uint64_t digest() const {
+        uint8_t tail[8] = {};
+        std::memcpy(tail, buffer_, buffered_);
+        uint64_t hash = step(hash_, word(tail) ^ length_);
+        // Final avalanche (the MurmurHash3 finalizer)
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        return hash ^ (hash >> 33);
+    }
+
+private:
+    static uint64_t word(const uint8_t* data) {
+        uint64_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+    static uint64_t step(uint64_t hash, uint64_t value) {
+        hash ^= value * 0x87c37b91114253d5ULL;
+        hash = (hash << 31) | (hash >> 33);
+        return hash * 0x9e3779b97f4a7c15ULL;
+    }
+    void mix(uint64_t value) { hash_ = step(hash_, value); }
+
+    uint64_t hash_ = 0;
+    uint64_t length_ = 0;
+    uint8_t buffer_[8];
+    size_t buffered_ = 0;
+};
+
+// Buffered output to the snapshot file, checksumming the current section
+class Writer {
+public:
+    explicit Writer(int fd) : fd_(fd), offset_(0) { buffer_.reserve(kWriteBuffer); }
+
+    void put(const void* data, size_t size) {
+        checksum_.update(static_cast<const uint8_t*>(data), size);
+        offset_ += size;
+        if (buffer_.size() + size > kWriteBuffer) {
+            flush();
+            if (size >= kWriteBuffer) {
+                write_out(static_cast<const char*>(data), size);
+                return;
+            }
+        }
+        buffer_.append(static_cast<const char*>(data), size);
+    }
+    template <typename T>
+    void put_int(T value) {
+        put(&value, sizeof(value));
+    }
+    void put_string(const std::string& value) {
+        put_int(static_cast<uint32_t>(value.size()));
+        put(value.data(), value.size());
+    }
+    void put_id(const StreamID& id) {
+        put_int(id.timestamp_ms);
+        put_int(id.sequence);
+    }
+
+    void begin_section() { checksum_ = Checksum(); }
+    void end_section() { put_int(checksum_.digest()); }
+
+    uint64_t offset() const { return offset_; }
+    void flush() {
+        write_out(buffer_.data(), buffer_.size());
+        buffer_.clear();
+    }
+
+private:
+    void write_out(const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::write(fd_, data, size);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string("write failed: ") + std::strerror(errno));
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+    }
+
+    int fd_;
+    uint64_t offset_;
+    std::string buffer_;
+    Checksum checksum_;
+};
+
+// Bounds-checked input from the mapped file
+class Reader {
+public:
+    Reader(const uint8_t* data, size_t size) : data_(data), end_(data + size) {}
+
+    const uint8_t* take(size_t size) {
+        if (size > static_cast<size_t>(end_ - data_)) {
+            throw std::runtime_error("section ends early");
+        }
+        const uint8_t* start = data_;
+        data_ += size;
+        return start;
+    }
+    template <typename T>
+    T get_int() {
+        T value;
+        std::memcpy(&value, take(sizeof(value)), sizeof(value));
+        return value;
+    }
+    std::string get_string() {
+        uint32_t size = get_int<uint32_t>();
+        return std::string(reinterpret_cast<const char*>(take(size)), size);
+    }
+    StreamID get_id() {
+        uint64_t ms = get_int<uint64_t>();
+        return StreamID(ms, get_int<uint64_t>());
+    }
+    bool done() const { return data_ == end_; }
+
+private:
+    const uint8_t* data_;
+    const uint8_t* end_;
+};
+
+// Returns the live entries written
+uint64_t write_stream(Writer& out, const std::string& name, const Stream::Snapshot& stream) {
+    out.begin_section();
+    out.put_string(name);
+    out.put_id(stream.last_id);
+    out.put_int(static_cast<uint8_t>(stream.capped));
+
+    uint64_t entries = 0;
+    out.put_int(static_cast<uint64_t>(stream.entries.blocks.size()));
+    for (const auto& block : stream.entries.blocks) {
+        out.put_id(block.block->master_id());
+        out.put_int(static_cast<uint32_t>(block.count));
+        out.put_int(static_cast<uint32_t>(block.size));
+        out.put(block.block->raw_offsets(), block.count * sizeof(uint32_t));
+        out.put(block.deleted.data(), block.count);
+        out.put(block.block->raw_data(), block.size);
+        entries += std::count(block.deleted.begin(), block.deleted.end(), 0);
+    }
+
+    out.put_int(static_cast<uint32_t>(stream.groups.size()));
+    for (const auto& pair : stream.groups) {
+        const ConsumerGroup::Snapshot& group = pair.second;
+        out.put_string(pair.first);
+        out.put_id(group.last_delivered_id);
+        out.put_int(static_cast<uint32_t>(group.consumers.size()));
+        for (const auto& consumer : group.consumers) {
+            out.put_string(consumer.first);
+            out.put_int(consumer.second);
+        }
+        out.put_int(static_cast<uint64_t>(group.pending.size()));
+        for (const auto& pending : group.pending) {
+            out.put_id(pending.id);
+            out.put_int(static_cast<uint32_t>(pending.consumer));
+            out.put_int(pending.delivery_time);
+            out.put_int(pending.delivery_count);
+        }
+    }
+    out.end_section();
+    return entries;
+}
+
+// Returns the live entries loaded
+uint64_t load_stream(const uint8_t* data, size_t size, const SnapshotFile::CreateStream& create) {
+    if (size < sizeof(uint64_t)) {
+        throw std::runtime_error("section too short");
+    }
+    size_t body = size - sizeof(uint64_t);
+    Checksum checksum;
+    checksum.update(data, body);
+    uint64_t expected;
+    std::memcpy(&expected, data + body, sizeof(expected));
+    if (checksum.digest() != expected) {
+        throw std::runtime_error("checksum mismatch");
+    }
+
+    Reader in(data, body);
+    std::string name = in.get_string();
+    std::shared_ptr<Stream> stream = create(name);
+    StreamID last_id = in.get_id();
+    bool capped = in.get_int<uint8_t>() != 0;
+
+    uint64_t entries = 0;
+    uint64_t blocks = in.get_int<uint64_t>();
+    StreamID previous;
+    std::vector<uint32_t> offsets;
+    for (uint64_t i = 0; i < blocks; i++) {
+        StreamID master_id = in.get_id();
+        uint32_t count = in.get_int<uint32_t>();
+        uint32_t block_size = in.get_int<uint32_t>();
+        if (count > StreamBlock::kMaxEntries) {
+            throw std::runtime_error("bad block entry count");
+        }
+        // The mapping gives no alignment, so the offsets are copied out
+        offsets.resize(count);
+        std::memcpy(offsets.data(), in.take(count * sizeof(uint32_t)), count * sizeof(uint32_t));
+        const uint8_t* deleted = in.take(count);
+        const uint8_t* encoded = in.take(block_size);
+
+        auto block = StreamBlock::restore(master_id, encoded, block_size, offsets.data(), deleted, count);
+        StreamID block_last = block->id_at(count - 1);
+        if ((i > 0 && master_id <= previous) || block_last < master_id || block_last > last_id) {
+            throw std::runtime_error("blocks out of order");
+        }
+        previous = block_last;
+        entries += block->live_count();
+        stream->restore_block(std::move(block));
+    }
+    stream->restore_state(last_id, capped);
+
+    uint32_t groups = in.get_int<uint32_t>();
+    for (uint32_t i = 0; i < groups; i++) {
+        std::string group_name = in.get_string();
+        StreamID last_delivered = in.get_id();
+        if (!stream->create_consumer_group(group_name, last_delivered)) {
+            throw std::runtime_error("duplicate consumer group " + group_name);
+        }
+        auto group = stream->get_consumer_group(group_name);
+
+        std::vector<std::string> consumers(in.get_int<uint32_t>());
+        for (auto& consumer : consumers) {
+            consumer = in.get_string();
+            group->restore_consumer(consumer, in.get_int<uint64_t>());
+        }
+        uint64_t pending = in.get_int<uint64_t>();
+        for (uint64_t j = 0; j < pending; j++) {
+            StreamID id = in.get_id();
+            uint32_t consumer = in.get_int<uint32_t>();
+            uint64_t delivery_time = in.get_int<uint64_t>();
+            uint64_t delivery_count = in.get_int<uint64_t>();
+            if (consumer >= consumers.size()) {
+                throw std::runtime_error("bad consumer index");
+            }
+            group->restore_pending(consumers[consumer], id, delivery_time, delivery_count);
+        }
+    }
+    if (!in.done()) {
+        throw std::runtime_error("trailing bytes in section");
+    }
+    return entries;
+}
+
+// Make a rename within the file's directory durable
+void sync_directory(const std::string& path) {
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+} // namespace
+
+SnapshotFile::SnapshotFile(std::string path, ForEachStream for_each)
+    : path_(std::move(path)), for_each_(std::move(for_each)), saving_(false),
+      last_save_ok_(true), saves_(0), last_save_time_(0) {
+}
+
+SnapshotFile::~SnapshotFile() {
+    wait();
+}
+
+SnapshotFile::SaveStats SnapshotFile::save() {
+    bool expected = false;
+    if (!saving_.compare_exchange_strong(expected, true)) {
+        throw std::runtime_error("Background save already in progress");
+    }
+    try {
+        SaveStats stats = write_file();
+        finish_save(true, stats);
+        return stats;
+    } catch (...) {
+        finish_save(false, SaveStats());
+        throw;
+    }
+}
+
+bool SnapshotFile::background_save() {
+    std::lock_guard<std::mutex> saver_lock(saver_mutex_);
+    bool expected = false;
+    if (!saving_.compare_exchange_strong(expected, true)) {
+        return false;
+    }
+    if (saver_.joinable()) {
+        saver_.join(); // The previous save, already done
+    }
+    saver_ = std::thread([this] {
+        try {
+            finish_save(true, write_file());
+        } catch (const std::exception& e) {
+            std::cerr << "Background save to " << path_ << " failed: " << e.what() << std::endl;
+            finish_save(false, SaveStats());
+        }
+    });
+    return true;
+}
+
+void SnapshotFile::wait() {
+    std::lock_guard<std::mutex> saver_lock(saver_mutex_);
+    if (saver_.joinable()) {
+        saver_.join();
+    }
+}
+
+SnapshotFile::Status SnapshotFile::status() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Status{saving_.load(), last_save_ok_, saves_, last_save_time_, last_save_, last_load_};
+}
+
+void SnapshotFile::finish_save(bool ok, const SaveStats& stats) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        last_save_ok_ = ok;
+        if (ok) {
+            saves_++;
+            last_save_time_ = std::time(nullptr);
+            last_save_ = stats;
+        }
+    }
+    saving_.store(false);
+}
+
+SnapshotFile::SaveStats SnapshotFile::write_file() {
+    uint64_t started = now_ms();
+    std::string temp_path = path_ + ".tmp";
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("cannot open " + temp_path + ": " + std::strerror(errno));
+    }
+
+    SaveStats stats;
+    try {
+        Writer out(fd);
+        out.put(kMagic, sizeof(kMagic));
+
+        std::vector<std::pair<uint64_t, uint64_t>> table;
+        for_each_([&out, &stats, &table](const std::string& name, const std::shared_ptr<Stream>& stream) {
+            // Blocks the stream drops while it is written out must stay
+            Epoch::Guard guard;
+            Stream::Snapshot snapshot = stream->snapshot();
+            uint64_t offset = out.offset();
+            stats.entries += write_stream(out, name, snapshot);
+            table.emplace_back(offset, out.offset() - offset);
+            stats.streams++;
+        });
+
+        uint64_t table_offset = out.offset();
+        for (const auto& section : table) {
+            out.put_int(section.first);
+            out.put_int(section.second);
+        }
+        out.put_int(static_cast<uint64_t>(table.size()));
+        out.put_int(table_offset);
+        out.put(kTableMagic, sizeof(kTableMagic));
+        out.flush();
+        stats.bytes = out.offset();
+
+        if (fdatasync(fd) != 0) {
+            throw std::runtime_error(std::string("fdatasync failed: ") + std::strerror(errno));
+        }
+    } catch (...) {
+        close(fd);
+        unlink(temp_path.c_str());
+        throw;
+    }
+    close(fd);
+
+    if (rename(temp_path.c_str(), path_.c_str()) != 0) {
+        int error = errno;
+        unlink(temp_path.c_str());
+        throw std::runtime_error("cannot rename " + temp_path + ": " + std::strerror(error));
+    }
+    sync_directory(path_);
+    stats.ms = now_ms() - started;
+    return stats;
+}
+
+bool SnapshotFile::load(const CreateStream& create) {
+    uint64_t started = now_ms();
+    int fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return false;
+        }
+        throw std::runtime_error("Cannot open snapshot " + path_ + ": " + std::strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int error = errno;
+        close(fd);
+        throw std::runtime_error("Cannot stat snapshot " + path_ + ": " + std::strerror(error));
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size < sizeof(kMagic) + kTrailerSize) {
+        close(fd);
+        throw std::runtime_error("Snapshot " + path_ + " is truncated");
+    }
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("Cannot map snapshot " + path_ + ": " + std::strerror(errno));
+    }
+    const uint8_t* data = static_cast<const uint8_t*>(mapping);
+    // Each thread reads its sections front to back
+    madvise(mapping, size, MADV_SEQUENTIAL);
+
+    LoadStats stats;
+    try {
+        // The table, from the trailer
+        Reader trailer(data + size - kTrailerSize, kTrailerSize);
+        uint64_t sections = trailer.get_int<uint64_t>();
+        uint64_t table_offset = trailer.get_int<uint64_t>();
+        if (std::memcmp(data, kMagic, sizeof(kMagic)) != 0 ||
+            std::memcmp(trailer.take(sizeof(kTableMagic)), kTableMagic, sizeof(kTableMagic)) != 0 ||
+            table_offset < sizeof(kMagic) || table_offset > size - kTrailerSize ||
+            (size - kTrailerSize - table_offset) / (2 * sizeof(uint64_t)) != sections ||
+            (size - kTrailerSize - table_offset) % (2 * sizeof(uint64_t)) != 0) {
+            throw std::runtime_error("not a snapshot file, or truncated");
+        }
+        Reader table(data + table_offset, size - kTrailerSize - table_offset);
+        std::vector<std::pair<uint64_t, uint64_t>> layout(sections);
+        for (auto& section : layout) {
+            section.first = table.get_int<uint64_t>();
+            section.second = table.get_int<uint64_t>();
+            if (section.first < sizeof(kMagic) || section.first > table_offset ||
+                section.second > table_offset - section.first) {
+                throw std::runtime_error("section out of bounds");
+            }
+        }
+
+        // Largest streams first, so one big stream does not start last and
+        // keep a single core busy after the others are done
+        std::sort(layout.begin(), layout.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+
+        unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+        threads = static_cast<unsigned>(std::min<uint64_t>(threads, std::max<uint64_t>(sections, 1)));
+        std::atomic<size_t> next(0);
+        std::atomic<uint64_t> entries(0);
+        std::atomic<bool> failed(false);
+        std::mutex error_mutex;
+        std::string error;
+
+        auto run = [&] {
+            size_t i;
+            while (!failed.load(std::memory_order_relaxed) && (i = next.fetch_add(1)) < layout.size()) {
+                try {
+                    entries += load_stream(data + layout[i].first, layout[i].second, create);
+                } catch (const std::exception& e) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!failed.exchange(true)) {
+                        error = "section at offset " + std::to_string(layout[i].first) + ": " + e.what();
+                    }
+                }
+            }
+        };
+        std::vector<std::thread> workers;
+        for (unsigned t = 1; t < threads; t++) {
+            workers.emplace_back(run);
+        }
+        run();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        if (failed) {
+            throw std::runtime_error(error);
+        }
+
+        stats.streams = sections;
+        stats.entries = entries;
+        stats.bytes = size;
+        stats.threads = threads;
+    } catch (const std::exception& e) {
+        munmap(mapping, size);
+        throw std::runtime_error("Bad snapshot " + path_ + ": " + e.what());
+    }
+    munmap(mapping, size);
+
+    stats.ms = now_ms() - started;
+    std::lock_guard<std::mutex> lock(mutex_);
+    last_load_ = stats;
+    return true;
+}
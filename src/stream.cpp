@@ -1,90 +1,179 @@
 #include "stream.h"
+#include "blocked_read.h"
+#include "memory_tracker.h"
 #include <algorithm>
 #include <chrono>
 
-Stream::Stream() : last_id_(0, 0) {
+Stream::Stream() : waiter_count_(0), capped_(false), last_id_version_(0), last_id_ms_(0), last_id_seq_(0) {
+    MemoryTracker::allocated(sizeof(Stream));
 }
 
-Stream::~Stream() = default;
+Stream::~Stream() {
+    MemoryTracker::released(sizeof(Stream));
+}
 
-StreamID Stream::add_entry(const StreamID& id, const std::vector<std::pair<std::string, std::string>>& fields) {
-    std::lock_guard<std::mutex> lock(entries_mutex_);
+StreamID Stream::add_entry(const StreamID& id, const FieldViews& fields, const StreamTrim& trim, bool exact_id) {
+    std::unique_lock<std::mutex> lock(write_mutex_);
+    
+    StreamID actual_id = next_id(id, exact_id);
+    
+    // Encode the entry into the tail block
+    entries_.append(actual_id, fields);
+    set_last_id(actual_id);
+    if (trim.strategy != StreamTrim::Strategy::None) {
+        capped_.store(true, std::memory_order_relaxed);
+        apply_trim(trim);
+    }
+    lock.unlock();
+    
+    // Wake blocked clients. The fence pairs with add_waiter(): either we see
+    // the new waiter here or its re-check sees this entry.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiter_count_.load(std::memory_order_relaxed) > 0) {
+        notify_waiters(actual_id);
+    }
     
+    return actual_id;
+}
+
+StreamID Stream::add_entries(const StreamID& id, const std::vector<FieldViews>& entries, const StreamTrim& trim,
+                             bool exact_id) {
+    if (entries.empty()) {
+        throw std::invalid_argument("No entries to add");
+    }
+    std::unique_lock<std::mutex> lock(write_mutex_);
+    
+    // The batch takes a contiguous run of sequence numbers after the first ID
+    StreamID first_id = next_id(id, exact_id);
+    if (UINT64_MAX - first_id.sequence < entries.size() - 1) {
+        throw std::invalid_argument("Stream ID sequence exhausted for this batch");
+    }
+    
+    StreamID entry_id = first_id;
+    for (const FieldViews& fields : entries) {
+        entries_.append(entry_id, fields);
+        entry_id.sequence++;
+    }
+    StreamID last_id(first_id.timestamp_ms, first_id.sequence + entries.size() - 1);
+    set_last_id(last_id);
+    if (trim.strategy != StreamTrim::Strategy::None) {
+        capped_.store(true, std::memory_order_relaxed);
+        apply_trim(trim);
+    }
+    lock.unlock();
+    
+    // One wake-up for the whole batch, as in add_entry()
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiter_count_.load(std::memory_order_relaxed) > 0) {
+        notify_waiters(last_id);
+    }
+    
+    return first_id;
+}
+
+StreamID Stream::next_id(const StreamID& id, bool exact_id) const {
+    StreamID last_id = get_last_id();
     StreamID actual_id = id;
     
     // Handle auto-generation and sequencing
-    if (id.timestamp_ms == 0 && id.sequence == 0) {
-        // Full auto-generation
+    if (exact_id) {
+        if (actual_id <= last_id) {
+            throw std::invalid_argument("Stream ID must be greater than last ID");
+        }
+    } else if (id.timestamp_ms == 0 && id.sequence == 0) {
+        // Full auto-generation; past the last sequence number of a
+        // millisecond it moves on to the next one, as Redis does
         actual_id = StreamID::generate_auto();
-        if (actual_id <= last_id_) {
-            actual_id = StreamID(last_id_.timestamp_ms, last_id_.sequence + 1);
+        if (actual_id <= last_id) {
+            if (last_id.sequence != UINT64_MAX) {
+                actual_id = StreamID(last_id.timestamp_ms, last_id.sequence + 1);
+            } else if (last_id.timestamp_ms != UINT64_MAX) {
+                actual_id = StreamID(last_id.timestamp_ms + 1, 0);
+            } else {
+                throw std::invalid_argument("The stream has exhausted the last possible ID, unable to add more items");
+            }
         }
     } else if (id.sequence == 0) {
-        // Auto-generate sequence for given timestamp
-        if (id.timestamp_ms == last_id_.timestamp_ms) {
-            actual_id = StreamID(id.timestamp_ms, last_id_.sequence + 1);
-        } else if (id.timestamp_ms > last_id_.timestamp_ms) {
+        // Auto-generate sequence for given timestamp, which has none left
+        // once the last one was used
+        if (id.timestamp_ms == last_id.timestamp_ms) {
+            if (last_id.sequence == UINT64_MAX) {
+                throw std::invalid_argument("Stream ID must be greater than last ID");
+            }
+            actual_id = StreamID(id.timestamp_ms, last_id.sequence + 1);
+        } else if (id.timestamp_ms > last_id.timestamp_ms) {
             actual_id = StreamID(id.timestamp_ms, 0);
         } else {
             throw std::invalid_argument("Stream ID must be greater than last ID");
         }
     } else {
         // Explicit ID provided
-        if (actual_id <= last_id_) {
+        if (actual_id <= last_id) {
             throw std::invalid_argument("Stream ID must be greater than last ID");
         }
     }
     
-    // Create and store the entry
-    entries_.emplace(actual_id, StreamEntry(actual_id, fields));
-    last_id_ = actual_id;
-    
-    // Notify blocked clients
-    notify_blocked_clients();
-    
     return actual_id;
 }
 
 std::vector<StreamEntry> Stream::get_range(const StreamID& start, const StreamID& end, int count) const {
-    std::lock_guard<std::mutex> lock(entries_mutex_);
+    Epoch::Guard guard;
     
     std::vector<StreamEntry> result;
-    
-    auto start_it = (start.timestamp_ms == 0 && start.sequence == 0) ? 
-                    entries_.begin() : entries_.lower_bound(start);
-    
-    auto end_it = (end.timestamp_ms == UINT64_MAX && end.sequence == UINT64_MAX) ? 
-                  entries_.end() : entries_.upper_bound(end);
+    StreamEntryView view;
     
     int added = 0;
-    for (auto it = start_it; it != end_it && (count < 0 || added < count); ++it, ++added) {
-        result.push_back(it->second);
+    for (auto it = entries_.lower_bound(start); it.valid() && (count < 0 || added < count); it.next(), ++added) {
+        if (it.id() > end) {
+            break;
+        }
+        it.decode(view);
+        result.push_back(view.to_entry());
     }
     
     return result;
 }
 
 std::vector<StreamEntry> Stream::get_entries_after(const StreamID& id, int count) const {
-    std::lock_guard<std::mutex> lock(entries_mutex_);
+    Epoch::Guard guard;
     
     std::vector<StreamEntry> result;
+    StreamEntryView view;
     
-    auto it = entries_.upper_bound(id);
     int added = 0;
-    
-    for (; it != entries_.end() && (count < 0 || added < count); ++it, ++added) {
-        result.push_back(it->second);
+    for (auto it = entries_.upper_bound(id); it.valid() && (count < 0 || added < count); it.next(), ++added) {
+        it.decode(view);
+        result.push_back(view.to_entry());
     }
     
     return result;
 }
 
+size_t Stream::trim(const StreamTrim& trim) {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    return apply_trim(trim);
+}
+
+size_t Stream::apply_trim(const StreamTrim& trim) {
+    // Entries still in a PEL may go too; readers of the PEL treat them like
+    // deleted ones
+    switch (trim.strategy) {
+        case StreamTrim::Strategy::MaxLen:
+            return entries_.trim_to_length(trim.max_len, trim.approximate, trim.limit);
+        case StreamTrim::Strategy::MinId:
+            return entries_.trim_before(trim.min_id, trim.approximate, trim.limit);
+        case StreamTrim::Strategy::None:
+            break;
+    }
+    return 0;
+}
+
 bool Stream::delete_entries(const std::vector<StreamID>& ids) {
-    std::lock_guard<std::mutex> lock(entries_mutex_);
+    std::lock_guard<std::mutex> lock(write_mutex_);
     
     bool any_deleted = false;
     for (const auto& id : ids) {
-        if (entries_.erase(id) > 0) {
+        if (entries_.remove(id)) {
             any_deleted = true;
         }
     }
@@ -93,10 +182,46 @@ bool Stream::delete_entries(const std::vector<StreamID>& ids) {
 }
 
 size_t Stream::length() const {
-    std::lock_guard<std::mutex> lock(entries_mutex_);
     return entries_.size();
 }
 
+size_t Stream::memory_usage() const {
+    size_t bytes = sizeof(Stream) + entries_.memory_usage();
+    
+    std::lock_guard<std::mutex> lock(groups_mutex_);
+    for (const auto& pair : consumer_groups_) {
+        bytes += pair.second->memory_usage();
+    }
+    return bytes;
+}
+
+size_t Stream::evict_oldest() {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    return entries_.trim_front_block();
+}
+
+size_t Stream::spill(size_t hot_limit, size_t max_bytes, const SpillWriter& write) {
+    // The blocks picked stay alive under the guard even if trimmed meanwhile
+    Epoch::Guard guard;
+    std::vector<const StreamBlock*> blocks = entries_.spill_candidates(hot_limit, max_bytes);
+    if (blocks.empty()) {
+        return 0;
+    }
+    
+    std::vector<const uint8_t*> bytes;
+    std::shared_ptr<const void> backing = write(blocks, bytes);
+    if (!backing) {
+        return 0;
+    }
+    
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    return entries_.make_cold(blocks, bytes, backing);
+}
+
+Stream::ReadGuard Stream::read() const {
+    return ReadGuard(entries_);
+}
+
 bool Stream::create_consumer_group(const std::string& group_name, const StreamID& start_id) {
     std::lock_guard<std::mutex> lock(groups_mutex_);
     
@@ -112,7 +237,7 @@ bool Stream::create_consumer_group(const std::string& group_name, const StreamID
         actual_start_id = StreamID(0, 0);
     } else if (start_id.timestamp_ms == UINT64_MAX && start_id.sequence == UINT64_MAX) {
         // Start from end ($ in Redis)
-        actual_start_id = last_id_;
+        actual_start_id = get_last_id();
     }
     
     auto group = std::make_shared<ConsumerGroup>(group_name, actual_start_id);
@@ -133,20 +258,99 @@ bool Stream::delete_consumer_group(const std::string& group_name) {
     return consumer_groups_.erase(group_name) > 0;
 }
 
+std::vector<std::pair<std::string, std::shared_ptr<ConsumerGroup>>> Stream::get_consumer_groups() const {
+    std::lock_guard<std::mutex> lock(groups_mutex_);
+    return std::vector<std::pair<std::string, std::shared_ptr<ConsumerGroup>>>(consumer_groups_.begin(),
+                                                                               consumer_groups_.end());
+}
+
+Stream::Snapshot Stream::snapshot() const {
+    // Appends, deletes and trims wait on the writer lock and deliveries on
+    // the group locks, so nothing moves while this is taken
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    std::lock_guard<std::mutex> groups_lock(groups_mutex_);
+    
+    Snapshot snapshot;
+    snapshot.last_id = get_last_id();
+    snapshot.capped = capped();
+    snapshot.entries = entries_.snapshot();
+    for (const auto& pair : consumer_groups_) {
+        snapshot.groups.emplace_back(pair.first, pair.second->snapshot());
+    }
+    return snapshot;
+}
+
+void Stream::restore_block(StreamBlock::Ptr block) {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    entries_.append_block(std::move(block));
+}
+
+void Stream::restore_state(const StreamID& last_id, bool capped) {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    set_last_id(last_id);
+    capped_.store(capped, std::memory_order_relaxed);
+}
+
 StreamID Stream::get_last_id() const {
-    std::lock_guard<std::mutex> lock(entries_mutex_);
-    return last_id_;
+    while (true) {
+        uint64_t version = last_id_version_.load(std::memory_order_acquire);
+        StreamID id(last_id_ms_.load(std::memory_order_relaxed), last_id_seq_.load(std::memory_order_relaxed));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (!(version & 1) && version == last_id_version_.load(std::memory_order_relaxed)) {
+            return id;
+        }
+    }
+}
+
+bool Stream::advance_last_id(const StreamID& id) {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    if (id < get_last_id()) {
+        return false;
+    }
+    set_last_id(id);
+    return true;
 }
 
-void Stream::add_blocked_client(int client_socket, const StreamID& last_id) {
-    std::lock_guard<std::mutex> lock(blocked_clients_mutex_);
-    blocked_clients_.push_back({client_socket, last_id});
+void Stream::set_last_id(const StreamID& id) {
+    uint64_t version = last_id_version_.load(std::memory_order_relaxed);
+    last_id_version_.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    last_id_ms_.store(id.timestamp_ms, std::memory_order_relaxed);
+    last_id_seq_.store(id.sequence, std::memory_order_relaxed);
+    last_id_version_.store(version + 2, std::memory_order_release);
 }
 
-void Stream::notify_blocked_clients() {
-    std::lock_guard<std::mutex> lock(blocked_clients_mutex_);
+void Stream::add_waiter(const std::shared_ptr<BlockedRead>& waiter, const StreamID& after) {
+    std::lock_guard<std::mutex> lock(waiters_mutex_);
+    waiters_.push_back({waiter, after});
+    waiter_count_.fetch_add(1, std::memory_order_seq_cst);
+}
+
+void Stream::remove_waiter(const BlockedRead* waiter) {
+    std::lock_guard<std::mutex> lock(waiters_mutex_);
     
-    // In a real implementation, we would notify the blocked clients here
-    // For now, we'll just clear the list as a placeholder
-    blocked_clients_.clear();
+    auto it = std::find_if(waiters_.begin(), waiters_.end(), [waiter](const Waiter& candidate) {
+        return candidate.read.get() == waiter;
+    });
+    if (it != waiters_.end()) {
+        waiters_.erase(it);
+        waiter_count_.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void Stream::notify_waiters(const StreamID& id) {
+    std::vector<std::shared_ptr<BlockedRead>> woken;
+    {
+        std::lock_guard<std::mutex> lock(waiters_mutex_);
+        for (const auto& waiter : waiters_) {
+            if (id > waiter.after) {
+                woken.push_back(waiter.read);
+            }
+        }
+    }
+    
+    // Waking only queues a retry on the reader's thread; no need to hold the list
+    for (const auto& read : woken) {
+        read->wake();
+    }
 }
@@ -0,0 +1,67 @@
+#include "stream_directory.h"
+#include <mutex>
+
+std::shared_ptr<Stream> StreamDirectory::find(std::string_view name) const {
+    const Stripe& stripe = stripe_for(name);
+    std::shared_lock<std::shared_mutex> lock(stripe.mutex);
+
+    auto it = stripe.streams.find(std::string(name));
+    return it != stripe.streams.end() ? it->second : nullptr;
+}
+
+std::shared_ptr<Stream> StreamDirectory::find_or_create(std::string_view name) {
+    Stripe& stripe = stripe_for(name);
+    std::string key(name);
+    {
+        std::shared_lock<std::shared_mutex> lock(stripe.mutex);
+        auto it = stripe.streams.find(key);
+        if (it != stripe.streams.end()) {
+            return it->second;
+        }
+    }
+
+    // Someone may have created it between the two locks; keep theirs
+    std::unique_lock<std::shared_mutex> lock(stripe.mutex);
+    auto& stream = stripe.streams[key];
+    if (!stream) {
+        stream = std::make_shared<Stream>();
+    }
+    return stream;
+}
+
+bool StreamDirectory::erase(std::string_view name) {
+    Stripe& stripe = stripe_for(name);
+    std::unique_lock<std::shared_mutex> lock(stripe.mutex);
+    return stripe.streams.erase(std::string(name)) > 0;
+}
+
+size_t StreamDirectory::size() const {
+    size_t total = 0;
+    for (const auto& stripe : stripes_) {
+        std::shared_lock<std::shared_mutex> lock(stripe.mutex);
+        total += stripe.streams.size();
+    }
+    return total;
+}
+
+void StreamDirectory::for_each(
+    const std::function<void(const std::string& name, const std::shared_ptr<Stream>& stream)>& visit) const {
+    std::vector<std::pair<std::string, std::shared_ptr<Stream>>> streams;
+    for (const auto& stripe : stripes_) {
+        {
+            std::shared_lock<std::shared_mutex> lock(stripe.mutex);
+            streams.assign(stripe.streams.begin(), stripe.streams.end());
+        }
+        for (const auto& pair : streams) {
+            visit(pair.first, pair.second);
+        }
+    }
+}
+
+StreamDirectory::Stripe& StreamDirectory::stripe_for(std::string_view name) {
+    return stripes_[std::hash<std::string_view>()(name) % kStripes];
+}
+
+const StreamDirectory::Stripe& StreamDirectory::stripe_for(std::string_view name) const {
+    return stripes_[std::hash<std::string_view>()(name) % kStripes];
+}
@@ -1,32 +1,45 @@
 #include "stream_entry.h"
+#include <charconv>
 #include <chrono>
-#include <sstream>
 #include <stdexcept>
 
+namespace {
+// One half of an ID: digits only, no sign or spaces, within 64 bits
+uint64_t parse_id_part(std::string_view text) {
+    uint64_t value = 0;
+    auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (text.empty() || result.ec != std::errc() || result.ptr != text.data() + text.size()) {
+        throw std::invalid_argument("Invalid stream ID format");
+    }
+    return value;
+}
+}
+
 // StreamID implementation
 std::string StreamID::to_string() const {
-    return std::to_string(timestamp_ms) + "-" + std::to_string(sequence);
+    char text[kMaxStringLength];
+    return std::string(text, format(text));
+}
+
+size_t StreamID::format(char* out) const {
+    size_t n = ReplyBuffer::format_uint(timestamp_ms, out);
+    out[n++] = '-';
+    return n + ReplyBuffer::format_uint(sequence, out + n);
 }
 
-StreamID StreamID::from_string(const std::string& id_str) {
+StreamID StreamID::from_string(std::string_view id_str) {
     if (id_str == "*") {
         return generate_auto();
     }
     
     size_t dash_pos = id_str.find('-');
-    if (dash_pos == std::string::npos) {
+    if (dash_pos == std::string_view::npos) {
         throw std::invalid_argument("Invalid stream ID format");
     }
     
-    uint64_t timestamp = std::stoull(id_str.substr(0, dash_pos));
-    uint64_t sequence;
-    
-    std::string seq_str = id_str.substr(dash_pos + 1);
-    if (seq_str == "*") {
-        sequence = 0; // Will be auto-incremented
-    } else {
-        sequence = std::stoull(seq_str);
-    }
+    uint64_t timestamp = parse_id_part(id_str.substr(0, dash_pos));
+    std::string_view seq_str = id_str.substr(dash_pos + 1);
+    uint64_t sequence = seq_str == "*" ? 0 : parse_id_part(seq_str); // "*" is auto-incremented
     
     return StreamID(timestamp, sequence);
 }
@@ -66,31 +79,28 @@ bool StreamID::operator!=(const StreamID& other) const {
 
 // StreamEntry implementation
 StreamEntry::StreamEntry(const StreamID& id, const std::vector<std::pair<std::string, std::string>>& fields)
-    : id_(id) {
-    for (const auto& field : fields) {
-        fields_[field.first] = field.second;
-    }
+    : id_(id), fields_(fields) {
 }
 
 std::string StreamEntry::to_resp_format() const {
-    std::ostringstream oss;
-    
+    ReplyBuffer out;
+    write_resp(out);
+    return out.str();
+}
+
+void StreamEntry::write_resp(ReplyBuffer& out) const {
     // Entry format: [stream_id, [field1, value1, field2, value2, ...]]
-    oss << "*2\r\n"; // Array of 2 elements
+    out.append_array_header(2);
     
     // Stream ID as bulk string
-    std::string id_str = id_.to_string();
-    oss << "$" << id_str.length() << "\r\n" << id_str << "\r\n";
+    char id_text[StreamID::kMaxStringLength];
+    out.append_bulk_string(std::string_view(id_text, id_.format(id_text)));
     
-    // Fields array
-    oss << "*" << (fields_.size() * 2) << "\r\n"; // Each field has key and value
+    // Fields array, each field has key and value
+    out.append_array_header(fields_.size() * 2);
     
     for (const auto& field : fields_) {
-        // Field name
-        oss << "$" << field.first.length() << "\r\n" << field.first << "\r\n";
-        // Field value
-        oss << "$" << field.second.length() << "\r\n" << field.second << "\r\n";
+        out.append_bulk_string(field.first);
+        out.append_bulk_string(field.second);
     }
-    
-    return oss.str();
 }
@@ -0,0 +1,772 @@
+#include "stream_storage.h"
+#include "block_allocator.h"
+#include "epoch.h"
+#include "memory_tracker.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+constexpr uint8_t kFlagSameFields = 0x02;
+// Block list slots allocated up front
+constexpr size_t kInitialIndexCapacity = 16;
+
+size_t varint_size(uint64_t value) {
+    size_t bytes = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        bytes++;
+    }
+    return bytes;
+}
+
+uint8_t* put_varint(uint8_t* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = static_cast<uint8_t>(value) | 0x80;
+        value >>= 7;
+    }
+    *out++ = static_cast<uint8_t>(value);
+    return out;
+}
+
+const uint8_t* get_varint(const uint8_t* in, uint64_t& value) {
+    uint64_t result = 0;
+    int shift = 0;
+    while (*in & 0x80) {
+        result |= static_cast<uint64_t>(*in++ & 0x7f) << shift;
+        shift += 7;
+    }
+    value = result | (static_cast<uint64_t>(*in++) << shift);
+    return in;
+}
+
+// ID deltas relative to a block master (see StreamBlock)
+uint64_t sequence_delta(const StreamID& master, const StreamID& id) {
+    return id.timestamp_ms == master.timestamp_ms ? id.sequence - master.sequence : id.sequence;
+}
+
+const uint8_t* decode_id(const uint8_t* in, const StreamID& master, StreamID& id) {
+    uint64_t ms_delta;
+    uint64_t seq;
+    in = get_varint(in, ms_delta);
+    in = get_varint(in, seq);
+    id.timestamp_ms = master.timestamp_ms + ms_delta;
+    id.sequence = ms_delta == 0 ? master.sequence + seq : seq;
+    return in;
+}
+
+} // namespace
+
+// StreamEntryView implementation
+StreamEntry StreamEntryView::to_entry() const {
+    std::vector<std::pair<std::string, std::string>> owned;
+    owned.reserve(fields.size());
+    for (const auto& field : fields) {
+        owned.emplace_back(field.first, field.second);
+    }
+    return StreamEntry(id, owned);
+}
+
+// StreamBlock implementation
+StreamBlock::StreamBlock(const StreamID& master_id, size_t names, size_t slots, size_t capacity, size_t allocation)
+    : master_id_(master_id), allocation_(allocation), data_(nullptr), bytes_(nullptr), capacity_(capacity), size_(0),
+      slots_(slots), count_(0), live_count_(0), master_count_(names) {
+    // Names, offsets, delete flags, then the encoding, each aligned for its type
+    auto* names_at = reinterpret_cast<std::string_view*>(this + 1);
+    for (size_t i = 0; i < names; i++) {
+        new (names_at + i) std::string_view();
+    }
+    master_fields_ = names_at;
+    offsets_ = reinterpret_cast<uint32_t*>(names_at + names);
+    auto* deleted_at = reinterpret_cast<std::atomic<uint8_t>*>(offsets_ + slots);
+    for (size_t i = 0; i < slots; i++) {
+        new (deleted_at + i) std::atomic<uint8_t>(0);
+    }
+    deleted_ = deleted_at;
+    if (capacity > 0) {
+        data_ = reinterpret_cast<uint8_t*>(deleted_at + slots);
+        bytes_ = data_;
+    }
+}
+
+StreamBlock::Ptr StreamBlock::allocate(const StreamID& master_id, size_t names, size_t slots, size_t capacity) {
+    static_assert(sizeof(StreamBlock) % alignof(std::string_view) == 0, "names must follow the block aligned");
+    size_t bytes = sizeof(StreamBlock) + names * sizeof(std::string_view) +
+                   slots * (sizeof(uint32_t) + sizeof(std::atomic<uint8_t>)) + capacity;
+    void* memory = BlockAllocator::allocate(bytes);
+    return Ptr(new (memory) StreamBlock(master_id, names, slots, capacity, BlockAllocator::allocation_size(bytes)));
+}
+
+void StreamBlock::destroy(const StreamBlock* block) {
+    if (block) {
+        block->~StreamBlock();
+        BlockAllocator::deallocate(const_cast<StreamBlock*>(block));
+    }
+}
+
+StreamBlock::Ptr StreamBlock::create(const StreamID& master_id, const FieldViews& master_fields, size_t capacity) {
+    Ptr block = allocate(master_id, master_fields.size(), kMaxEntries, capacity);
+    uint8_t* out = put_varint(block->data_, master_fields.size());
+    for (size_t i = 0; i < master_fields.size(); i++) {
+        std::string_view name = master_fields[i].first;
+        out = put_varint(out, name.size());
+        std::memcpy(out, name.data(), name.size());
+        block->master_fields_[i] = std::string_view(reinterpret_cast<const char*>(out), name.size());
+        out += name.size();
+    }
+    block->size_ = out - block->data_;
+    return block;
+}
+
+StreamBlock::Ptr StreamBlock::restore(const StreamID& master_id, const uint8_t* data, size_t size,
+                                      const uint32_t* offsets, const uint8_t* deleted, size_t count) {
+    if (count == 0 || count > kMaxEntries || size > UINT32_MAX) {
+        throw std::invalid_argument("bad block entry count");
+    }
+
+    // Master names, checked against the bounds as they are read
+    const uint8_t* in = data;
+    const uint8_t* end = in + size;
+    auto read_varint = [&in, end](uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (in == end) {
+                throw std::invalid_argument("truncated block header");
+            }
+            uint8_t byte = *in++;
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return;
+            }
+        }
+        throw std::invalid_argument("bad varint in block header");
+    };
+    uint64_t names;
+    read_varint(names);
+    std::vector<std::pair<size_t, size_t>> name_spans;
+    for (uint64_t i = 0; i < names; i++) {
+        uint64_t length;
+        read_varint(length);
+        if (length > static_cast<uint64_t>(end - in)) {
+            throw std::invalid_argument("truncated block header");
+        }
+        name_spans.emplace_back(in - data, length);
+        in += length;
+    }
+
+    // Entries follow the header in order; each needs its flags byte
+    size_t previous = in - data;
+    for (size_t i = 0; i < count; i++) {
+        if (offsets[i] < previous || offsets[i] >= size) {
+            throw std::invalid_argument("bad block entry offset");
+        }
+        previous = offsets[i] + 1;
+    }
+
+    Ptr block = allocate(master_id, name_spans.size(), kMaxEntries, std::max(size, kTargetBytes));
+    std::memcpy(block->data_, data, size);
+    block->size_ = size;
+    for (size_t i = 0; i < name_spans.size(); i++) {
+        const char* name = reinterpret_cast<const char*>(block->data_) + name_spans[i].first;
+        block->master_fields_[i] = std::string_view(name, name_spans[i].second);
+    }
+    for (size_t i = 0; i < count; i++) {
+        block->offsets_[i] = offsets[i];
+        block->deleted_[i].store(deleted[i] ? 1 : 0, std::memory_order_relaxed);
+        if (!deleted[i]) {
+            block->live_count_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    block->count_.store(static_cast<uint32_t>(count), std::memory_order_release);
+    return block;
+}
+
+StreamBlock::Ptr StreamBlock::make_cold(const StreamBlock& hot, const uint8_t* bytes,
+                                        std::shared_ptr<const void> backing) {
+    size_t count = hot.entry_count();
+    Ptr block = allocate(hot.master_id_, hot.master_count_, count, 0);
+    block->bytes_ = bytes;
+    block->backing_ = std::move(backing);
+    block->size_ = hot.size_;
+    std::copy(hot.offsets_, hot.offsets_ + count, block->offsets_);
+    for (size_t i = 0; i < count; i++) {
+        block->deleted_[i].store(hot.deleted_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < hot.master_count_; i++) {
+        const std::string_view& name = hot.master_fields_[i];
+        const char* at = reinterpret_cast<const char*>(bytes) + (name.data() - reinterpret_cast<const char*>(hot.bytes_));
+        block->master_fields_[i] = std::string_view(at, name.size());
+    }
+    block->live_count_.store(hot.live_count(), std::memory_order_relaxed);
+    block->count_.store(static_cast<uint32_t>(count), std::memory_order_release);
+    return block;
+}
+
+size_t StreamBlock::initial_size(const FieldViews& master_fields) {
+    // Master names, then the master entry itself: zero ID deltas and values only
+    size_t bytes = varint_size(master_fields.size()) + 3;
+    for (const auto& field : master_fields) {
+        bytes += varint_size(field.first.size()) + field.first.size();
+        bytes += varint_size(field.second.size()) + field.second.size();
+    }
+    return bytes;
+}
+
+size_t StreamBlock::encoded_size(const StreamID& id, const FieldViews& fields) const {
+    size_t bytes = 1;
+    bytes += varint_size(id.timestamp_ms - master_id_.timestamp_ms);
+    bytes += varint_size(sequence_delta(master_id_, id));
+
+    bool same_fields = has_master_fields(fields);
+    if (!same_fields) {
+        bytes += varint_size(fields.size());
+    }
+    for (const auto& field : fields) {
+        if (!same_fields) {
+            bytes += varint_size(field.first.size()) + field.first.size();
+        }
+        bytes += varint_size(field.second.size()) + field.second.size();
+    }
+    return bytes;
+}
+
+bool StreamBlock::has_room(size_t bytes) const {
+    return count_.load(std::memory_order_relaxed) < kMaxEntries && size_ + bytes <= capacity_;
+}
+
+void StreamBlock::append(const StreamID& id, const FieldViews& fields) {
+    uint8_t* start = data_ + size_;
+    uint8_t* out = start;
+
+    bool same_fields = has_master_fields(fields);
+    *out++ = same_fields ? kFlagSameFields : 0;
+    out = put_varint(out, id.timestamp_ms - master_id_.timestamp_ms);
+    out = put_varint(out, sequence_delta(master_id_, id));
+    if (!same_fields) {
+        out = put_varint(out, fields.size());
+    }
+    for (const auto& field : fields) {
+        if (!same_fields) {
+            out = put_varint(out, field.first.size());
+            std::memcpy(out, field.first.data(), field.first.size());
+            out += field.first.size();
+        }
+        out = put_varint(out, field.second.size());
+        std::memcpy(out, field.second.data(), field.second.size());
+        out += field.second.size();
+    }
+
+    // Fill in the slot, then publish it
+    uint32_t index = count_.load(std::memory_order_relaxed);
+    offsets_[index] = static_cast<uint32_t>(size_);
+    deleted_[index].store(0, std::memory_order_relaxed);
+    size_ += out - start;
+    live_count_.fetch_add(1, std::memory_order_relaxed);
+    count_.store(index + 1, std::memory_order_release);
+}
+
+StreamID StreamBlock::id_at(size_t index) const {
+    StreamID id;
+    decode_id(bytes_ + offsets_[index] + 1, master_id_, id);
+    return id;
+}
+
+void StreamBlock::decode(size_t index, StreamEntryView& view) const {
+    const uint8_t* in = bytes_ + offsets_[index];
+    bool same_fields = *in & kFlagSameFields;
+    in = decode_id(in + 1, master_id_, view.id);
+
+    uint64_t field_count = master_count_;
+    if (!same_fields) {
+        in = get_varint(in, field_count);
+    }
+
+    view.fields.clear();
+    for (uint64_t i = 0; i < field_count; i++) {
+        std::string_view name;
+        if (same_fields) {
+            name = master_fields_[i];
+        } else {
+            uint64_t name_length;
+            in = get_varint(in, name_length);
+            name = std::string_view(reinterpret_cast<const char*>(in), name_length);
+            in += name_length;
+        }
+
+        uint64_t value_length;
+        in = get_varint(in, value_length);
+        std::string_view value(reinterpret_cast<const char*>(in), value_length);
+        in += value_length;
+
+        view.fields.emplace_back(name, value);
+    }
+}
+
+bool StreamBlock::mark_deleted(size_t index) {
+    if (deleted_[index].load(std::memory_order_relaxed)) {
+        return false;
+    }
+    deleted_[index].store(1, std::memory_order_release);
+    live_count_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+size_t StreamBlock::lower_bound(const StreamID& id) const {
+    size_t low = 0;
+    size_t high = entry_count();
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (id_at(mid) < id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+bool StreamBlock::has_master_fields(const FieldViews& fields) const {
+    if (fields.size() != master_count_) {
+        return false;
+    }
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (fields[i].first != master_fields_[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// StreamStorage implementation
+StreamStorage::BlockIndex::BlockIndex(size_t capacity)
+    : capacity(capacity), first(0), count(0), blocks(new std::atomic<StreamBlock*>[capacity]) {
+}
+
+void StreamStorage::BlockIndex::copy(const BlockIndex& from, size_t begin, size_t end, size_t to) {
+    for (size_t i = begin; i < end; i++) {
+        blocks[to++].store(from.at(i), std::memory_order_relaxed);
+    }
+}
+
+StreamStorage::StreamStorage()
+    : index_(new BlockIndex(kInitialIndexCapacity)), live_entries_(0), memory_usage_(0), cold_memory_(0) {
+    charge(sizeof(StreamStorage) + index_bytes(kInitialIndexCapacity));
+}
+
+StreamStorage::~StreamStorage() {
+    // The owning stream is gone, so no reader can still be looking
+    BlockIndex* index = index_.load(std::memory_order_relaxed);
+    size_t count = index->count.load(std::memory_order_relaxed);
+    for (size_t i = index->first.load(std::memory_order_relaxed); i < count; i++) {
+        StreamBlock::destroy(index->at(i));
+    }
+    delete index;
+    MemoryTracker::released(memory_usage_.load(std::memory_order_relaxed));
+}
+
+void StreamStorage::append(const StreamID& id, const FieldViews& fields) {
+    BlockIndex* index = index_.load(std::memory_order_relaxed);
+    size_t first = index->first.load(std::memory_order_relaxed);
+    size_t count = index->count.load(std::memory_order_relaxed);
+
+    if (count > first) {
+        StreamBlock& tail = *index->at(count - 1);
+        // Lookups binary search the blocks, so an entry out of order would
+        // send every one of them astray
+        if (id <= tail.id_at(tail.entry_count() - 1)) {
+            throw std::invalid_argument("Stream ID must be greater than last ID");
+        }
+        size_t bytes = tail.encoded_size(id, fields);
+        if (tail.has_room(bytes)) {
+            tail.append(id, fields);
+            live_entries_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    // Start a new block mastered by this entry; oversized entries get a block of their own
+    size_t bytes = StreamBlock::initial_size(fields);
+    StreamBlock* block = StreamBlock::create(id, fields, std::max(bytes, StreamBlock::kTargetBytes)).release();
+    block->append(id, fields);
+    charge(block->memory_usage());
+
+    // A tail emptied by XDEL is not worth keeping once it stops being the tail
+    bool drop_tail = count > first && index->at(count - 1)->live_count() == 0;
+
+    if (!drop_tail && count < index->capacity) {
+        index->set(count, block);
+        index->count.store(count + 1, std::memory_order_release);
+    } else {
+        // The new snapshot also sheds the slots trimmed off the front
+        size_t kept = (drop_tail ? count - 1 : count) - first;
+        // Grow only if still more than half full after shedding them, so
+        // compaction stays amortized
+        size_t capacity = index->capacity;
+        if (count == capacity && kept + 1 > capacity / 2) {
+            capacity *= 2;
+        }
+        auto* next = new BlockIndex(capacity);
+        next->copy(*index, first, first + kept, 0);
+        next->set(kept, block);
+        next->count.store(kept + 1, std::memory_order_relaxed);
+        if (drop_tail) {
+            StreamBlock* dropped = index->at(count - 1);
+            release(dropped->memory_usage());
+            Epoch::retire([dropped] { StreamBlock::destroy(dropped); });
+        }
+        replace_index(next);
+    }
+    live_entries_.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool StreamStorage::remove(const StreamID& id) {
+    BlockIndex* index = index_.load(std::memory_order_relaxed);
+    size_t first = index->first.load(std::memory_order_relaxed);
+    size_t count = index->count.load(std::memory_order_relaxed);
+    if (count == first) {
+        return false;
+    }
+
+    size_t block_index = find_block(*index, first, count, id);
+    StreamBlock* block = index->at(block_index);
+    size_t entry = block->lower_bound(id);
+    if (entry == block->entry_count() || block->id_at(entry) != id || !block->mark_deleted(entry)) {
+        return false;
+    }
+    live_entries_.fetch_sub(1, std::memory_order_relaxed);
+
+    // Release blocks whose entries are all gone, except the tail that
+    // new entries are still appended to. Readers may be inside the block,
+    // so it goes out with a new snapshot of the list.
+    if (block->live_count() == 0 && block_index + 1 < count) {
+        if (block_index == first) {
+            drop_front_block();
+            return true;
+        }
+        auto* next = new BlockIndex(index->capacity);
+        next->copy(*index, first, block_index, 0);
+        next->copy(*index, block_index + 1, count, block_index - first);
+        next->count.store(count - first - 1, std::memory_order_relaxed);
+        replace_index(next);
+        release_block(*block);
+        Epoch::retire([block] { StreamBlock::destroy(block); });
+    }
+    return true;
+}
+
+size_t StreamStorage::trim_to_length(size_t max_len, bool approximate, size_t limit) {
+    BlockIndex* index = index_.load(std::memory_order_relaxed);
+    size_t removed = 0;
+
+    // Whole blocks, as long as what is left still holds max_len entries
+    for (;;) {
+        size_t first = index->first.load(std::memory_order_relaxed);
+        if (first == index->count.load(std::memory_order_relaxed)) {
+            return removed;
+        }
+        size_t live = index->at(first)->live_count();
+        if (size() - live < max_len || (limit > 0 && removed + live > limit)) {
+            break;
+        }
+        drop_front_block();
+        removed += live;
+    }
+
+    if (approximate) {
+        return removed;
+    }
+
+    // The rest one entry at a time. The first block keeps some of its
+    // entries, so it is never emptied here.
+    StreamBlock& block = *index->at(index->first.load(std::memory_order_relaxed));
+    for (size_t i = 0; i < block.entry_count() && size() > max_len && (limit == 0 || removed < limit); i++) {
+        if (block.mark_deleted(i)) {
+            live_entries_.fetch_sub(1, std::memory_order_relaxed);
+            removed++;
+        }
+    }
+    return removed;
+}
+
+size_t StreamStorage::trim_before(const StreamID& min_id, bool approximate, size_t limit) {
+    BlockIndex* index = index_.load(std::memory_order_relaxed);
+    size_t removed = 0;
+
+    // Whole blocks whose last entry is below min_id
+    for (;;) {
+        size_t first = index->first.load(std::memory_order_relaxed);
+        if (first == index->count.load(std::memory_order_relaxed)) {
+            return removed;
+        }
+        const StreamBlock& block = *index->at(first);
+        size_t live = block.live_count();
+        if (block.id_at(block.entry_count() - 1) >= min_id || (limit > 0 && removed + live > limit)) {
+            break;
+        }
+        drop_front_block();
+        removed += live;
+    }
+
+    if (approximate) {
+        return removed;
+    }
+
+    size_t first = index->first.load(std::memory_order_relaxed);
+    StreamBlock& block = *index->at(first);
+    for (size_t i = 0; i < block.entry_count() && block.id_at(i) < min_id && (limit == 0 || removed < limit); i++) {
+        if (block.mark_deleted(i)) {
+            live_entries_.fetch_sub(1, std::memory_order_relaxed);
+            removed++;
+        }
+    }
+
+    // The entries from min_id on may all have been deleted already; release
+    // the emptied block as remove() does, unless it is the tail
+    if (block.live_count() == 0 && first + 1 < index->count.load(std::memory_order_relaxed)) {
+        drop_front_block();
+    }
+    return removed;
+}
+
+size_t StreamStorage::trim_front_block() {
+    BlockIndex* index = index_.load(std::memory_order_relaxed);
+    size_t first = index->first.load(std::memory_order_relaxed);
+    if (index->count.load(std::memory_order_relaxed) - first < 2) {
+        return 0;
+    }
+
+    size_t live = index->at(first)->live_count();
+    drop_front_block();
+    return live;
+}
+
+StreamStorage::Snapshot StreamStorage::snapshot() const {
+    const BlockIndex* index = index_.load(std::memory_order_relaxed);
+    size_t first = index->first.load(std::memory_order_relaxed);
+    size_t count = index->count.load(std::memory_order_relaxed);
+
+    Snapshot snapshot;
+    snapshot.blocks.reserve(count - first);
+    for (size_t i = first; i < count; i++) {
+        const StreamBlock* block = index->at(i);
+        size_t entries = block->entry_count();
+        std::vector<uint8_t> deleted(entries);
+        for (size_t j = 0; j < entries; j++) {
+            deleted[j] = block->is_deleted(j) ? 1 : 0;
+        }
+        snapshot.blocks.push_back(Snapshot::Block{block, entries, block->raw_size(), std::move(deleted)});
+    }
+    return snapshot;
+}
+
+void StreamStorage::append_block(StreamBlock::Ptr block) {
+    BlockIndex* index = index_.load(std::memory_order_relaxed);
+    size_t first = index->first.load(std::memory_order_relaxed);
+    size_t count = index->count.load(std::memory_order_relaxed);
+    size_t live = block->live_count();
+    charge(block->memory_usage());
+
+    if (count < index->capacity) {
+        index->set(count, block.release());
+        index->count.store(count + 1, std::memory_order_release);
+    } else {
+        size_t kept = count - first;
+        size_t capacity = index->capacity;
+        if (kept + 1 > capacity / 2) {
+            capacity *= 2;
+        }
+        auto* next = new BlockIndex(capacity);
+        next->copy(*index, first, count, 0);
+        next->set(kept, block.release());
+        next->count.store(kept + 1, std::memory_order_relaxed);
+        replace_index(next);
+    }
+    live_entries_.fetch_add(live, std::memory_order_relaxed);
+}
+
+size_t StreamStorage::hot_memory() const {
+    // The two counters move separately
+    size_t total = memory_usage();
+    size_t cold = cold_memory_.load(std::memory_order_relaxed);
+    return total > cold ? total - cold : 0;
+}
+
+std::vector<const StreamBlock*> StreamStorage::spill_candidates(size_t hot_limit, size_t max_bytes) const {
+    std::vector<const StreamBlock*> candidates;
+    size_t hot = hot_memory();
+    if (hot <= hot_limit) {
+        return candidates;
+    }
+
+    const BlockIndex* index = index_.load(std::memory_order_acquire);
+    size_t first = index->first.load(std::memory_order_acquire);
+    size_t count = index->count.load(std::memory_order_acquire);
+    if (count - first < 2) {
+        return candidates;
+    }
+
+    // Blocks go cold oldest first, so the cold ones are a prefix
+    auto begin = index->blocks.get() + first;
+    auto end = index->blocks.get() + count - 1;
+    auto it = std::partition_point(begin, end, [](const std::atomic<StreamBlock*>& block) {
+        return block.load(std::memory_order_acquire)->cold();
+    });
+
+    size_t bytes = 0;
+    for (; it != end && hot > hot_limit && bytes < max_bytes; ++it) {
+        const StreamBlock* block = it->load(std::memory_order_acquire);
+        candidates.push_back(block);
+        hot -= std::min(hot, block->memory_usage());
+        bytes += block->raw_size();
+    }
+    return candidates;
+}
+
+size_t StreamStorage::make_cold(const std::vector<const StreamBlock*>& blocks, const std::vector<const uint8_t*>& bytes,
+                                const std::shared_ptr<const void>& backing) {
+    BlockIndex* index = index_.load(std::memory_order_relaxed);
+    size_t first = index->first.load(std::memory_order_relaxed);
+    size_t count = index->count.load(std::memory_order_relaxed);
+
+    size_t swapped = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (count == first) {
+            break;
+        }
+        // Skip blocks trimmed or deleted since they were picked
+        size_t slot = find_block(*index, first, count, blocks[i]->master_id());
+        StreamBlock* hot = index->at(slot);
+        if (hot != blocks[i] || slot + 1 == count) {
+            continue;
+        }
+
+        StreamBlock* cold = StreamBlock::make_cold(*hot, bytes[i], backing).release();
+        index->set(slot, cold);
+        release(hot->memory_usage());
+        charge(cold->memory_usage());
+        cold_memory_.fetch_add(cold->memory_usage(), std::memory_order_relaxed);
+        Epoch::retire([hot] { StreamBlock::destroy(hot); });
+        swapped++;
+    }
+    return swapped;
+}
+
+StreamStorage::Iterator StreamStorage::begin() const {
+    const BlockIndex* index = index_.load(std::memory_order_acquire);
+    return Iterator(index, index->first.load(std::memory_order_acquire), 0);
+}
+
+StreamStorage::Iterator StreamStorage::lower_bound(const StreamID& id) const {
+    const BlockIndex* index = index_.load(std::memory_order_acquire);
+    size_t first = index->first.load(std::memory_order_acquire);
+    size_t count = index->count.load(std::memory_order_acquire);
+    if (count == first) {
+        return Iterator(index, first, 0);
+    }
+
+    size_t block_index = find_block(*index, first, count, id);
+    return Iterator(index, block_index, index->at(block_index)->lower_bound(id));
+}
+
+StreamStorage::Iterator StreamStorage::upper_bound(const StreamID& id) const {
+    Iterator it = lower_bound(id);
+    if (it.valid() && it.id() == id) {
+        it.next();
+    }
+    return it;
+}
+
+size_t StreamStorage::block_count() const {
+    const BlockIndex* index = index_.load(std::memory_order_acquire);
+    size_t first = index->first.load(std::memory_order_acquire);
+    return index->count.load(std::memory_order_acquire) - first;
+}
+
+size_t StreamStorage::find_block(const BlockIndex& index, size_t first, size_t count, const StreamID& id) {
+    auto begin = index.blocks.get() + first;
+    auto end = index.blocks.get() + count;
+    auto it = std::upper_bound(begin, end, id, [](const StreamID& value, const std::atomic<StreamBlock*>& block) {
+        return value < block.load(std::memory_order_acquire)->master_id();
+    });
+    return it == begin ? first : (it - index.blocks.get()) - 1;
+}
+
+void StreamStorage::drop_front_block() {
+    BlockIndex* index = index_.load(std::memory_order_relaxed);
+    size_t first = index->first.load(std::memory_order_relaxed);
+    StreamBlock* block = index->at(first);
+
+    live_entries_.fetch_sub(block->live_count(), std::memory_order_relaxed);
+    index->first.store(first + 1, std::memory_order_release);
+    release_block(*block);
+    Epoch::retire([block] { StreamBlock::destroy(block); });
+}
+
+void StreamStorage::replace_index(BlockIndex* next) {
+    BlockIndex* previous = index_.exchange(next, std::memory_order_acq_rel);
+    charge(index_bytes(next->capacity));
+    release(index_bytes(previous->capacity));
+    Epoch::retire([previous] { delete previous; });
+}
+
+size_t StreamStorage::index_bytes(size_t capacity) {
+    return sizeof(BlockIndex) + capacity * sizeof(StreamBlock*);
+}
+
+void StreamStorage::release_block(const StreamBlock& block) {
+    size_t bytes = block.memory_usage();
+    if (block.cold()) {
+        cold_memory_.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+    release(bytes);
+}
+
+void StreamStorage::charge(size_t bytes) {
+    memory_usage_.fetch_add(bytes, std::memory_order_relaxed);
+    MemoryTracker::allocated(bytes);
+}
+
+void StreamStorage::release(size_t bytes) {
+    memory_usage_.fetch_sub(bytes, std::memory_order_relaxed);
+    MemoryTracker::released(bytes);
+}
+
+// StreamStorage::Iterator implementation
+StreamStorage::Iterator::Iterator(const BlockIndex* index, size_t block, size_t entry)
+    : index_(index), count_(index->count.load(std::memory_order_acquire)),
+      block_(block), entry_(entry), block_entries_(0) {
+    if (block_ < count_) {
+        block_entries_ = index_->at(block_)->entry_count();
+    }
+    skip_deleted();
+}
+
+const StreamBlock& StreamStorage::Iterator::block() const {
+    return *index_->at(block_);
+}
+
+void StreamStorage::Iterator::next() {
+    entry_++;
+    skip_deleted();
+}
+
+void StreamStorage::Iterator::skip_deleted() {
+    while (block_ < count_) {
+        if (entry_ >= block_entries_) {
+            // The writer may have appended since we last looked
+            block_entries_ = block().entry_count();
+            if (entry_ < block_entries_) {
+                continue;
+            }
+            block_++;
+            entry_ = 0;
+            block_entries_ = block_ < count_ ? block().entry_count() : 0;
+            continue;
+        }
+        if (!block().is_deleted(entry_)) {
+            return;
+        }
+        entry_++;
+    }
+}
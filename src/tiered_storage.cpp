@@ -0,0 +1,164 @@
+#include "tiered_storage.h"
+#include "epoch.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr auto kScanInterval = std::chrono::milliseconds(200);
+// Encoding written per segment, so one stream far over its limit is
+// brought down over a few rounds rather than in one huge file
+constexpr size_t kSegmentBytes = 64 * 1024 * 1024;
+constexpr size_t kWriteBuffer = 1024 * 1024;
+
+std::atomic<uint64_t> live_segments(0);
+std::atomic<uint64_t> live_segment_bytes(0);
+
+// A mapped segment file, unmapped with the last cold block using it
+class Segment {
+public:
+    Segment(void* mapping, size_t size) : mapping_(mapping), size_(size) {
+        live_segments++;
+        live_segment_bytes += size;
+    }
+    ~Segment() {
+        munmap(mapping_, size_);
+        live_segments--;
+        live_segment_bytes -= size_;
+    }
+
+    Segment(const Segment&) = delete;
+    Segment& operator=(const Segment&) = delete;
+
+    const uint8_t* data() const { return static_cast<const uint8_t*>(mapping_); }
+
+private:
+    void* mapping_;
+    size_t size_;
+};
+
+bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+TieredStorage::TieredStorage(Options options, ForEachStream for_each)
+    : options_(std::move(options)), for_each_(std::move(for_each)), stopping_(false), next_segment_(0),
+      spills_(0), spilled_blocks_(0), spilled_bytes_(0) {
+}
+
+TieredStorage::~TieredStorage() {
+    stop();
+}
+
+void TieredStorage::start() {
+    thread_ = std::thread([this] { run(); });
+}
+
+void TieredStorage::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+TieredStorage::Stats TieredStorage::stats() const {
+    return Stats{live_segments.load(), live_segment_bytes.load(), spills_.load(), spilled_blocks_.load(),
+                 spilled_bytes_.load()};
+}
+
+void TieredStorage::run() {
+    Stream::SpillWriter write = [this](const std::vector<const StreamBlock*>& blocks,
+                                       std::vector<const uint8_t*>& bytes) {
+        return write_segment(blocks, bytes);
+    };
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!cv_.wait_for(lock, kScanInterval, [this] { return stopping_; })) {
+        lock.unlock();
+        for_each_([this, &write](const std::string&, const std::shared_ptr<Stream>& stream) {
+            if (stream->hot_memory() > options_.hot_bytes) {
+                stream->spill(options_.hot_bytes, kSegmentBytes, write);
+            }
+        });
+        // Hot blocks swapped out, and cold ones trimmed, wait in the epoch
+        // list; free them now rather than when it next fills up
+        Epoch::collect();
+        lock.lock();
+    }
+}
+
+std::shared_ptr<const void> TieredStorage::write_segment(const std::vector<const StreamBlock*>& blocks,
+                                                         std::vector<const uint8_t*>& bytes) {
+    std::string path = options_.dir + "/segment-" + std::to_string(getpid()) + "-" +
+                       std::to_string(next_segment_++) + ".seg";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        std::cerr << "Cannot create segment file " << path << ": " << std::strerror(errno) << std::endl;
+        return nullptr;
+    }
+    unlink(path.c_str()); // Lives on through the fd and then the mapping
+
+    // Closed blocks no longer change, so they are read without the lock
+    std::vector<size_t> offsets;
+    std::string buffer;
+    buffer.reserve(kWriteBuffer);
+    size_t size = 0;
+    bool ok = true;
+    for (const StreamBlock* block : blocks) {
+        offsets.push_back(size);
+        if (buffer.size() + block->raw_size() > kWriteBuffer) {
+            ok = ok && write_all(fd, buffer.data(), buffer.size());
+            buffer.clear();
+        }
+        buffer.append(reinterpret_cast<const char*>(block->raw_data()), block->raw_size());
+        size += block->raw_size();
+    }
+    ok = ok && write_all(fd, buffer.data(), buffer.size());
+
+    // Synced pages are clean, so the kernel may drop them under memory
+    // pressure; dropping them now is what moves the data out of RAM
+    void* mapping = MAP_FAILED;
+    if (ok && fdatasync(fd) == 0) {
+        mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Cannot write segment file " << path << ": " << std::strerror(errno) << std::endl;
+        close(fd);
+        return nullptr;
+    }
+    posix_fadvise(fd, 0, static_cast<off_t>(size), POSIX_FADV_DONTNEED);
+    close(fd);
+
+    auto segment = std::make_shared<Segment>(mapping, size);
+    bytes.clear();
+    for (size_t offset : offsets) {
+        bytes.push_back(segment->data() + offset);
+    }
+    spills_++;
+    spilled_blocks_ += blocks.size();
+    spilled_bytes_ += size;
+    return segment;
+}
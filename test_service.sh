@@ -3,20 +3,178 @@
 echo "Redis Streams Service Test Script"
 echo "================================="
 
-# Function to test a Redis command
-test_command() {
-    echo -n "Testing: $1 ... "
-    result=$(echo "$1" | nc localhost 6379 2>/dev/null)
-    if [ $? -eq 0 ]; then
+shopt -s extglob
+
+PORT=${PORT:-6379}
+# With the service binary in SERVICE, the script also starts servers of its
+# own: for the log rewrite and snapshots at PORT + 1, a primary and its
+# replica at PORT + 2 and PORT + 3, and a sharded one at PORT + 4
+SERVICE=${SERVICE:-}
+# Keys are unique to this run, so the script can be run again on the same server
+K="test:$$"
+failures=0
+
+# resp <variable> <argument>...: stores the RESP encoding of one command
+# (command substitution would strip its final newline)
+resp() {
+    local -n out=$1
+    shift
+    out="*$#"$'\r\n'
+    local arg
+    for arg in "$@"; do
+        out+="\$${#arg}"$'\r\n'"$arg"$'\r\n'
+    done
+}
+
+# Sends each parameter as a separate write on one new connection, pausing
+# in between, and prints the replies on one line: bulk length headers are
+# dropped and everything else is kept, space separated
+request() {
+    exec 3<>/dev/tcp/127.0.0.1/$PORT || return 1
+    send_on 3 "$@"
+    receive_on 3
+    exec 3>&-
+}
+
+# send_on <fd> <part>...: writes each part on an open connection, pausing
+# in between, then the end marker
+send_on() {
+    local fd=$1 part
+    shift
+    for part in "$@"; do
+        printf '%s' "$part" >&$fd
+        sleep 0.1
+    done
+    # An unknown command marks the end of the replies
+    printf 'END_OF_TEST\r\n' >&$fd
+}
+
+# receive_on <fd>: prints the replies up to the end marker, as request does
+receive_on() {
+    local reply="" line
+    while IFS= read -r -t 5 line <&$1; do
+        line=${line%$'\r'}
+        [[ $line == "-ERR unknown command 'END_OF_TEST'" ]] && break
+        [[ $line =~ ^\$[0-9]+$ ]] && continue
+        reply+="$line "
+    done
+    echo "${reply% }"
+}
+
+# check_raw <description> <expected reply> <request> [<request> ...]
+# The reply must match exactly, except that <n> stands for any number, such
+# as an idle time
+check_raw() {
+    local description=$1 expected=$2
+    shift 2
+    echo -n "Testing: $description ... "
+    result=$(request "$@")
+    verify "$expected" "$result"
+}
+
+# verify <expected reply> <reply>: finishes the line check_raw started
+verify() {
+    local pattern
+    pattern=$(printf '%q' "$1")
+    pattern=${pattern//'\<n\>'/+([0-9])}
+    [[ $2 == $pattern ]]
+    report $? "$1" "$2"
+}
+
+# report <status> <expected> <got>: prints the outcome of one test
+report() {
+    if [ "$1" -eq 0 ]; then
         echo "✓ Success"
     else
         echo "✗ Failed"
+        echo "    expected: $2"
+        echo "    got:      $3"
+        failures=$((failures + 1))
     fi
 }
 
+# check <description> <expected reply> <command> [<argument> ...]
+check() {
+    local description=$1 expected=$2 command
+    shift 2
+    resp command "$@"
+    check_raw "$description" "$expected" "$command"
+}
+
+# park <command> [<argument> ...]: sends a blocking read on a connection
+# of its own, whose reply check_parked collects
+park() {
+    local command
+    resp command "$@"
+    exec 4<>/dev/tcp/127.0.0.1/$PORT
+    send_on 4 "$command"
+}
+
+# check_parked <description> <expected reply>
+check_parked() {
+    echo -n "Testing: $1 ... "
+    result=$(receive_on 4)
+    exec 4>&-
+    verify "$2" "$result"
+}
+
+# fill <key> <count>: adds entries 1-1 to 1-<count>, pipelined on one connection
+fill() {
+    local batch="" ids="" command i
+    for ((i = 1; i <= $2; i++)); do
+        resp command XADD "$1" 1-$i f v
+        batch+=$command
+        ids+=" 1-$i"
+    done
+    check_raw "XADD of $2 entries" "${ids# }" "$batch"
+}
+
+# start_service <directory> [<option> ...]: starts a server of this
+# script's own at PORT, in <directory>
+start_service() {
+    local dir=$1 i
+    shift
+    # Another server on the port would answer in place of this one
+    if (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null; then
+        echo "Error: port $PORT is already in use"
+        exit 1
+    fi
+    (cd "$dir" && exec "$SERVICE" --port $PORT "$@" >> service.log 2>&1) &
+    service_pid=$!
+    for ((i = 0; i < 50; i++)); do
+        (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "Error: the service did not start on port $PORT"
+    exit 1
+}
+
+# restart_service <directory> [<option> ...]: stops that server and starts
+# it again
+restart_service() {
+    kill $service_pid
+    wait $service_pid
+    start_service "$@"
+}
+
+# wait_for <pattern> <command> [<argument> ...]: repeats a command on the
+# server at PORT until its reply matches, for up to five seconds; the last
+# reply is left in result
+wait_for() {
+    local pattern=$1 command i
+    shift
+    resp command "$@"
+    for ((i = 0; i < 50; i++)); do
+        result=$(request "$command")
+        [[ $result == $pattern ]] && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
 # Check if the service is running
-if ! nc -z localhost 6379 2>/dev/null; then
-    echo "Error: Redis Streams Service is not running on localhost:6379"
+if ! (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null; then
+    echo "Error: Redis Streams Service is not running on localhost:$PORT"
     echo "Please start the service first: cd build && ./redis_streams_service"
     exit 1
 fi
@@ -24,25 +182,490 @@ fi
 echo "Service is running. Starting tests..."
 echo
 
-# Basic connectivity
-test_command "PING"
+# The stream tests, run against the server at PORT
+stream_tests() {
+    # Basic connectivity
+    check "PING" "+PONG" PING
+
+    # Basic stream operations
+    echo "Testing basic stream operations..."
+    check "XADD" "1-1" XADD $K:s 1-1 field1 value1 field2 value2
+    check "XADD" "1-2" XADD $K:s 1-2 temperature 25.5 humidity 60
+    check "XLEN" ":2" XLEN $K:s
+    check "XRANGE" "*2 *2 1-1 *4 field1 value1 field2 value2 *2 1-2 *4 temperature 25.5 humidity 60" \
+        XRANGE $K:s - +
+
+    # Consumer group operations
+    echo "Testing consumer group operations..."
+    check "XGROUP CREATE" "+OK" XGROUP CREATE $K:s testgroup 0-0
+    check "XREADGROUP" "*1 *2 $K:s *1 *2 1-1 *4 field1 value1 field2 value2" \
+        XREADGROUP GROUP testgroup consumer1 COUNT 1 STREAMS $K:s '>'
+
+    # Test reading from stream
+    echo "Testing stream reading..."
+    check "XREAD" "*1 *2 $K:s *1 *2 1-2 *4 temperature 25.5 humidity 60" XREAD STREAMS $K:s 1-1
+
+    # Reads naming several streams; on a sharded server, eight of them all
+    # but surely span shards and the replies are merged in request order
+    echo "Testing multi-stream reads..."
+    local keys=() ids=() batch="" expected="" command i
+    for i in 1 2 3 4 5 6 7 8; do
+        keys+=($K:m$i)
+        ids+=(0-0)
+        resp command XADD $K:m$i $i-1 f $i
+        batch+=$command
+        expected+=" $i-1"
+    done
+    check_raw "XADD pipelined across streams" "${expected# }" "$batch"
+    expected="*8"
+    for i in 1 2 3 4 5 6 7 8; do
+        expected+=" *2 $K:m$i *1 *2 $i-1 *2 f $i"
+    done
+    check "XREAD of several streams" "$expected" XREAD COUNT 10 STREAMS "${keys[@]}" "${ids[@]}"
+    check "XREAD skips streams with nothing new" "*2 *2 $K:m3 *1 *2 3-1 *2 f 3 *2 $K:m6 *1 *2 6-1 *2 f 6" \
+        XREAD STREAMS "${keys[@]}" 1-1 2-1 0-0 4-1 5-1 0-0 7-1 8-1
+    check "XREAD with nothing new" "*-1" XREAD STREAMS "${keys[@]}" 1-1 2-1 3-1 4-1 5-1 6-1 7-1 8-1
+    batch=""
+    expected=""
+    for i in 1 2 3 4 5 6 7 8; do
+        resp command XGROUP CREATE $K:m$i g 0-0
+        batch+=$command
+        expected+=" +OK"
+    done
+    check_raw "XGROUP CREATE pipelined across streams" "${expected# }" "$batch"
+    expected="*8"
+    for i in 1 2 3 4 5 6 7 8; do
+        expected+=" *2 $K:m$i *1 *2 $i-1 *2 f $i"
+    done
+    check "XREADGROUP of several streams" "$expected" \
+        XREADGROUP GROUP g alice STREAMS "${keys[@]}" '>' '>' '>' '>' '>' '>' '>' '>'
+    check "XREADGROUP of several streams with nothing new" "*-1" \
+        XREADGROUP GROUP g alice STREAMS "${keys[@]}" '>' '>' '>' '>' '>' '>' '>' '>'
+    batch=""
+    expected=""
+    for i in 1 2 3 4 5 6 7 8; do
+        resp command XPENDING $K:m$i g
+        batch+=$command
+        expected+=" *4 :1 $i-1 $i-1 *1 *2 alice 1"
+    done
+    check_raw "XPENDING pipelined across streams" "${expected# }" "$batch"
+    # Replies keep request order whether a command ran on a shard, spanned
+    # several or was answered without one
+    batch=""
+    expected=""
+    for i in 1 2 3 4 5 6 7 8; do
+        resp command XADD $K:q$i $i-1 f $i
+        batch+=$command
+        resp command XLEN $K:q$i
+        batch+=$command
+        expected+=" $i-1 :1"
+    done
+    resp command PING
+    batch+=$command
+    resp command XLEN
+    batch+=$command
+    resp command XREAD STREAMS $K:q1 $K:q8 0-0 0-0
+    batch+=$command
+    resp command XADD $K:q1 1-2 f 1
+    batch+=$command
+    expected+=" +PONG -ERR wrong number of arguments for 'xlen' command"
+    expected+=" *2 *2 $K:q1 *1 *2 1-1 *2 f 1 *2 $K:q8 *1 *2 8-1 *2 f 8 1-2"
+    check_raw "mixed commands pipelined across streams" "${expected# }" "$batch"
+
+    # Blocking reads
+    echo "Testing blocking reads..."
+    fill $K:blk 1
+    check "XREAD BLOCK times out" "*-1" XREAD BLOCK 100 STREAMS $K:blk '$'
+    check "XREAD BLOCK of several streams times out" "*-1" \
+        XREAD BLOCK 100 STREAMS "${keys[@]}" 1-1 2-1 3-1 4-1 5-1 6-1 7-1 8-1
+    check "XREADGROUP BLOCK of several streams times out" "*-1" \
+        XREADGROUP GROUP g alice BLOCK 100 STREAMS "${keys[@]}" '>' '>' '>' '>' '>' '>' '>' '>'
+    park XREAD BLOCK 5000 STREAMS $K:blk '$'
+    check "XADD wakes a blocked XREAD" "1-2" XADD $K:blk 1-2 f v
+    check_parked "XREAD BLOCK woken by XADD" "*1 *2 $K:blk *1 *2 1-2 *2 f v"
+    check "XGROUP CREATE" "+OK" XGROUP CREATE $K:blk g '$'
+    check "XREADGROUP BLOCK times out" "*-1" XREADGROUP GROUP g alice BLOCK 100 STREAMS $K:blk '>'
+    park XREADGROUP GROUP g alice BLOCK 5000 STREAMS $K:blk '>'
+    check "XADD wakes a blocked XREADGROUP" "1-3" XADD $K:blk 1-3 f v
+    check_parked "XREADGROUP BLOCK woken by XADD" "*1 *2 $K:blk *1 *2 1-3 *2 f v"
+    check "XPENDING after XREADGROUP BLOCK" "*4 :1 1-3 1-3 *1 *2 alice 1" XPENDING $K:blk g
+    park XREAD BLOCK 5000 STREAMS "${keys[@]}" 1-1 2-1 3-1 4-1 5-1 6-1 7-1 8-1
+    check "XADD wakes a read of several streams" "5-2" XADD $K:m5 5-2 f 5
+    check_parked "XREAD BLOCK of several streams woken" "*1 *2 $K:m5 *1 *2 5-2 *2 f 5"
+    # A client that leaves while parked takes no entries with it
+    park XREADGROUP GROUP g carol BLOCK 0 STREAMS $K:blk '>'
+    exec 4>&-
+    sleep 0.2
+    check "XADD after a parked client left" "1-4" XADD $K:blk 1-4 f v
+    check "XREADGROUP after a parked client left" "*1 *2 $K:blk *1 *2 1-4 *2 f v" \
+        XREADGROUP GROUP g dave STREAMS $K:blk '>'
+    check "XPENDING after a parked client left" "*4 :2 1-3 1-4 *2 *2 alice 1 *2 dave 1" XPENDING $K:blk g
+    # Streams woken together, possibly on several shards at once: whatever
+    # the read took from the group must reach the client, in the blocked
+    # reply or, if it woke before the rest, in the next read
+    local round seen
+    for round in 3 4 5 6 7 8 9 10 11 12; do
+        park XREADGROUP GROUP g bob BLOCK 5000 STREAMS "${keys[@]}" '>' '>' '>' '>' '>' '>' '>' '>'
+        batch=""
+        for i in 1 2 3 4 5 6 7 8; do
+            resp command XADD $K:m$i $i-$round f $i
+            batch+=$command
+        done
+        request "$batch" > /dev/null
+        seen=$(receive_on 4)
+        exec 4>&-
+        resp command XREADGROUP GROUP g bob STREAMS "${keys[@]}" '>' '>' '>' '>' '>' '>' '>' '>'
+        seen+=" $(request "$command")"
+        # Every entry of the round, counted by ID
+        echo -n "Testing: streams woken together, round $((round - 2)) ... "
+        verify "8" "$(grep -Ec "^[1-8]-$round$" <<< "${seen// /$'\n'}")"
+    done
+
+    # Requests split across reads
+    echo "Testing request parsing..."
+    resp first XLEN $K:s
+    resp second XADD $K:split 1-1 field value
+    check_raw "command split across writes" "1-1" "${second:0:20}" "${second:20}"
+    # Most of the second command is scanned before the first one runs
+    resp second XADD $K:split 1-2 field value
+    check_raw "command split across writes after a complete one" ":2 1-2" \
+        "$first${second:0:${#second}-8}" "${second:${#second}-8}"
+    check "arguments of split commands" "*2 *2 1-1 *2 field value *2 1-2 *2 field value" XRANGE $K:split - +
+
+    # Pending entries: XPENDING, XCLAIM and XAUTOCLAIM
+    echo "Testing pending entries..."
+    for i in 1 2 3 4 5 6; do
+        check "XADD" "$i-1" XADD $K:p $i-1 f $i
+    done
+    check "XGROUP CREATE" "+OK" XGROUP CREATE $K:p g 0-0
+    check "XREADGROUP delivers" "*1 *2 $K:p *2 *2 1-1 *2 f 1 *2 2-1 *2 f 2" \
+        XREADGROUP GROUP g alice COUNT 2 STREAMS $K:p '>'
+    check "XREADGROUP delivers the rest" "*1 *2 $K:p *4 *2 3-1 *2 f 3 *2 4-1 *2 f 4 *2 5-1 *2 f 5 *2 6-1 *2 f 6" \
+        XREADGROUP GROUP g alice STREAMS $K:p '>'
+    check "XPENDING summary" "*4 :6 1-1 6-1 *1 *2 alice 6" XPENDING $K:p g
+    check "XPENDING range" "*2 *4 1-1 alice :<n> :1 *4 2-1 alice :<n> :1" XPENDING $K:p g - + 2 alice
+    check "XCLAIM" "*1 *2 1-1 *2 f 1" XCLAIM $K:p g bob 0 1-1
+    check "XCLAIM counts a delivery" "*1 *4 1-1 bob :<n> :2" XPENDING $K:p g 1-1 1-1 1
+    check "XCLAIM JUSTID" "*1 1-1" XCLAIM $K:p g bob 0 1-1 JUSTID
+    check "XCLAIM JUSTID leaves the count" "*1 *4 1-1 bob :<n> :2" XPENDING $K:p g 1-1 1-1 1
+    check "XPENDING of one consumer" "*1 *4 1-1 bob :<n> :2" XPENDING $K:p g - + 10 bob
+    # 2-1 and 5-1 go stale, 5-1 the longest; everything else stays fresh
+    check "XCLAIM IDLE" "*1 2-1" XCLAIM $K:p g alice 0 2-1 IDLE 100000 JUSTID
+    check "XCLAIM IDLE" "*1 5-1" XCLAIM $K:p g alice 0 5-1 IDLE 200000 JUSTID
+    check "XPENDING IDLE" "*2 *4 2-1 alice :<n> :1 *4 5-1 alice :<n> :1" XPENDING $K:p g IDLE 50000 - + 10
+    check "XAUTOCLAIM claims in ID order" "*3 3-1 *1 2-1 *0" XAUTOCLAIM $K:p g carol 50000 0-0 COUNT 1 JUSTID
+    check "XAUTOCLAIM continues from the cursor" "*3 6-1 *1 5-1 *0" XAUTOCLAIM $K:p g carol 50000 3-1 COUNT 1 JUSTID
+    check "XAUTOCLAIM ends the sweep" "*3 0-0 *0 *0" XAUTOCLAIM $K:p g carol 50000 6-1 COUNT 1 JUSTID
+    check "XAUTOCLAIM counts a delivery" "*3 2-1 *1 *2 1-1 *2 f 1 *0" XAUTOCLAIM $K:p g dave 0 0-0 COUNT 1
+    check "XAUTOCLAIM counts a delivery" "*1 *4 1-1 dave :<n> :3" XPENDING $K:p g 1-1 1-1 1
+    # Entries deleted or trimmed while pending are dropped from the PEL when claimed
+    check "XDEL a pending entry" ":1" XDEL $K:p 3-1
+    check "XTRIM pending entries" ":1" XTRIM $K:p MINID 2-1
+    check "XCLAIM of a trimmed entry" "*0" XCLAIM $K:p g erin 0 1-1 JUSTID
+    # The deleted entry counts towards COUNT
+    check "XAUTOCLAIM of a deleted entry" "*3 6-1 *3 2-1 4-1 5-1 *1 3-1" XAUTOCLAIM $K:p g erin 0 0-0 COUNT 4 JUSTID
+    check "XPENDING after claims" "*4 :4 2-1 6-1 *2 *2 alice 1 *2 erin 3" XPENDING $K:p g
 
-# Basic stream operations
-echo "Testing basic stream operations..."
-test_command "XADD teststream * field1 value1 field2 value2"
-test_command "XADD teststream * temperature 25.5 humidity 60"
-test_command "XLEN teststream"
-test_command "XRANGE teststream - +"
+    # Trimming; blocks hold up to 128 entries, and approximate trims only drop
+    # whole blocks
+    echo "Testing trimming..."
+    fill $K:t 300
+    check "XTRIM MAXLEN" ":50" XTRIM $K:t MAXLEN 250
+    check "XLEN after XTRIM" ":250" XLEN $K:t
+    check "XRANGE after XTRIM" "*1 *2 1-51 *2 f v" XRANGE $K:t - + COUNT 1
+    check "XTRIM MAXLEN ~" ":78" XTRIM $K:t MAXLEN '~' 100
+    check "XTRIM MAXLEN ~ LIMIT" ":0" XTRIM $K:t MAXLEN '~' 0 LIMIT 100
+    check "XTRIM LIMIT without ~" "-ERR syntax error, LIMIT cannot be used without the special ~ option" \
+        XTRIM $K:t MAXLEN 0 LIMIT 5
+    check "XTRIM MINID" ":71" XTRIM $K:t MINID 1-200
+    check "XRANGE after XTRIM MINID" "*1 *2 1-200 *2 f v" XRANGE $K:t - + COUNT 1
+    check "XADD MAXLEN" "1-301" XADD $K:t MAXLEN 100 1-301 f v
+    check "XLEN after XADD MAXLEN" ":100" XLEN $K:t
+    check "XRANGE after XADD MAXLEN" "*1 *2 1-202 *2 f v" XRANGE $K:t - + COUNT 1
+    check "XADD MINID ~" "1-302" XADD $K:t MINID '~' 1-250 1-302 f v
+    check "XLEN after XADD MINID ~" ":101" XLEN $K:t
 
-# Consumer group operations
-echo "Testing consumer group operations..."
-test_command "XGROUP CREATE teststream testgroup \$"
-test_command "XREADGROUP GROUP testgroup consumer1 STREAMS teststream >"
+    # A block whose remaining entries were deleted is released by the trim
+    fill $K:e 300
+    check "XDEL the last entry of a block" ":1" XDEL $K:e 1-128
+    resp command MEMORY USAGE $K:e
+    before=$(request "$command")
+    check "XTRIM MINID empties a block" ":127" XTRIM $K:e MINID 1-128
+    after=$(request "$command")
+    echo -n "Testing: emptied block is released ... "
+    [[ $before == :+([0-9]) && $after == :+([0-9]) ]] && ((${after#:} < ${before#:}))
+    report $? "below $before" "$after"
+    check "XREAD after emptying a block" "*1 *2 $K:e *1 *2 1-129 *2 f v" XREAD COUNT 1 STREAMS $K:e 1-1
 
-# Test reading from stream
-echo "Testing stream reading..."
-test_command "XREAD STREAMS teststream 0-0"
+    # Trimming entries that are still pending
+    fill $K:q 10
+    check "XGROUP CREATE" "+OK" XGROUP CREATE $K:q g 0-0
+    check "XREADGROUP" "*1 *2 $K:q *4 *2 1-1 *2 f v *2 1-2 *2 f v *2 1-3 *2 f v *2 1-4 *2 f v" \
+        XREADGROUP GROUP g alice COUNT 4 STREAMS $K:q '>'
+    check "XTRIM pending entries" ":3" XTRIM $K:q MAXLEN 7
+    check "XREADGROUP history of trimmed entries" "*1 *2 $K:q *4 *2 1-1 *-1 *2 1-2 *-1 *2 1-3 *-1 *2 1-4 *2 f v" \
+        XREADGROUP GROUP g alice STREAMS $K:q 0-0
+    check "XREADGROUP after XTRIM" "*1 *2 $K:q *2 *2 1-5 *2 f v *2 1-6 *2 f v" \
+        XREADGROUP GROUP g alice COUNT 2 STREAMS $K:q '>'
+    check "XACK of trimmed entries" ":2" XACK $K:q g 1-1 1-2
+    check "XPENDING after XACK" "*4 :4 1-3 1-6 *1 *2 alice 4" XPENDING $K:q g
+
+    # IDs at the end of a millisecond's sequence numbers
+    echo "Testing ID limits..."
+    check "XADD of the last sequence number" "5-18446744073709551615" XADD $K:id 5-18446744073709551615 f v
+    check "XADD <ms>-* past the last sequence number" "-ERR Stream ID must be greater than last ID" XADD $K:id '5-*' f v
+    check "XSETID into the future" "+OK" XSETID $K:id 99999999999999-18446744073709551615
+    check "XADD * past the last sequence number" "100000000000000-0" XADD $K:id '*' f v
+    check "XADDBATCH * after a future ID" "*2 100000000000000-1 100000000000000-2" XADDBATCH $K:id '*' 1 a 1 1 b 2
+    check "XRANGE stays in order" "*4 *2 5-18446744073709551615 *2 f v *2 100000000000000-0 *2 f v *2 100000000000000-1 *2 a 1 *2 100000000000000-2 *2 b 2" \
+        XRANGE $K:id - +
+    check "XADD of the last possible ID" "18446744073709551615-18446744073709551615" \
+        XADD $K:idmax 18446744073709551615-18446744073709551615 f v
+    check "XADD * after the last possible ID" "-ERR The stream has exhausted the last possible ID, unable to add more items" \
+        XADD $K:idmax '*' f v
+
+    # Batches
+    echo "Testing XADDBATCH..."
+    check "XADDBATCH" "*2 1-1 1-3" XADDBATCH $K:b 1-1 1 a 1 2 b 2 c 3 1 d 4
+    check "XRANGE of a batch" "*3 *2 1-1 *2 a 1 *2 1-2 *4 b 2 c 3 *2 1-3 *2 d 4" XRANGE $K:b - +
+    check "XADDBATCH of a partial ID" "*2 5-0 5-1" XADDBATCH $K:b '5-*' 1 e 5 1 f 6
+    check "XADDBATCH of a partial ID" "*2 5-2 5-2" XADDBATCH $K:b '5-*' 1 g 7
+    check "XADDBATCH below the last ID" "-ERR Stream ID must be greater than last ID" XADDBATCH $K:b 5-2 1 a 1
+    check "XADDBATCH below the last ID" "-ERR Stream ID must be greater than last ID" XADDBATCH $K:b '4-*' 1 a 1
+    check "XADDBATCH of an explicit ID" "*2 6-5 6-6" XADDBATCH $K:b 6-5 1 h 8 1 i 9
+    check "XADDBATCH of an automatic ID" "*2 <n>-0 <n>-1" XADDBATCH $K:b '*' 1 j 10 1 k 11
+    check "XLEN after XADDBATCH" ":10" XLEN $K:b
+    check "XADDBATCH without entries" "-ERR wrong number of arguments for 'xaddbatch' command" XADDBATCH $K:b '*'
+    check "XADDBATCH without fields" "-ERR wrong number of arguments for 'xaddbatch' command" XADDBATCH $K:b '*' 0
+    check "XADDBATCH with too few fields" "-ERR wrong number of arguments for 'xaddbatch' command" \
+        XADDBATCH $K:b '*' 2 a 1
+    check "XADDBATCH with a field missing its value" "-ERR wrong number of arguments for 'xaddbatch' command" \
+        XADDBATCH $K:b '*' 1 a 1 1 b
+    check "XADDBATCH with a bad field count" "-ERR value is not an integer or out of range" XADDBATCH $K:b '*' x a 1
+    check "XLEN after rejected batches" ":10" XLEN $K:b
+    check "XADDBATCH MAXLEN" "*2 1-1 1-5" XADDBATCH $K:bm MAXLEN 3 1-1 1 a 1 1 a 2 1 a 3 1 a 4 1 a 5
+    check "XRANGE after XADDBATCH MAXLEN" "*3 *2 1-3 *2 a 3 *2 1-4 *2 a 4 *2 1-5 *2 a 5" XRANGE $K:bm - +
+    check "XADDBATCH NOMKSTREAM" "\$-1" XADDBATCH $K:bn NOMKSTREAM 1-1 1 a 1
+    check "XADDBATCH NOMKSTREAM" "*2 1-6 1-6" XADDBATCH $K:bm NOMKSTREAM 1-6 1 a 6
+    # A rejected ID leaves no empty stream behind
+    check "XADDBATCH of 0-0" "-ERR Stream ID must be greater than 0-0" XADDBATCH $K:bn 0-0 1 a 1
+    check "XADDBATCH of an invalid ID" "-ERR Invalid stream ID format" XADDBATCH $K:bn 1-x 1 a 1
+    check "XADDBATCH past the last sequence number" "-ERR Stream ID sequence exhausted for this batch" \
+        XADDBATCH $K:bn 1-18446744073709551615 1 a 1 1 b 2
+    check "XADD of 0-0" "-ERR Stream ID must be greater than 0-0" XADD $K:bn 0-0 a 1
+    check "XADD of an invalid ID" "-ERR Invalid stream ID format" XADD $K:bn 1-x a 1
+    check "no stream for rejected IDs" "\$-1" XADD $K:bn NOMKSTREAM 1-1 a 1
+}
+
+stream_tests
+
+# The same tests on a sharded server, where commands run on the shard
+# threads, spanning them when a read names several streams
+if [ -n "$SERVICE" ]; then
+    echo "Testing a sharded server..."
+    service_port=$PORT
+    PORT=$((PORT + 4))
+    dir=$(mktemp -d)
+    start_service "$dir" --shards 4
+    stream_tests
+    kill $service_pid
+    wait $service_pid
+    rm -rf "$dir"
+    PORT=$service_port
+fi
+
+# Log rewrite and snapshots with a restart, on servers this script starts
+# itself
+# The state the rewritten log or a snapshot must restore
+check_restored() {
+    check "XRANGE of a trimmed stream" "*4 *2 1-2 *2 f v *2 1-4 *2 f v *2 1-5 *2 f v *2 1-6 *2 f v" XRANGE $K:a - +
+    check "XPENDING of a trimmed stream" "*4 :2 1-2 1-4 *2 *2 alice 1 *2 bob 1" XPENDING $K:a g
+    check "XPENDING entries of a trimmed stream" "*2 *4 1-2 alice :<n> :1 *4 1-4 bob :<n> :4" XPENDING $K:a g - + 10
+    check "XPENDING of a second group" "*4 :0 \$-1 \$-1 *-1" XPENDING $K:a h
+    check "XLEN of an emptied stream" ":0" XLEN $K:empty
+    check "XLEN of a stream trimmed to nothing" ":0" XLEN $K:gone
+    check "XRANGE of batches" "*4 *2 5-1 *4 b 2 c 3 *2 5-2 *2 d 4 *2 5-3 *2 e 5 *2 5-4 *2 f 6" XRANGE $K:b - +
+}
+
+# The state check_restored expects, built on the server at PORT
+populate() {
+    fill $K:a 6
+    check "XGROUP CREATE" "+OK" XGROUP CREATE $K:a g 0-0
+    check "XGROUP CREATE" "+OK" XGROUP CREATE $K:a h '$'
+    check "XREADGROUP" "*1 *2 $K:a *2 *2 1-1 *2 f v *2 1-2 *2 f v" XREADGROUP GROUP g alice COUNT 2 STREAMS $K:a '>'
+    check "XREADGROUP" "*1 *2 $K:a *2 *2 1-3 *2 f v *2 1-4 *2 f v" XREADGROUP GROUP g alice COUNT 2 STREAMS $K:a '>'
+    check "XACK" ":2" XACK $K:a g 1-1 1-3
+    check "XCLAIM" "*1 1-4" XCLAIM $K:a g bob 0 1-4 RETRYCOUNT 4 JUSTID
+    check "XDEL" ":1" XDEL $K:a 1-3
+    check "XTRIM" ":1" XTRIM $K:a MINID 1-2
+    check "XSETID" "+OK" XSETID $K:a 7-0
+    fill $K:empty 1
+    check "XGROUP CREATE" "+OK" XGROUP CREATE $K:empty g 0-0
+    check "XREADGROUP" "*1 *2 $K:empty *1 *2 1-1 *2 f v" XREADGROUP GROUP g carol STREAMS $K:empty '>'
+    check "XDEL" ":1" XDEL $K:empty 1-1
+    check "XPENDING of a deleted entry" "*4 :1 1-1 1-1 *1 *2 carol 1" XPENDING $K:empty g
+    fill $K:gone 3
+    check "XTRIM" ":3" XTRIM $K:gone MAXLEN 0
+    check "XADDBATCH" "*2 5-0 5-2" XADDBATCH $K:b MAXLEN 4 '5-*' 1 a 1 2 b 2 c 3 1 d 4
+    check "XADDBATCH" "*2 5-3 5-4" XADDBATCH $K:b MAXLEN 4 '5-*' 1 e 5 1 f 6
+}
+
+if [ -n "$SERVICE" ]; then
+    echo "Testing log rewrite and restart..."
+    service_port=$PORT
+    PORT=$((PORT + 1))
+    dir=$(mktemp -d)
+    start_service "$dir" --appendonly yes
+
+    populate
+    check_restored
+
+    # Replaying the log as written, then as rewritten
+    restart_service "$dir" --appendonly yes
+    check_restored
+
+    check "BGREWRITEAOF" "+Background append only file rewriting started" BGREWRITEAOF
+    resp command INFO persistence
+    for ((i = 0; i < 50; i++)); do
+        [[ $(request "$command") == *"aof_rewrite_in_progress:0 aof_rewrites:1 "* ]] && break
+        sleep 0.1
+    done
+    kill $service_pid
+    wait $service_pid
+    echo -n "Testing: rewritten log holds no placeholder entries ... "
+    ! grep -aq -e XDEL -e XTRIM "$dir/appendonly.aof"
+    report $? "no XDEL or XTRIM" "$(grep -ac -e XDEL -e XTRIM "$dir/appendonly.aof") records"
+
+    start_service "$dir" --appendonly yes
+    check_restored
+    # A pending entry of a deleted entry cannot be claimed back; the next
+    # claim would drop it, so the rewrite leaves it out
+    check "XPENDING of a deleted entry" "*4 :0 \$-1 \$-1 *-1" XPENDING $K:empty g
+    check "XREADGROUP after restart" "*1 *2 $K:a *1 *2 1-5 *2 f v" XREADGROUP GROUP g alice COUNT 1 STREAMS $K:a '>'
+    check "XADD below a restored last ID" "-ERR Stream ID must be greater than last ID" XADD $K:a 6-0 f v
+    check "XADD below a restored last ID" "-ERR Stream ID must be greater than last ID" XADD $K:empty 1-1 f v
+    check "XADD below a restored last ID" "-ERR Stream ID must be greater than last ID" XADD $K:gone 1-3 f v
+    check "XADD after a restored last ID" "1-4" XADD $K:gone 1-4 f v
+    kill $service_pid
+    wait $service_pid
+    rm -rf "$dir"
+
+    # A snapshot taken by SAVE, then one by BGSAVE, each restored by a
+    # restart; the sharded server saves and loads every shard of its own
+    for options in "" "--shards 4"; do
+        echo "Testing snapshots and restart${options:+ with $options}..."
+        dir=$(mktemp -d)
+        start_service "$dir" $options
+        populate
+        check "SAVE" "+OK" SAVE
+        restart_service "$dir" $options
+        check_restored
+        check "XPENDING of a deleted entry" "*4 :1 1-1 1-1 *1 *2 carol 1" XPENDING $K:empty g
+        check "XADD below a restored last ID" "-ERR Stream ID must be greater than last ID" XADD $K:empty 1-1 f v
+        check "XADD below a restored last ID" "-ERR Stream ID must be greater than last ID" XADD $K:gone 1-3 f v
+
+        check "XACK" ":1" XACK $K:a g 1-2
+        check "XREADGROUP" "*1 *2 $K:a *1 *2 1-5 *2 f v" XREADGROUP GROUP g dave COUNT 1 STREAMS $K:a '>'
+        check "XADD" "7-1" XADD $K:a 7-1 f v
+        check "XDEL" ":1" XDEL $K:b 5-4
+        check "BGSAVE" "+Background saving started" BGSAVE
+        resp command INFO persistence
+        for ((i = 0; i < 50; i++)); do
+            [[ $(request "$command") == *"rdb_bgsave_in_progress:0 rdb_saves:1 "* ]] && break
+            sleep 0.1
+        done
+        restart_service "$dir" $options
+        check "XRANGE after BGSAVE" "*5 *2 1-2 *2 f v *2 1-4 *2 f v *2 1-5 *2 f v *2 1-6 *2 f v *2 7-1 *2 f v" \
+            XRANGE $K:a - +
+        check "XPENDING after BGSAVE" "*4 :2 1-4 1-5 *2 *2 bob 1 *2 dave 1" XPENDING $K:a g
+        check "XPENDING entries after BGSAVE" "*2 *4 1-4 bob :<n> :4 *4 1-5 dave :<n> :1" XPENDING $K:a g - + 10
+        check "XREADGROUP after BGSAVE" "*1 *2 $K:a *2 *2 1-6 *2 f v *2 7-1 *2 f v" \
+            XREADGROUP GROUP g alice STREAMS $K:a '>'
+        check "XRANGE of batches after BGSAVE" "*3 *2 5-1 *4 b 2 c 3 *2 5-2 *2 d 4 *2 5-3 *2 e 5" XRANGE $K:b - +
+        check "XLEN of an emptied stream" ":0" XLEN $K:empty
+        check "XADD below a restored last ID" "-ERR Stream ID must be greater than last ID" XADD $K:empty 1-1 f v
+        check "XADD after a restored last ID" "1-2" XADD $K:empty 1-2 f v
+        kill $service_pid
+        wait $service_pid
+        rm -rf "$dir"
+    done
+
+    # A primary at PORT + 2 and its replica at PORT + 3: a full resync on
+    # attaching, records streamed from then on, and a partial resync for a
+    # replica coming back with the replication ID and offset it had
+    echo "Testing replication..."
+    PORT=$((service_port + 2))
+    dir=$(mktemp -d)
+    start_service "$dir" --repl-backlog-size 1mb
+    primary_pid=$service_pid
+    populate
+    PORT=$((service_port + 3))
+    replica_dir=$(mktemp -d)
+    start_service "$replica_dir" --replicaof 127.0.0.1:$((service_port + 2))
+    echo -n "Testing: replica attaches with a full resync ... "
+    wait_for "*master_link_status:up *slave_full_syncs:1 slave_partial_syncs:0 *" INFO replication
+    report $? "link up after one full resync" "$result"
+    check_restored
+    check "XPENDING of a deleted entry" "*4 :1 1-1 1-1 *1 *2 carol 1" XPENDING $K:empty g
+    check "XADD on a replica" "-READONLY You can't write against a read only replica." XADD $K:r 1-1 f v
+    check "XREADGROUP on a replica" "-READONLY You can't write against a read only replica." \
+        XREADGROUP GROUP g alice STREAMS $K:a '>'
+    check "XLEN on a replica" ":4" XLEN $K:a
+
+    PORT=$((service_port + 2))
+    check "XADD" "2-1" XADD $K:r 2-1 f v
+    check "XREADGROUP" "*1 *2 $K:a *2 *2 1-5 *2 f v *2 1-6 *2 f v" XREADGROUP GROUP g alice STREAMS $K:a '>'
+    PORT=$((service_port + 3))
+    echo -n "Testing: replica follows new records ... "
+    wait_for "\*4 :4 1-2 1-6 *" XPENDING $K:a g
+    report $? "1-5 and 1-6 pending" "$result"
+    check "XRANGE on a replica" "*1 *2 2-1 *2 f v" XRANGE $K:r - +
+    check "XPENDING on a replica" "*4 :4 1-2 1-6 *2 *2 alice 3 *2 bob 1" XPENDING $K:a g
+    check "XPENDING entries on a replica" "*2 *4 1-5 alice :<n> :1 *4 1-6 alice :<n> :1" XPENDING $K:a g 1-5 + 10
+
+    # This script stands in for a second replica: it leaves as soon as its
+    # full resync starts, then asks to carry on from where that began
+    PORT=$((service_port + 2))
+    resp command PSYNC '?' -1
+    exec 5<>/dev/tcp/127.0.0.1/$PORT
+    printf '%s' "$command" >&5
+    IFS=' ' read -r -t 5 reply replid offset <&5
+    exec 5>&-
+    echo -n "Testing: PSYNC of a new replica ... "
+    [[ $reply == +FULLRESYNC && -n $replid ]]
+    report $? "+FULLRESYNC <replid> <offset>" "$reply $replid $offset"
+    check "XADD" "3-1" XADD $K:r 3-1 f v
+    resp command PSYNC "$replid" "${offset%$'\r'}"
+    exec 5<>/dev/tcp/127.0.0.1/$PORT
+    printf '%s' "$command" >&5
+    result=""
+    for ((i = 0; i < 12; i++)); do
+        IFS= read -r -t 5 line <&5 || break
+        line=${line%$'\r'}
+        [[ $line =~ ^\$[0-9]+$ ]] || result+="$line "
+    done
+    exec 5>&-
+    echo -n "Testing: PSYNC of a returning replica ... "
+    verify "+CONTINUE $replid *5 XADD $K:r 3-1 f v" "${result% }"
+    echo -n "Testing: INFO of the primary ... "
+    wait_for "*sync_full:2 sync_partial_ok:1 *" INFO replication
+    report $? "sync_full:2 sync_partial_ok:1" "$result"
+
+    PORT=$((service_port + 3))
+    echo -n "Testing: replica keeps following ... "
+    wait_for "*2 *2 2-1 *2 f v *2 3-1 *2 f v" XRANGE $K:r - +
+    report $? "2-1 and 3-1" "$result"
+    kill $service_pid $primary_pid
+    wait $service_pid $primary_pid
+    rm -rf "$dir" "$replica_dir"
+    PORT=$service_port
+fi
 
 echo
-echo "Test script completed."
-echo "For interactive testing, use: redis-cli -p 6379"
+if [ $failures -eq 0 ]; then
+    echo "Test script completed: all tests passed."
+else
+    echo "Test script completed: $failures failed."
+fi
+echo "For interactive testing, use: redis-cli -p $PORT"
+exit $((failures > 0))